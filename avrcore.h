@@ -0,0 +1,276 @@
+#ifndef AVRCORE_H
+#define AVRCORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C interface of libavrcore.a / libavrcore.so. The library is built for a
+// single MCU (see LIBRARY_MCU in the Makefile); avrcoreMcu() reports which.
+// The emulator's state is global, so a process has at most one core at a
+// time and the core is not thread safe. Lanes (see below) run many copies
+// of one program side by side.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define AVRCORE_API __attribute__((visibility("default")))
+#else
+#define AVRCORE_API
+#endif
+
+// Bumped whenever a signature, a public struct, the meaning of an existing
+// call or the snapshot layout changes. Snapshots and recompiled images
+// record it and are refused by a library built with another version.
+#define AVRCORE_ABI_VERSION 2
+
+typedef struct avrcore avrcore;
+
+//Stop Reasons
+#define AVRCORE_STOP_BUDGET 0
+#define AVRCORE_STOP_BREAK 1
+#define AVRCORE_STOP_SLEEP 2
+#define AVRCORE_STOP_BREAKPOINT 3
+#define AVRCORE_STOP_WATCHPOINT 4
+#define AVRCORE_STOP_ILLEGAL_OPCODE 5
+#define AVRCORE_STOP_STACK_OVERFLOW 6
+
+//Watchpoint Modes
+#define AVRCORE_WATCH_READ 0x1
+#define AVRCORE_WATCH_WRITE 0x2
+#define AVRCORE_WATCH_VALUE 0x4 // only accesses of the watchpoint's value
+#define AVRCORE_WATCH_LOG 0x8 // call the watch callback instead of stopping
+
+//Registers
+// 0 to 31 are r0 to r31
+#define AVRCORE_REGISTER_SREG 32
+#define AVRCORE_REGISTER_SP 33
+#define AVRCORE_REGISTER_PC 34 // flash byte address
+
+//Peripheral Callbacks
+// port is 0 for PORTB, 1 for PORTC, and so on.
+typedef void (*avrcorePortCallback)(void* context, int32_t port, uint8_t value);
+typedef void (*avrcoreSpiCallback)(void* context, uint8_t value);
+// Called for every data space write to the I/O range, including sbi/cbi.
+typedef void (*avrcoreIoWriteCallback)(void* context, int32_t address, uint8_t value);
+// Called for every data space read of the I/O range. Gets the value the
+// emulator would return and returns the value the program should see.
+typedef uint8_t (*avrcoreIoReadCallback)(void* context, int32_t address, uint8_t value);
+// Called for every access an AVRCORE_WATCH_LOG watchpoint matches, with
+// AVRCORE_WATCH_READ or AVRCORE_WATCH_WRITE as the mode.
+typedef void (*avrcoreWatchCallback)(void* context, int32_t address, uint8_t value, int32_t mode);
+
+AVRCORE_API int32_t avrcoreAbiVersion(void);
+AVRCORE_API const char* avrcoreMcu(void);
+
+// Returns NULL while another core exists.
+AVRCORE_API avrcore* avrcoreCreate(void);
+AVRCORE_API void avrcoreDestroy(avrcore* core);
+// Resets the CPU and data space, keeping the loaded image.
+AVRCORE_API void avrcoreReset(avrcore* core);
+
+// Both loaders replace the image and reset the core. They return 0 on
+// success and -1 on malformed or oversized input.
+AVRCORE_API int32_t avrcoreLoadHex(avrcore* core, const char* hex, size_t size);
+AVRCORE_API int32_t avrcoreLoadBinary(avrcore* core, const uint8_t* image, size_t size);
+
+// Runs until either budget is used up (0 is unlimited) or the core stops.
+// Returns one of the AVRCORE_STOP_* reasons.
+AVRCORE_API int32_t avrcoreRun(avrcore* core, uint64_t instructions, uint64_t cycles);
+AVRCORE_API uint64_t avrcoreCycles(avrcore* core);
+// Data space address of the last watchpoint hit, -1 if none.
+AVRCORE_API int32_t avrcoreWatchpointAddress(avrcore* core);
+
+// Data space accessors. They bypass peripheral side effects and return 0
+// on success and -1 when the range is out of bounds.
+AVRCORE_API int32_t avrcoreReadMemory(avrcore* core, int32_t address, uint8_t* buffer, size_t size);
+AVRCORE_API int32_t avrcoreWriteMemory(avrcore* core, int32_t address, const uint8_t* buffer, size_t size);
+AVRCORE_API int32_t avrcoreReadFlash(avrcore* core, int32_t address, uint8_t* buffer, size_t size);
+AVRCORE_API uint32_t avrcoreReadRegister(avrcore* core, int32_t reg);
+AVRCORE_API void avrcoreWriteRegister(avrcore* core, int32_t reg, uint32_t value);
+
+AVRCORE_API void avrcoreRaiseInterrupt(avrcore* core, int32_t vector);
+AVRCORE_API void avrcoreSetBreakpoint(avrcore* core, int32_t address, int32_t enabled);
+AVRCORE_API void avrcoreSetWatchpoint(avrcore* core, int32_t address, int32_t mode);
+// Watches the data space range [start, end) with a mask of AVRCORE_WATCH_*
+// modes, replacing the watchpoint on the same range; a mode of 0 removes
+// it. Accesses to unwatched 32-byte pages are not slowed down. Returns -1
+// for a range outside the data space or when 32 watchpoints are taken.
+// avrcoreSetWatchpoint() watches a single address this way.
+AVRCORE_API int32_t avrcoreSetWatchRange(avrcore* core, int32_t start, int32_t end, int32_t mode, uint8_t value);
+AVRCORE_API void avrcoreSetStackLimit(avrcore* core, int32_t address);
+// Calls to libgcc's unsigned division and avr-libc's memcpy, memset and
+// strlen run natively, with the same results and instruction count. They
+// are enabled by default; disable them to step through every instruction.
+AVRCORE_API void avrcoreEnableNative(avrcore* core, int32_t enabled);
+
+// A NULL callback restores the default (ignore the event).
+AVRCORE_API void avrcoreSetPortCallback(avrcore* core, avrcorePortCallback callback, void* context);
+AVRCORE_API void avrcoreSetSpiCallback(avrcore* core, avrcoreSpiCallback callback, void* context);
+AVRCORE_API void avrcoreSetIoCallbacks(avrcore* core, avrcoreIoReadCallback read, avrcoreIoWriteCallback write, void* context);
+AVRCORE_API void avrcoreSetWatchCallback(avrcore* core, avrcoreWatchCallback callback, void* context);
+
+//Event Queue
+// Hands port and SPI writes to another thread instead of calling the
+// callbacks on the thread running the core. Enabling the queue replaces the
+// port and SPI callbacks; setting either callback again takes it back. The
+// consumer may poll from any one thread while the core runs. When the
+// AVRCORE_EVENT_QUEUE_SIZE slots are full the backpressure policy decides:
+#define AVRCORE_BACKPRESSURE_DROP 0 // discard the new event
+#define AVRCORE_BACKPRESSURE_BLOCK 1 // wait for the consumer; never poll from the running thread
+#define AVRCORE_BACKPRESSURE_COALESCE 2 // keep only the latest value per port and for SPI until there is room
+#define AVRCORE_EVENT_QUEUE_SIZE 4096
+
+#define AVRCORE_EVENT_PORT 0
+#define AVRCORE_EVENT_SPI 1
+
+typedef struct avrcoreEvent
+{
+    uint64_t cycle;
+    int32_t kind;
+    int32_t port; // AVRCORE_EVENT_PORT only
+    uint8_t value;
+} avrcoreEvent;
+
+// Returns -1 for an unknown policy.
+AVRCORE_API int32_t avrcoreEnableEventQueue(avrcore* core, int32_t policy);
+// Copies up to count events, oldest first, and returns how many.
+AVRCORE_API size_t avrcorePollEvents(avrcore* core, avrcoreEvent* events, size_t count);
+// Events the consumer will never see, dropped or coalesced.
+AVRCORE_API uint64_t avrcoreLostEvents(avrcore* core);
+
+// Snapshots hold the complete machine state (CPU, data space and flash)
+// but not breakpoints, watchpoints or callbacks. Restore returns -1 when the
+// buffer is too small or was written by a different MCU or ABI version.
+AVRCORE_API size_t avrcoreSnapshotSize(void);
+AVRCORE_API int32_t avrcoreSaveSnapshot(avrcore* core, void* buffer, size_t size);
+AVRCORE_API int32_t avrcoreRestoreSnapshot(avrcore* core, const void* buffer, size_t size);
+
+//Reverse Execution
+// With history enabled, avrcoreRun takes a checkpoint of the core every so
+// many cycles, holding the CPU state and the data space pages that changed
+// since the one before, in a ring of the given number of checkpoints. The
+// interval adapts to keep checkpoints at about 2% of run time. Going back
+// restores the nearest earlier checkpoint and re-executes forward with the
+// port, SPI and I/O write callbacks silenced, so an I/O read callback must
+// answer the same way again. Changes made through this interface between
+// runs are kept as checkpoints of their own. Flash is not checkpointed.
+// Returns -1 when out of memory; 0 checkpoints disables the history.
+AVRCORE_API int32_t avrcoreEnableHistory(avrcore* core, int32_t checkpoints);
+// Instructions executed since the last reset
+AVRCORE_API uint64_t avrcoreInstructions(avrcore* core);
+// Both leave the core just before the instruction they move back to, drop
+// the checkpoints after it and return -1 without moving when the history
+// does not reach back far enough.
+AVRCORE_API int32_t avrcoreStepBack(avrcore* core, uint64_t instructions);
+// Moves back to the newest instruction that wrote the data space address.
+// Stores are always found; pushes, calls and register writes only when
+// they changed the value.
+AVRCORE_API int32_t avrcoreRunBackToWrite(avrcore* core, int32_t address);
+
+//Code Analysis
+// Each image is analyzed once, when it is loaded, by recursive descent from
+// the reset and interrupt vectors. avrcoreCodeFlags() returns a mask of
+// AVRCORE_CODE_* for the flash word at a byte address, 0 for words the
+// analysis did not reach. Flash written by the program is not re-analyzed.
+#define AVRCORE_CODE_INSTRUCTION 0x01
+#define AVRCORE_CODE_OPERAND 0x02 // second word of a two word instruction
+#define AVRCORE_CODE_BLOCK_START 0x04
+#define AVRCORE_CODE_CALL_TARGET 0x08
+#define AVRCORE_CODE_JUMP_TABLE 0x10 // jump table entry, an instruction or a data word
+#define AVRCORE_CODE_UNSUPPORTED 0x20 // running it stops with AVRCORE_STOP_ILLEGAL_OPCODE
+#define AVRCORE_CODE_INDIRECT 0x40 // ijmp or icall with unknown targets
+#define AVRCORE_CODE_VECTOR 0x80 // reset or interrupt vector
+
+AVRCORE_API uint32_t avrcoreCodeFlags(avrcore* core, int32_t address);
+// Writes the disassembly of the instruction at a flash byte address and
+// returns its length in bytes, -1 when the address is out of bounds.
+AVRCORE_API int32_t avrcoreDisassemble(avrcore* core, int32_t address, char* text, size_t size);
+
+//Recompiled Images
+// "avrcore -aot name file.cpp image.hex" translates every analyzed basic
+// block of an image to a C++ function and writes them to file.cpp with an
+// avrcoreRecompiledImage called name. Build it with the host compiler
+// against this header and link it with the library. Once the image is
+// attached, avrcoreRun calls a block's function whenever it reaches the
+// start of the block. Register arithmetic, branches and jumps are inlined.
+// Every other instruction runs through the interpreter, by way of
+// machine->step. Indirect jumps, returns and code the analysis did not
+// reach continue in the interpreter until they land on the start of a
+// block again. Blocks whose flash no longer matches the loaded image, or
+// that hold a breakpoint, are interpreted instead.
+typedef struct avrcoreMachine
+{
+    uint8_t* data; // data space, r0 to r31 first
+    uint8_t* sreg;
+    const uint8_t* addFlags; // [carry][a][b], SREG after a + b + carry
+    const uint8_t* subFlags; // [carry][a][b], SREG after a - b - carry
+    const uint8_t* logicFlags; // [result]
+    const uint8_t* shiftFlags; // [carry out][result]
+    // Runs the instruction at flash byte address *pc and stores the next
+    // one. Returns 0 when the block has to give control back to the run
+    // loop, for a pending interrupt or a stop.
+    int32_t (*step)(int32_t* pc);
+} avrcoreMachine;
+// Returns the instructions retired and stores the flash byte address to
+// continue at in *pc.
+typedef int32_t (*avrcoreBlockFunction)(const avrcoreMachine* machine, int32_t* pc);
+typedef struct avrcoreRecompiledBlock
+{
+    int32_t address; // flash byte address of the first instruction
+    int32_t instructions;
+    int32_t words;
+    const uint16_t* source; // the flash words the function was generated from
+    avrcoreBlockFunction run;
+} avrcoreRecompiledBlock;
+typedef struct avrcoreRecompiledImage
+{
+    int32_t abiVersion;
+    const char* mcu;
+    int32_t count;
+    const avrcoreRecompiledBlock* blocks;
+} avrcoreRecompiledImage;
+// Attaches image to the core, or detaches it for NULL, and returns how
+// many of its blocks match the loaded image. The image stays attached
+// across loads. Returns -1 when it was generated for another MCU or ABI.
+AVRCORE_API int32_t avrcoreAttachRecompiled(avrcore* core, const avrcoreRecompiledImage* image);
+
+//Lanes
+// A lane set runs AVRCORE_LANE_COUNT copies of a core in lockstep, for
+// fuzzing and parameter sweeps that run one image on many inputs. Lanes
+// executing the same instruction share one vectorized dispatch; lanes that
+// branch differently continue on their own and rejoin at a common PC. Every
+// lane produces the same results and cycle counts as avrcoreRun would.
+// The core's callbacks are called per lane, with avrcoreLaneIndex() telling
+// which. Breakpoints and watchpoints are not checked, and stores past the
+// end of data space land in the shared image instead of a per-lane copy.
+#define AVRCORE_LANE_COUNT 32
+
+typedef struct avrcoreLanes avrcoreLanes;
+
+AVRCORE_API int32_t avrcoreLaneCount(void);
+// Every lane starts as a copy of the core's current state. The lanes share
+// the core's image, so the core must outlive them and keep its image.
+AVRCORE_API avrcoreLanes* avrcoreLanesCreate(avrcore* core);
+AVRCORE_API void avrcoreLanesDestroy(avrcoreLanes* lanes);
+// Runs every lane until the instruction budget is used up (0 is unlimited)
+// or the lane stops. reasons, if not NULL, receives one AVRCORE_STOP_*
+// reason per lane.
+AVRCORE_API void avrcoreLanesRun(avrcoreLanes* lanes, uint64_t instructions, int32_t* reasons);
+AVRCORE_API uint64_t avrcoreLanesCycles(avrcoreLanes* lanes, int32_t lane);
+// Same conventions as the single core accessors, for lane 0 to
+// AVRCORE_LANE_COUNT - 1.
+AVRCORE_API int32_t avrcoreLanesReadMemory(avrcoreLanes* lanes, int32_t lane, int32_t address, uint8_t* buffer, size_t size);
+AVRCORE_API int32_t avrcoreLanesWriteMemory(avrcoreLanes* lanes, int32_t lane, int32_t address, const uint8_t* buffer, size_t size);
+AVRCORE_API uint32_t avrcoreLanesReadRegister(avrcoreLanes* lanes, int32_t lane, int32_t reg);
+AVRCORE_API void avrcoreLanesWriteRegister(avrcoreLanes* lanes, int32_t lane, int32_t reg, uint32_t value);
+AVRCORE_API void avrcoreLanesRaiseInterrupt(avrcoreLanes* lanes, int32_t lane, int32_t vector);
+// Lane being run when called from a peripheral callback, -1 otherwise.
+AVRCORE_API int32_t avrcoreLaneIndex(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,5 +4,6 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE    := avrcore
 LOCAL_SRC_FILES := ../main.cpp
+LOCAL_LDLIBS    := -ldl
 
 include $(BUILD_EXECUTABLE)
@@ -1,4 +1,5 @@
 #include <thread>
+#include <atomic>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,10 +8,38 @@
 #ifdef EMSCRIPTEN
 #include "emscripten.h"
 #endif
+#ifdef LIBRARY
+#include "avrcore.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+#endif
 
-#ifdef PROFILE
 #include <chrono>
 using namespace std::chrono;
+#ifdef COVERAGE
+#include <elf.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#endif
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+#endif
+#ifdef FUZZ
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
 #endif
 
 int32_t cachedArgc = 0;
@@ -22,32 +51,51 @@ char* cachedArgv[64];
 //Platform Defines
 #ifdef ATMEGA32U4
 #define ATMEGA32U4_ENTRY 0xB00
-#define ATMEGA32U4_TIMER_INTERRUPT_ADDRESS 0x5C
+#define ATMEGA32U4_RAMSTART 0x100
+#define ATMEGA32U4_TIMER0_OVF_VECTOR 23
 #define ATMEGA32U4_UCSR1A 0xC8
 #define ATMEGA32U4_PORTE_ADDRESS 0x2E
 #define ATMEGA32U4_PORTF_ADDRESS 0x31
 #define ATMEGA32U4_PLLCSR_ADDRESS 0x49
 #define ENTRY_ADDRESS ATMEGA32U4_ENTRY
-#define TIMER_INTERRUPT_ADDRESS ATMEGA32U4_TIMER_INTERRUPT_ADDRESS
+#define RAMSTART ATMEGA32U4_RAMSTART
+#define TIMER0_OVF_VECTOR ATMEGA32U4_TIMER0_OVF_VECTOR
 #define UCSRA_ADDRESS ATMEGA32U4_UCSR1A
+#define MCU_NAME "atmega32u4"
 #elif defined(ATMEGA328)
 #define ATMEGA328_ENTRY 0x900
-#define ATMEGA328_TIMER_INTERRUPT_ADDRESS 0x40
+#define ATMEGA328_RAMSTART 0x100
+#define ATMEGA328_TIMER0_OVF_VECTOR 16
 #define ATMEGA328_UCSR0A 0xC0
 #define ENTRY_ADDRESS ATMEGA328_ENTRY
-#define TIMER_INTERRUPT_ADDRESS ATMEGA328_TIMER_INTERRUPT_ADDRESS
+#define RAMSTART ATMEGA328_RAMSTART
+#define TIMER0_OVF_VECTOR ATMEGA328_TIMER0_OVF_VECTOR
 #define UCSRA_ADDRESS ATMEGA328_UCSR0A
+#define MCU_NAME "atmega328"
 #elif defined(ATMEGA2560)
 #define ATMEGA2560_ENTRY 0x2200
-#define ATMEGA2560_TIMER_INTERRUPT_ADDRESS 0x5C
+#define ATMEGA2560_RAMSTART 0x200
+#define ATMEGA2560_EIND 0x5C
+#define ATMEGA2560_TIMER0_OVF_VECTOR 23
 #define ATMEGA2560_UCSR0A 0xC0
 #define ENTRY_ADDRESS ATMEGA2560_ENTRY
-#define TIMER_INTERRUPT_ADDRESS ATMEGA2560_TIMER_INTERRUPT_ADDRESS
+#define RAMSTART ATMEGA2560_RAMSTART
+#define TIMER0_OVF_VECTOR ATMEGA2560_TIMER0_OVF_VECTOR
 #define UCSRA_ADDRESS ATMEGA2560_UCSR0A
+#define MCU_NAME "atmega2560"
 #else
 #error "Unknown target platform"
 #endif
 
+// Flash is mapped above the data space, so the 2560 needs more than 16 bits
+// to address it. The smaller parts keep a 16-bit program counter.
+#define MEMORY_SIZE (ENTRY_ADDRESS + FLASH_SIZE)
+#ifdef ATMEGA2560
+typedef uint32_t programCounter;
+#else
+typedef uint16_t programCounter;
+#endif
+
 //Common Registers
 #define ADCSRA_ADDRESS 0x7A
 #define ADCH_ADDRESS 0x79
@@ -56,10 +104,12 @@ char* cachedArgv[64];
 #define SPH_ADDRESS  0x5E
 #define SPL_ADDRESS  0x5D
 #define SPMCSR_ADDRESS 0x57
+#define SMCR_ADDRESS 0x53
 #define SDR_ADDRESS 0x4E
 #define SPSR_ADDRESS 0x4D
 #define TCNT0_ADDRESS 0x46
 #define TIFR0_ADDRESS 0x35
+#define INTERRUPT_REGISTER_LIMIT 0x140
 #define PORTB_ADDRESS 0x25
 #define PORTC_ADDRESS 0x28
 #define PORTD_ADDRESS 0x2B
@@ -72,1929 +122,10828 @@ char* cachedArgv[64];
 #define SPMEN_BIT 1<<0
 #define SPIF_BIT 1<<7
 #define ADSC_BIT 1<<6
+#define SE_BIT 1<<0
 
 //Platform Specific Status Bits
 #define ATMEGA32U4_PLLE_BIT 1<<1
 #define ATMEGA32U4_PLOCK_BIT 1<<0
-#define ATMEGA2560_RAMPZ 0x58
+#define ATMEGA2560_RAMPZ 0x5B
+
+//Interrupts
+#define INTERRUPT_VECTOR_SIZE 4
+#ifdef ATMEGA2560
+#define INTERRUPT_ENTRY_CYCLES 5
+#else
+#define INTERRUPT_ENTRY_CYCLES 4
+#endif
+
+//Stop Reasons
+#define STOP_BUDGET 0
+#define STOP_BREAK 1
+#define STOP_SLEEP 2
+#define STOP_BREAKPOINT 3
+#define STOP_WATCHPOINT 4
+#define STOP_ILLEGAL_OPCODE 5
+#define STOP_STACK_OVERFLOW 6
+#define STOP_REASON_COUNT 7
+
+//Watchpoint Modes
+#define WATCH_READ 0x1
+#define WATCH_WRITE 0x2
+#define WATCH_VALUE 0x4 // only accesses of the watchpoint's value
+#define WATCH_LOG 0x8 // report the access and keep running
 
 //Globals
 #define INSTRUCTION_LIMIT 1024
+#define CLOCK_HZ 16000000
 #define MANUFACTURER_ID 0xBF
-#define CLR 0
-#define SET 1
-#define IGNORE 2
-struct status
-{
-    status()
-    {
-        clear();
-    }
-    void clear()
-    {
-        C = IGNORE;
-        Z = IGNORE;
-        N = IGNORE;
-        V = IGNORE;
-        S = IGNORE;
-        H = IGNORE;
-        T = IGNORE;
-        I = IGNORE;
-    }
-    int8_t I:3;
-    int8_t T:3;
-    int8_t H:3;
-    int8_t S:3;
-    int8_t V:3;
-    int8_t N:3;
-    int8_t Z:3;
-    int8_t C:3;
-};
-uint8_t memory[FLASH_SIZE];
+//Status Register Bits
+#define SREG_C 0x01
+#define SREG_Z 0x02
+#define SREG_N 0x04
+#define SREG_V 0x08
+#define SREG_S 0x10
+#define SREG_H 0x20
+#define SREG_T 0x40
+#define SREG_I 0x80
+#define ARITHMETIC_FLAGS (SREG_H|SREG_S|SREG_V|SREG_N|SREG_Z|SREG_C)
+#define LOGIC_FLAGS (SREG_S|SREG_V|SREG_N|SREG_Z)
+uint8_t memory[MEMORY_SIZE];
 int32_t programStart = ENTRY_ADDRESS;
-uint16_t PC;
-status SREG;
+int32_t programEnd = ENTRY_ADDRESS;
+programCounter PC;
+// SPH:SPL, only mirrored into the I/O space when the program accesses it
+uint16_t stackPointer;
+// Lowest stack pointer value before runUntil reports a stack overflow. The
+// default only protects the I/O space; embedders that know the end of
+// .bss or the heap can raise it.
+uint16_t stackLimit = RAMSTART - 1;
+int32_t stopReason = STOP_BUDGET;
+// Emulated time is cycleCount alone; the core never reads the host clock.
+// Unless virtualTime is set, the command line build paces whole fetchN
+// batches to CLOCK_HZ, which changes how long a run takes but not what it
+// does. The profiler then reports emulated instead of host time.
+bool virtualTime = false;
 
-//API
-extern "C" void loadPartialProgram(uint8_t* binary);
-extern "C" void engineInit();
-extern "C" int32_t fetchN(int32_t n);
+//Watchpoints
+// Each watchpoint covers a data space range. Loads and stores look up the
+// page of their address in watchedPages, which holds the access modes
+// watched anywhere on it, so only accesses to watched pages search the
+// list and every other access costs one table lookup.
+#define WATCHPOINT_LIMIT 32
+#define WATCH_PAGE_SHIFT 5
+struct watchpoint
+{
+    int32_t start;
+    int32_t end; // exclusive
+    uint8_t mode;
+    uint8_t value; // with WATCH_VALUE
+};
+struct watchpointSet
+{
+    watchpoint entries[WATCHPOINT_LIMIT];
+    int32_t count;
+};
+watchpointSet watchpoints;
+// Stores past the data space land in flash, so the table covers it too
+uint8_t watchedPages[(MEMORY_SIZE >> WATCH_PAGE_SHIFT) + 1];
+int32_t watchpointAddress = -1; // data address of the last watchpoint hit
+uint8_t watchpointMode = 0; // mode of the watchpoint that stopped there
 
-void loadProgram(uint8_t* binary);
-void loadDefaultProgram();
-void execProgram();
-int32_t fetch();
+//Peripheral Callbacks
+// Embedders hook port, SPI and raw I/O traffic here instead of parsing the
+// printed output. Unset callbacks keep the default behavior.
+typedef void (*portWriteHandler)(void* context, int32_t port, uint8_t value);
+typedef void (*spiWriteHandler)(void* context, uint8_t value);
+typedef void (*ioWriteHandler)(void* context, int32_t address, uint8_t value);
+typedef uint8_t (*ioReadHandler)(void* context, int32_t address, uint8_t value);
+typedef void (*watchHandler)(void* context, int32_t address, uint8_t value, int32_t mode);
+portWriteHandler portCallback = NULL;
+spiWriteHandler spiCallback = NULL;
+ioWriteHandler ioWriteCallback = NULL;
+ioReadHandler ioReadCallback = NULL;
+watchHandler watchCallback = NULL; // WATCH_LOG hits
+void* peripheralContext = NULL;
+uint8_t SREG;
 
-uint8_t readMemory(int32_t address);
-void writeMemory(int32_t address, int32_t value);
-void pushStatus(status& newStatus);
-void decrementStackPointer();
-void resetFetchState()
+void ignorePort(void* context, int32_t port, uint8_t value)
 {
-    memory[ADCSRA_ADDRESS] &= ~ADSC_BIT;
-    memory[SPSR_ADDRESS] |= SPIF_BIT;
-    memory[UCSRA_ADDRESS] |= UDRE_BIT;
 }
 
-void platformPrint(const char* message)
+void ignoreSpi(void* context, uint8_t value)
 {
-#ifdef EMSCRIPTEN
-    char buffer[1024];
-    sprintf(buffer, "console.log('%s')", message);
-    emscripten_run_script(buffer);
+}
+
+void ignoreWatch(void* context, int32_t address, uint8_t value, int32_t mode)
+{
+}
+
+//Register Pairs
+#define X_REGISTER 26
+#define Y_REGISTER 28
+#define Z_REGISTER 30
+// The register file occupies the first 32 bytes of the data space. Pairs
+// (X, Y, Z and the movw/adiw/sbiw operands) are aligned little-endian words,
+// so on little-endian hosts they are read and written with a single access.
+inline uint16_t readPair(int32_t reg)
+{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    uint16_t value;
+    memcpy(&value, &memory[reg], sizeof(value));
+    return value;
 #else
-    printf("%s\n", message);
+    return (memory[reg+1] << 8) | memory[reg];
 #endif
 }
 
-#ifndef LIBRARY
-size_t totalFetches = 0;
-int32_t main(int32_t argc, char** argv)
+inline void writePair(int32_t reg, uint16_t value)
 {
-    cachedArgc = argc;
-    char* storagePointer = argvStorage;
-    while(argc--)
-    {
-        cachedArgv[argc] = storagePointer;
-        int32_t length = strlen(argv[argc]);
-        strcat(storagePointer, argv[argc]);
-        storagePointer+=(length+1);
-    }
-    FILE* executable = NULL;
-#ifdef EMSCRIPTEN
-    EM_ASM(var fs = require('fs'); fs.readFile(process.argv[process.argv.length-1], 'utf8', function(error, hex){fs.writeFileSync('scratch', hex)}););
-    EM_ASM(FS.mkdir('/working'); FS.mount(NODEFS, { root: '.' }, '/working'););
-    executable = fopen("/working/scratch","rb");
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    memcpy(&memory[reg], &value, sizeof(value));
 #else
-    if(cachedArgc > 1) executable = fopen(cachedArgv[1],"rb");
-#endif
-    if(executable)
-    {
-        fseek(executable, 0, SEEK_END);
-        int32_t size = ftell(executable);
-        rewind(executable);
-        uint8_t* binary = (uint8_t*)malloc(size);
-        size_t read = fread(binary, 1, size, executable);
-        if(read != size) return -1;
-        fclose(executable);
-        loadProgram(binary);
-#ifdef EMSCRIPTEN
-        EM_ASM(FS.unlink('/working/scratch'););
+    memory[reg] = value & 0xFF;
+    memory[reg+1] = value >> 8;
 #endif
-    }
-    else
-    {
-        loadDefaultProgram();
-    }
+}
+uint64_t cycleCount = 0;
+// Instructions retired by runUntil
+uint64_t instructionCount = 0;
 
-#ifdef PROFILE
-    microseconds startProfile = duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch());
+//Interrupt Vector Table
+struct interruptSource
+{
+    const char* name;
+    uint16_t enableAddress; // 0 when the source has no enable bit (RESET)
+    uint8_t enableMask;
+};
+#ifdef ATMEGA32U4
+const interruptSource interruptVectors[] =
+{
+    {"RESET", 0x00, 0x00},
+    {"INT0", 0x3D, 1<<0},
+    {"INT1", 0x3D, 1<<1},
+    {"INT2", 0x3D, 1<<2},
+    {"INT3", 0x3D, 1<<3},
+    {"RESERVED5", 0x00, 0x00},
+    {"RESERVED6", 0x00, 0x00},
+    {"INT6", 0x3D, 1<<6},
+    {"RESERVED8", 0x00, 0x00},
+    {"PCINT0", 0x68, 1<<0},
+    {"USB_GEN", 0xE2, 0x7D},
+    {"USB_COM", 0xF0, 0xDF},
+    {"WDT", 0x60, 1<<6},
+    {"RESERVED13", 0x00, 0x00},
+    {"RESERVED14", 0x00, 0x00},
+    {"RESERVED15", 0x00, 0x00},
+    {"TIMER1_CAPT", 0x6F, 1<<5},
+    {"TIMER1_COMPA", 0x6F, 1<<1},
+    {"TIMER1_COMPB", 0x6F, 1<<2},
+    {"TIMER1_COMPC", 0x6F, 1<<3},
+    {"TIMER1_OVF", 0x6F, 1<<0},
+    {"TIMER0_COMPA", 0x6E, 1<<1},
+    {"TIMER0_COMPB", 0x6E, 1<<2},
+    {"TIMER0_OVF", 0x6E, 1<<0},
+    {"SPI_STC", 0x4C, 1<<7},
+    {"USART1_RX", 0xC9, 1<<7},
+    {"USART1_UDRE", 0xC9, 1<<5},
+    {"USART1_TX", 0xC9, 1<<6},
+    {"ANALOG_COMP", 0x50, 1<<3},
+    {"ADC", 0x7A, 1<<3},
+    {"EE_READY", 0x3F, 1<<3},
+    {"TIMER3_CAPT", 0x71, 1<<5},
+    {"TIMER3_COMPA", 0x71, 1<<1},
+    {"TIMER3_COMPB", 0x71, 1<<2},
+    {"TIMER3_COMPC", 0x71, 1<<3},
+    {"TIMER3_OVF", 0x71, 1<<0},
+    {"TWI", 0xBC, 1<<0},
+    {"SPM_READY", 0x57, 1<<7},
+    {"TIMER4_COMPA", 0x72, 1<<6},
+    {"TIMER4_COMPB", 0x72, 1<<5},
+    {"TIMER4_COMPD", 0x72, 1<<7},
+    {"TIMER4_OVF", 0x72, 1<<2},
+    {"TIMER4_FPF", 0xC3, 1<<7},
+};
+#elif defined(ATMEGA328)
+const interruptSource interruptVectors[] =
+{
+    {"RESET", 0x00, 0x00},
+    {"INT0", 0x3D, 1<<0},
+    {"INT1", 0x3D, 1<<1},
+    {"PCINT0", 0x68, 1<<0},
+    {"PCINT1", 0x68, 1<<1},
+    {"PCINT2", 0x68, 1<<2},
+    {"WDT", 0x60, 1<<6},
+    {"TIMER2_COMPA", 0x70, 1<<1},
+    {"TIMER2_COMPB", 0x70, 1<<2},
+    {"TIMER2_OVF", 0x70, 1<<0},
+    {"TIMER1_CAPT", 0x6F, 1<<5},
+    {"TIMER1_COMPA", 0x6F, 1<<1},
+    {"TIMER1_COMPB", 0x6F, 1<<2},
+    {"TIMER1_OVF", 0x6F, 1<<0},
+    {"TIMER0_COMPA", 0x6E, 1<<1},
+    {"TIMER0_COMPB", 0x6E, 1<<2},
+    {"TIMER0_OVF", 0x6E, 1<<0},
+    {"SPI_STC", 0x4C, 1<<7},
+    {"USART_RX", 0xC1, 1<<7},
+    {"USART_UDRE", 0xC1, 1<<5},
+    {"USART_TX", 0xC1, 1<<6},
+    {"ADC", 0x7A, 1<<3},
+    {"EE_READY", 0x3F, 1<<3},
+    {"ANALOG_COMP", 0x50, 1<<3},
+    {"TWI", 0xBC, 1<<0},
+    {"SPM_READY", 0x57, 1<<7},
+};
+#elif defined(ATMEGA2560)
+const interruptSource interruptVectors[] =
+{
+    {"RESET", 0x00, 0x00},
+    {"INT0", 0x3D, 1<<0},
+    {"INT1", 0x3D, 1<<1},
+    {"INT2", 0x3D, 1<<2},
+    {"INT3", 0x3D, 1<<3},
+    {"INT4", 0x3D, 1<<4},
+    {"INT5", 0x3D, 1<<5},
+    {"INT6", 0x3D, 1<<6},
+    {"INT7", 0x3D, 1<<7},
+    {"PCINT0", 0x68, 1<<0},
+    {"PCINT1", 0x68, 1<<1},
+    {"PCINT2", 0x68, 1<<2},
+    {"WDT", 0x60, 1<<6},
+    {"TIMER2_COMPA", 0x70, 1<<1},
+    {"TIMER2_COMPB", 0x70, 1<<2},
+    {"TIMER2_OVF", 0x70, 1<<0},
+    {"TIMER1_CAPT", 0x6F, 1<<5},
+    {"TIMER1_COMPA", 0x6F, 1<<1},
+    {"TIMER1_COMPB", 0x6F, 1<<2},
+    {"TIMER1_COMPC", 0x6F, 1<<3},
+    {"TIMER1_OVF", 0x6F, 1<<0},
+    {"TIMER0_COMPA", 0x6E, 1<<1},
+    {"TIMER0_COMPB", 0x6E, 1<<2},
+    {"TIMER0_OVF", 0x6E, 1<<0},
+    {"SPI_STC", 0x4C, 1<<7},
+    {"USART0_RX", 0xC1, 1<<7},
+    {"USART0_UDRE", 0xC1, 1<<5},
+    {"USART0_TX", 0xC1, 1<<6},
+    {"ANALOG_COMP", 0x50, 1<<3},
+    {"ADC", 0x7A, 1<<3},
+    {"EE_READY", 0x3F, 1<<3},
+    {"TIMER3_CAPT", 0x71, 1<<5},
+    {"TIMER3_COMPA", 0x71, 1<<1},
+    {"TIMER3_COMPB", 0x71, 1<<2},
+    {"TIMER3_COMPC", 0x71, 1<<3},
+    {"TIMER3_OVF", 0x71, 1<<0},
+    {"USART1_RX", 0xC9, 1<<7},
+    {"USART1_UDRE", 0xC9, 1<<5},
+    {"USART1_TX", 0xC9, 1<<6},
+    {"TWI", 0xBC, 1<<0},
+    {"SPM_READY", 0x57, 1<<7},
+    {"TIMER4_CAPT", 0x72, 1<<5},
+    {"TIMER4_COMPA", 0x72, 1<<1},
+    {"TIMER4_COMPB", 0x72, 1<<2},
+    {"TIMER4_COMPC", 0x72, 1<<3},
+    {"TIMER4_OVF", 0x72, 1<<0},
+    {"TIMER5_CAPT", 0x73, 1<<5},
+    {"TIMER5_COMPA", 0x73, 1<<1},
+    {"TIMER5_COMPB", 0x73, 1<<2},
+    {"TIMER5_COMPC", 0x73, 1<<3},
+    {"TIMER5_OVF", 0x73, 1<<0},
+    {"USART2_RX", 0xD1, 1<<7},
+    {"USART2_UDRE", 0xD1, 1<<5},
+    {"USART2_TX", 0xD1, 1<<6},
+    {"USART3_RX", 0x131, 1<<7},
+    {"USART3_UDRE", 0x131, 1<<5},
+    {"USART3_TX", 0x131, 1<<6},
+};
 #endif
+#define INTERRUPT_VECTOR_COUNT (sizeof(interruptVectors)/sizeof(interruptVectors[0]))
 
-    engineInit();
-    execProgram();
+//Interrupt State
+// One bit per vector; lower vector numbers have higher priority.
+uint64_t pendingInterrupts = 0;
+uint64_t enabledInterrupts = 0;
+// Recomputed only when pending, enable or SREG I state changes.
+bool interruptReady = false;
+// Set by sei/reti so that one more instruction runs before an interrupt is served.
+bool interruptInhibit = false;
+bool interruptEnableRegister[INTERRUPT_REGISTER_LIMIT];
 
+//Superinstructions
+#define FUSED_NONE 0
+#define FUSED_LDI_RUN 1
+#define FUSED_PUSH_RUN 2
+#define FUSED_POP_RUN 3
+#define FUSED_SUBI_SBCI 4
+#define FUSED_COMPARE_BRNE 5
+#define FUSED_SBIW_BRNE 6
+#define FUSED_PATTERN_COUNT 7
+#define FUSED_RUN_LIMIT 8
+// Breakpoints share the dispatch slot, so unfused words pay nothing for them
+#define FUSED_BREAKPOINT 0xFF
+#define FUSED_RECOMPILED 0xFC // start of a block from an attached recompiled image
+#define FUSED_NATIVE 0xF0 // plus the index of a native routine, see nativeRoutines
+#define NATIVE_CODE_LIMIT 34 // words of the longest native routine
+const char* fusedPatternNames[FUSED_PATTERN_COUNT] =
+{
+    "none",
+    "ldi run",
+    "push run",
+    "pop run",
+    "subi/sbci",
+    "cp/cpc/brne",
+    "sbiw/brne loop",
+};
+// One entry per flash word, indexed by PC >> 1.
+struct predecodedWord
+{
+    uint8_t pattern;
+    uint8_t length; // instructions covered by the fused handler
+    uint8_t breakpoint;
+    uint8_t code; // WORD_* flags from analyzeProgram()
+};
+predecodedWord predecoded[MEMORY_SIZE/2];
+#define WORD_INSTRUCTION 0x01 // reachable instruction
+#define WORD_OPERAND 0x02 // second word of a two word instruction
+#define WORD_BLOCK_START 0x04
+#define WORD_CALL_TARGET 0x08
+#define WORD_JUMP_TABLE 0x10 // jump table entry, an instruction or a data word
+#define WORD_UNSUPPORTED 0x20 // fetch() stops with STOP_ILLEGAL_OPCODE here
+#define WORD_INDIRECT 0x40 // ijmp or icall with unknown targets
+#define WORD_VECTOR 0x80 // reset or interrupt vector
+// Cleared by the loaders so that engineInit analyzes each image once
+bool programAnalyzed = false;
+// Cleared while tracing, which records every instruction as its own step
+bool fusionEnabled = true;
+// Cleared by -nohle, native routines are not dispatched
+bool nativeEnabled = true;
+// Set by -cosim while the reference interpreter runs, which only fetch()es
+bool referenceEngine = false;
 #ifdef PROFILE
-    microseconds endProfile = duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch());
-    char buffer[256];
-    memset(buffer, '\0', 256);
-    long long profileTime = (long long)(endProfile.count()-startProfile.count());
-    sprintf(buffer, "%s 0x%X %i %lld %lld", argv[2], PC, (memory[25] << 8 | memory[24]), profileTime, (profileTime*1000)/totalFetches);
-    platformPrint(buffer);
+uint64_t fusedDispatches[FUSED_PATTERN_COUNT];
+uint64_t fusedInstructions[FUSED_PATTERN_COUNT];
 #endif
 
-    return 0;
+//Execution Tiers
+// With "-tiers warm hot" every analyzed block starts out on plain fetch()
+// and its first word counts block entries. Past warm entries the block gets
+// the superinstructions above, past hot entries it is queued for the
+// compiler thread, and once compiled it runs as one dispatch, in host code
+// when the host compiler is there (see Host Code Tier). Unanalyzed words are
+// predecoded from the start.
+#define FUSED_PROFILE 0xFE // counts the entry, then the word runs through fetch()
+#define FUSED_COMPILED 0xFD
+#define TIER_INTERPRETED 0
+#define TIER_PREDECODED 1
+#define TIER_QUEUED 2
+#define TIER_COMPILED 3
+#define TIER_UNCOMPILABLE 4 // predecoded for good
+#define TIER_COUNT 5
+#define COMPILED_BLOCK_LIMIT 64
+#define COMPILED_IMMEDIATE 0x80 // second operand is k rather than memory[r]
+#define COMPILED_NOP 0
+#define COMPILED_MOV 1
+#define COMPILED_MOVW 2
+#define COMPILED_ADD 3
+#define COMPILED_ADC 4
+#define COMPILED_SUB 5
+#define COMPILED_SBC 6
+#define COMPILED_CP 7
+#define COMPILED_CPC 8
+#define COMPILED_AND 9
+#define COMPILED_OR 10
+#define COMPILED_EOR 11
+#define COMPILED_MUL 12
+#define COMPILED_COM 13
+#define COMPILED_NEG 14
+#define COMPILED_SWAP 15
+#define COMPILED_INC 16
+#define COMPILED_DEC 17
+#define COMPILED_ASR 18
+#define COMPILED_LSR 19
+#define COMPILED_ROR 20
+#define COMPILED_ADIW 21
+#define COMPILED_SBIW 22
+#define COMPILED_BRANCH 23 // leaves the block when taken
+#define COMPILED_RJMP 24 // ends the block
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+// What host code for a block sees of the core, laid out like the library's
+// avrcoreMachine without the step callback
+struct compiledMachine
+{
+    uint8_t* data; // r0 to r31 first
+    uint8_t* sreg;
+    const uint8_t* addFlags; // [carry][a][b]
+    const uint8_t* subFlags; // [carry][a][b]
+    const uint8_t* logicFlags; // [result]
+    const uint8_t* shiftFlags; // [carry out][result]
+};
+// Returns the instructions retired and stores the flash byte address to
+// continue at in *pc
+typedef int32_t (*compiledFunction)(const compiledMachine* m, int32_t* pc);
+struct compiledOp
+{
+    uint8_t code;
+    uint8_t d;
+    uint8_t r;
+    uint8_t k;
+    int32_t target; // branch and rjmp destination
+};
+struct compiledBlock
+{
+    int32_t start;
+    int32_t length;
+    uint16_t source[COMPILED_BLOCK_LIMIT]; // checked against flash before install
+    compiledOp ops[COMPILED_BLOCK_LIMIT];
+    compiledFunction host; // host code for ops, NULL to interpret them
+};
+struct tierStatistics
+{
+    int32_t blocks[TIER_COUNT]; // block starts by their current tier
+    int32_t hostBlocks; // compiled blocks running as host code
+    uint64_t promotions[TIER_COUNT];
+    uint64_t dropped;
+    uint64_t dispatches; // compiled block runs
+    uint64_t instructions;
+    uint64_t hostDispatches; // of those, in host code
+};
+bool tiering = false;
+uint32_t tierWarm = 0;
+uint32_t tierHot = 0;
+uint8_t wordTier[MEMORY_SIZE/2];
+uint32_t blockHeat[MEMORY_SIZE/2];
+compiledBlock* compiledBlocks[MEMORY_SIZE/2]; // by block start
+uint64_t tierPromotions[TIER_COUNT];
+uint64_t droppedBlocks = 0;
+uint64_t compiledDispatches = 0;
+uint64_t compiledInstructions = 0;
+uint64_t hostDispatches = 0;
+#endif
+#ifdef LIBRARY
+const avrcoreRecompiledBlock** recompiledBlocks = NULL; // by flash word, for the active core
+bool recompiledValid(const avrcoreRecompiledBlock& block);
+int32_t runRecompiled(int32_t budget);
+#endif
+
+//Edge Coverage
+// AFL-style edge bitmap for the fuzz build. Control transfers count the
+// (previous location, PC) pair, where locations are hashed word addresses
+// and the previous one is shifted so that A->B and B->A differ. Compiles
+// to nothing in every other build.
+#define EDGE_MAP_SIZE (1 << 16)
+#ifdef FUZZ
+uint8_t localEdges[EDGE_MAP_SIZE];
+uint8_t* edgeMap = localEdges;
+uint16_t previousLocation = 0;
+#endif
+inline void coverEdge(programCounter address)
+{
+#ifdef FUZZ
+    uint16_t location = (address >> 1)*0x9E37;
+    edgeMap[location ^ previousLocation]++;
+    previousLocation = location >> 1;
+#endif
 }
+#ifdef FUZZ
+// Cycle of the last wdr, for the fuzz build's watchdog
+uint64_t watchdogResetCycle = 0;
+// Set once a store, an SPM signature read or the stack reaches flash, so
+// that the fuzz loop only restores flash when it has to
+bool flashWritten = false;
+#endif
 
+//Executed Words
+// One bit per flash word that started an instruction, set by the dispatch
+// loop in the coverage build. Fused sequences mark all of their words.
+#ifdef COVERAGE
+#define COVERAGE_WORDS (FLASH_SIZE/2)
+uint64_t executedWords[COVERAGE_WORDS/64];
+inline void markExecuted(programCounter address, int32_t words)
+{
+    uint32_t word = (address - programStart) >> 1;
+    while(words-- && (word < COVERAGE_WORDS))
+    {
+        executedWords[word >> 6] |= 1ULL << (word & 63);
+        word++;
+    }
+}
 #endif
 
-uint8_t readMemory(int32_t address)
+//Event Queue
+// Port and SPI writes can be handed to another thread instead of being
+// handled on the emulation thread. The queue is a lock-free ring with one
+// producer, the thread running the core, and one consumer. When it is full
+// the backpressure policy decides whether the core drops the event, waits
+// for the consumer, or coalesces: every source (a port or SPI) keeps only
+// its latest value until there is room, so the consumer sees the current
+// state but not every intermediate write.
+#define EVENT_QUEUE_SIZE 4096 // power of two
+#define CACHE_LINE_SIZE 64
+#define EVENT_PORT 0
+#define EVENT_SPI 1
+#define EVENT_END 2 // the producer is done, only used by the command line build
+#define EVENT_SOURCES 8 // ports, then SPI last
+#define BACKPRESSURE_DROP 0
+#define BACKPRESSURE_BLOCK 1
+#define BACKPRESSURE_COALESCE 2
+const char* backpressureNames[] = {"drop", "block", "coalesce"};
+struct peripheralEvent
+{
+    uint64_t cycle;
+    int32_t kind;
+    int32_t port;
+    uint8_t value;
+};
+struct eventQueue
+{
+    peripheralEvent events[EVENT_QUEUE_SIZE];
+    // Queues come from new, which ignores alignas before C++17, so a cache
+    // line of padding keeps the indices off each other's and the events' lines
+    uint8_t eventPadding[CACHE_LINE_SIZE];
+    std::atomic<uint32_t> head; // next event to consume
+    uint8_t headPadding[CACHE_LINE_SIZE];
+    std::atomic<uint32_t> tail; // next free slot
+    int32_t policy;
+    std::atomic<uint64_t> dropped;
+    // Held by whoever owns the producer side: the running core, or between
+    // runs a consumer publishing what was coalesced
+    std::atomic<bool> producing;
+    uint32_t coalescedMask;
+    peripheralEvent coalesced[EVENT_SOURCES];
+};
+// Queue the port and SPI handlers below publish to
+eventQueue* eventSink = NULL;
+
+bool publishEvent(eventQueue& queue, const peripheralEvent& event)
 {
-    if(address == ADCH_ADDRESS)
+    uint32_t tail = queue.tail.load(std::memory_order_relaxed);
+    if(tail - queue.head.load(std::memory_order_acquire) == EVENT_QUEUE_SIZE)
     {
-        return 0;
+        return false;
     }
-    if(address == ADCL_ADDRESS)
+    queue.events[tail & (EVENT_QUEUE_SIZE - 1)] = event;
+    queue.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+bool consumeEvent(eventQueue& queue, peripheralEvent& event)
+{
+    uint32_t head = queue.head.load(std::memory_order_relaxed);
+    if(head == queue.tail.load(std::memory_order_acquire))
     {
-        return 9;
+        return false;
     }
-    if(address == TIFR0_ADDRESS)
+    event = queue.events[head & (EVENT_QUEUE_SIZE - 1)];
+    queue.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+// Publishes coalesced events in source order as long as there is room
+void flushCoalesced(eventQueue& queue)
+{
+    while(queue.coalescedMask)
     {
-        return TOV0_BIT;
+        int32_t source = __builtin_ctz(queue.coalescedMask);
+        if(!publishEvent(queue, queue.coalesced[source]))
+        {
+            return;
+        }
+        queue.coalescedMask &= ~(1 << source);
     }
-    return memory[address];
 }
 
-void writeMemory(int32_t address, int32_t value)
+void queueEvent(eventQueue& queue, int32_t kind, int32_t port, uint8_t value)
 {
-    char buffer[256];
-    memory[address] = value;
-    switch(address)
+    peripheralEvent event = {cycleCount, kind, port, value};
+    int32_t source = (kind == EVENT_PORT) ? port: EVENT_SOURCES - 1;
+    flushCoalesced(queue);
+    //A source with a coalesced value stays coalesced, so its writes keep their order
+    if(!(queue.coalescedMask & (1 << source)) && publishEvent(queue, event))
     {
-        case PORTB_ADDRESS:
-        case PORTC_ADDRESS:
-        case PORTD_ADDRESS:
-#ifdef ATMEGA32U4
-        case ATMEGA32U4_PORTE_ADDRESS:
-        case ATMEGA32U4_PORTF_ADDRESS:
-#endif
-#ifdef LIBRARY
-            sprintf(buffer, "writePort(%i, %i)", (address-PORTB_ADDRESS)/3, value);
-            emscripten_run_script(buffer);
-#else
-            sprintf(buffer, "Port %i 0x%X", (address-PORTB_ADDRESS)/3, value);
-            platformPrint(buffer);
-#endif
+        return;
+    }
+    switch(queue.policy)
+    {
+        case BACKPRESSURE_DROP:
+            queue.dropped++;
             break;
-        case SPMCSR_ADDRESS:
-            if(value == (SIGRD_BIT|SPMEN_BIT))
+        case BACKPRESSURE_BLOCK:
+            while(!publishEvent(queue, event))
             {
-                 memory[((memory[31] << 8) | memory[30]) + programStart + 1] = MANUFACTURER_ID;
+                std::this_thread::yield();
             }
             break;
-        case SDR_ADDRESS:
-#ifdef LIBRARY
-            sprintf(buffer, "writeSPI(%i)", value);
-            emscripten_run_script(buffer);
-#else
-            sprintf(buffer, "SPI Transmit %i", value);
-            platformPrint(buffer);
-#endif
-            break;
-#ifdef ATMEGA32U4
-        case ATMEGA32U4_PLLCSR_ADDRESS:
-            memory[ATMEGA32U4_PLLCSR_ADDRESS] = value;
-            memory[ATMEGA32U4_PLLCSR_ADDRESS] = (value & ATMEGA32U4_PLLE_BIT) > 0 ? memory[ATMEGA32U4_PLLCSR_ADDRESS] | ATMEGA32U4_PLOCK_BIT : memory[ATMEGA32U4_PLLCSR_ADDRESS] & ~ATMEGA32U4_PLOCK_BIT;
+        case BACKPRESSURE_COALESCE:
+            queue.dropped += (queue.coalescedMask >> source) & 0x1;
+            queue.coalesced[source] = event;
+            queue.coalescedMask |= 1 << source;
             break;
-#endif
     }
 }
 
-void pushStatus(status& newStatus)
+void queuePort(void* context, int32_t port, uint8_t value)
 {
-    if(newStatus.C != IGNORE)
-    {
-        SREG.C = newStatus.C;
-    }
-    if(newStatus.Z != IGNORE)
-    {
-        SREG.Z = newStatus.Z;
-    }
-    if(newStatus.N != IGNORE)
+    queueEvent(*eventSink, EVENT_PORT, port, value);
+}
+
+void queueSpi(void* context, uint8_t value)
+{
+    queueEvent(*eventSink, EVENT_SPI, 0, value);
+}
+
+#ifndef LIBRARY
+//Trace
+// "-trace file" records every executed instruction, data space write and
+// interrupt entry as a stream of varints. The low three bits of each one
+// are the record kind and the rest is its payload:
+//   TRACE_STEP n       n instructions ran, each at the address after the
+//                      previous one and matching the image
+//   TRACE_JUMP d       the next instruction is d words (zigzag) away from
+//                      the address after the previous one
+//   TRACE_OPCODE w     the next instruction is w, not the word in the image
+//   TRACE_WRITE d      the last instruction wrote the byte that follows to
+//                      the previous write address plus d (zigzag)
+//   TRACE_INTERRUPT v  vector v was entered
+//   TRACE_END r        the run stopped for reason r
+//   TRACE_REPEAT k     the last TRACE_STEP and TRACE_JUMP pair repeated k
+//                      more times
+//   TRACE_WATCH a      the last instruction hit a watchpoint, a is the data
+//                      address shifted left by two above the access mode
+// Straight-line code only bumps the pending step count and loops only the
+// pending repeat count. Superinstructions are not dispatched while
+// tracing, so every instruction is one step.
+#define TRACE_STEP 0
+#define TRACE_JUMP 1
+#define TRACE_OPCODE 2
+#define TRACE_WRITE 3
+#define TRACE_INTERRUPT 4
+#define TRACE_END 5
+#define TRACE_REPEAT 6
+#define TRACE_WATCH 7
+#define TRACE_MAGIC "avrtrace"
+#define TRACE_VERSION 1
+// Two buffers, one filled by the core while a writer thread saves the other
+#define TRACE_BUFFER_SIZE (1 << 20)
+#define TRACE_RECORD_LIMIT 24
+bool tracing = false;
+uint8_t traceBuffers[2][TRACE_BUFFER_SIZE];
+int32_t traceActive = 0;
+size_t traceUsed = 0;
+uint64_t traceSteps = 0; // not yet recorded
+uint64_t traceRepeats = 0; // not yet recorded
+bool tracePaired = false; // last record was a jump that a repeat may follow
+uint64_t tracePairSteps = 0;
+uint64_t tracePairJump = 0;
+uint64_t traceTotal = 0;
+programCounter traceNext = 0;
+int32_t traceLastWrite = 0;
+uint8_t* traceImage = NULL; // flash as loaded, for TRACE_OPCODE
+
+void traceHandoff();
+
+inline uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+inline void traceRecord(int32_t kind, uint64_t payload)
+{
+    if(traceUsed > TRACE_BUFFER_SIZE - TRACE_RECORD_LIMIT)
     {
-        SREG.N = newStatus.N;
+        traceHandoff();
     }
-    if(newStatus.V != IGNORE)
+    uint64_t value = (payload << 3) | kind;
+    uint8_t* out = &traceBuffers[traceActive][traceUsed];
+    while(value >= 0x80)
     {
-        SREG.V = newStatus.V;
+        *out++ = (value & 0x7F) | 0x80;
+        value >>= 7;
     }
-    if(newStatus.S != IGNORE)
+    *out++ = value;
+    traceUsed = out - traceBuffers[traceActive];
+}
+
+inline void traceFlushSteps()
+{
+    if(traceRepeats)
     {
-        SREG.S = newStatus.S;
+        traceRecord(TRACE_REPEAT, traceRepeats);
+        traceRepeats = 0;
     }
-    if(newStatus.H != IGNORE)
+    if(traceSteps)
     {
-        SREG.H = newStatus.H;
+        traceRecord(TRACE_STEP, traceSteps);
+        traceSteps = 0;
     }
-    if(newStatus.T != IGNORE)
+    tracePaired = false;
+}
+
+inline void traceInstruction()
+{
+    if(PC != traceNext)
     {
-         SREG.T = newStatus.T;
+        uint64_t jump = zigzag(((int64_t)PC - (int64_t)traceNext) >> 1);
+        if(tracePaired && (traceSteps == tracePairSteps) && (jump == tracePairJump))
+        {
+            traceRepeats++;
+            traceSteps = 0;
+        }
+        else
+        {
+            tracePairSteps = traceSteps;
+            traceFlushSteps();
+            traceRecord(TRACE_JUMP, jump);
+            tracePaired = true;
+            tracePairJump = jump;
+        }
     }
-    if(newStatus.I != IGNORE)
+    uint16_t opcode = (memory[PC] << 8) | memory[PC+1];
+    if((memory[PC] != traceImage[PC]) || (memory[PC+1] != traceImage[PC+1]))
     {
-         SREG.I = newStatus.I;
+        traceFlushSteps();
+        traceRecord(TRACE_OPCODE, opcode);
     }
+    traceSteps++;
+    traceTotal++;
+    //lds, sts, jmp and call are two words long
+    traceNext = PC + ((((opcode & 0xFC0F) == 0x9000) || ((opcode & 0xFE0C) == 0x940C)) ? 4: 2);
 }
 
-void engineInit()
+inline void traceWrite(int32_t address, uint8_t value)
 {
-    SREG.clear();
+    traceFlushSteps();
+    traceRecord(TRACE_WRITE, zigzag(address - traceLastWrite));
+    traceBuffers[traceActive][traceUsed++] = value;
+    traceLastWrite = address;
+}
 
-    PC = programStart;
-    int32_t SP = programStart - 1;
-    memory[SPH_ADDRESS] = (SP & 0xFF00) >> 8;
-    memory[SPL_ADDRESS] = (SP & 0xFF);
-    resetFetchState();
+inline void traceInterrupt(int32_t vector)
+{
+    traceFlushSteps();
+    traceRecord(TRACE_INTERRUPT, vector);
+    traceNext = PC;
 }
 
-int32_t getValueFromHex(uint8_t* buffer, int32_t size)
+inline void traceWatch(int32_t address, int32_t mode)
 {
-    int32_t value = 0;
-    int32_t cursor = 0;
-    while(size--)
-    {
-        int32_t shift = (1 << size*4);
-        if(buffer[cursor] < ':')
-        {
-            value += (buffer[cursor++] - '0')*shift;
-        }
-        else
-        {
-            value += (buffer[cursor++] - 0x37)*shift;
-        }
-    }
+    traceFlushSteps();
+    traceRecord(TRACE_WATCH, (address << 2) | mode);
+}
+#endif
 
-    return value;
+const char* stopReasonNames[STOP_REASON_COUNT] =
+{
+    "budget",
+    "break",
+    "sleep",
+    "breakpoint",
+    "watchpoint",
+    "illegal opcode",
+    "stack overflow",
+};
+
+//API
+extern "C" void loadPartialProgram(uint8_t* binary);
+extern "C" void engineInit();
+extern "C" int32_t fetchN(int32_t n);
+extern "C" int32_t runUntil(uint64_t instructions, uint64_t cycles);
+extern "C" void setBreakpoint(int32_t address, bool enabled);
+extern "C" void setWatchpoint(int32_t address, int32_t mode);
+extern "C" void setStackLimit(int32_t address);
+#ifdef FUZZ
+int32_t fuzzMain(int32_t inputCount, char** inputs);
+#endif
+#ifdef COVERAGE
+bool mergeCoverage(const char* path);
+bool exportLcov(const char* bitmapPath, const char* elfPath, const char* infoPath);
+#endif
+
+void loadProgram(uint8_t* binary, int32_t size);
+bool loadHex(const uint8_t* binary, int32_t size);
+void loadDefaultProgram();
+void printListing();
+void reportUnsupported();
+void execProgram();
+void execThreaded(int32_t policy);
+bool openDisplay(const char* name, const char* output, int32_t frameSkip);
+void closeDisplay();
+bool loadInputScript(const char* path);
+void execBenchmark(uint64_t frames, int32_t syncPort, int32_t syncBit);
+bool openTrace(const char* path);
+void closeTrace();
+bool replayTrace(const char* path, uint64_t step);
+bool openGdb(const char* endpoint);
+bool parseWatchpoint(const char* range, const char* access, bool log);
+void execGdb();
+bool execCosim(uint64_t interval);
+bool openSemihost(int32_t address);
+int32_t closeSemihost();
+int32_t fetch();
+void predecodeProgram(int32_t start, int32_t end);
+void analyzeProgram();
+int32_t fetchFused(int32_t budget);
+bool verifyEngines();
+#ifdef LIBRARY
+bool verifyLanes();
+#endif
+#ifdef PROFILE
+void reportNative();
+#endif
+void startTiering(uint32_t warm, uint32_t hot);
+void stopTiering();
+bool writeRecompiled(const char* name, const char* path);
+int32_t dropCompiled(int32_t start, int32_t end);
+void profileBlock();
+int32_t runCompiled(int32_t budget);
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+void compileHost(compiledBlock** blocks, int32_t count);
+void readTierStatistics(tierStatistics& statistics);
+#endif
+
+uint8_t readMemory(int32_t address);
+void writeMemory(int32_t address, int32_t value);
+void buildFlagTables();
+bool verifyFlagTables();
+void raiseInterrupt(int32_t vector);
+void updateInterruptMask();
+void updateInterruptState();
+void serviceInterrupts();
+bool wakeFromSleep();
+void resetFetchState()
+{
+    memory[ADCSRA_ADDRESS] &= ~ADSC_BIT;
+    memory[SPSR_ADDRESS] |= SPIF_BIT;
+    memory[UCSRA_ADDRESS] |= UDRE_BIT;
 }
 
-void loadDefaultProgram()
+void platformPrint(const char* message)
 {
-    platformPrint("Fall back to default internal test program.");
-    // 0:   0c 94 56 00     jmp     0xac    ; 0xac <__ctors_end>
-        memory[0xB00] = 0x94;
-        memory[0xB01] = 0x0C;
-        memory[0xB02] = 0x00;
-        memory[0xB03] = 0x56;
-    //ac:   11 24           eor     r1, r1
-        memory[0xBAC] = 0x24;
-        memory[0xBAD] = 0x11;
-    //ae:   1f be           out     0x3f, r1        ; 63
-        memory[0xBAE] = 0xBE;
-        memory[0xBAF] = 0x1F;
-    //b0:   cf ef           ldi     r28, 0xFF       ; 255
-    //b2:   da e0           ldi     r29, 0x0A       ; 10
-        memory[0xBB0] = 0xEF;
-        memory[0xBB1] = 0xCF;
-        memory[0xBB2] = 0xE0;
-        memory[0xBB3] = 0xDA;
-    //b4:   de bf           out     0x3e, r29       ; 62
-    //b6:   cd bf           out     0x3d, r28       ; 61
-        memory[0xBB4] = 0xBF;
-        memory[0xBB5] = 0xDE;
-        memory[0xBB6] = 0xBF;
-        memory[0xBB7] = 0xCD;
-    //b8:   0e 94 62 00     call    0xc4    ; 0xc4 <main>
-        memory[0xBB8] = 0x94;
-        memory[0xBB9] = 0x0E;
-        memory[0xBBA] = 0x00;
-        memory[0xBBB] = 0x62;
-    //c4:   cf 93           push    r28
-    //c6:   df 93           push    r29
-        memory[0xBC4] = 0x93;
-        memory[0xBC5] = 0xCF;
-        memory[0xBC6] = 0x93;
-        memory[0xBC7] = 0xDF;
-    //c8:   cd b7           in      r28, 0x3d       ; 61
-    //ca:   de b7           in      r29, 0x3e       ; 62
-        memory[0xBC8] = 0xB7;
-        memory[0xBC9] = 0xCD;
-        memory[0xBCA] = 0xB7;
-        memory[0xBCB] = 0xDE;
-    //cc:   84 e2           ldi     r24, 0x24       ; 36
-    //ce:   90 e0           ldi     r25, 0x00       ; 0
-    //d0:   28 e0           ldi     r18, 0x08       ; 8
-        memory[0xBCC] = 0xE2;
-        memory[0xBCD] = 0x84;
-        memory[0xBCE] = 0xE0;
-        memory[0xBCF] = 0x90;
-        memory[0xBD0] = 0xE0;
-        memory[0xBD1] = 0x28;
-    //d2:   fc 01           movw    r30, r24
-        memory[0xBD2] = 0x01;
-        memory[0xBD3] = 0xFC;
-    //d4:   20 83           st      Z, r18
-        memory[0xBD4] = 0x83;
-        memory[0xBD5] = 0x20;
-    //d6:   85 e2           ldi     r24, 0x25       ; 37
-        memory[0xBD6] = 0xE2;
-        memory[0xBD7] = 0x85;
-    //d8:   90 e0           ldi     r25, 0x00       ; 0
-        memory[0xBD8] = 0xE0;
-        memory[0xBD9] = 0x90;
-    //da:   21 e0           ldi     r18, 0x01       ; 1
-        memory[0xBDA] = 0xE0;
-        memory[0xBDB] = 0x21;
-    //dc:   fc 01           movw    r30, r24
-        memory[0xBDC] = 0x01;
-        memory[0xBDD] = 0xFC;
-    //de:   20 83           st      Z, r18
-        memory[0xBDE] = 0x83;
-        memory[0xBDF] = 0x20;
-    //e0:   98 95           break
-        memory[0xBE0] = 0x95;
-        memory[0xBE1] = 0x98;
+#ifdef EMSCRIPTEN
+    char buffer[1024];
+    sprintf(buffer, "console.log('%s')", message);
+    emscripten_run_script(buffer);
+#else
+    printf("%s\n", message);
+#endif
 }
 
-int32_t currentAddressCursor = ENTRY_ADDRESS;
-void loadPartialProgram(uint8_t* binary)
+size_t totalFetches = 0;
+#ifndef LIBRARY
+int32_t main(int32_t argc, char** argv)
 {
-    int32_t lineCursor = 0;
-    assert(binary[lineCursor++] == ':');
-    int32_t byteCount = getValueFromHex(&binary[lineCursor], 2);
-    int32_t address = getValueFromHex(&binary[lineCursor+=2], 4);
-    int32_t recordType = getValueFromHex(&binary[lineCursor+=4], 2);
-    if(recordType == 0x00)
-    {
-        while(byteCount)
-        {
-            int32_t instr = getValueFromHex(&binary[lineCursor+=2], 2);
-            memory[currentAddressCursor++] = getValueFromHex(&binary[lineCursor+=2], 2);
-            memory[currentAddressCursor++] = instr;
-            byteCount-=2;
-        }
-    }
-    else if(recordType == 0x01)
-    {
-        return;
-    }
-    else
+#ifdef ENGINE_CHECK
+    return verifyEngines() ? 0: 1;
+#endif
+#ifdef FLAG_TABLE_CHECK
+    return verifyFlagTables() ? 0: 1;
+#endif
+#ifdef COVERAGE
+    if((argc == 5) && !strcmp(argv[1], "-lcov"))
     {
-        assert(false);
+        return exportLcov(argv[2], argv[3], argv[4]) ? 0: 1;
     }
-}
-
-void loadProgram(uint8_t* binary)
-{
-    int32_t fileCursor = 0;
-    int32_t addressCursor = ENTRY_ADDRESS;
-    while(true)
+#endif
+    bool listing = false;
+    int32_t backpressure = -1;
+    const char* displayName = NULL;
+    const char* displayOutput = NULL;
+    int32_t frameSkip = 1;
+    uint64_t benchmarkFrames = 0;
+    int32_t syncPort = -1;
+    int32_t syncBit = 0;
+    const char* tracePath = NULL;
+    const char* replayPath = NULL;
+    uint64_t replayStep = 0;
+    const char* gdbEndpoint = NULL;
+    int64_t tierWarmEntries = -1;
+    int64_t tierHotEntries = -1;
+    const char* recompiledName = NULL;
+    const char* recompiledPath = NULL;
+    uint64_t cosimInstructions = 0;
+    int32_t semihostRequest = -1;
+    int32_t exitStatus = 0;
+    while((argc > 1) && (argv[1][0] == '-'))
     {
-        assert(binary[fileCursor++] == ':');
-        int32_t byteCount = getValueFromHex(&binary[fileCursor], 2);
-        int32_t address = getValueFromHex(&binary[fileCursor+=2], 4);
-        int32_t recordType = getValueFromHex(&binary[fileCursor+=4], 2);
-        if(recordType == 0x00)
+        if(!strcmp(argv[1], "-list"))
+        {
+            listing = true;
+        }
+        else if(!strcmp(argv[1], "-nohle"))
+        {
+            nativeEnabled = false;
+        }
+        else if(!strcmp(argv[1], "-virtual"))
+        {
+            virtualTime = true;
+        }
+        else if(!strcmp(argv[1], "-threaded") && (argc > 2))
         {
-            while(byteCount)
+            for(backpressure = BACKPRESSURE_COALESCE; (backpressure >= 0) && strcmp(argv[2], backpressureNames[backpressure]); backpressure--)
+                ;
+            if(backpressure < 0)
             {
-                int32_t instr = getValueFromHex(&binary[fileCursor+=2], 2);
-                memory[addressCursor++] = getValueFromHex(&binary[fileCursor+=2], 2);
-                memory[addressCursor++] = instr;
-                byteCount-=2;
+                char buffer[256];
+                snprintf(buffer, sizeof(buffer), "Unknown backpressure policy %s, use drop, block or coalesce", argv[2]);
+                platformPrint(buffer);
+                return 1;
             }
-            while(binary[++fileCursor] != ':')
-            ;
+            argc--;
+            argv++;
         }
-        else if(recordType == 0x01)
+        else if(!strcmp(argv[1], "-display") && (argc > 3))
         {
-            break;
+            displayName = argv[2];
+            displayOutput = argv[3];
+            argc-=2;
+            argv+=2;
         }
-        else if(recordType == 0x02)
+        else if(!strcmp(argv[1], "-bench") && (argc > 2))
+        {
+            benchmarkFrames = strtoull(argv[2], NULL, 0);
+            argc--;
+            argv++;
+        }
+        else if(!strcmp(argv[1], "-framesync") && (argc > 3))
+        {
+            syncPort = atoi(argv[2]);
+            syncBit = atoi(argv[3]);
+            argc-=2;
+            argv+=2;
+        }
+        else if(!strcmp(argv[1], "-input") && (argc > 2))
         {
-            int32_t segmentAddress = 0;
-            while(byteCount)
+            if(!loadInputScript(argv[2]))
             {
-                segmentAddress = getValueFromHex(&binary[fileCursor+=2], 2);
-                segmentAddress = segmentAddress << 4;
-                segmentAddress |= getValueFromHex(&binary[fileCursor+=2], 2);
-                segmentAddress = segmentAddress << 4;
-                byteCount-=2;
+                char buffer[256];
+                snprintf(buffer, sizeof(buffer), "Cannot read input script %s", argv[2]);
+                platformPrint(buffer);
+                return 1;
             }
-            while(binary[++fileCursor] != ':')
-            ;
-            addressCursor = segmentAddress*16;
+            argc--;
+            argv++;
+        }
+        else if(!strcmp(argv[1], "-trace") && (argc > 2))
+        {
+            tracePath = argv[2];
+            argc--;
+            argv++;
+        }
+        else if(!strcmp(argv[1], "-replay") && (argc > 3))
+        {
+            replayPath = argv[2];
+            replayStep = strtoull(argv[3], NULL, 0);
+            argc-=2;
+            argv+=2;
+        }
+        else if((!strcmp(argv[1], "-watch") || !strcmp(argv[1], "-log")) && (argc > 3))
+        {
+            if(!parseWatchpoint(argv[2], argv[3], !strcmp(argv[1], "-log")))
+            {
+                char buffer[256];
+                snprintf(buffer, sizeof(buffer), "Cannot watch %s %s", argv[2], argv[3]);
+                platformPrint(buffer);
+                return 1;
+            }
+            argc-=2;
+            argv+=2;
+        }
+        else if(!strcmp(argv[1], "-gdb") && (argc > 2))
+        {
+            gdbEndpoint = argv[2];
+            argc--;
+            argv++;
+        }
+        else if(!strcmp(argv[1], "-tiers") && (argc > 3))
+        {
+            tierWarmEntries = strtoll(argv[2], NULL, 0);
+            tierHotEntries = strtoll(argv[3], NULL, 0);
+            if((tierWarmEntries < 0) || (tierHotEntries < tierWarmEntries) || (tierHotEntries > UINT32_MAX))
+            {
+                char buffer[256];
+                snprintf(buffer, sizeof(buffer), "Bad tier thresholds %s %s, need 0 <= warm <= hot", argv[2], argv[3]);
+                platformPrint(buffer);
+                return 1;
+            }
+            argc-=2;
+            argv+=2;
+        }
+        else if(!strcmp(argv[1], "-semihost") && (argc > 2))
+        {
+            semihostRequest = strtol(argv[2], NULL, 0);
+            argc--;
+            argv++;
+        }
+        else if(!strcmp(argv[1], "-cosim") && (argc > 2))
+        {
+            cosimInstructions = strtoull(argv[2], NULL, 0);
+            if(!cosimInstructions)
+            {
+                char buffer[256];
+                snprintf(buffer, sizeof(buffer), "Bad co-simulation interval %s", argv[2]);
+                platformPrint(buffer);
+                return 1;
+            }
+            argc--;
+            argv++;
+        }
+        else if(!strcmp(argv[1], "-aot") && (argc > 3))
+        {
+            recompiledName = argv[2];
+            recompiledPath = argv[3];
+            argc-=2;
+            argv+=2;
+        }
+        else if(!strcmp(argv[1], "-frameskip") && (argc > 2))
+        {
+            frameSkip = (atoi(argv[2]) > 0) ? atoi(argv[2]): 1;
+            argc--;
+            argv++;
         }
         else
         {
-            assert(false);
+            break;
         }
+        argc--;
+        argv++;
     }
-    free(binary);
-}
-
-int8_t generateVStatus(uint8_t firstOp, uint8_t secondOp)
-{
-    bool firstMSB = (firstOp & 0x80) > 0;
-    bool secondMSB = (secondOp & 0x80) > 0;
-    if(firstMSB && secondMSB)
+#ifdef ATMEGA328
+    const char* defaultDisplay = "pcd8544";
+#else
+    const char* defaultDisplay = "ssd1306";
+#endif
+    //Benchmarks count frames through the display model even without output
+    displayName = (benchmarkFrames && !displayName) ? defaultDisplay: displayName;
+    if(displayName && !openDisplay(displayName, displayOutput, frameSkip))
     {
-        return ((firstOp + secondOp) & 0x80) > 0 ? CLR: SET;
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "Unknown display %s, use ssd1306 or pcd8544", displayName);
+        platformPrint(buffer);
+        return 1;
     }
-    else if(!firstMSB && !secondMSB)
+    //The fuzz build takes any number of inputs, only cache what fits
+    char* storagePointer = argvStorage;
+    while(cachedArgc < argc && cachedArgc < 64)
     {
-        return ((firstOp + secondOp) & 0x80) == 0 ? CLR: SET;
+        int32_t length = strlen(argv[cachedArgc]);
+        if(storagePointer + length + 1 > argvStorage + sizeof(argvStorage))
+        {
+            break;
+        }
+        cachedArgv[cachedArgc] = storagePointer;
+        strcat(storagePointer, argv[cachedArgc++]);
+        storagePointer+=(length+1);
     }
-
-    return CLR;
-}
-
-int8_t generateVStatus2(uint8_t firstOp, uint8_t secondOp)
-{
-    bool firstMSB = (firstOp & 0x80) > 0;
-    bool secondMSB = (secondOp & 0x80) > 0;
-    if(firstMSB && !secondMSB)
+    FILE* executable = NULL;
+#ifdef EMSCRIPTEN
+    EM_ASM(var fs = require('fs'); fs.readFile(process.argv[process.argv.length-1], 'utf8', function(error, hex){fs.writeFileSync('scratch', hex)}););
+    EM_ASM(FS.mkdir('/working'); FS.mount(NODEFS, { root: '.' }, '/working'););
+    executable = fopen("/working/scratch","rb");
+#else
+    if(cachedArgc > 1) executable = fopen(cachedArgv[1],"rb");
+#endif
+    if(executable)
     {
-        return ((firstOp - secondOp) & 0x80) == 0 ? SET: CLR;
+        fseek(executable, 0, SEEK_END);
+        int32_t size = ftell(executable);
+        rewind(executable);
+        uint8_t* binary = (uint8_t*)malloc(size);
+        size_t read = fread(binary, 1, size, executable);
+        if(read != size) return -1;
+        fclose(executable);
+        loadProgram(binary, size);
+#ifdef EMSCRIPTEN
+        EM_ASM(FS.unlink('/working/scratch'););
+#endif
     }
-    else if(!firstMSB && secondMSB)
+    else
     {
-        return ((firstOp - secondOp) & 0x80) > 0 ? SET: CLR;
+        loadDefaultProgram();
     }
 
-    return CLR;
-}
-
-int8_t generateHStatus(uint8_t firstOp, uint8_t secondOp)
-{
-    return (((firstOp & 0xF) + (secondOp & 0xF)) & 0x10) == 0x10 ? SET: CLR;
-}
-
-void execProgram()
-{
-    while(fetchN(1))
-        ;
-}
-
-void callTOV0Interrupt()
-{
-  writeMemory((memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS], PC >> 8);
-  decrementStackPointer();
-  writeMemory((memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS], PC & 255);
-  decrementStackPointer();
-  PC = TIMER_INTERRUPT_ADDRESS + programStart;
-}
+#ifdef PROFILE
+    microseconds startProfile = virtualTime ? microseconds(0): duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch());
+#endif
 
-int32_t trackedFetches = 0;
-int32_t fetchN(int32_t n)
-{
-    bool success = true;
-    bool timed = false;
-    for(int i = 0; i < n/INSTRUCTION_LIMIT; i++)
+    engineInit();
+    if(listing)
+    {
+        printListing();
+        return 0;
+    }
+#ifndef EMSCRIPTEN
+    if(recompiledName)
+    {
+        if(!writeRecompiled(recompiledName, recompiledPath))
+        {
+            char buffer[256];
+            snprintf(buffer, sizeof(buffer), "Cannot write %s", recompiledPath);
+            platformPrint(buffer);
+            return 1;
+        }
+        return 0;
+    }
+#endif
+#ifdef FUZZ
+    return fuzzMain(argc - 2, &argv[2]);
+#endif
+#ifndef EMSCRIPTEN
+    if(replayPath)
     {
-        timed = true;
-        callTOV0Interrupt();
+        return replayTrace(replayPath, replayStep) ? 0: 1;
     }
-    if(!timed)
+    if(tracePath && !openTrace(tracePath))
     {
-        trackedFetches += n;
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "Cannot write trace %s", tracePath);
+        platformPrint(buffer);
+        return 1;
     }
-    if(trackedFetches/INSTRUCTION_LIMIT)
+    if(gdbEndpoint && !openGdb(gdbEndpoint))
     {
-        trackedFetches = 0;
-        callTOV0Interrupt();
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "Cannot serve gdb on %s", gdbEndpoint);
+        platformPrint(buffer);
+        return 1;
     }
-    while(success && n)
+    if(tierWarmEntries >= 0)
     {
-        success = fetch();
-        n--;
+        startTiering(tierWarmEntries, tierHotEntries);
+    }
+#endif
+    if((semihostRequest >= 0) && !openSemihost(semihostRequest))
+    {
+        char buffer[256];
+        snprintf(buffer, sizeof(buffer), "Cannot map semihosting at 0x%X", semihostRequest);
+        platformPrint(buffer);
+        return 1;
+    }
+    reportUnsupported();
+#ifndef EMSCRIPTEN
+    if(gdbEndpoint)
+    {
+        execGdb();
+    }
+    else if(benchmarkFrames)
+    {
+        execBenchmark(benchmarkFrames, syncPort, syncBit);
+    }
+    else if(cosimInstructions)
+    {
+        exitStatus = execCosim(cosimInstructions) ? 0: 1;
+    }
+    else if(backpressure >= 0)
+    {
+        execThreaded(backpressure);
+    }
+    else
+#endif
+    {
+        execProgram();
+    }
+#ifndef EMSCRIPTEN
+    closeTrace();
+    stopTiering();
+#endif
+    closeDisplay();
+    int32_t guestStatus = closeSemihost();
+    exitStatus = exitStatus ? exitStatus: guestStatus;
+#ifdef COVERAGE
+    if((argc > 2) && !mergeCoverage(argv[2]))
+    {
+        return 1;
     }
-#ifdef LIBRARY
-    EM_ASM("refreshUI();");
 #endif
 
-    return success;
+#ifdef PROFILE
+    microseconds endProfile = virtualTime ? microseconds((cycleCount*1000000ULL)/CLOCK_HZ): duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch());
+    char buffer[256];
+    memset(buffer, '\0', 256);
+    long long profileTime = (long long)(endProfile.count()-startProfile.count());
+    sprintf(buffer, "%s 0x%X %i %lld %lld", argv[2], PC, readPair(24), profileTime, totalFetches ? (profileTime*1000)/(long long)totalFetches: 0);
+    platformPrint(buffer);
+    for(int32_t pattern = FUSED_NONE+1; pattern < FUSED_PATTERN_COUNT; pattern++)
+    {
+        if(fusedDispatches[pattern])
+        {
+            sprintf(buffer, "Fused %s %llu %llu", fusedPatternNames[pattern], (unsigned long long)fusedDispatches[pattern], (unsigned long long)fusedInstructions[pattern]);
+            platformPrint(buffer);
+        }
+    }
+    reportNative();
+#endif
+
+    return exitStatus;
 }
 
-bool longOpcode(uint16_t programCounter)
-{
-    uint16_t opcode0 = memory[programCounter];
-    uint16_t opcode1 = memory[programCounter+1];
+#endif
 
-    switch(opcode0)
-    {
-        case 0x90:
-        case 0x91:
-            if((opcode1 & 0xF) == 0) //lds
+//Semihosting
+#ifndef LIBRARY
+// "-semihost address" hands SEMIHOST_SIZE reserved I/O addresses to the
+// host. Bytes written to SEMIHOST_LOG are buffered and go to standard
+// output in bulk, writing SEMIHOST_EXIT stops the core and makes the value
+// the exit status of the process, and reading SEMIHOST_CYCLES latches the
+// cycle counter so the next three bytes return the rest of it, least
+// significant first.
+#define SEMIHOST_LOG 0
+#define SEMIHOST_FLUSH 1
+#define SEMIHOST_EXIT 2
+#define SEMIHOST_CYCLES 4
+#define SEMIHOST_SIZE 8
+#define SEMIHOST_BUFFER_SIZE 4096
+
+int32_t semihostAddress = MEMORY_SIZE;
+bool semihostMuted = false; // set while co-simulation runs the reference
+int32_t semihostStatus = -1;
+uint32_t semihostCycles = 0;
+char semihostBuffer[SEMIHOST_BUFFER_SIZE];
+int32_t semihostUsed = 0;
+
+// Runs of data addresses below RAMSTART that the datasheet leaves
+// reserved, end exclusive. No peripheral decodes them, so the host can take
+// them over without shadowing a register the program might use.
+struct reservedRange
+{
+    uint16_t start;
+    uint16_t end;
+};
+#ifdef ATMEGA32U4
+const reservedRange reservedIo[] =
+{
+    {0x9E, 0xB8},
+};
+#elif defined(ATMEGA328)
+const reservedRange reservedIo[] =
+{
+    {0x8C, 0xB0},
+    {0xC7, 0x100},
+};
+#elif defined(ATMEGA2560)
+const reservedRange reservedIo[] =
+{
+    {0xD7, 0x100},
+    {0x10C, 0x120},
+    {0x137, 0x200},
+};
+#endif
+
+bool openSemihost(int32_t address)
+{
+    const int32_t end = address + SEMIHOST_SIZE;
+    if((address < IO_REG_START) || (end > RAMSTART))
+    {
+        return false;
+    }
+    for(uint32_t i = 0; i < sizeof(reservedIo)/sizeof(reservedIo[0]); i++)
+    {
+        if((address >= reservedIo[i].start) && (end <= reservedIo[i].end))
+        {
+            semihostAddress = address;
+            return true;
+        }
+    }
+    return false;
+}
+
+void flushSemihost()
+{
+    fwrite(semihostBuffer, 1, semihostUsed, stdout);
+    fflush(stdout);
+    semihostUsed = 0;
+}
+
+// Flushes the log and returns the status the guest exited with
+int32_t closeSemihost()
+{
+    flushSemihost();
+    return (semihostStatus >= 0) ? semihostStatus: 0;
+}
+
+uint8_t readSemihost(int32_t offset, uint8_t value)
+{
+    if(offset == SEMIHOST_CYCLES)
+    {
+        semihostCycles = cycleCount;
+    }
+    if(offset >= SEMIHOST_CYCLES)
+    {
+        value = semihostCycles >> (8*(offset - SEMIHOST_CYCLES));
+    }
+    return value;
+}
+
+void writeSemihost(int32_t offset, uint8_t value)
+{
+    switch(offset)
+    {
+        case SEMIHOST_LOG:
+            if(!semihostMuted)
             {
-                return true;
+                semihostBuffer[semihostUsed++] = value;
+                if(semihostUsed == SEMIHOST_BUFFER_SIZE)
+                {
+                    flushSemihost();
+                }
             }
             break;
-        case 0x92:
-        case 0x93:
-            if((opcode1 & 0xF) == 0) //sts
+        case SEMIHOST_FLUSH:
+            if(!semihostMuted)
             {
-                return true;
+                flushSemihost();
             }
             break;
-        case 0x94:
-        case 0x95:
-            if((opcode1 & 0xF) > 0xB) //jmp / call
+        case SEMIHOST_EXIT:
+            semihostStatus = value;
+            stopReason = STOP_BREAK;
+            break;
+    }
+}
+#endif
+
+// Slow path for accesses to a watched page
+void watchAccess(int32_t address, int32_t mode, uint8_t value)
+{
+    bool hit = false;
+    for(int32_t i = 0; i < watchpoints.count; i++)
+    {
+        const watchpoint& entry = watchpoints.entries[i];
+        if(!(entry.mode & mode) || (address < entry.start) || (address >= entry.end) || ((entry.mode & WATCH_VALUE) && (value != entry.value)))
+        {
+            continue;
+        }
+        hit = true;
+        if(!(entry.mode & WATCH_LOG))
+        {
+            stopReason = STOP_WATCHPOINT;
+            watchpointAddress = address;
+            watchpointMode = entry.mode;
+        }
+        else if(watchCallback)
+        {
+            watchCallback(peripheralContext, address, value, mode);
+        }
+        else
+        {
+#ifndef LIBRARY
+            char buffer[256];
+            sprintf(buffer, "Watch %s 0x%X 0x%X at 0x%X", (mode == WATCH_READ) ? "read": "write", address, value, PC);
+            platformPrint(buffer);
+#endif
+        }
+    }
+#ifndef LIBRARY
+    if(hit && tracing)
+    {
+        traceWatch(address, mode);
+    }
+#endif
+}
+
+inline void checkWatchpoint(int32_t address, int32_t mode, uint8_t value)
+{
+    if(watchedPages[address >> WATCH_PAGE_SHIFT] & mode)
+    {
+        watchAccess(address, mode, value);
+    }
+}
+
+uint8_t readMemory(int32_t address)
+{
+    uint8_t value = memory[address];
+    switch(address)
+    {
+        case ADCH_ADDRESS:
+            value = 0;
+            break;
+        case ADCL_ADDRESS:
+            value = 9;
+            break;
+        case TIFR0_ADDRESS:
+            value = (pendingInterrupts & (1ULL << TIMER0_OVF_VECTOR)) ? TOV0_BIT: 0;
+            break;
+        case SREG_ADDRESS:
+            value = SREG;
+            break;
+        case SPL_ADDRESS:
+            value = stackPointer & 0xFF;
+            break;
+        case SPH_ADDRESS:
+            value = stackPointer >> 8;
+            break;
+    }
+#ifndef LIBRARY
+    if((uint32_t)(address - semihostAddress) < SEMIHOST_SIZE)
+    {
+        value = readSemihost(address - semihostAddress, value);
+    }
+#endif
+    if(ioReadCallback && (address >= IO_REG_START) && (address < RAMSTART))
+    {
+        value = ioReadCallback(peripheralContext, address, value);
+    }
+    checkWatchpoint(address, WATCH_READ, value);
+    return value;
+}
+
+void writeMemory(int32_t address, int32_t value)
+{
+#ifdef FUZZ
+    flashWritten |= (address >= ENTRY_ADDRESS) || (address == SPMCSR_ADDRESS);
+#endif
+#ifndef LIBRARY
+    if(tracing)
+    {
+        traceWrite(address, value);
+    }
+#endif
+    checkWatchpoint(address, WATCH_WRITE, value);
+    char buffer[256];
+    memory[address] = value;
+    switch(address)
+    {
+        case PORTB_ADDRESS:
+        case PORTC_ADDRESS:
+        case PORTD_ADDRESS:
+#ifdef ATMEGA32U4
+        case ATMEGA32U4_PORTE_ADDRESS:
+        case ATMEGA32U4_PORTF_ADDRESS:
+#endif
+            if(portCallback)
             {
-                return true;
+                portCallback(peripheralContext, (address-PORTB_ADDRESS)/3, value);
+                break;
+            }
+#ifdef LIBRARY
+#ifdef EMSCRIPTEN
+            sprintf(buffer, "writePort(%i, %i)", (address-PORTB_ADDRESS)/3, value);
+            emscripten_run_script(buffer);
+#endif
+#else
+            sprintf(buffer, "Port %i 0x%X", (address-PORTB_ADDRESS)/3, value);
+            platformPrint(buffer);
+#endif
+            break;
+        case SPMCSR_ADDRESS:
+            if(value == (SIGRD_BIT|SPMEN_BIT))
+            {
+                 memory[readPair(Z_REGISTER) + programStart + 1] = MANUFACTURER_ID;
+                 predecodeProgram(readPair(Z_REGISTER) + programStart - 2*FUSED_RUN_LIMIT, readPair(Z_REGISTER) + programStart + 2);
+            }
+            break;
+        case SDR_ADDRESS:
+            if(spiCallback)
+            {
+                spiCallback(peripheralContext, value);
+                break;
+            }
+#ifdef LIBRARY
+#ifdef EMSCRIPTEN
+            sprintf(buffer, "writeSPI(%i)", value);
+            emscripten_run_script(buffer);
+#endif
+#else
+            sprintf(buffer, "SPI Transmit %i", value);
+            platformPrint(buffer);
+#endif
+            break;
+#ifdef ATMEGA32U4
+        case ATMEGA32U4_PLLCSR_ADDRESS:
+            memory[ATMEGA32U4_PLLCSR_ADDRESS] = value;
+            memory[ATMEGA32U4_PLLCSR_ADDRESS] = (value & ATMEGA32U4_PLLE_BIT) > 0 ? memory[ATMEGA32U4_PLLCSR_ADDRESS] | ATMEGA32U4_PLOCK_BIT : memory[ATMEGA32U4_PLLCSR_ADDRESS] & ~ATMEGA32U4_PLOCK_BIT;
+            break;
+#endif
+        case TIFR0_ADDRESS:
+            //Writing a logical one clears the flag
+            if(value & TOV0_BIT)
+            {
+                pendingInterrupts &= ~(1ULL << TIMER0_OVF_VECTOR);
+                updateInterruptState();
             }
             break;
+        case SREG_ADDRESS:
+            SREG = value;
+            updateInterruptState();
+            break;
+        case SPL_ADDRESS:
+            stackPointer = (stackPointer & 0xFF00) | (value & 0xFF);
+            break;
+        case SPH_ADDRESS:
+            stackPointer = (stackPointer & 0x00FF) | ((value & 0xFF) << 8);
+            break;
+    }
+#ifndef LIBRARY
+    if((uint32_t)(address - semihostAddress) < SEMIHOST_SIZE)
+    {
+        writeSemihost(address - semihostAddress, value);
+    }
+#endif
+    if(address < INTERRUPT_REGISTER_LIMIT && interruptEnableRegister[address])
+    {
+        updateInterruptMask();
+    }
+    if(ioWriteCallback && (address >= IO_REG_START) && (address < RAMSTART))
+    {
+        ioWriteCallback(peripheralContext, address, value);
     }
-
-    return false;
 }
 
-void incrementStackPointer()
+void raiseInterrupt(int32_t vector)
 {
-    int32_t SP = (memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS];
-    SP++;
-    memory[SPH_ADDRESS] = (SP & 0xFF00) >> 8;
-    memory[SPL_ADDRESS] = (SP & 0xFF);
+    pendingInterrupts |= (1ULL << vector);
+    updateInterruptState();
 }
 
-void decrementStackPointer()
+void updateInterruptMask()
 {
-    int32_t SP = (memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS];
-    SP--;
-    memory[SPH_ADDRESS] = (SP & 0xFF00) >> 8;
-    memory[SPL_ADDRESS] = (SP & 0xFF);
+    enabledInterrupts = 0;
+    for(uint32_t vector = 1; vector < INTERRUPT_VECTOR_COUNT; vector++)
+    {
+        if(interruptVectors[vector].enableAddress && (memory[interruptVectors[vector].enableAddress] & interruptVectors[vector].enableMask))
+        {
+            enabledInterrupts |= (1ULL << vector);
+        }
+    }
+    updateInterruptState();
 }
 
-void handleUnimplemented()
+void updateInterruptState()
 {
-    char buffer[1024];
-    sprintf(buffer, "Instruction not implemented at address 0x%X", PC);
-    platformPrint(buffer);
-    assert(0);
+    interruptReady = (SREG & SREG_I) && ((pendingInterrupts & enabledInterrupts) != 0);
 }
 
-uint16_t result;
-status newStatus;
-#ifndef EMSCRIPTEN
-system_clock::time_point syncPoint;
+// Return addresses are stacked as word addresses, low byte first, so code
+// that inspects or builds frames itself (setjmp, tablejump) sees what the
+// hardware would. The 2560 stacks a third byte for PC bits 16 to 21.
+#ifdef ATMEGA2560
+#define RETURN_ADDRESS_SIZE 3
+#else
+#define RETURN_ADDRESS_SIZE 2
 #endif
-int32_t fetch()
+inline void pushReturnAddress(programCounter address)
 {
-#ifndef EMSCRIPTEN
-        syncPoint = system_clock::now() + nanoseconds(60);
+    address = (address - programStart) >> 1;
+    memory[stackPointer--] = (address & 0xFF);
+    memory[stackPointer--] = (address & 0xFF00) >> 8;
+#ifdef ATMEGA2560
+    memory[stackPointer--] = (address & 0x3F0000) >> 16;
 #endif
-        if((PC >= FLASH_SIZE) || ((memory[PC] == 0x95) && (memory[PC+1] == 0x98))) //break
-            return false;
+}
 
-#ifndef EMSCRIPTEN
-        totalFetches++;
+inline programCounter popReturnAddress()
+{
+#ifndef ATMEGA2560
+    programCounter address = (memory[stackPointer+1] << 8) | memory[stackPointer+2];
+    stackPointer += 2;
+#else
+    programCounter address = ((memory[stackPointer+1] & 0x3F) << 16) | (memory[stackPointer+2] << 8) | memory[stackPointer+3];
+    stackPointer += 3;
 #endif
+    return programStart + (address << 1);
+}
 
-        result = 0;
-        newStatus.clear();
+void serviceInterrupts()
+{
+    if(interruptInhibit)
+    {
+        interruptInhibit = false;
+        return;
+    }
+    int32_t vector = __builtin_ctzll(pendingInterrupts & enabledInterrupts);
+    pendingInterrupts &= ~(1ULL << vector);
+    pushReturnAddress(PC);
+    SREG &= ~SREG_I;
+    PC = programStart + vector*INTERRUPT_VECTOR_SIZE;
+    coverEdge(PC);
+#ifndef LIBRARY
+    if(tracing)
+    {
+        traceInterrupt(vector);
+    }
+#endif
+    cycleCount += INTERRUPT_ENTRY_CYCLES;
+    updateInterruptState();
+}
 
-        switch(memory[PC])
+void engineInit()
+{
+    SREG = 0;
+    buildFlagTables();
+    pendingInterrupts = 0;
+    interruptInhibit = false;
+    memset(interruptEnableRegister, 0, sizeof(interruptEnableRegister));
+    for(uint32_t vector = 1; vector < INTERRUPT_VECTOR_COUNT; vector++)
+    {
+        if(interruptVectors[vector].enableAddress)
         {
-            case 0x0:
-                if(memory[PC+1] == 0x00) //nop
-                {
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                handleUnimplemented();
-            case 0x1: //movw
-                memory[((memory[PC+1] & 0xF0) >> 4)*2] = memory[(memory[PC+1] & 0xF)*2];
-                memory[(((memory[PC+1] & 0xF0) >> 4)*2)+1] = memory[((memory[PC+1] & 0xF)*2)+1];
-                // No SREG Updates
-                PC+=2;
-                break;
-            case 0x2: //muls
-            case 0x3: //mulsu
-                result = (int)memory[((memory[PC+1] & 0xF0) >> 4)*2]*(int)memory[(memory[PC+1] & 0xF)*2];
-                memory[0] = result & 0xFF;
-                memory[1] = result >> 8;
-                // No SREG Updates
-                PC+=2;
-                break;
-            case 0x4:
-            case 0x5:
-            case 0x6:
-            case 0x7: //cpc
-                result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] - memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-                result -= SREG.C == SET ? 1: 0;
-                newStatus.H = generateHStatus(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-                newStatus.V = generateVStatus2(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)] + (SREG.C == SET ? 1: 0));
-                newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                newStatus.Z = result == 0x00 ? newStatus.Z: CLR;
-                newStatus.C = abs(memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)] + (SREG.C == SET ? 1: 0)) > abs(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]) ? SET: CLR;
-                //Special Cases
-                if(((memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] & 0x80) == 0) && memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)] == 0x7F && SREG.C == SET)
-                {
-                    newStatus.V = CLR;
-                }
-                if(((memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] & 0x80) == 0x80) && memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)] == 0x7F && SREG.C == SET)
-                {
-                    newStatus.V = SET;
-                }
-                newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                PC+=2;
-                break;
-            case 0x8:
-            case 0x9:
-            case 0xA:
-            case 0xB: //sbc
-                result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] - memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-                result -= SREG.C == SET ? 1: 0;
-                newStatus.H = generateHStatus(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-                newStatus.V = generateVStatus2(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-                newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                newStatus.Z = result == 0x00 ? newStatus.Z: CLR;
-                newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                newStatus.C = abs(memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)] + (SREG.C == SET ? 1: 0)) > abs(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]) ? SET: CLR;
-                memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result & 0xFF;
-                PC+=2;
-                break;
-            case 0xC:
-            case 0xD:
-            case 0xE:
-            case 0xF: //add
-                result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] + memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-                newStatus.H = generateHStatus(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-                newStatus.V = generateVStatus(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-                newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                newStatus.Z = result == 0x00 ? SET: CLR;
-                newStatus.C = result > 0xFF ? SET: CLR;
-                memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result & 0xFF;
-                PC+=2;
-                break;
-            case 0x10:
-            case 0x11:
-            case 0x12:
-            case 0x13: //cpse
-                if(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] == memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)])
+            interruptEnableRegister[interruptVectors[vector].enableAddress] = true;
+        }
+    }
+    updateInterruptMask();
+
+    PC = programStart;
+    stackPointer = programStart - 1;
+    predecodeProgram(programStart, programEnd);
+    if(!programAnalyzed)
+    {
+        analyzeProgram();
+    }
+    resetFetchState();
+}
+
+int32_t getValueFromHex(uint8_t* buffer, int32_t size)
+{
+    int32_t value = 0;
+    int32_t cursor = 0;
+    while(size--)
+    {
+        int32_t shift = (1 << size*4);
+        if(buffer[cursor] < ':')
+        {
+            value += (buffer[cursor++] - '0')*shift;
+        }
+        else
+        {
+            value += (buffer[cursor++] - 0x37)*shift;
+        }
+    }
+
+    return value;
+}
+
+void loadDefaultProgram()
+{
+    platformPrint("Fall back to default internal test program.");
+    // 0:   0c 94 56 00     jmp     0xac    ; 0xac <__ctors_end>
+        memory[0xB00] = 0x94;
+        memory[0xB01] = 0x0C;
+        memory[0xB02] = 0x00;
+        memory[0xB03] = 0x56;
+    //ac:   11 24           eor     r1, r1
+        memory[0xBAC] = 0x24;
+        memory[0xBAD] = 0x11;
+    //ae:   1f be           out     0x3f, r1        ; 63
+        memory[0xBAE] = 0xBE;
+        memory[0xBAF] = 0x1F;
+    //b0:   cf ef           ldi     r28, 0xFF       ; 255
+    //b2:   da e0           ldi     r29, 0x0A       ; 10
+        memory[0xBB0] = 0xEF;
+        memory[0xBB1] = 0xCF;
+        memory[0xBB2] = 0xE0;
+        memory[0xBB3] = 0xDA;
+    //b4:   de bf           out     0x3e, r29       ; 62
+    //b6:   cd bf           out     0x3d, r28       ; 61
+        memory[0xBB4] = 0xBF;
+        memory[0xBB5] = 0xDE;
+        memory[0xBB6] = 0xBF;
+        memory[0xBB7] = 0xCD;
+    //b8:   0e 94 62 00     call    0xc4    ; 0xc4 <main>
+        memory[0xBB8] = 0x94;
+        memory[0xBB9] = 0x0E;
+        memory[0xBBA] = 0x00;
+        memory[0xBBB] = 0x62;
+    //c4:   cf 93           push    r28
+    //c6:   df 93           push    r29
+        memory[0xBC4] = 0x93;
+        memory[0xBC5] = 0xCF;
+        memory[0xBC6] = 0x93;
+        memory[0xBC7] = 0xDF;
+    //c8:   cd b7           in      r28, 0x3d       ; 61
+    //ca:   de b7           in      r29, 0x3e       ; 62
+        memory[0xBC8] = 0xB7;
+        memory[0xBC9] = 0xCD;
+        memory[0xBCA] = 0xB7;
+        memory[0xBCB] = 0xDE;
+    //cc:   84 e2           ldi     r24, 0x24       ; 36
+    //ce:   90 e0           ldi     r25, 0x00       ; 0
+    //d0:   28 e0           ldi     r18, 0x08       ; 8
+        memory[0xBCC] = 0xE2;
+        memory[0xBCD] = 0x84;
+        memory[0xBCE] = 0xE0;
+        memory[0xBCF] = 0x90;
+        memory[0xBD0] = 0xE0;
+        memory[0xBD1] = 0x28;
+    //d2:   fc 01           movw    r30, r24
+        memory[0xBD2] = 0x01;
+        memory[0xBD3] = 0xFC;
+    //d4:   20 83           st      Z, r18
+        memory[0xBD4] = 0x83;
+        memory[0xBD5] = 0x20;
+    //d6:   85 e2           ldi     r24, 0x25       ; 37
+        memory[0xBD6] = 0xE2;
+        memory[0xBD7] = 0x85;
+    //d8:   90 e0           ldi     r25, 0x00       ; 0
+        memory[0xBD8] = 0xE0;
+        memory[0xBD9] = 0x90;
+    //da:   21 e0           ldi     r18, 0x01       ; 1
+        memory[0xBDA] = 0xE0;
+        memory[0xBDB] = 0x21;
+    //dc:   fc 01           movw    r30, r24
+        memory[0xBDC] = 0x01;
+        memory[0xBDD] = 0xFC;
+    //de:   20 83           st      Z, r18
+        memory[0xBDE] = 0x83;
+        memory[0xBDF] = 0x20;
+    //e0:   98 95           break
+        memory[0xBE0] = 0x95;
+        memory[0xBE1] = 0x98;
+    programEnd = 0xBE2;
+    programAnalyzed = false;
+}
+
+int32_t currentAddressCursor = ENTRY_ADDRESS;
+void loadPartialProgram(uint8_t* binary)
+{
+    int32_t lineCursor = 0;
+    assert(binary[lineCursor++] == ':');
+    int32_t byteCount = getValueFromHex(&binary[lineCursor], 2);
+    int32_t address = getValueFromHex(&binary[lineCursor+=2], 4);
+    int32_t recordType = getValueFromHex(&binary[lineCursor+=4], 2);
+    if(recordType == 0x00)
+    {
+        while(byteCount)
+        {
+            int32_t instr = getValueFromHex(&binary[lineCursor+=2], 2);
+            memory[currentAddressCursor++] = getValueFromHex(&binary[lineCursor+=2], 2);
+            memory[currentAddressCursor++] = instr;
+            byteCount-=2;
+        }
+        programEnd = currentAddressCursor > programEnd ? currentAddressCursor: programEnd;
+        programAnalyzed = false;
+    }
+    else if(recordType == 0x01)
+    {
+        return;
+    }
+    else
+    {
+        assert(false);
+    }
+}
+
+// Parses an Intel hex image into flash, returning false on malformed input.
+// Data records are streamed in order from the flash base; extended segment
+// and linear address records move the cursor.
+bool loadHex(const uint8_t* binary, int32_t size)
+{
+    int32_t fileCursor = 0;
+    int32_t addressCursor = ENTRY_ADDRESS;
+    while(true)
+    {
+        while((fileCursor < size) && (binary[fileCursor] != ':'))
+        {
+            fileCursor++;
+        }
+        if(fileCursor + 11 > size)
+        {
+            return false;
+        }
+        uint8_t* record = (uint8_t*)&binary[fileCursor+1];
+        int32_t byteCount = getValueFromHex(record, 2);
+        int32_t recordType = getValueFromHex(&record[6], 2);
+        if(fileCursor + 11 + 2*byteCount > size)
+        {
+            return false;
+        }
+        if(recordType == 0x00)
+        {
+            if(addressCursor + byteCount > MEMORY_SIZE)
+            {
+                return false;
+            }
+            for(int32_t i = 0; i < byteCount; i++)
+            {
+                memory[(addressCursor + i) ^ 1] = getValueFromHex(&record[8 + 2*i], 2);
+            }
+            addressCursor += byteCount;
+            programEnd = addressCursor > programEnd ? addressCursor: programEnd;
+            programAnalyzed = false;
+        }
+        else if(recordType == 0x01)
+        {
+            return true;
+        }
+        else if(recordType == 0x02)
+        {
+            addressCursor = ENTRY_ADDRESS + getValueFromHex(&record[8], 4)*16;
+        }
+        else if(recordType == 0x04)
+        {
+            addressCursor = ENTRY_ADDRESS + (getValueFromHex(&record[8], 4) << 16);
+        }
+        else if((recordType != 0x03) && (recordType != 0x05)) //start addresses are ignored
+        {
+            return false;
+        }
+        fileCursor += 11 + 2*byteCount;
+    }
+}
+
+void loadProgram(uint8_t* binary, int32_t size)
+{
+    bool loaded = loadHex(binary, size);
+    assert(loaded);
+    free(binary);
+}
+
+//Flag Tables
+// Packed H, S, V, N, Z and C for Rd + Rr + carry and Rd - Rr - carry,
+// indexed by [carry][Rd][Rr]. sbc, sbci and cpc additionally keep Z only
+// when it was already set.
+uint8_t addFlags[2][256][256];
+uint8_t subFlags[2][256][256];
+// S, V, N and Z of a logical result (V always cleared)
+uint8_t logicFlags[256];
+// S, V, N, Z and C of lsr/asr/ror, indexed by [shifted out bit][result]
+uint8_t shiftFlags[2][256];
+
+void buildFlagTables()
+{
+    static bool built = false;
+    if(built)
+    {
+        return;
+    }
+    for(int32_t carry = 0; carry < 2; carry++)
+    {
+        for(int32_t first = 0; first < 256; first++)
+        {
+            for(int32_t second = 0; second < 256; second++)
+            {
+                int32_t sum = first + second + carry;
+                uint8_t flags = 0;
+                flags |= (sum > 0xFF) ? SREG_C: 0;
+                flags |= ((sum & 0xFF) == 0) ? SREG_Z: 0;
+                flags |= (sum & 0x80) ? SREG_N: 0;
+                flags |= (((first ^ sum) & (second ^ sum)) & 0x80) ? SREG_V: 0;
+                flags |= (((first & 0xF) + (second & 0xF) + carry) > 0xF) ? SREG_H: 0;
+                flags |= (((flags & SREG_N) != 0) != ((flags & SREG_V) != 0)) ? SREG_S: 0;
+                addFlags[carry][first][second] = flags;
+
+                int32_t difference = first - second - carry;
+                flags = 0;
+                flags |= (difference < 0) ? SREG_C: 0;
+                flags |= ((difference & 0xFF) == 0) ? SREG_Z: 0;
+                flags |= (difference & 0x80) ? SREG_N: 0;
+                flags |= (((first ^ second) & (first ^ difference)) & 0x80) ? SREG_V: 0;
+                flags |= (((first & 0xF) - (second & 0xF) - carry) < 0) ? SREG_H: 0;
+                flags |= (((flags & SREG_N) != 0) != ((flags & SREG_V) != 0)) ? SREG_S: 0;
+                subFlags[carry][first][second] = flags;
+            }
+        }
+    }
+    for(int32_t value = 0; value < 256; value++)
+    {
+        logicFlags[value] = (value == 0 ? SREG_Z: 0) | ((value & 0x80) ? (SREG_N|SREG_S): 0);
+        for(int32_t carry = 0; carry < 2; carry++)
+        {
+            //V = N ^ C, S = N ^ V
+            bool negative = (value & 0x80) != 0;
+            bool overflow = negative != (carry != 0);
+            shiftFlags[carry][value] = (value == 0 ? SREG_Z: 0) | (negative ? SREG_N: 0) | (carry ? SREG_C: 0) |
+                                       (overflow ? SREG_V: 0) | ((negative != overflow) ? SREG_S: 0);
+        }
+    }
+    built = true;
+}
+
+// Checks every table entry against the boolean flag definitions of the AVR
+// instruction set manual; run by the flagcheck build target.
+bool verifyFlagTables()
+{
+    buildFlagTables();
+    for(int32_t carry = 0; carry < 2; carry++)
+    {
+        for(int32_t first = 0; first < 256; first++)
+        {
+            for(int32_t second = 0; second < 256; second++)
+            {
+                uint8_t R = first + second + carry;
+                bool Rd7 = first & 0x80, Rr7 = second & 0x80, R7 = R & 0x80;
+                bool Rd3 = first & 0x08, Rr3 = second & 0x08, R3 = R & 0x08;
+                bool H = (Rd3 && Rr3) || (Rr3 && !R3) || (!R3 && Rd3);
+                bool V = (Rd7 && Rr7 && !R7) || (!Rd7 && !Rr7 && R7);
+                bool N = R7;
+                bool Z = R == 0;
+                bool C = (Rd7 && Rr7) || (Rr7 && !R7) || (!R7 && Rd7);
+                uint8_t expected = (H ? SREG_H: 0) | ((N != V) ? SREG_S: 0) | (V ? SREG_V: 0) | (N ? SREG_N: 0) | (Z ? SREG_Z: 0) | (C ? SREG_C: 0);
+                if(addFlags[carry][first][second] != expected)
                 {
-                    PC+=2;
-                    if(longOpcode(PC))
-                    {
-                        PC+=2;
-                    }
+                    printf("add flags mismatch %i + %i + %i\n", first, second, carry);
+                    return false;
                 }
-                // No SREG Updates
-                PC+=2;
-                break;
-            case 0x14:
-            case 0x15:
-            case 0x16:
-            case 0x17: //cp
-               result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] - memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               newStatus.H = generateHStatus(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               newStatus.V = generateVStatus2(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-               newStatus.Z = result == 0x00 ? SET: CLR;
-               newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-               newStatus.C = abs(memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]) > abs(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]) ? SET: CLR;
-               PC+=2;
-               break;
-            case 0x18:
-            case 0x19:
-            case 0x1A:
-            case 0x1B: //sub
-               result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] - memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               newStatus.H = generateHStatus(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               newStatus.V = generateVStatus2(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-               newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-               newStatus.Z = result == 0x00 ? SET: CLR;
-               newStatus.C = abs(memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]) > abs(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]) ? SET: CLR;
-               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result & 0xFF;
-               PC+=2;
-               break;
-            case 0x1C:
-            case 0x1D:
-            case 0x1E:
-            case 0x1F: //adc
-               result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] + memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               result += SREG.C == SET ? 1: 0;
-               newStatus.H = generateHStatus(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               newStatus.V = generateVStatus(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-               newStatus.Z = result == 0x00 ? SET: CLR;
-               newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-               newStatus.C = result > 0xFF ? SET: CLR;
-               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result & 0xFF;
-               PC+=2;
-               break;
-            case 0x20:
-            case 0x21:
-            case 0x22:
-            case 0x23: //and
-               result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] & memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
-               newStatus.V = CLR;
-               newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-               newStatus.Z = result == 0x00 ? SET: CLR;
-               newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-               PC+=2;
-               break;
-            case 0x24:
-            case 0x25:
-            case 0x26:
-            case 0x27: //eor
-               memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)] = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)]^memory[(((memory[PC] & 0x2) << 3) | (memory[PC+1] & 0xF))];
-               result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-               newStatus.V = CLR;
-               newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-               newStatus.Z = result == 0x00 ? SET: CLR;
-               newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-               PC+=2;
-               break;
-            case 0x28:
-            case 0x29:
-            case 0x2A:
-            case 0x2B: //or
-               result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] | memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
-               newStatus.V = CLR;
-               newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-               newStatus.Z = result == 0x00 ? SET: CLR;
-               newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-               PC+=2;
-               break;
-            case 0x2C:
-            case 0x2D:
-            case 0x2E:
-            case 0x2F: //mov
-               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)];
-               PC+=2;
-               break;
-            case 0x30:
-            case 0x31:
-            case 0x32:
-            case 0x33:
-            case 0x34:
-            case 0x35:
-            case 0x36:
-            case 0x37:
-            case 0x38:
-            case 0x39:
-            case 0x3A:
-            case 0x3B:
-            case 0x3C:
-            case 0x3D:
-            case 0x3E:
-            case 0x3F: //cpi
-                result = memory[16+(memory[PC+1] >> 4)] - (((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF));
-                newStatus.V = generateVStatus2(memory[16+(memory[PC+1] >> 4)], (((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF)));
-                newStatus.H = generateHStatus(memory[16+(memory[PC+1] >> 4)], (((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF)));
-                newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                newStatus.Z = result == 0x00 ? SET: CLR;
-                newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                newStatus.C = abs((((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF))) > abs(memory[16+(memory[PC+1] >> 4)]) ? SET: CLR;
-                PC+=2;
-                break;
-            case 0x40:
-            case 0x41:
-            case 0x42:
-            case 0x43:
-            case 0x44:
-            case 0x45:
-            case 0x46:
-            case 0x47:
-            case 0x48:
-            case 0x49:
-            case 0x4A:
-            case 0x4B:
-            case 0x4C:
-            case 0x4D:
-            case 0x4E:
-            case 0x4F: //sbci
-                result = ((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF);
-                newStatus.H = generateHStatus(memory[16+((memory[PC+1] & 0xF0) >> 4)], result);
-                newStatus.V = generateVStatus2(memory[16+((memory[PC+1] & 0xF0) >> 4)], result);
-                result += SREG.C;
-                newStatus.C = abs(result) > abs(memory[16+((memory[PC+1] & 0xF0) >> 4)]) ? SET: CLR;
-                memory[16+((memory[PC+1] & 0xF0) >> 4)] -= result;
-                result = memory[16+((memory[PC+1] & 0xF0) >> 4)];
-                newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                newStatus.Z = result == 0x00 ? newStatus.Z: CLR;
-                newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                PC+=2;
-                break;
-            case 0x50:
-            case 0x51:
-            case 0x52:
-            case 0x53:
-            case 0x54:
-            case 0x55:
-            case 0x56:
-            case 0x57:
-            case 0x58:
-            case 0x59:
-            case 0x5A:
-            case 0x5B:
-            case 0x5C:
-            case 0x5D:
-            case 0x5E:
-            case 0x5F: //subi
-                result = ((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF);
-                newStatus.H = generateHStatus(memory[16+((memory[PC+1] & 0xF0) >> 4)], result);
-                newStatus.V = generateVStatus(memory[16+((memory[PC+1] & 0xF0) >> 4)], result);
-                newStatus.C = abs(result) > abs(memory[16+((memory[PC+1] & 0xF0) >> 4)]) ? SET: CLR;
-                memory[16+((memory[PC+1] & 0xF0) >> 4)] -= result;
-                result = memory[16+((memory[PC+1] & 0xF0) >> 4)];
-                newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                newStatus.Z = result == 0x00 ? SET: CLR;
-                newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                PC+=2;
-                break;
-            case 0x60:
-            case 0x61:
-            case 0x62:
-            case 0x63:
-            case 0x64:
-            case 0x65:
-            case 0x66:
-            case 0x67:
-            case 0x68:
-            case 0x69:
-            case 0x6A:
-            case 0x6B:
-            case 0x6C:
-            case 0x6D:
-            case 0x6E:
-            case 0x6F: //ori
-                result = ((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF);
-                memory[16+((memory[PC+1] & 0xF0) >> 4)] |= result;
-                newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                newStatus.Z = result == 0x00 ? SET: CLR;
-                newStatus.V = CLR;
-                newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                PC+=2;
-                break;
-            case 0x70:
-            case 0x71:
-            case 0x72:
-            case 0x73:
-            case 0x74:
-            case 0x75:
-            case 0x76:
-            case 0x77:
-            case 0x78:
-            case 0x79:
-            case 0x7A:
-            case 0x7B:
-            case 0x7C:
-            case 0x7D:
-            case 0x7E:
-            case 0x7F: //andi
-                result = ((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF);
-                memory[16+((memory[PC+1] & 0xF0) >> 4)] &= result;
-                newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                newStatus.Z = result == 0x00 ? SET: CLR;
-                newStatus.V = CLR;
-                newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                PC+=2;
-                break;
-            case 0x80:
-            case 0x81:
-                if((memory[PC+1] & 0xF) >= 0x8) //ld (ldd) y
-                {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory(((memory[29] << 8) | memory[28]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                if((memory[PC+1] & 0xF) < 0x8) //ld (ldd) z
-                {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory(((memory[31] << 8) | memory[30]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                handleUnimplemented();
-            case 0x82:
-            case 0x83:
-                if((memory[PC+1] & 0xF) >= 0x8) //st (std) y
-                {
-                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    writeMemory(((memory[29] << 8) | memory[28]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                if((memory[PC+1] & 0xF) < 0x8) //st (std) z
-                {
-                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    writeMemory(((memory[31] << 8) | memory[30]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                handleUnimplemented();
-            case 0x84:
-            case 0x85:
-            case 0x8C:
-            case 0x8D:
-                if((memory[PC+1] & 0xF) >= 0x8) //ld (ldd) y
-                {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory(((memory[29] << 8) | memory[28]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                if((memory[PC+1] & 0xF) < 0x8) //ld (ldd) z
-                {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory(((memory[31] << 8) | memory[30]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                handleUnimplemented();
-            case 0x86:
-            case 0x87:
-                if((memory[PC+1] & 0xF) >= 0x8) //st (std) y
-                {
-                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    writeMemory(((memory[29] << 8) | memory[28]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                if((memory[PC+1] & 0xF) < 0x8) //st (std) z
+
+                R = first - second - carry;
+                R7 = R & 0x80;
+                R3 = R & 0x08;
+                H = (!Rd3 && Rr3) || (Rr3 && R3) || (R3 && !Rd3);
+                V = (Rd7 && !Rr7 && !R7) || (!Rd7 && Rr7 && R7);
+                N = R7;
+                Z = R == 0;
+                C = (!Rd7 && Rr7) || (Rr7 && R7) || (R7 && !Rd7);
+                expected = (H ? SREG_H: 0) | ((N != V) ? SREG_S: 0) | (V ? SREG_V: 0) | (N ? SREG_N: 0) | (Z ? SREG_Z: 0) | (C ? SREG_C: 0);
+                if(subFlags[carry][first][second] != expected)
                 {
-                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    writeMemory(((memory[31] << 8) | memory[30]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
-                    // No SREG Updates
-                    PC+=2;
-                    break;
+                    printf("sub flags mismatch %i - %i - %i\n", first, second, carry);
+                    return false;
                 }
-                handleUnimplemented();
-            case 0x88:
-            case 0x89:
-                if((memory[PC+1] & 0xF) >= 0x8) //ld (ldd) y
+            }
+        }
+    }
+    for(int32_t value = 0; value < 256; value++)
+    {
+        bool N = value & 0x80;
+        if(logicFlags[value] != ((N ? (SREG_N|SREG_S): 0) | (value == 0 ? SREG_Z: 0)))
+        {
+            printf("logic flags mismatch %i\n", value);
+            return false;
+        }
+        for(int32_t carry = 0; carry < 2; carry++)
+        {
+            bool V = N != (carry != 0);
+            if(shiftFlags[carry][value] != ((N ? SREG_N: 0) | (value == 0 ? SREG_Z: 0) | (carry ? SREG_C: 0) | (V ? SREG_V: 0) | ((N != V) ? SREG_S: 0)))
+            {
+                printf("shift flags mismatch %i %i\n", value, carry);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+inline void setFlags(uint8_t flags, uint8_t mask)
+{
+    SREG = (SREG & ~mask) | (flags & mask);
+}
+
+void runProgram()
+{
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+    steady_clock::time_point paceStart = steady_clock::now();
+    uint64_t paceCycles = cycleCount;
+    while(fetchN(INSTRUCTION_LIMIT))
+    {
+        if(!virtualTime)
+        {
+            steady_clock::time_point deadline = paceStart + nanoseconds(((cycleCount - paceCycles)*1000000000ULL)/CLOCK_HZ);
+            while(steady_clock::now() < deadline)
+                ;
+        }
+    }
+#else
+    while(fetchN(INSTRUCTION_LIMIT))
+        ;
+#endif
+}
+
+void reportStop()
+{
+    if(stopReason == STOP_ILLEGAL_OPCODE)
+    {
+        char buffer[1024];
+        sprintf(buffer, "Instruction not implemented at address 0x%X", PC);
+        platformPrint(buffer);
+    }
+    else if(stopReason != STOP_BREAK)
+    {
+        char buffer[1024];
+        sprintf(buffer, "Stopped on %s at address 0x%X", stopReasonNames[stopReason], PC);
+        platformPrint(buffer);
+    }
+}
+
+void execProgram()
+{
+    runProgram();
+    reportStop();
+}
+
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+void runCore(eventQueue* queue)
+{
+    runProgram();
+    peripheralEvent end = {cycleCount, EVENT_END, 0, 0};
+    while(queue->coalescedMask || !publishEvent(*queue, end))
+    {
+        flushCoalesced(*queue);
+        std::this_thread::yield();
+    }
+}
+
+// "-threaded policy" runs the core on its own thread and prints port and
+// SPI traffic from this one, so a slow terminal no longer stalls the core.
+// Callbacks installed before, such as the display models, run here instead.
+void execThreaded(int32_t policy)
+{
+    portWriteHandler portConsumer = portCallback;
+    spiWriteHandler spiConsumer = spiCallback;
+    eventQueue* queue = new eventQueue();
+    queue->policy = policy;
+    eventSink = queue;
+    portCallback = queuePort;
+    spiCallback = queueSpi;
+    std::thread core(runCore, queue);
+    char buffer[256];
+    peripheralEvent event;
+    while(true)
+    {
+        if(!consumeEvent(*queue, event))
+        {
+            std::this_thread::sleep_for(microseconds(50));
+            continue;
+        }
+        if(event.kind == EVENT_END)
+        {
+            break;
+        }
+        if(event.kind == EVENT_PORT)
+        {
+            if(portConsumer)
+            {
+                portConsumer(peripheralContext, event.port, event.value);
+                continue;
+            }
+            sprintf(buffer, "Port %i 0x%X", event.port, event.value);
+        }
+        else
+        {
+            if(spiConsumer)
+            {
+                spiConsumer(peripheralContext, event.value);
+                continue;
+            }
+            sprintf(buffer, "SPI Transmit %i", event.value);
+        }
+        platformPrint(buffer);
+    }
+    core.join();
+    reportStop();
+    if(queue->dropped)
+    {
+        sprintf(buffer, "%llu events %s", (unsigned long long)queue->dropped.load(), (policy == BACKPRESSURE_DROP) ? "dropped": "coalesced");
+        platformPrint(buffer);
+    }
+    portCallback = portConsumer;
+    spiCallback = spiConsumer;
+    eventSink = NULL;
+    delete queue;
+}
+#endif
+
+#ifndef LIBRARY
+#ifndef EMSCRIPTEN
+std::atomic<int32_t> traceFull(-1); // buffer waiting for the writer
+size_t traceFullSize = 0;
+std::atomic<bool> traceClosing(false);
+FILE* traceFile = NULL;
+std::thread* traceWriter = NULL;
+
+void traceWriterLoop()
+{
+    while(true)
+    {
+        int32_t full = traceFull.load();
+        if(full >= 0)
+        {
+            fwrite(traceBuffers[full], 1, traceFullSize, traceFile);
+            traceFull = -1;
+        }
+        else if(traceClosing)
+        {
+            break;
+        }
+        else
+        {
+            std::this_thread::sleep_for(microseconds(100));
+        }
+    }
+}
+
+// Passes the filled buffer to the writer, waiting if it is still busy with
+// the other one. Replays compare after every step and never get here.
+void traceHandoff()
+{
+    while(traceFull.load() >= 0)
+    {
+        std::this_thread::yield();
+    }
+    traceFullSize = traceUsed;
+    traceFull = traceActive;
+    traceActive ^= 1;
+    traceUsed = 0;
+}
+
+void startTrace()
+{
+    traceImage = (uint8_t*)malloc(MEMORY_SIZE);
+    memcpy(traceImage, memory, MEMORY_SIZE);
+    traceNext = PC;
+    traceUsed = 0;
+    tracing = true;
+    fusionEnabled = false;
+    predecodeProgram(programStart, programEnd);
+}
+
+bool openTrace(const char* path)
+{
+    if(!(traceFile = fopen(path, "wb")))
+    {
+        return false;
+    }
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), traceFile);
+    fputc(TRACE_VERSION, traceFile);
+    startTrace();
+    traceWriter = new std::thread(traceWriterLoop);
+    return true;
+}
+
+void closeTrace()
+{
+    if(!traceFile)
+    {
+        return;
+    }
+    traceFlushSteps();
+    traceRecord(TRACE_END, stopReason);
+    traceHandoff();
+    while(traceFull.load() >= 0)
+    {
+        std::this_thread::yield();
+    }
+    traceClosing = true;
+    traceWriter->join();
+    delete traceWriter;
+    long size = ftell(traceFile);
+    fclose(traceFile);
+    traceFile = NULL;
+    tracing = false;
+    fusionEnabled = true;
+    predecodeProgram(programStart, programEnd);
+    char buffer[256];
+    sprintf(buffer, "Traced %llu instructions in %ld bytes", (unsigned long long)traceTotal, size);
+    platformPrint(buffer);
+}
+
+// "-replay trace step" reruns the image to the given step, checking every
+// record it would write against the trace, and prints the machine state
+// there or where the two first differ. The run must only have depended on
+// the image, which excludes -input scripts, and needs the same -watch and
+// -log options.
+bool replayTrace(const char* path, uint64_t step)
+{
+    FILE* file = fopen(path, "rb");
+    if(!file)
+    {
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    rewind(file);
+    uint8_t* expected = (uint8_t*)malloc(size + 1);
+    size_t header = strlen(TRACE_MAGIC) + 1;
+    bool valid = (fread(expected, 1, size, file) == size) && (size >= header) && !memcmp(expected, TRACE_MAGIC, header - 1) && (expected[header - 1] == TRACE_VERSION);
+    fclose(file);
+    if(!valid)
+    {
+        free(expected);
+        return false;
+    }
+    portCallback = ignorePort;
+    spiCallback = ignoreSpi;
+    startTrace();
+    size_t offset = header;
+    bool diverged = false;
+    bool running = true;
+    char buffer[256];
+    while(running && !diverged && (traceTotal < step))
+    {
+        running = fetchN(1);
+        if(!running)
+        {
+            traceFlushSteps();
+            traceRecord(TRACE_END, stopReason);
+        }
+        diverged = (offset + traceUsed > size) || memcmp(traceBuffers[traceActive], &expected[offset], traceUsed);
+        offset += traceUsed;
+        traceUsed = 0;
+    }
+    free(expected);
+    if(diverged)
+    {
+        sprintf(buffer, "Replay diverged from the trace at step %llu", (unsigned long long)traceTotal);
+    }
+    else if(traceTotal < step)
+    {
+        sprintf(buffer, "Trace ends at step %llu", (unsigned long long)traceTotal);
+    }
+    else
+    {
+        sprintf(buffer, "Step %llu", (unsigned long long)traceTotal);
+    }
+    platformPrint(buffer);
+    sprintf(buffer, "PC 0x%X SP 0x%X SREG 0x%02X cycles %llu", PC, stackPointer, SREG, (unsigned long long)cycleCount);
+    platformPrint(buffer);
+    for(int32_t row = 0; row < 32; row += 8)
+    {
+        char* cursor = buffer;
+        for(int32_t reg = row; reg < row + 8; reg++)
+        {
+            cursor += sprintf(cursor, "%sr%i 0x%02X", (reg == row) ? "": " ", reg, memory[reg]);
+        }
+        platformPrint(buffer);
+    }
+    return !diverged;
+}
+#endif
+
+//Benchmark
+// "-bench n" runs the image unpaced for n emulated frames and reports how
+// many of them the host manages per second. Frames end on a display
+// refresh, or with "-framesync port bit" on every rising edge of that
+// port pin. "-input script" replays button presses: each line holds a
+// frame, a data space address (usually a PIN register) and the value
+// reads return from the start of that frame on.
+#define BENCH_SCRIPT_LIMIT 4096
+struct scriptedInput
+{
+    uint64_t frame;
+    int32_t address;
+    uint8_t value;
+};
+scriptedInput benchScript[BENCH_SCRIPT_LIMIT];
+int32_t benchScriptLength = 0;
+int32_t benchScriptNext = 0;
+uint64_t benchTarget = 0;
+uint64_t benchFrames = 0;
+uint64_t benchEndCycle = 0;
+int32_t frameSyncPort = -1;
+uint8_t frameSyncMask = 0;
+
+bool loadInputScript(const char* path)
+{
+    FILE* script = fopen(path, "r");
+    if(!script)
+    {
+        return false;
+    }
+    char line[256];
+    while(fgets(line, sizeof(line), script) && (benchScriptLength < BENCH_SCRIPT_LIMIT))
+    {
+        unsigned long long frame;
+        int32_t address, value;
+        if((line[0] == '#') || (sscanf(line, "%llu %i %i", &frame, &address, &value) != 3))
+        {
+            continue;
+        }
+        if((address < IO_REG_START) || (address >= RAMSTART))
+        {
+            continue;
+        }
+        //Keep the script sorted by frame, stable for lines of the same frame
+        int32_t slot = benchScriptLength++;
+        for(; (slot > 0) && (benchScript[slot - 1].frame > frame); slot--)
+        {
+            benchScript[slot] = benchScript[slot - 1];
+        }
+        benchScript[slot].frame = frame;
+        benchScript[slot].address = address;
+        benchScript[slot].value = value;
+    }
+    fclose(script);
+    return true;
+}
+
+// The scripted values go straight into the data space, so in, lds and
+// sbis all see them until the firmware or the next line changes them.
+void applyInputScript()
+{
+    for(; (benchScriptNext < benchScriptLength) && (benchScript[benchScriptNext].frame <= benchFrames); benchScriptNext++)
+    {
+        memory[benchScript[benchScriptNext].address] = benchScript[benchScriptNext].value;
+    }
+}
+
+void benchFrame()
+{
+    if(++benchFrames == benchTarget)
+    {
+        benchEndCycle = cycleCount;
+    }
+    applyInputScript();
+}
+
+#ifndef EMSCRIPTEN
+void execBenchmark(uint64_t frames, int32_t syncPort, int32_t syncBit)
+{
+    benchTarget = frames;
+    frameSyncPort = syncPort;
+    frameSyncMask = 1 << (syncBit & 0x7);
+    applyInputScript();
+    uint64_t startCycle = cycleCount;
+    clock_t startCpu = clock();
+    steady_clock::time_point startWall = steady_clock::now();
+    while((benchFrames < benchTarget) && fetchN(INSTRUCTION_LIMIT))
+        ;
+    double cpu = (double)(clock() - startCpu)/CLOCKS_PER_SEC;
+    double wall = duration_cast<nanoseconds>(steady_clock::now() - startWall).count()/1e9;
+    char buffer[256];
+    if(benchFrames < benchTarget)
+    {
+        reportStop();
+        sprintf(buffer, "Benchmark stopped after %llu of %llu frames", (unsigned long long)benchFrames, (unsigned long long)benchTarget);
+        platformPrint(buffer);
+        return;
+    }
+    double emulated = (double)(benchEndCycle - startCycle)/CLOCK_HZ;
+    sprintf(buffer, "%llu frames in %.3f s: %.1f FPS, %.2fx real time, %.1f us CPU per frame, firmware %.1f FPS", (unsigned long long)benchFrames, wall, benchFrames/wall, emulated/wall, cpu*1e6/benchFrames, benchFrames/emulated);
+    platformPrint(buffer);
+}
+#endif
+
+//Display
+// Models of the SPI display controllers driven by Arduboy (SSD1306, 128x64)
+// and Gamebuino (PCD8544, 84x48) firmware. They sit on the port and SPI
+// callbacks: port writes track the CS and D/C pins, and SPI bytes sent
+// while CS is low are commands or data for the controller RAM. Each RAM
+// byte covers eight pixel rows of one column. A frame is complete when the
+// write pointer wraps, which both libraries do once per screen update.
+// Segment and scan remapping are ignored, so frames come out the way the
+// firmware draws them.
+#define DISPLAY_NONE 0
+#define DISPLAY_SSD1306 1
+#define DISPLAY_PCD8544 2
+#define DISPLAY_MODEL_COUNT 3
+#define DISPLAY_MAX_WIDTH 128
+#define DISPLAY_MAX_PAGES 8
+#define DISPLAY_PORT_COUNT 8
+struct displayModel
+{
+    const char* name;
+    int32_t width;
+    int32_t pages;
+    int32_t csPort; // 0 is PORTB
+    uint8_t csMask;
+    int32_t dcPort;
+    uint8_t dcMask;
+    bool litIsWhite;
+};
+const displayModel displayModels[DISPLAY_MODEL_COUNT] =
+{
+    {"none", 0, 0, 0, 0, 0, 0, false},
+    {"ssd1306", 128, 8, 2, 1 << 6, 2, 1 << 4, true}, //CS on PD6, D/C on PD4
+    {"pcd8544", 84, 6, 1, 1 << 1, 1, 1 << 2, false}, //SCE on PC1, D/C on PC2
+};
+struct displayState
+{
+    int32_t model;
+    uint8_t ports[DISPLAY_PORT_COUNT];
+    uint8_t ram[DISPLAY_MAX_PAGES][DISPLAY_MAX_WIDTH];
+    int32_t column;
+    int32_t page;
+    int32_t columnStart;
+    int32_t columnEnd;
+    int32_t pageStart;
+    int32_t pageEnd;
+    int32_t addressing; // SSD1306: 0 horizontal, 1 vertical, 2 page; PCD8544: V bit
+    bool extended; // PCD8544 H bit
+    bool inverted;
+    uint8_t command; // SSD1306 command still taking arguments
+    int32_t argumentsLeft;
+    uint8_t arguments[6];
+    int32_t argumentCount;
+    uint64_t frames;
+    uint64_t written;
+    int32_t frameSkip;
+    const char* output; // ends in .png: printf pattern for a PNG per frame, else one raw file
+    FILE* raw;
+};
+displayState display;
+
+uint32_t crcTable[256];
+uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size)
+{
+    if(!crcTable[1])
+    {
+        for(uint32_t n = 0; n < 256; n++)
+        {
+            uint32_t c = n;
+            for(int32_t k = 0; k < 8; k++)
+            {
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1): c >> 1;
+            }
+            crcTable[n] = c;
+        }
+    }
+    crc = ~crc;
+    while(size--)
+    {
+        crc = crcTable[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void writeBigEndian(uint8_t* buffer, uint32_t value)
+{
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+void writePngChunk(FILE* file, const char* type, const uint8_t* data, uint32_t size)
+{
+    uint8_t header[8];
+    writeBigEndian(header, size);
+    memcpy(&header[4], type, 4);
+    uint8_t trailer[4];
+    writeBigEndian(trailer, crc32(crc32(0, &header[4], 4), data, size));
+    fwrite(header, 1, sizeof(header), file);
+    fwrite(data, 1, size, file);
+    fwrite(trailer, 1, sizeof(trailer), file);
+}
+
+// Writes a 1-bit grayscale PNG. The image is stored uncompressed, which at
+// these sizes fits a single deflate block.
+bool writePng(const char* path, const uint8_t* rows, int32_t width, int32_t height)
+{
+    FILE* file = fopen(path, "wb");
+    if(!file)
+    {
+        return false;
+    }
+    const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    fwrite(signature, 1, sizeof(signature), file);
+    uint8_t header[13] = {0};
+    writeBigEndian(&header[0], width);
+    writeBigEndian(&header[4], height);
+    header[8] = 1; //bit depth, grayscale
+    writePngChunk(file, "IHDR", header, sizeof(header));
+
+    int32_t rowBytes = (width + 7)/8;
+    uint32_t size = height*(rowBytes + 1);
+    uint8_t data[2 + 5 + DISPLAY_MAX_PAGES*8*(DISPLAY_MAX_WIDTH/8 + 1) + 4];
+    uint8_t* cursor = data;
+    *cursor++ = 0x78; //zlib, no compression
+    *cursor++ = 0x01;
+    *cursor++ = 0x01; //final stored block
+    *cursor++ = size & 0xFF;
+    *cursor++ = size >> 8;
+    *cursor++ = ~size & 0xFF;
+    *cursor++ = (~size >> 8) & 0xFF;
+    uint32_t a = 1, b = 0;
+    for(int32_t y = 0; y < height; y++)
+    {
+        *cursor++ = 0; //no filter
+        memcpy(cursor, &rows[y*rowBytes], rowBytes);
+        cursor += rowBytes;
+    }
+    for(uint8_t* byte = data + 7; byte < cursor; byte++)
+    {
+        a = (a + *byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    writeBigEndian(cursor, (b << 16) | a);
+    cursor += 4;
+    writePngChunk(file, "IDAT", data, cursor - data);
+    writePngChunk(file, "IEND", NULL, 0);
+    return fclose(file) == 0;
+}
+
+// Captures the controller RAM as rows of 1-bit pixels, most significant
+// bit first. Raw files get a 1 for every lit pixel; PNGs get white for a
+// lit OLED pixel and black for a dark LCD one.
+void writeFrame()
+{
+    const displayModel& model = displayModels[display.model];
+    int32_t rowBytes = (model.width + 7)/8;
+    bool png = strstr(display.output, ".png") != NULL;
+    uint8_t rows[DISPLAY_MAX_PAGES*8*(DISPLAY_MAX_WIDTH/8)];
+    memset(rows, 0, sizeof(rows));
+    for(int32_t y = 0; y < model.pages*8; y++)
+    {
+        for(int32_t x = 0; x < model.width; x++)
+        {
+            bool lit = ((display.ram[y/8][x] >> (y & 7)) & 0x1) != display.inverted;
+            if(lit != (png && !model.litIsWhite))
+            {
+                rows[y*rowBytes + x/8] |= 0x80 >> (x & 7);
+            }
+        }
+    }
+    if(png)
+    {
+        char path[1024];
+        snprintf(path, sizeof(path), display.output, (int32_t)display.written);
+        if(!writePng(path, rows, model.width, model.pages*8))
+        {
+            return;
+        }
+    }
+    else
+    {
+        if(!display.raw && !(display.raw = fopen(display.output, "wb")))
+        {
+            return;
+        }
+        fwrite(rows, 1, rowBytes*model.pages*8, display.raw);
+    }
+    display.written++;
+}
+
+void completeFrame()
+{
+    if(display.output && ((display.frames % display.frameSkip) == 0))
+    {
+        writeFrame();
+    }
+    display.frames++;
+    if(frameSyncPort < 0)
+    {
+        benchFrame();
+    }
+}
+
+int32_t ssd1306Arguments(uint8_t command)
+{
+    switch(command)
+    {
+        case 0x20: case 0x81: case 0x8D: case 0xA8: case 0xD3: case 0xD5: case 0xD9: case 0xDA: case 0xDB:
+            return 1;
+        case 0x21: case 0x22: case 0xA3:
+            return 2;
+        case 0x29: case 0x2A:
+            return 5;
+        case 0x26: case 0x27:
+            return 6;
+    }
+    return 0;
+}
+
+void ssd1306Command(uint8_t value)
+{
+    if(display.argumentsLeft)
+    {
+        display.arguments[display.argumentCount++] = value;
+        if(--display.argumentsLeft)
+        {
+            return;
+        }
+        value = display.command;
+    }
+    else if((display.argumentsLeft = ssd1306Arguments(value)))
+    {
+        display.command = value;
+        display.argumentCount = 0;
+        return;
+    }
+    switch(value)
+    {
+        case 0x20: //addressing mode
+            display.addressing = display.arguments[0] & 0x3;
+            break;
+        case 0x21: //column range
+            display.column = display.columnStart = display.arguments[0] & 0x7F;
+            display.columnEnd = display.arguments[1] & 0x7F;
+            break;
+        case 0x22: //page range
+            display.page = display.pageStart = display.arguments[0] & 0x7;
+            display.pageEnd = display.arguments[1] & 0x7;
+            break;
+        case 0xA6:
+        case 0xA7:
+            display.inverted = value & 0x1;
+            break;
+        default:
+            if((value & 0xF8) == 0xB0) //page start, page addressing
+            {
+                display.page = value & 0x7;
+            }
+            else if(value < 0x10) //lower column nibble
+            {
+                display.column = (display.column & 0x70) | value;
+            }
+            else if(value < 0x20) //upper column nibble
+            {
+                display.column = ((value & 0x7) << 4) | (display.column & 0xF);
+            }
+            break;
+    }
+}
+
+void ssd1306Data(uint8_t value)
+{
+    display.ram[display.page][display.column] = value;
+    if(display.addressing == 1)
+    {
+        if(display.page++ < display.pageEnd)
+        {
+            return;
+        }
+        display.page = display.pageStart;
+        if(display.column++ < display.columnEnd)
+        {
+            return;
+        }
+        display.column = display.columnStart;
+        completeFrame();
+    }
+    else if(display.addressing == 0)
+    {
+        if(display.column++ < display.columnEnd)
+        {
+            return;
+        }
+        display.column = display.columnStart;
+        if(display.page++ < display.pageEnd)
+        {
+            return;
+        }
+        display.page = display.pageStart;
+        completeFrame();
+    }
+    else if(++display.column == DISPLAY_MAX_WIDTH)
+    {
+        //Page addressing wraps within the page; the last page ends the frame
+        display.column = 0;
+        if(display.page == DISPLAY_MAX_PAGES - 1)
+        {
+            completeFrame();
+        }
+    }
+}
+
+void pcd8544Command(uint8_t value)
+{
+    if((value & 0xF8) == 0x20) //function set
+    {
+        display.extended = value & 0x1;
+        display.addressing = (value >> 1) & 0x1;
+    }
+    else if(display.extended)
+    {
+        //Temperature, bias and contrast do not change the picture
+    }
+    else if(value & 0x80)
+    {
+        display.column = ((value & 0x7F) < 84) ? (value & 0x7F): 0;
+    }
+    else if((value & 0xF8) == 0x40)
+    {
+        display.page = ((value & 0x7) < 6) ? (value & 0x7): 0;
+    }
+    else if((value & 0xFA) == 0x08) //display control
+    {
+        display.inverted = (value & 0x5) == 0x5;
+    }
+}
+
+void pcd8544Data(uint8_t value)
+{
+    display.ram[display.page][display.column] = value;
+    if(display.addressing)
+    {
+        if(++display.page < 6)
+        {
+            return;
+        }
+        display.page = 0;
+        if(++display.column < 84)
+        {
+            return;
+        }
+        display.column = 0;
+    }
+    else
+    {
+        if(++display.column < 84)
+        {
+            return;
+        }
+        display.column = 0;
+        if(++display.page < 6)
+        {
+            return;
+        }
+        display.page = 0;
+    }
+    completeFrame();
+}
+
+void displayPort(void* context, int32_t port, uint8_t value)
+{
+    if(port >= DISPLAY_PORT_COUNT)
+    {
+        return;
+    }
+    if((port == frameSyncPort) && (value & ~display.ports[port] & frameSyncMask))
+    {
+        benchFrame();
+    }
+    display.ports[port] = value;
+}
+
+void displaySpi(void* context, uint8_t value)
+{
+    const displayModel& model = displayModels[display.model];
+    if(display.ports[model.csPort] & model.csMask)
+    {
+        return;
+    }
+    bool data = display.ports[model.dcPort] & model.dcMask;
+    if(display.model == DISPLAY_SSD1306)
+    {
+        data ? ssd1306Data(value): ssd1306Command(value);
+    }
+    else
+    {
+        data ? pcd8544Data(value): pcd8544Command(value);
+    }
+}
+
+// "-display model output" replaces the Port and SPI lines with frames, of
+// which "-frameskip n" keeps every nth. A NULL output only counts frames.
+bool openDisplay(const char* name, const char* output, int32_t frameSkip)
+{
+    for(display.model = DISPLAY_MODEL_COUNT - 1; (display.model > DISPLAY_NONE) && strcmp(name, displayModels[display.model].name); display.model--)
+        ;
+    if(display.model == DISPLAY_NONE)
+    {
+        return false;
+    }
+    display.output = output;
+    display.addressing = (display.model == DISPLAY_SSD1306) ? 2: 0;
+    display.columnEnd = DISPLAY_MAX_WIDTH - 1;
+    display.pageEnd = DISPLAY_MAX_PAGES - 1;
+    display.frameSkip = frameSkip;
+    portCallback = displayPort;
+    spiCallback = displaySpi;
+    return true;
+}
+
+void closeDisplay()
+{
+    if((display.model == DISPLAY_NONE) || !display.output)
+    {
+        return;
+    }
+    if(display.raw)
+    {
+        fclose(display.raw);
+    }
+    char buffer[256];
+    sprintf(buffer, "%llu frames, %llu written to %s", (unsigned long long)display.frames, (unsigned long long)display.written, display.output);
+    platformPrint(buffer);
+}
+#endif
+
+// Runs until the instruction budget or the cycle budget is used up, or the
+// core stops on its own. A budget of 0 is unlimited. Every stop leaves the
+// core at an instruction boundary with PC on the next instruction to run.
+// The exception is break and illegal opcodes, where PC stays on the
+// offending instruction. A breakpoint on the starting PC is stepped over,
+// so callers can resume after a breakpoint stop.
+int32_t trackedFetches = 0;
+int32_t runUntil(uint64_t instructions, uint64_t cycles)
+{
+    uint64_t cycleLimit = cycles ? (cycleCount + cycles): UINT64_MAX;
+    instructions = instructions ? instructions: UINT64_MAX;
+    uint64_t instructionBudget = instructions;
+    bool resuming = true;
+    stopReason = STOP_BUDGET;
+    while(instructions && (cycleCount < cycleLimit))
+    {
+        if(interruptReady)
+        {
+            serviceInterrupts();
+            resuming = false;
+        }
+        const predecodedWord& word = predecoded[PC >> 1];
+        int32_t executed = 0;
+        if(word.pattern == FUSED_BREAKPOINT)
+        {
+            if(!resuming)
+            {
+                stopReason = STOP_BREAKPOINT;
+                break;
+            }
+        }
+        else if((word.pattern != FUSED_NONE) && !referenceEngine)
+        {
+            //Never let a fused sequence straddle the next timer event or either budget
+            uint64_t budget = INSTRUCTION_LIMIT - trackedFetches;
+            budget = (instructions < budget) ? instructions: budget;
+            budget = ((cycleLimit - cycleCount) < budget) ? (cycleLimit - cycleCount): budget;
+#ifdef COVERAGE
+            programCounter start = PC;
+#endif
+            executed = fetchFused(budget);
+#ifdef COVERAGE
+            if(executed)
+            {
+                //Compiled blocks cover one word per instruction up to where they exit
+                markExecuted(start, (word.pattern == FUSED_COMPILED) ? executed: word.length);
+            }
+#endif
+        }
+        resuming = false;
+        if(!executed)
+        {
+#ifdef COVERAGE
+            markExecuted(PC, 1);
+#endif
+#ifndef LIBRARY
+            if(tracing)
+            {
+                traceInstruction();
+            }
+#endif
+            if(!fetch())
+            {
+                break;
+            }
+            executed = 1;
+        }
+        instructions -= executed;
+        trackedFetches += executed;
+        if(trackedFetches == INSTRUCTION_LIMIT)
+        {
+            trackedFetches = 0;
+            raiseInterrupt(TIMER0_OVF_VECTOR);
+        }
+        if(stackPointer < stackLimit)
+        {
+            stopReason = STOP_STACK_OVERFLOW;
+        }
+#ifdef FUZZ
+        //The next push would land in flash
+        flashWritten |= (stackPointer >= ENTRY_ADDRESS);
+#endif
+        if(stopReason != STOP_BUDGET)
+        {
+            break;
+        }
+    }
+    instructionCount += instructionBudget - instructions;
+
+    return stopReason;
+}
+
+// Skips ahead to the next timer event. Returns false when no enabled
+// interrupt source could ever wake the core.
+bool wakeFromSleep()
+{
+    if(pendingInterrupts & enabledInterrupts)
+    {
+        return true;
+    }
+    if(!(enabledInterrupts & (1ULL << TIMER0_OVF_VECTOR)))
+    {
+        return false;
+    }
+    cycleCount += INSTRUCTION_LIMIT - trackedFetches;
+    trackedFetches = 0;
+    raiseInterrupt(TIMER0_OVF_VECTOR);
+    return true;
+}
+
+int32_t fetchN(int32_t n)
+{
+    int32_t reason = runUntil(n, 0);
+    if(reason == STOP_SLEEP && wakeFromSleep())
+    {
+        reason = STOP_BUDGET;
+    }
+#if defined(LIBRARY) && defined(EMSCRIPTEN)
+    EM_ASM("refreshUI();");
+#endif
+
+    return reason == STOP_BUDGET;
+}
+
+// address is a flash byte address, as in the disassembly of the image
+void setBreakpoint(int32_t address, bool enabled)
+{
+    address = (programStart + address) & ~1;
+    if((address < programStart) || (address >= MEMORY_SIZE))
+    {
+        return;
+    }
+    predecoded[address >> 1].breakpoint = enabled;
+    //Fused sequences and native routines must not run across a breakpoint
+    predecodeProgram(address - 2*NATIVE_CODE_LIMIT, address + 2);
+}
+
+void updateWatchedPages()
+{
+    memset(watchedPages, 0, sizeof(watchedPages));
+    for(int32_t i = 0; i < watchpoints.count; i++)
+    {
+        const watchpoint& entry = watchpoints.entries[i];
+        for(int32_t page = entry.start >> WATCH_PAGE_SHIFT; page <= ((entry.end - 1) >> WATCH_PAGE_SHIFT); page++)
+        {
+            watchedPages[page] |= entry.mode & (WATCH_READ | WATCH_WRITE);
+        }
+    }
+}
+
+void clearWatchpoints()
+{
+    watchpoints.count = 0;
+    updateWatchedPages();
+}
+
+// The watchpoint covering exactly [start, end), NULL if there is none
+watchpoint* findWatchRange(int32_t start, int32_t end)
+{
+    for(int32_t i = 0; i < watchpoints.count; i++)
+    {
+        if((watchpoints.entries[i].start == start) && (watchpoints.entries[i].end == end))
+        {
+            return &watchpoints.entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Watches the data space range [start, end). mode is a mask of WATCH_*
+// and replaces that of an existing watchpoint on the same range; 0 removes
+// it. Returns false for a range outside the data space or when all
+// WATCHPOINT_LIMIT watchpoints are taken.
+bool setWatchRange(int32_t start, int32_t end, int32_t mode, uint8_t value)
+{
+    if((start < 0) || (end > ENTRY_ADDRESS) || (start >= end))
+    {
+        return false;
+    }
+    watchpoint* entry = findWatchRange(start, end);
+    if(!entry && mode)
+    {
+        if(watchpoints.count == WATCHPOINT_LIMIT)
+        {
+            return false;
+        }
+        entry = &watchpoints.entries[watchpoints.count++];
+        entry->start = start;
+        entry->end = end;
+    }
+    if(entry && !mode)
+    {
+        *entry = watchpoints.entries[--watchpoints.count];
+    }
+    else if(entry)
+    {
+        entry->mode = mode;
+        entry->value = value;
+    }
+    updateWatchedPages();
+    return true;
+}
+
+// address is a data space address, mode a mask of WATCH_READ and WATCH_WRITE
+void setWatchpoint(int32_t address, int32_t mode)
+{
+    setWatchRange(address, address + 1, mode, 0);
+}
+
+#ifndef LIBRARY
+// "-watch range access" stops and "-log range access" prints every access
+// to a range, "0x100" or "0x100-0x11f" inclusive. access is r, w or rw,
+// optionally followed by "=value" to only match accesses of that value.
+bool parseWatchpoint(const char* range, const char* access, bool log)
+{
+    char* next = NULL;
+    int32_t start = strtol(range, &next, 0);
+    int32_t end = (*next == '-') ? strtol(next + 1, &next, 0) + 1: start + 1;
+    int32_t mode = log ? WATCH_LOG: 0;
+    for(; (*access == 'r') || (*access == 'w'); access++)
+    {
+        mode |= (*access == 'r') ? WATCH_READ: WATCH_WRITE;
+    }
+    uint8_t value = 0;
+    if(*access == '=')
+    {
+        mode |= WATCH_VALUE;
+        value = strtol(access + 1, (char**)&access, 0);
+    }
+    return !*next && !*access && (mode & (WATCH_READ | WATCH_WRITE)) && setWatchRange(start, end, mode, value);
+}
+#endif
+
+void setStackLimit(int32_t address)
+{
+    stackLimit = address;
+}
+
+bool longOpcode(programCounter address)
+{
+    uint16_t opcode0 = memory[address];
+    uint16_t opcode1 = memory[address+1];
+
+    switch(opcode0)
+    {
+        case 0x90:
+        case 0x91:
+            if((opcode1 & 0xF) == 0) //lds
+            {
+                return true;
+            }
+            break;
+        case 0x92:
+        case 0x93:
+            if((opcode1 & 0xF) == 0) //sts
+            {
+                return true;
+            }
+            break;
+        case 0x94:
+        case 0x95:
+            if((opcode1 & 0xF) > 0xB) //jmp / call
+            {
+                return true;
+            }
+            break;
+    }
+
+    return false;
+}
+
+int32_t handleUnimplemented()
+{
+    stopReason = STOP_ILLEGAL_OPCODE;
+    return false;
+}
+
+uint16_t result;
+programCounter target;
+int32_t fetch()
+{
+        if((PC >= MEMORY_SIZE) || ((memory[PC] == 0x95) && (memory[PC+1] == 0x98))) //break
+        {
+            stopReason = (PC >= MEMORY_SIZE) ? STOP_ILLEGAL_OPCODE: STOP_BREAK;
+            return false;
+        }
+
+#ifndef EMSCRIPTEN
+        totalFetches++;
+#endif
+        cycleCount++;
+
+        result = 0;
+
+        switch(memory[PC])
+        {
+            case 0x0:
+                if(memory[PC+1] == 0x00) //nop
+                {
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0x1: //movw
+                writePair(((memory[PC+1] & 0xF0) >> 4)*2, readPair((memory[PC+1] & 0xF)*2));
+                // No SREG Updates
+                PC+=2;
+                break;
+            case 0x2: //muls
+            case 0x3: //mulsu
+                result = (int)memory[((memory[PC+1] & 0xF0) >> 4)*2]*(int)memory[(memory[PC+1] & 0xF)*2];
+                memory[0] = result & 0xFF;
+                memory[1] = result >> 8;
+                // No SREG Updates
+                PC+=2;
+                break;
+            case 0x4:
+            case 0x5:
+            case 0x6:
+            case 0x7: //cpc
+                setFlags(subFlags[SREG & SREG_C][memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]][memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]] & (SREG | ~SREG_Z), ARITHMETIC_FLAGS);
+                PC+=2;
+                break;
+            case 0x8:
+            case 0x9:
+            case 0xA:
+            case 0xB: //sbc
+                result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] - memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)] - (SREG & SREG_C);
+                setFlags(subFlags[SREG & SREG_C][memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]][memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]] & (SREG | ~SREG_Z), ARITHMETIC_FLAGS);
+                memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result & 0xFF;
+                PC+=2;
+                break;
+            case 0xC:
+            case 0xD:
+            case 0xE:
+            case 0xF: //add
+                result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] + memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)];
+                setFlags(addFlags[0][memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]][memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]], ARITHMETIC_FLAGS);
+                memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result & 0xFF;
+                PC+=2;
+                break;
+            case 0x10:
+            case 0x11:
+            case 0x12:
+            case 0x13: //cpse
+                if(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] == memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)])
+                {
+                    PC+=2;
+                    if(longOpcode(PC))
+                    {
+                        PC+=2;
+                    }
+                }
+                // No SREG Updates
+                PC+=2;
+                coverEdge(PC);
+                break;
+            case 0x14:
+            case 0x15:
+            case 0x16:
+            case 0x17: //cp
+               setFlags(subFlags[0][memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]][memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]], ARITHMETIC_FLAGS);
+               PC+=2;
+               break;
+            case 0x18:
+            case 0x19:
+            case 0x1A:
+            case 0x1B: //sub
+               result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] - memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)];
+               setFlags(subFlags[0][memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]][memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]], ARITHMETIC_FLAGS);
+               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result & 0xFF;
+               PC+=2;
+               break;
+            case 0x1C:
+            case 0x1D:
+            case 0x1E:
+            case 0x1F: //adc
+               result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] + memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)] + (SREG & SREG_C);
+               setFlags(addFlags[SREG & SREG_C][memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)]][memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]], ARITHMETIC_FLAGS);
+               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result & 0xFF;
+               PC+=2;
+               break;
+            case 0x20:
+            case 0x21:
+            case 0x22:
+            case 0x23: //and
+               result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] & memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
+               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
+               setFlags(logicFlags[result & 0xFF], LOGIC_FLAGS);
+               PC+=2;
+               break;
+            case 0x24:
+            case 0x25:
+            case 0x26:
+            case 0x27: //eor
+               memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)] = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)]^memory[(((memory[PC] & 0x2) << 3) | (memory[PC+1] & 0xF))];
+               result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+               setFlags(logicFlags[result & 0xFF], LOGIC_FLAGS);
+               PC+=2;
+               break;
+            case 0x28:
+            case 0x29:
+            case 0x2A:
+            case 0x2B: //or
+               result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] | memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
+               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
+               setFlags(logicFlags[result & 0xFF], LOGIC_FLAGS);
+               PC+=2;
+               break;
+            case 0x2C:
+            case 0x2D:
+            case 0x2E:
+            case 0x2F: //mov
+               memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)];
+               PC+=2;
+               break;
+            case 0x30:
+            case 0x31:
+            case 0x32:
+            case 0x33:
+            case 0x34:
+            case 0x35:
+            case 0x36:
+            case 0x37:
+            case 0x38:
+            case 0x39:
+            case 0x3A:
+            case 0x3B:
+            case 0x3C:
+            case 0x3D:
+            case 0x3E:
+            case 0x3F: //cpi
+                setFlags(subFlags[0][memory[16+(memory[PC+1] >> 4)]][((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF)], ARITHMETIC_FLAGS);
+                PC+=2;
+                break;
+            case 0x40:
+            case 0x41:
+            case 0x42:
+            case 0x43:
+            case 0x44:
+            case 0x45:
+            case 0x46:
+            case 0x47:
+            case 0x48:
+            case 0x49:
+            case 0x4A:
+            case 0x4B:
+            case 0x4C:
+            case 0x4D:
+            case 0x4E:
+            case 0x4F: //sbci
+                result = memory[16+((memory[PC+1] & 0xF0) >> 4)] - (((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF)) - (SREG & SREG_C);
+                setFlags(subFlags[SREG & SREG_C][memory[16+((memory[PC+1] & 0xF0) >> 4)]][((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF)] & (SREG | ~SREG_Z), ARITHMETIC_FLAGS);
+                memory[16+((memory[PC+1] & 0xF0) >> 4)] = result & 0xFF;
+                PC+=2;
+                break;
+            case 0x50:
+            case 0x51:
+            case 0x52:
+            case 0x53:
+            case 0x54:
+            case 0x55:
+            case 0x56:
+            case 0x57:
+            case 0x58:
+            case 0x59:
+            case 0x5A:
+            case 0x5B:
+            case 0x5C:
+            case 0x5D:
+            case 0x5E:
+            case 0x5F: //subi
+                result = ((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF);
+                setFlags(subFlags[0][memory[16+((memory[PC+1] & 0xF0) >> 4)]][result], ARITHMETIC_FLAGS);
+                memory[16+((memory[PC+1] & 0xF0) >> 4)] -= result;
+                PC+=2;
+                break;
+            case 0x60:
+            case 0x61:
+            case 0x62:
+            case 0x63:
+            case 0x64:
+            case 0x65:
+            case 0x66:
+            case 0x67:
+            case 0x68:
+            case 0x69:
+            case 0x6A:
+            case 0x6B:
+            case 0x6C:
+            case 0x6D:
+            case 0x6E:
+            case 0x6F: //ori
+                result = ((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF);
+                memory[16+((memory[PC+1] & 0xF0) >> 4)] |= result;
+                setFlags(logicFlags[memory[16+((memory[PC+1] & 0xF0) >> 4)]], LOGIC_FLAGS);
+                PC+=2;
+                break;
+            case 0x70:
+            case 0x71:
+            case 0x72:
+            case 0x73:
+            case 0x74:
+            case 0x75:
+            case 0x76:
+            case 0x77:
+            case 0x78:
+            case 0x79:
+            case 0x7A:
+            case 0x7B:
+            case 0x7C:
+            case 0x7D:
+            case 0x7E:
+            case 0x7F: //andi
+                result = ((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF);
+                memory[16+((memory[PC+1] & 0xF0) >> 4)] &= result;
+                setFlags(logicFlags[memory[16+((memory[PC+1] & 0xF0) >> 4)]], LOGIC_FLAGS);
+                PC+=2;
+                break;
+            case 0x80:
+            case 0x81:
+                if((memory[PC+1] & 0xF) >= 0x8) //ld (ldd) y
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Y_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) < 0x8) //ld (ldd) z
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Z_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0x82:
+            case 0x83:
+                if((memory[PC+1] & 0xF) >= 0x8) //st (std) y
+                {
+                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    writeMemory(readPair(Y_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) < 0x8) //st (std) z
+                {
+                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    writeMemory(readPair(Z_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0x84:
+            case 0x85:
+            case 0x8C:
+            case 0x8D:
+                if((memory[PC+1] & 0xF) >= 0x8) //ld (ldd) y
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Y_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) < 0x8) //ld (ldd) z
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Z_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0x86:
+            case 0x87:
+                if((memory[PC+1] & 0xF) >= 0x8) //st (std) y
+                {
+                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    writeMemory(readPair(Y_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) < 0x8) //st (std) z
+                {
+                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    writeMemory(readPair(Z_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0x88:
+            case 0x89:
+                if((memory[PC+1] & 0xF) >= 0x8) //ld (ldd) y
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Y_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) < 0x8) //ld (ldd) z
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Z_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0x8A:
+            case 0x8B:
+            case 0x8E:
+            case 0x8F:
+                if((memory[PC+1] & 0xF) >= 0x8) //st (std) y
+                {
+                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    writeMemory(readPair(Y_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) < 0x8) //st (std) z
+                {
+                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    writeMemory(readPair(Z_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0x90:
+            case 0x91:
+                if((memory[PC+1] & 0xF) == 0x0) //lds
+                {
+                   memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)] = readMemory(((memory[PC+2] << 8) | memory[PC+3]));
+                   // No SREG Updates
+                   PC+=4;
+                   break;
+                }
+                if((memory[PC+1] & 0xF) == 0x1) //ld z+
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Z_REGISTER));
+                    // No SREG Updates
+                    writePair(Z_REGISTER, readPair(Z_REGISTER) + 1);
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) == 0x2) //ld -z
+                {
+                    writePair(Z_REGISTER, readPair(Z_REGISTER) - 1);
+                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
+                    memory[result] = readMemory(readPair(Z_REGISTER));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) == 0x4) //lpm (rd, z)
+                {
+                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
+                    memory[result] = memory[programStart + (readPair(Z_REGISTER) ^ 1)];
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) == 0x5) //lpm (rd, z+)
+                {
+                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
+                    memory[result] = memory[programStart + (readPair(Z_REGISTER) ^ 1)];
+                    // No SREG Updates
+                    writePair(Z_REGISTER, readPair(Z_REGISTER) + 1);
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xE) == 0x6) //elpm (rd, z), elpm (rd, z+)
+                {
+                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
+                    int32_t address = readPair(Z_REGISTER) | (memory[ATMEGA2560_RAMPZ] << 16);
+                    memory[result] = memory[programStart + ((address & (FLASH_SIZE - 1)) ^ 1)];
+                    // No SREG Updates
+                    if(memory[PC+1] & 0x1)
+                    {
+                        //Z+ carries into RAMPZ
+                        address++;
+                        writePair(Z_REGISTER, address & 0xFFFF);
+                        memory[ATMEGA2560_RAMPZ] = address >> 16;
+                    }
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) == 0x9) //ld y+
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Y_REGISTER));
+                    // No SREG Updates
+                    writePair(Y_REGISTER, readPair(Y_REGISTER) + 1);
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) == 0xA) //ld -y
+                {
+                    writePair(Y_REGISTER, readPair(Y_REGISTER) - 1);
+                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
+                    memory[result] = readMemory(readPair(Y_REGISTER));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) == 0xC) //ld x
+                {
+                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
+                    memory[result] = readMemory(readPair(X_REGISTER));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) == 0xD) //ld x+
+                {
+                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
+                    memory[result] = readMemory(readPair(X_REGISTER));
+                    // No SREG Updates
+                    writePair(X_REGISTER, readPair(X_REGISTER) + 1);
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) == 0xF) //pop
+                {
+                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
+                    memory[result] = memory[++stackPointer];
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0x92:
+            case 0x93:
+               if((memory[PC+1] & 0xF) == 0x0) //sts
+               {
+                  writeMemory(((memory[PC+2] << 8) | memory[PC+3]), memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)]);
+                  // No SREG Updates
+                  PC+=4;
+                  break;
+               }
+               if((memory[PC+1] & 0xF) == 0x1) //st (std) z+
+               {
+                   result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
+                   writeMemory(readPair(Z_REGISTER), result);
+                   // No SREG Updates
+                   writePair(Z_REGISTER, readPair(Z_REGISTER) + 1);
+                   PC+=2;
+                   break;
+               }
+               if((memory[PC+1] & 0xF) == 0x2) //st (std) -z
+               {
+                   result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                   writePair(Z_REGISTER, readPair(Z_REGISTER) - 1);
+                   writeMemory(readPair(Z_REGISTER), result);
+                   // No SREG Updates
+                   PC+=2;
+                   break;
+               }
+               if((memory[PC+1] & 0xF) == 0x9) //st (std) y+
+               {
+                   result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                   writeMemory(readPair(Y_REGISTER), result);
+                   // No SREG Updates
+                   writePair(Y_REGISTER, readPair(Y_REGISTER) + 1);
+                   PC+=2;
+                   break;
+               }
+               if((memory[PC+1] & 0xF) == 0xA) //st (std) -y
+               {
+                   writePair(Y_REGISTER, readPair(Y_REGISTER) - 1);
+                   result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                   writeMemory(readPair(Y_REGISTER), result);
+                   // No SREG Updates
+                   PC+=2;
+                   break;
+               }
+               if((memory[PC+1] & 0xF) == 0xF) //push
+               {
+                   memory[stackPointer--] = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                   // No SREG Updates
+                   PC+=2;
+                   break;
+               }
+               if((memory[PC+1] & 0xF) == 0xC) //st x
+               {
+                   result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
+                   writeMemory(readPair(X_REGISTER), result);
+                   // No SREG Updates
+                   PC+=2;
+                   break;
+               }
+               if((memory[PC+1] & 0xF) == 0xD) //st x+
+               {
+                   result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
+                   writeMemory(readPair(X_REGISTER), result);
+                   // No SREG Updates
+                   writePair(X_REGISTER, readPair(X_REGISTER) + 1);
+                   PC+=2;
+                   break;
+               }
+               if((memory[PC+1] & 0xF) == 0xE) //st -x
+               {
+                   result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
+                   writePair(X_REGISTER, readPair(X_REGISTER) - 1);
+                   writeMemory(readPair(X_REGISTER), result);
+                   // No SREG Updates
+                   PC+=2;
+                   break;
+               }
+               return handleUnimplemented();
+            case 0x94:
+            case 0x95:
+                if((memory[PC] == 0x94) && (memory[PC+1] == 0x09)) //ijmp
+                {
+                    // No SREG Updates
+                    PC = (2*readPair(Z_REGISTER)) + programStart;
+                    coverEdge(PC);
+                    break;
+                }
+#ifdef ATMEGA2560
+                if((memory[PC] == 0x94) && (memory[PC+1] == 0x19)) //eijmp
+                {
+                    // No SREG Updates
+                    PC = (2*(readPair(Z_REGISTER) | ((memory[ATMEGA2560_EIND] & 0x3F) << 16))) + programStart;
+                    coverEdge(PC);
+                    break;
+                }
+#endif
+                if((memory[PC] == 0x94) && ((memory[PC+1] & 0xF) == 0x8)) //bset, bclr (sec, sei, clt, cli, ...)
+                {
+                    result = 1 << ((memory[PC+1] >> 4) & 0x7);
+                    if(memory[PC+1] & 0x80)
+                    {
+                        SREG &= ~result;
+                    }
+                    else
+                    {
+                        SREG |= result;
+                    }
+                    if(result == SREG_I)
+                    {
+                        updateInterruptState();
+                        interruptInhibit = interruptReady;
+                    }
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC] == 0x95) && (memory[PC+1] == 0x88)) //sleep
+                {
+                    // No SREG Updates
+                    PC+=2;
+                    if(memory[SMCR_ADDRESS] & SE_BIT)
+                    {
+                        stopReason = STOP_SLEEP;
+                    }
+                    break;
+                }
+                if((memory[PC] == 0x95) && (memory[PC+1] == 0xA8)) //wdr
+                {
+#ifdef FUZZ
+                    watchdogResetCycle = cycleCount;
+#endif
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC] == 0x95) && (memory[PC+1] == 0x8)) //ret
+                {
+                    // No SREG Updates
+                    PC = popReturnAddress();
+                    coverEdge(PC);
+                    break;
+                }
+                if((memory[PC] == 0x95) && (memory[PC+1] == 0x9)) //icall
+                {
+                    pushReturnAddress(PC + 2);
+                    // No SREG Updates
+                    PC = (readPair(Z_REGISTER)*2)+programStart;
+                    coverEdge(PC);
+                    break;
+                }
+#ifdef ATMEGA2560
+                if((memory[PC] == 0x95) && (memory[PC+1] == 0x19)) //eicall
+                {
+                    pushReturnAddress(PC + 2);
+                    // No SREG Updates
+                    PC = (2*(readPair(Z_REGISTER) | ((memory[ATMEGA2560_EIND] & 0x3F) << 16))) + programStart;
+                    coverEdge(PC);
+                    break;
+                }
+#endif
+                if((memory[PC] == 0x95) && (memory[PC+1] == 0x18)) //reti
+                {
+                    SREG |= SREG_I;
+                    updateInterruptState();
+                    interruptInhibit = interruptReady;
+                    PC = popReturnAddress();
+                    coverEdge(PC);
+                    break;
+                }
+                switch(memory[PC+1] & 0x0F)
+                {
+                    case 0x0: //com
+                        result = ~memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] & 0xFF;
+                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
+                        setFlags(logicFlags[result] | SREG_C, LOGIC_FLAGS|SREG_C);
+                        PC+=2;
+                        break;
+                    case 0x1: //neg
+                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
+                        setFlags(subFlags[0][0][result], ARITHMETIC_FLAGS);
+                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = (0x100 - result) & 0xFF;
+                        PC+=2;
+                        break;
+                    case 0x2: //swap
+                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] << 4;
+                        result |= (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] >> 4);
+                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
+                        PC+=2;
+                        break;
+                    case 0x3: //inc
+                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
+                        setFlags(addFlags[0][result][1], LOGIC_FLAGS);
+                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = ++result;
+                        PC+=2;
+                        break;
+                    case 0x5: //asr
+                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
+                        setFlags(shiftFlags[result & 0x1][(result >> 1) | (result & 0x80)], LOGIC_FLAGS|SREG_C);
+                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = (result >> 1) | (result & 0x80);
+                        PC+=2;
+                        break;
+                    case 0x6: //lsr
+                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
+                        setFlags(shiftFlags[result & 0x1][result >> 1], LOGIC_FLAGS|SREG_C);
+                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result >> 1;
+                        PC+=2;
+                        break;
+                    case 0x7: //ror
+                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] | ((SREG & SREG_C) << 8);
+                        setFlags(shiftFlags[result & 0x1][result >> 1], LOGIC_FLAGS|SREG_C);
+                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result >> 1;
+                        PC+=2;
+                        break;
+                    case 0xA: //dec
+                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
+                        setFlags(subFlags[0][result][1], LOGIC_FLAGS);
+                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = --result;
+                        PC+=2;
+                        break;
+                    case 0xC:
+                    case 0xD: //jmp
+                        // No SREG Updates
+                        target  = (memory[PC] & 0x1) << 21;
+                        target |= (memory[PC+1] >> 4) << 17;
+                        target |= (memory[PC+1] & 0x1) << 16;
+                        target |= (memory[PC+2] << 8 | memory[PC+3]);
+                        PC = programStart + (target*2);
+                        coverEdge(PC);
+                        break;
+                    case 0xE:
+                    case 0xF: //call
+                        target = programStart + (((memory[PC] & 0x1) << 21) | ((memory[PC+1] & 0xF0) << 13) | ((memory[PC+1] & 0x1) << 16)
+                         | (memory[PC+2] << 8) | memory[PC+3])*2;
+                        pushReturnAddress(PC + 4);
+                        // No SREG Updates
+                        PC = target;
+                        coverEdge(PC);
+                        break;
+                    default:
+                        return handleUnimplemented();
+                }
+                break;
+            case 0x96: //adiw
+            case 0x97: //sbiw
+                result = readPair(24 + ((memory[PC+1] & 0x30) >> 3));
+                if(memory[PC] == 0x96)
+                {
+                    result = result + (((memory[PC+1] & 0xC0) >> 0x2) | (memory[PC+1] & 0xF));
+                    //V = !Rdh7 & R15, C = !R15 & Rdh7
+                    setFlags(((~(memory[25 + ((memory[PC+1] & 0x30) >> 3)] << 8) & result & 0x8000) ? SREG_V: 0) |
+                             ((~result & (memory[25 + ((memory[PC+1] & 0x30) >> 3)] << 8) & 0x8000) ? SREG_C: 0), SREG_V|SREG_C);
+                }
+                else
+                {
+                    result = result - (((memory[PC+1] & 0xC0) >> 0x2) | (memory[PC+1] & 0xF));
+                    //V = Rdh7 & !R15, C = R15 & !Rdh7
+                    setFlags((((memory[25 + ((memory[PC+1] & 0x30) >> 3)] << 8) & ~result & 0x8000) ? SREG_V: 0) |
+                             ((result & ~(memory[25 + ((memory[PC+1] & 0x30) >> 3)] << 8) & 0x8000) ? SREG_C: 0), SREG_V|SREG_C);
+                }
+                setFlags((result == 0x0000 ? SREG_Z: 0) | ((result & 0x8000) ? SREG_N: 0) |
+                         ((((result & 0x8000) != 0) != ((SREG & SREG_V) != 0)) ? SREG_S: 0), SREG_Z|SREG_N|SREG_S);
+                writePair(24 + ((memory[PC+1] & 0x30) >> 3), result);
+                PC+=2;
+                break;
+            case 0x98: //cbi
+                result = (1 << (memory[PC+1] & 0x7));
+                memory[(memory[PC+1] >> 0x3) + IO_REG_START] &= ~result;
+                if(interruptEnableRegister[(memory[PC+1] >> 0x3) + IO_REG_START])
+                {
+                    updateInterruptMask();
+                }
+                if(ioWriteCallback)
+                {
+                    ioWriteCallback(peripheralContext, (memory[PC+1] >> 0x3) + IO_REG_START, memory[(memory[PC+1] >> 0x3) + IO_REG_START]);
+                }
+                // No SREG Updates
+                PC+=2;
+                break;
+            case 0x9A: //sbi
+                result = (1 << (memory[PC+1] & 0x7));
+                memory[(memory[PC+1] >> 0x3) + IO_REG_START] |= result;
+                if(interruptEnableRegister[(memory[PC+1] >> 0x3) + IO_REG_START])
+                {
+                    updateInterruptMask();
+                }
+                if(ioWriteCallback)
+                {
+                    ioWriteCallback(peripheralContext, (memory[PC+1] >> 0x3) + IO_REG_START, memory[(memory[PC+1] >> 0x3) + IO_REG_START]);
+                }
+                // No SREG Updates
+                PC+=2;
+                break;
+            case 0x99: //sbic
+            case 0x9B: //sbis
+                result = readMemory((memory[PC+1] >> 0x3) + IO_REG_START);
+                if(((result & (1 << (memory[PC+1] & 0x7))) > 0) == ((memory[PC] & 0x2) > 0))
+                {
+                    PC+=2;
+                    if(longOpcode(PC))
+                    {
+                        PC+=2;
+                    }
+                }
+                // No SREG Updates
+                PC+=2;
+                coverEdge(PC);
+                break;
+            case 0x9C:
+            case 0x9D:
+            case 0x9E:
+            case 0x9F: //mul
+               result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] * memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
+               setFlags((result == 0x0000 ? SREG_Z: 0) | ((result & 0x8000) ? SREG_C: 0), SREG_Z|SREG_C);
+               memory[1] = result >> 8;
+               memory[0] = result & 0xFF;
+               PC+=2;
+               break;
+            case 0xA0:
+            case 0xA1:
+            case 0xA4:
+            case 0xA5:
+            case 0xA8:
+            case 0xA9:
+            case 0xAC:
+            case 0xAD:
+                if((memory[PC+1] & 0xF) < 0x8) //ld (ldd) z
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Z_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) >= 0x8) //ld (ldd) y
+                {
+                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
+                    memory[result] = readMemory(readPair(Y_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0xA2:
+            case 0xA3:
+            case 0xA6:
+            case 0xA7:
+            case 0xAA:
+            case 0xAB:
+            case 0xAE:
+            case 0xAF:
+                if((memory[PC+1] & 0xF) < 0x8) //st (std) z
+                {
+                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    writeMemory(readPair(Z_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                if((memory[PC+1] & 0xF) >= 0x8) //st (std) y
+                {
+                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    writeMemory(readPair(Y_REGISTER) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1 )), result);
+                    // No SREG Updates
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0xB0:
+            case 0xB1:
+            case 0xB2:
+            case 0xB3:
+            case 0xB4:
+            case 0xB5:
+            case 0xB6:
+            case 0xB7: //in
+                memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)] = readMemory(((((memory[PC] & 0x07) >> 1) << 4) | (memory[PC+1] & 0x0F)) + IO_REG_START);
+                // No SREG Updates
+                PC+=2;
+                break;
+            case 0xB8:
+            case 0xB9:
+            case 0xBA:
+            case 0xBB:
+            case 0xBC:
+            case 0xBD:
+            case 0xBE:
+            case 0xBF: //out
+                writeMemory(((((memory[PC] & 0x07) >> 1) << 4) | (memory[PC+1] & 0x0F)) + IO_REG_START, memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)]);
+                // No SREG Updates
+                PC+=2;
+                break;
+            case 0xC0:
+            case 0xC1:
+            case 0xC2:
+            case 0xC3:
+            case 0xC4:
+            case 0xC5:
+            case 0xC6:
+            case 0xC7:
+            case 0xC8:
+            case 0xC9:
+            case 0xCA:
+            case 0xCB:
+            case 0xCC:
+            case 0xCD:
+            case 0xCE:
+            case 0xCF: //rjmp
+                if((memory[PC] == 0xCF) && (memory[PC+1] == 0xFF))
+                {
+                    //Program Exit
+                    stopReason = STOP_BREAK;
+                    return false;
+                }
+                result = ((memory[PC] & 0xF) << 8) | memory[PC+1];
+                PC+=2;
+                PC = (0x800 == (result & 0x800)) ? PC - (0x1000 - (2*(result^0x800))) : PC + (2*result);
+                coverEdge(PC);
+                // No SREG Updates
+                break;
+            case 0xD0:
+            case 0xD1:
+            case 0xD2:
+            case 0xD3:
+            case 0xD4:
+            case 0xD5:
+            case 0xD6:
+            case 0xD7:
+            case 0xD8:
+            case 0xD9:
+            case 0xDA:
+            case 0xDB:
+            case 0xDC:
+            case 0xDD:
+            case 0xDE:
+            case 0xDF: //rcall
+                result = ((memory[PC] & 0xF) << 8) | memory[PC+1];
+                PC+=2;
+                pushReturnAddress(PC);
+                // No SREG Updates
+                if(0x800 == (result & 0x800))
+                {
+                    PC -= (0x1000 - 2*(result^0x800));
+                }
+                else
+                {
+                    PC += (2*result);
+                }
+                coverEdge(PC);
+                break;
+            case 0xE0:
+            case 0xE1:
+            case 0xE2:
+            case 0xE3:
+            case 0xE4:
+            case 0xE5:
+            case 0xE6:
+            case 0xE7:
+            case 0xE8:
+            case 0xE9:
+            case 0xEA:
+            case 0xEB:
+            case 0xEC:
+            case 0xED:
+            case 0xEE:
+            case 0xEF: //ldi
+                memory[16 + ((memory[PC+1] & 0xF0) >> 4)] = ((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF);
+                // No SREG Updates
+                PC+=2;
+                break;
+            case 0xF0:
+            case 0xF1:
+            case 0xF2:
+            case 0xF3:
+                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x0)) //brcs
+                {
+                    if(SREG & SREG_C)
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x1)) //breq
+                {
+                    if(SREG & SREG_Z)
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x2)) //brmi
+                {
+                    if(SREG & SREG_N)
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x4)) //brlt
+                {
+                    if(SREG & SREG_S)
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x6)) //brts
+                {
+                    if(SREG & SREG_T)
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                return handleUnimplemented();
+            case 0xF4:
+            case 0xF5:
+            case 0xF6:
+            case 0xF7:
+                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x2)) //brpl
+                {
+                    if(!(SREG & SREG_N))
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x0)) //brcc
+                {
+                    if(!(SREG & SREG_C))
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x1)) //brne
+                {
+                    if(!(SREG & SREG_Z))
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x4)) //brge
+                {
+                    if(!(SREG & SREG_S))
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x6)) //brtc
+                {
+                    if(!(SREG & SREG_T))
+                    {
+                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
+                        PC = (0x40 <= result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
+                    }
+                    // No SREG Updates
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                return handleUnimplemented();
+            case 0xF8:
+            case 0xF9: //bld
+                if((memory[PC+1] & 0xF) < 0x8)
+                {
+                    if(SREG & SREG_T)
+                    {
+                        memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)] |= (1 << (memory[PC+1] & 0x7));
+                    }
+                    else
+                    {
+                        memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)] &= ~(1 << (memory[PC+1] & 0x7));
+                    }
+                    PC+=2;
+                    break;
+                }
+                return handleUnimplemented();
+            case 0xFA:
+            case 0xFB: //bst
+                result = memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                setFlags((result & (1 << (memory[PC+1] & 0x7))) ? SREG_T: 0, SREG_T);
+                PC+=2;
+                break;
+            case 0xFC:
+            case 0xFD: //sbrc
+                if((memory[PC+1] & 0xF) < 0x8)
+                {
+                    result = memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    if((result & (1 << (memory[PC+1] & 0xF))) == 0)
+                    {
+                        PC+=2;
+                        if(longOpcode(PC))
+                        {
+                            PC+=2;
+                        }
+                    }
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                return handleUnimplemented();
+            case 0xFE:
+            case 0xFF: //sbrs
+                if((memory[PC+1] & 0xF) < 0x8)
+                {
+                    result = memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
+                    if((result & (1 << (memory[PC+1] & 0xF))) > 0)
+                    {
+                        PC+=2;
+                        if(longOpcode(PC))
+                        {
+                            PC+=2;
+                        }
+                    }
+                    PC+=2;
+                    coverEdge(PC);
+                    break;
+                }
+                return handleUnimplemented();
+            default:
+                return handleUnimplemented();
+        }
+        resetFetchState();
+#ifdef EMSCRIPTEN
+        std::this_thread::yield();
+#endif
+        return true;
+}
+
+//Native Routines
+// libgcc's unsigned division and avr-libc's memcpy, memset and strlen are
+// recognized by their code, as built for cores with MOVW, wherever they
+// start in the image. A call then runs natively as one dispatch and leaves
+// the registers, SREG, data space, stack and instruction count exactly as
+// interpreting the routine and its ret would. The signed divisions call the
+// unsigned ones and speed up with them. Calls that do not fit the budget,
+// or whose buffers reach outside SRAM or into watched memory, are
+// interpreted instead. "-nohle" and avrcoreEnableNative() turn this off,
+// and tracing never dispatches them.
+
+// Works on a copy of the registers and SREG, committed once the call fits
+struct nativeCall
+{
+    uint8_t r[32];
+    uint8_t sreg;
+    int32_t executed;
+};
+
+struct nativeRoutine
+{
+    const char* name;
+    int32_t words;
+    uint16_t code[NATIVE_CODE_LIMIT];
+    bool (*run)(nativeCall& call, int32_t budget); // false to interpret the call instead
+};
+
+inline void nativeFlags(nativeCall& call, uint8_t flags, uint8_t mask)
+{
+    call.sreg = (call.sreg & ~mask) | (flags & mask);
+}
+
+inline uint8_t nativeAdd(nativeCall& call, uint8_t a, uint8_t b, uint8_t carry)
+{
+    nativeFlags(call, addFlags[carry][a][b], ARITHMETIC_FLAGS);
+    return a + b + carry;
+}
+
+// rol is adc of a register with itself
+inline uint8_t nativeAdc(nativeCall& call, uint8_t a, uint8_t b)
+{
+    return nativeAdd(call, a, b, call.sreg & SREG_C);
+}
+
+inline uint8_t nativeSub(nativeCall& call, uint8_t a, uint8_t b)
+{
+    nativeFlags(call, subFlags[0][a][b], ARITHMETIC_FLAGS);
+    return a - b;
+}
+
+inline uint8_t nativeSbc(nativeCall& call, uint8_t a, uint8_t b)
+{
+    uint8_t carry = call.sreg & SREG_C;
+    nativeFlags(call, subFlags[carry][a][b] & (call.sreg | ~SREG_Z), ARITHMETIC_FLAGS);
+    return a - b - carry;
+}
+
+inline uint8_t nativeDec(nativeCall& call, uint8_t a)
+{
+    nativeFlags(call, subFlags[0][a][1], LOGIC_FLAGS);
+    return a - 1;
+}
+
+inline uint8_t nativeCom(nativeCall& call, uint8_t a)
+{
+    a = ~a;
+    nativeFlags(call, logicFlags[a] | SREG_C, LOGIC_FLAGS|SREG_C);
+    return a;
+}
+
+// Whether size bytes from address are plain SRAM that no watchpoint sees
+bool nativeMemory(int32_t address, int32_t size, int32_t mode)
+{
+    if((address < RAMSTART) || (address + size > ENTRY_ADDRESS))
+    {
+        return false;
+    }
+#ifndef LIBRARY
+    if((address < semihostAddress + SEMIHOST_SIZE) && (address + size > semihostAddress))
+    {
+        return false;
+    }
+#endif
+    for(int32_t i = address; (mode == WATCH_WRITE) && (i < address + size) && (i < INTERRUPT_REGISTER_LIMIT); i++)
+    {
+        if(interruptEnableRegister[i])
+        {
+            return false;
+        }
+    }
+    for(int32_t page = address >> WATCH_PAGE_SHIFT; size && (page <= ((address + size - 1) >> WATCH_PAGE_SHIFT)); page++)
+    {
+        if(watchedPages[page] & mode)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// __udivmodqi4: r24 / r22, quotient in r24 and remainder in r25
+bool nativeUdivmodqi4(nativeCall& call, int32_t budget)
+{
+    uint8_t* r = call.r;
+    //Each quotient bit that is set costs the one subtraction the loop skips
+    //otherwise, and dividing by zero sets every bit
+    uint8_t quotient = r[22] ? r[24]/r[22]: 0xFF;
+    if(56 + __builtin_popcount(quotient) > budget)
+    {
+        return false;
+    }
+    r[25] = nativeSub(call, r[25], r[25]);
+    r[23] = 9;
+    call.executed += 3;
+    while(true)
+    {
+        r[24] = nativeAdc(call, r[24], r[24]);
+        r[23] = nativeDec(call, r[23]);
+        call.executed += 3;
+        if(!r[23])
+        {
+            break;
+        }
+        r[25] = nativeAdc(call, r[25], r[25]);
+        nativeSub(call, r[25], r[22]);
+        call.executed += 3;
+        if(!(call.sreg & SREG_C))
+        {
+            r[25] = nativeSub(call, r[25], r[22]);
+            call.executed++;
+        }
+    }
+    r[24] = nativeCom(call, r[24]);
+    call.executed += 2;
+    return true;
+}
+
+// __udivmodhi4: r25:r24 / r23:r22, quotient in r23:r22 and remainder in
+// r25:r24
+bool nativeUdivmodhi4(nativeCall& call, int32_t budget)
+{
+    uint8_t* r = call.r;
+    uint16_t dividend = r[24] | (r[25] << 8);
+    uint16_t divisor = r[22] | (r[23] << 8);
+    uint16_t quotient = divisor ? dividend/divisor: 0xFFFF;
+    if(157 + 2*__builtin_popcount(quotient) > budget)
+    {
+        return false;
+    }
+    r[26] = nativeSub(call, r[26], r[26]);
+    r[27] = nativeSub(call, r[27], r[27]);
+    r[21] = 17;
+    call.executed += 4;
+    while(true)
+    {
+        r[24] = nativeAdc(call, r[24], r[24]);
+        r[25] = nativeAdc(call, r[25], r[25]);
+        r[21] = nativeDec(call, r[21]);
+        call.executed += 4;
+        if(!r[21])
+        {
+            break;
+        }
+        r[26] = nativeAdc(call, r[26], r[26]);
+        r[27] = nativeAdc(call, r[27], r[27]);
+        nativeSub(call, r[26], r[22]);
+        nativeSbc(call, r[27], r[23]);
+        call.executed += 5;
+        if(!(call.sreg & SREG_C))
+        {
+            r[26] = nativeSub(call, r[26], r[22]);
+            r[27] = nativeSbc(call, r[27], r[23]);
+            call.executed += 2;
+        }
+    }
+    r[24] = nativeCom(call, r[24]);
+    r[25] = nativeCom(call, r[25]);
+    r[22] = r[24];
+    r[23] = r[25];
+    r[24] = r[26];
+    r[25] = r[27];
+    call.executed += 5;
+    return true;
+}
+
+// __udivmodsi4: r25:r22 / r21:r18, quotient in r21:r18 and remainder in
+// r25:r22. The loop counts down in r1, which ends up zero again.
+bool nativeUdivmodsi4(nativeCall& call, int32_t budget)
+{
+    uint8_t* r = call.r;
+    uint32_t dividend = r[22] | (r[23] << 8) | (r[24] << 16) | ((uint32_t)r[25] << 24);
+    uint32_t divisor = r[18] | (r[19] << 8) | (r[20] << 16) | ((uint32_t)r[21] << 24);
+    uint32_t quotient = divisor ? dividend/divisor: 0xFFFFFFFF;
+    if(501 + 4*__builtin_popcount(quotient) > budget)
+    {
+        return false;
+    }
+    static const uint8_t remainder[4] = {26, 27, 30, 31};
+    r[26] = 33;
+    r[1] = r[26];
+    r[26] = nativeSub(call, r[26], r[26]);
+    r[27] = nativeSub(call, r[27], r[27]);
+    r[30] = r[26];
+    r[31] = r[27];
+    call.executed += 6;
+    while(true)
+    {
+        for(int32_t i = 22; i <= 25; i++)
+        {
+            r[i] = nativeAdc(call, r[i], r[i]);
+        }
+        r[1] = nativeDec(call, r[1]);
+        call.executed += 6;
+        if(!r[1])
+        {
+            break;
+        }
+        for(int32_t i = 0; i < 4; i++)
+        {
+            r[remainder[i]] = nativeAdc(call, r[remainder[i]], r[remainder[i]]);
+        }
+        nativeSub(call, r[26], r[18]);
+        for(int32_t i = 1; i < 4; i++)
+        {
+            nativeSbc(call, r[remainder[i]], r[18 + i]);
+        }
+        call.executed += 9;
+        if(!(call.sreg & SREG_C))
+        {
+            r[26] = nativeSub(call, r[26], r[18]);
+            for(int32_t i = 1; i < 4; i++)
+            {
+                r[remainder[i]] = nativeSbc(call, r[remainder[i]], r[18 + i]);
+            }
+            call.executed += 4;
+        }
+    }
+    for(int32_t i = 22; i <= 25; i++)
+    {
+        r[i] = nativeCom(call, r[i]);
+    }
+    memcpy(&r[18], &r[22], 4);
+    r[22] = r[26];
+    r[23] = r[27];
+    r[24] = r[30];
+    r[25] = r[31];
+    call.executed += 9;
+    return true;
+}
+
+// memcpy(r25:r24, r23:r22, r21:r20), copied forwards a byte at a time
+bool nativeMemcpy(nativeCall& call, int32_t budget)
+{
+    uint8_t* r = call.r;
+    int32_t destination = r[24] | (r[25] << 8);
+    int32_t source = r[22] | (r[23] << 8);
+    int32_t size = r[20] | (r[21] << 8);
+    call.executed = 7 + 5*size;
+    if((call.executed > budget) || !nativeMemory(source, size, WATCH_READ) || !nativeMemory(destination, size, WATCH_WRITE))
+    {
+        return false;
+    }
+    for(int32_t i = 0; i < size; i++)
+    {
+        r[0] = memory[destination + i] = memory[source + i];
+    }
+    r[30] = (source + size) & 0xFF;
+    r[31] = (source + size) >> 8;
+    r[26] = (destination + size) & 0xFF;
+    r[27] = (destination + size) >> 8;
+    //The last count down borrows from zero
+    r[20] = nativeSub(call, 0, 1);
+    r[21] = nativeSbc(call, 0, 0);
+    return true;
+}
+
+// memset(r25:r24, r22, r21:r20)
+bool nativeMemset(nativeCall& call, int32_t budget)
+{
+    uint8_t* r = call.r;
+    int32_t destination = r[24] | (r[25] << 8);
+    int32_t size = r[20] | (r[21] << 8);
+    call.executed = 6 + 4*size;
+    if((call.executed > budget) || !nativeMemory(destination, size, WATCH_WRITE))
+    {
+        return false;
+    }
+    memset(&memory[destination], r[22], size);
+    r[26] = (destination + size) & 0xFF;
+    r[27] = (destination + size) >> 8;
+    r[20] = nativeSub(call, 0, 1);
+    r[21] = nativeSbc(call, 0, 0);
+    return true;
+}
+
+// strlen(r25:r24)
+bool nativeStrlen(nativeCall& call, int32_t budget)
+{
+    uint8_t* r = call.r;
+    int32_t source = r[24] | (r[25] << 8);
+    int32_t end = source;
+    while((end >= RAMSTART) && (end < ENTRY_ADDRESS) && memory[end])
+    {
+        end++;
+    }
+    call.executed = 9 + 3*(end - source);
+    if((call.executed > budget) || !nativeMemory(source, end - source + 1, WATCH_READ))
+    {
+        return false;
+    }
+    r[0] = 0;
+    nativeFlags(call, logicFlags[0], LOGIC_FLAGS);
+    r[30] = (end + 1) & 0xFF;
+    r[31] = (end + 1) >> 8;
+    r[24] = nativeCom(call, r[24]);
+    r[25] = nativeCom(call, r[25]);
+    r[24] = nativeAdd(call, r[24], r[30], 0);
+    r[25] = nativeAdc(call, r[25], r[31]);
+    return true;
+}
+
+const nativeRoutine nativeRoutines[] =
+{
+    {"__udivmodqi4", 12, {0x1B99, 0xE079, 0xC004, 0x1F99, 0x1796, 0xF008, 0x1B96, 0x1F88, 0x957A, 0xF7C9, 0x9580, 0x9508}, nativeUdivmodqi4},
+    {"__udivmodhi4", 20, {0x1BAA, 0x1BBB, 0xE151, 0xC007, 0x1FAA, 0x1FBB, 0x17A6, 0x07B7, 0xF010, 0x1BA6, 0x0BB7, 0x1F88, 0x1F99, 0x955A,
+                          0xF7A9, 0x9580, 0x9590, 0x01BC, 0x01CD, 0x9508}, nativeUdivmodhi4},
+    {"__udivmodsi4", 34, {0xE2A1, 0x2E1A, 0x1BAA, 0x1BBB, 0x01FD, 0xC00D, 0x1FAA, 0x1FBB, 0x1FEE, 0x1FFF, 0x17A2, 0x07B3, 0x07E4, 0x07F5,
+                          0xF020, 0x1BA2, 0x0BB3, 0x0BE4, 0x0BF5, 0x1F66, 0x1F77, 0x1F88, 0x1F99, 0x941A, 0xF769, 0x9560, 0x9570, 0x9580,
+                          0x9590, 0x019B, 0x01AC, 0x01BD, 0x01CF, 0x9508}, nativeUdivmodsi4},
+    {"memcpy", 9, {0x01FB, 0x01DC, 0xC002, 0x9001, 0x920D, 0x5041, 0x4050, 0xF7D8, 0x9508}, nativeMemcpy},
+    {"memset", 7, {0x01DC, 0xC001, 0x936D, 0x5041, 0x4050, 0xF7E0, 0x9508}, nativeMemset},
+    {"strlen", 9, {0x01FC, 0x9001, 0x2000, 0xF7E9, 0x9580, 0x9590, 0x0F8E, 0x1F9F, 0x9508}, nativeStrlen},
+};
+#define NATIVE_ROUTINE_COUNT ((int32_t)(sizeof(nativeRoutines)/sizeof(nativeRoutines[0])))
+#ifdef PROFILE
+uint64_t nativeDispatches[NATIVE_ROUTINE_COUNT];
+uint64_t nativeInstructions[NATIVE_ROUTINE_COUNT];
+
+void reportNative()
+{
+    char buffer[256];
+    for(int32_t routine = 0; routine < NATIVE_ROUTINE_COUNT; routine++)
+    {
+        if(nativeDispatches[routine])
+        {
+            sprintf(buffer, "Native %s %llu %llu", nativeRoutines[routine].name, (unsigned long long)nativeDispatches[routine], (unsigned long long)nativeInstructions[routine]);
+            platformPrint(buffer);
+        }
+    }
+}
+#endif
+
+// Index of the routine whose code starts at address and ends before limit,
+// -1 if there is none or a breakpoint is set in it
+int32_t matchNative(int32_t address, int32_t limit)
+{
+    uint16_t first = (memory[address] << 8) | memory[address+1];
+    for(int32_t routine = 0; routine < NATIVE_ROUTINE_COUNT; routine++)
+    {
+        const nativeRoutine& candidate = nativeRoutines[routine];
+        if((first != candidate.code[0]) || (address + 2*candidate.words > limit))
+        {
+            continue;
+        }
+        int32_t word = 0;
+        for(; word < candidate.words; word++)
+        {
+            int32_t at = address + 2*word;
+            if((((memory[at] << 8) | memory[at+1]) != candidate.code[word]) || predecoded[at >> 1].breakpoint)
+            {
+                break;
+            }
+        }
+        if(word == candidate.words)
+        {
+            return routine;
+        }
+    }
+    return -1;
+}
+
+int32_t runNative(int32_t budget)
+{
+    int32_t routine = predecoded[PC >> 1].pattern - FUSED_NATIVE;
+    if(interruptInhibit)
+    {
+        return 0;
+    }
+    nativeCall call;
+    memcpy(call.r, memory, sizeof(call.r));
+    call.sreg = SREG;
+    call.executed = 0;
+    if(!nativeRoutines[routine].run(call, budget) || (call.executed > budget))
+    {
+        return 0;
+    }
+    memcpy(memory, call.r, sizeof(call.r));
+    SREG = call.sreg;
+    PC = popReturnAddress();
+    coverEdge(PC);
+#ifndef EMSCRIPTEN
+    totalFetches += call.executed;
+#endif
+    cycleCount += call.executed;
+#ifdef PROFILE
+    nativeDispatches[routine]++;
+    nativeInstructions[routine] += call.executed;
+#endif
+    return call.executed;
+}
+
+#define IS_LDI(address) ((memory[address] & 0xF0) == 0xE0)
+#define IS_PUSH(address) (((memory[address] & 0xFE) == 0x92) && ((memory[address+1] & 0xF) == 0xF))
+#define IS_POP(address) (((memory[address] & 0xFE) == 0x90) && ((memory[address+1] & 0xF) == 0xF))
+#define IS_SUBI(address) ((memory[address] & 0xF0) == 0x50)
+#define IS_SBCI(address) ((memory[address] & 0xF0) == 0x40)
+#define IS_CP(address) ((memory[address] & 0xFC) == 0x14)
+#define IS_CPI(address) ((memory[address] & 0xF0) == 0x30)
+#define IS_CPC(address) ((memory[address] & 0xFC) == 0x04)
+#define IS_BRNE(address) (((memory[address] & 0xFC) == 0xF4) && ((memory[address+1] & 0x7) == 0x1))
+#define IS_SBIW(address) (memory[address] == 0x97)
+
+int32_t countRun(int32_t address, int32_t end, bool (*matches)(int32_t))
+{
+    int32_t length = 0;
+    while((address < end) && (length < FUSED_RUN_LIMIT) && matches(address))
+    {
+        address += 2;
+        length++;
+    }
+    return length;
+}
+
+bool matchesLdi(int32_t address) { return IS_LDI(address); }
+bool matchesPush(int32_t address) { return IS_PUSH(address); }
+bool matchesPop(int32_t address) { return IS_POP(address); }
+bool matchesSbci(int32_t address) { return IS_SBCI(address); }
+bool matchesCpc(int32_t address) { return IS_CPC(address); }
+
+// Rebuilds the entries for [start, end). Sequences may extend past end up
+// to the end of the loaded image.
+void predecodeProgram(int32_t start, int32_t end)
+{
+    start = start < programStart ? programStart: (start & ~1);
+    end = end > MEMORY_SIZE - 2 ? MEMORY_SIZE - 2: end;
+    int32_t limit = programEnd > end ? (programEnd > MEMORY_SIZE - 2 ? MEMORY_SIZE - 2: programEnd): end;
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+    if(tiering)
+    {
+        start = dropCompiled(start, end);
+    }
+#endif
+    for(int32_t address = start; address < end; address += 2)
+    {
+        predecodedWord& word = predecoded[address >> 1];
+        word.pattern = FUSED_NONE;
+        word.length = 0;
+        int32_t length = 0;
+        int32_t routine = -1;
+        if((length = countRun(address, limit, matchesLdi)) > 1)
+        {
+            word.pattern = FUSED_LDI_RUN;
+        }
+        else if((length = countRun(address, limit, matchesPush)) > 1)
+        {
+            word.pattern = FUSED_PUSH_RUN;
+        }
+        else if((length = countRun(address, limit, matchesPop)) > 1)
+        {
+            word.pattern = FUSED_POP_RUN;
+        }
+        else if(IS_SUBI(address) && (length = countRun(address+2, limit, matchesSbci)) > 0)
+        {
+            word.pattern = FUSED_SUBI_SBCI;
+            length += 1;
+        }
+        else if((IS_CP(address) || IS_CPI(address)))
+        {
+            length = countRun(address+2, limit, matchesCpc);
+            if((address + 2*(length+1) < limit) && IS_BRNE(address + 2*(length+1)))
+            {
+                word.pattern = FUSED_COMPARE_BRNE;
+                length += 2;
+            }
+        }
+        else if(IS_SBIW(address) && (address + 2 < limit) && ((((memory[address+1] & 0xC0) >> 0x2) | (memory[address+1] & 0xF)) != 0) &&
+                (memory[address+2] == 0xF7) && (memory[address+3] == 0xF1)) //brne .-4
+        {
+            word.pattern = FUSED_SBIW_BRNE;
+            length = 2;
+        }
+        for(int32_t covered = 0; (word.pattern != FUSED_NONE) && (covered < length); covered++)
+        {
+            if(predecoded[(address >> 1) + covered].breakpoint)
+            {
+                word.pattern = FUSED_NONE;
+            }
+        }
+        if(!fusionEnabled)
+        {
+            word.pattern = FUSED_NONE;
+        }
+        else if(nativeEnabled && ((routine = matchNative(address, limit)) >= 0))
+        {
+            word.pattern = FUSED_NATIVE + routine;
+            length = nativeRoutines[routine].words;
+        }
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+        else if(tiering && compiledBlocks[address >> 1])
+        {
+            word.pattern = FUSED_COMPILED;
+            length = compiledBlocks[address >> 1]->length;
+        }
+        else if(tiering && (word.code & WORD_BLOCK_START) && (wordTier[address >> 1] <= TIER_QUEUED))
+        {
+            word.pattern = FUSED_PROFILE;
+            length = 0;
+        }
+        else if(tiering && (wordTier[address >> 1] == TIER_INTERPRETED))
+        {
+            word.pattern = FUSED_NONE;
+        }
+#endif
+#ifdef LIBRARY
+        else if(recompiledBlocks && recompiledBlocks[address >> 1] && recompiledValid(*recompiledBlocks[address >> 1]))
+        {
+            word.pattern = FUSED_RECOMPILED;
+            length = recompiledBlocks[address >> 1]->instructions;
+        }
+#endif
+        if(word.pattern != FUSED_NONE)
+        {
+            word.length = length;
+        }
+        if(word.breakpoint)
+        {
+            word.pattern = FUSED_BREAKPOINT;
+        }
+    }
+}
+
+//Engine Checks
+// Short programs the enginecheck build runs from reset, each covering a
+// case where fused dispatch once differed from stepping through fetch().
+// A check passes when the program reaches break with r25:r24 as expected.
+#define CHECK_INSTRUCTION_LIMIT 1000
+
+void loadCheck(int32_t word, const uint16_t* code, int32_t words)
+{
+    for(int32_t i = 0; i < words; i++)
+    {
+        memory[programStart + 2*(word + i)] = code[i] >> 8;
+        memory[programStart + 2*(word + i) + 1] = code[i] & 0xFF;
+    }
+    programEnd = (programStart + 2*(word + words) > programEnd) ? programStart + 2*(word + words): programEnd;
+    programAnalyzed = false;
+}
+
+// Runs the loaded program with vector pending and enabled when it is not -1
+bool runCheck(const char* name, int32_t vector, int32_t expected)
+{
+    memset(memory, 0, ENTRY_ADDRESS);
+    engineInit();
+    if(vector >= 0)
+    {
+        writeMemory(interruptVectors[vector].enableAddress, interruptVectors[vector].enableMask);
+        raiseInterrupt(vector);
+    }
+    bool stopped = !fetchN(CHECK_INSTRUCTION_LIMIT);
+    bool passed = stopped && (readPair(24) == expected);
+    if(!passed)
+    {
+        printf("%s: %s with r25:r24 0x%X, expected 0x%X\n", name, stopped ? "stopped": "still running", readPair(24), expected);
+    }
+    memset(memory + programStart, 0, programEnd - programStart);
+    programEnd = programStart;
+    return passed;
+}
+
+bool verifyEngines()
+{
+    bool passed = true;
+
+    //A pending interrupt enters after the first push of a fused run following sei
+    const uint16_t pushRun[] =
+    {
+        0x9478, //sei
+        0x921F, 0x921F, 0x921F, 0x921F, 0x921F, 0x921F, 0x921F, 0x921F, //push r1
+        0x9598, //break
+    };
+    const uint16_t readStack[] =
+    {
+        0xB78D, //in r24, SPL
+        0x9598, //break
+    };
+    loadCheck(0, pushRun, sizeof(pushRun)/sizeof(pushRun[0]));
+    loadCheck(TIMER0_OVF_VECTOR*INTERRUPT_VECTOR_SIZE/2, readStack, sizeof(readStack)/sizeof(readStack[0]));
+    //One push and a return address below the initial stack pointer
+    passed &= runCheck("interrupt after sei", TIMER0_OVF_VECTOR, (programStart - 1 - 1 - RETURN_ADDRESS_SIZE) & 0xFF);
+
+    //sbis and sbic test I/O bits through readMemory(), here TOV0 of a pending overflow
+    const uint16_t bitTests[] =
+    {
+        0x9BA8, //sbis TIFR0, 0
+        0xC003, //rjmp +3
+        0xE081, //ldi r24, 1
+        0x99A8, //sbic TIFR0, 0
+        0xE091, //ldi r25, 1
+        0x9598, //break
+    };
+    loadCheck(0, bitTests, sizeof(bitTests)/sizeof(bitTests[0]));
+    passed &= runCheck("I/O bit tests", TIMER0_OVF_VECTOR, 0x0101);
+
+#ifdef ATMEGA2560
+    //elpm reads flash above 64 KiB through RAMPZ, and Z+ carries into it
+    const uint16_t farRead[] =
+    {
+        0xE001, //ldi r16, 1
+        0xBF0B, //out RAMPZ, r16
+        0xEFEF, //ldi r30, 0xFF
+        0xEFFF, //ldi r31, 0xFF
+        0x9187, //elpm r24, Z+
+        0x9196, //elpm r25, Z
+        0x9598, //break
+    };
+    loadCheck(0, farRead, sizeof(farRead)/sizeof(farRead[0]));
+    memory[programStart + (0x1FFFF ^ 1)] = 0x34;
+    memory[programStart + (0x20000 ^ 1)] = 0x12;
+    passed &= runCheck("elpm above 64 KiB", -1, 0x1234);
+#endif
+
+#ifdef LIBRARY
+    passed &= verifyLanes();
+#endif
+    return passed;
+}
+
+// Runs the fused sequence at PC as one dispatch with the same architectural
+// effects as stepping it through fetch(). Returns the number of instructions
+// retired, or 0 when the sequence does not fit the budget and the caller
+// must fall back to single stepping.
+int32_t fetchFused(int32_t budget)
+{
+    //Still ready here means sei or reti held the interrupt back for one
+    //instruction, so that instruction runs alone and the interrupt enters after it
+    if(interruptReady)
+    {
+        return 0;
+    }
+    const predecodedWord& word = predecoded[PC >> 1];
+    if((word.pattern >= FUSED_NATIVE) && (word.pattern < FUSED_NATIVE + NATIVE_ROUTINE_COUNT))
+    {
+        return runNative(budget);
+    }
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+    if(word.pattern == FUSED_PROFILE)
+    {
+        profileBlock();
+        return 0;
+    }
+    if(word.pattern == FUSED_COMPILED)
+    {
+        return runCompiled(budget);
+    }
+#endif
+#ifdef LIBRARY
+    if(word.pattern == FUSED_RECOMPILED)
+    {
+        return runRecompiled(budget);
+    }
+#endif
+    if(word.length > budget)
+    {
+        return 0;
+    }
+    int32_t executed = word.length;
+    int32_t address = PC;
+    switch(word.pattern)
+    {
+        case FUSED_LDI_RUN:
+            for(int32_t i = 0; i < word.length; i++, address += 2)
+            {
+                memory[16 + ((memory[address+1] & 0xF0) >> 4)] = ((memory[address] & 0xF) << 4) | (memory[address+1] & 0xF);
+            }
+            PC = address;
+            break;
+        case FUSED_PUSH_RUN:
+            for(int32_t i = 0; i < word.length; i++, address += 2)
+            {
+                memory[stackPointer--] = memory[((memory[address] & 0x1) << 4) | ((memory[address+1] & 0xF0) >> 4)];
+            }
+            PC = address;
+            break;
+        case FUSED_POP_RUN:
+            for(int32_t i = 0; i < word.length; i++, address += 2)
+            {
+                memory[((memory[address] & 0x1) << 4) | (memory[address+1] >> 4)] = memory[++stackPointer];
+            }
+            PC = address;
+            break;
+        case FUSED_SUBI_SBCI:
+        {
+            //Only C and Z carry between the steps, the last sbci owns H, V, N and S
+            int32_t reg = 16 + ((memory[address+1] & 0xF0) >> 4);
+            int32_t constant = ((memory[address] & 0xF) << 4) | (memory[address+1] & 0xF);
+            uint8_t flags = subFlags[0][memory[reg]][constant];
+            memory[reg] -= constant;
+            for(int32_t i = 1; i < word.length; i++)
+            {
+                address += 2;
+                reg = 16 + ((memory[address+1] & 0xF0) >> 4);
+                constant = ((memory[address] & 0xF) << 4) | (memory[address+1] & 0xF);
+                int32_t carry = flags & SREG_C;
+                flags = subFlags[carry][memory[reg]][constant] & (flags | ~SREG_Z);
+                memory[reg] -= constant + carry;
+            }
+            setFlags(flags, ARITHMETIC_FLAGS);
+            PC = address + 2;
+            break;
+        }
+        case FUSED_COMPARE_BRNE:
+        {
+            uint8_t flags = subFlags[0][memory[((memory[address] & 0x1) << 4) | (memory[address+1] >> 4)]][memory[(((memory[address] & 0x2) >> 1) << 4) | (memory[address+1] & 0xF)]];
+            if(IS_CPI(address))
+            {
+                flags = subFlags[0][memory[16 + (memory[address+1] >> 4)]][((memory[address] & 0xF) << 4) | (memory[address+1] & 0xF)];
+            }
+            for(int32_t i = 1; i < word.length - 1; i++)
+            {
+                address += 2;
+                flags = subFlags[flags & SREG_C][memory[((memory[address] & 0x1) << 4) | (memory[address+1] >> 4)]][memory[(((memory[address] & 0x2) >> 1) << 4) | (memory[address+1] & 0xF)]] & (flags | ~SREG_Z);
+            }
+            setFlags(flags, ARITHMETIC_FLAGS);
+            address += 2; //brne
+            if(!(flags & SREG_Z))
+            {
+                result = ((memory[address] & 0x3) << 5) | (memory[address+1] >> 3);
+                address = (0x40 <= result) ? (address - (2*(0x80 - result))) : (address + (2*result));
+            }
+            PC = address + 2;
+            coverEdge(PC);
+            break;
+        }
+        case FUSED_SBIW_BRNE:
+        {
+            //Delay loop: iterate the whole count down, or as much of it as the budget allows
+            int32_t pair = 24 + ((memory[address+1] & 0x30) >> 3);
+            int32_t constant = ((memory[address+1] & 0xC0) >> 0x2) | (memory[address+1] & 0xF);
+            uint16_t value = readPair(pair);
+            if(value == 0 || (value % constant) != 0)
+            {
+                return 0;
+            }
+            int32_t iterations = value / constant;
+            if(iterations > budget/2)
+            {
+                iterations = budget/2;
+            }
+            value -= (iterations - 1)*constant;
+            uint16_t difference = value - constant;
+            //V = Rdh7 & !R15, C = R15 & !Rdh7
+            bool overflow = (value & ~difference & 0x8000) != 0;
+            setFlags((overflow ? SREG_V: 0) | ((difference & ~value & 0x8000) ? SREG_C: 0) | (difference == 0x0000 ? SREG_Z: 0) |
+                     ((difference & 0x8000) ? SREG_N: 0) | ((((difference & 0x8000) != 0) != overflow) ? SREG_S: 0), SREG_V|SREG_C|SREG_Z|SREG_N|SREG_S);
+            value = difference;
+            writePair(pair, value);
+            PC = (value == 0) ? address + 4: address;
+            coverEdge(PC);
+            executed = 2*iterations;
+            break;
+        }
+        default:
+            return 0;
+    }
+#ifndef EMSCRIPTEN
+    totalFetches += executed;
+#endif
+    cycleCount += executed;
+#ifdef PROFILE
+    fusedDispatches[word.pattern]++;
+    fusedInstructions[word.pattern] += executed;
+#endif
+    return executed;
+}
+
+//Program Analysis
+// Recursive descent over the loaded image from the reset and interrupt
+// vectors. Runs once per image, from engineInit, and leaves its results in
+// the WORD_* flags of the predecoded table so that later passes know the
+// instruction boundaries without decoding the image again. Flash written
+// at run time is not re-analyzed.
+#define FLOW_NEXT 0
+#define FLOW_BRANCH 1 // target or next
+#define FLOW_SKIP 2 // next or the instruction after it
+#define FLOW_JUMP 3
+#define FLOW_CALL 4
+#define FLOW_RETURN 5
+#define FLOW_INDIRECT_JUMP 6
+#define FLOW_INDIRECT_CALL 7
+#define FLOW_STOP 8 // break and the rjmp .-2 program exit
+#define JUMP_TABLE_LIMIT 256
+#define TABLE_SEARCH_WORDS 8
+struct decodedInstruction
+{
+    int32_t length; // bytes
+    int32_t flow;
+    int32_t target; // memory address of a direct branch, jump or call
+    bool supported; // false where fetch() stops with STOP_ILLEGAL_OPCODE
+    const char* mnemonic;
+    const char* operands; // format taking a and b
+    int32_t a;
+    int32_t b;
+};
+const char* registerOpcodeNames[16] = {"", "cpc", "sbc", "add", "cpse", "cp", "sub", "adc", "and", "eor", "or", "mov", "", "", "", ""};
+const char* immediateOpcodeNames[16] = {"", "", "", "cpi", "sbci", "subi", "ori", "andi", "", "", "", "", "", "", "ldi", ""};
+const char* branchSetNames[8] = {"brcs", "breq", "brmi", "brvs", "brlt", "brhs", "brts", "brie"};
+const char* branchClearNames[8] = {"brcc", "brne", "brpl", "brvc", "brge", "brhc", "brtc", "brid"};
+const char* flagSetNames[8] = {"sec", "sez", "sen", "sev", "ses", "seh", "set", "sei"};
+const char* flagClearNames[8] = {"clc", "clz", "cln", "clv", "cls", "clh", "clt", "cli"};
+const char* singleOpcodeNames[16] = {"com", "neg", "swap", "inc", NULL, "asr", "lsr", "ror", NULL, NULL, "dec", NULL, "jmp", "jmp", "call", "call"};
+const char* loadNames[16] = {"lds", "ld", "ld", NULL, "lpm", "lpm", "elpm", "elpm", NULL, "ld", "ld", NULL, "ld", "ld", "ld", "pop"};
+const char* loadOperands[16] = {"r%d, 0x%04X", "r%d, Z+", "r%d, -Z", NULL, "r%d, Z", "r%d, Z+", "r%d, Z", "r%d, Z+", NULL, "r%d, Y+", "r%d, -Y", NULL, "r%d, X", "r%d, X+", "r%d, -X", "r%d"};
+const char* storeNames[16] = {"sts", "st", "st", NULL, "xch", "las", "lac", "lat", NULL, "st", "st", NULL, "st", "st", "st", "push"};
+const char* storeOperands[16] = {"0x%04X, r%d", "Z+, r%d", "-Z, r%d", NULL, "Z, r%d", "Z, r%d", "Z, r%d", "Z, r%d", NULL, "Y+, r%d", "-Y, r%d", NULL, "X, r%d", "X+, r%d", "-X, r%d", "r%d"};
+// Load and store forms fetch() implements, by low nibble
+#define SUPPORTED_LOADS 0xB6B7
+#define SUPPORTED_STORES 0xF607
+#define SUPPORTED_BRANCH_BITS 0x57
+
+inline uint16_t readWord(int32_t address)
+{
+    return (address + 1 < MEMORY_SIZE) ? (memory[address] << 8) | memory[address+1]: 0;
+}
+
+inline int32_t immediateOperand(int32_t address)
+{
+    return ((memory[address] & 0xF) << 4) | (memory[address+1] & 0xF);
+}
+
+void describe(decodedInstruction& instruction, const char* mnemonic, const char* operands, int32_t a, int32_t b)
+{
+    instruction.mnemonic = mnemonic;
+    instruction.operands = operands;
+    instruction.a = a;
+    instruction.b = b;
+}
+
+// Decodes the instruction at address the way fetch() would execute it.
+void decodeInstruction(int32_t address, decodedInstruction& instruction)
+{
+    uint16_t opcode = readWord(address);
+    int32_t d = (opcode >> 4) & 0x1F;
+    int32_t r = (opcode & 0xF) | ((opcode >> 5) & 0x10);
+    int32_t upper = 16 + ((opcode >> 4) & 0xF);
+    int32_t immediate = ((opcode >> 4) & 0xF0) | (opcode & 0xF);
+    int32_t offset = 0;
+    instruction.length = 2;
+    instruction.flow = FLOW_NEXT;
+    instruction.target = 0;
+    instruction.supported = true;
+    describe(instruction, ".word", "0x%04X", opcode, 0);
+    switch(opcode >> 12)
+    {
+        case 0x0:
+        case 0x1:
+        case 0x2:
+            if(opcode == 0x0000)
+            {
+                describe(instruction, "nop", "", 0, 0);
+            }
+            else if((opcode & 0xFF00) == 0x0000)
+            {
+                instruction.supported = false;
+            }
+            else if((opcode & 0xFF00) == 0x0100)
+            {
+                describe(instruction, "movw", "r%d, r%d", 2*((opcode >> 4) & 0xF), 2*(opcode & 0xF));
+            }
+            else if((opcode & 0xFF00) == 0x0200)
+            {
+                describe(instruction, "muls", "r%d, r%d", upper, 16 + (opcode & 0xF));
+            }
+            else if((opcode & 0xFF00) == 0x0300)
+            {
+                const char* names[4] = {"mulsu", "fmul", "fmuls", "fmulsu"};
+                describe(instruction, names[((opcode >> 6) & 0x2) | ((opcode >> 3) & 0x1)], "r%d, r%d", 16 + ((opcode >> 4) & 0x7), 16 + (opcode & 0x7));
+            }
+            else if((d == r) && ((opcode & 0xFC00) == 0x0C00))
+            {
+                describe(instruction, "lsl", "r%d", d, 0);
+            }
+            else if((d == r) && ((opcode & 0xFC00) == 0x1C00))
+            {
+                describe(instruction, "rol", "r%d", d, 0);
+            }
+            else if((d == r) && ((opcode & 0xFC00) == 0x2000))
+            {
+                describe(instruction, "tst", "r%d", d, 0);
+            }
+            else if((d == r) && ((opcode & 0xFC00) == 0x2400))
+            {
+                describe(instruction, "clr", "r%d", d, 0);
+            }
+            else
+            {
+                describe(instruction, registerOpcodeNames[(opcode >> 10) & 0xF], "r%d, r%d", d, r);
+                instruction.flow = ((opcode & 0xFC00) == 0x1000) ? FLOW_SKIP: FLOW_NEXT;
+            }
+            break;
+        case 0x3:
+        case 0x4:
+        case 0x5:
+        case 0x6:
+        case 0x7:
+        case 0xE:
+            describe(instruction, immediateOpcodeNames[opcode >> 12], "r%d, 0x%02X", upper, immediate);
+            break;
+        case 0x8:
+        case 0xA: //ldd, std
+            offset = ((opcode >> 8) & 0x20) | ((opcode >> 7) & 0x18) | (opcode & 0x7);
+            if(opcode & 0x0200)
+            {
+                describe(instruction, offset ? "std": "st", offset ? ((opcode & 0x8) ? "Y+%d, r%d": "Z+%d, r%d"): ((opcode & 0x8) ? "Y, r%d": "Z, r%d"), offset ? offset: d, d);
+            }
+            else
+            {
+                describe(instruction, offset ? "ldd": "ld", offset ? ((opcode & 0x8) ? "r%d, Y+%d": "r%d, Z+%d"): ((opcode & 0x8) ? "r%d, Y": "r%d, Z"), d, offset);
+            }
+            break;
+        case 0x9:
+            switch((opcode >> 8) & 0xF)
+            {
+                case 0x0:
+                case 0x1:
+                case 0x2:
+                case 0x3:
+                    if(opcode & 0x0200)
+                    {
+                        describe(instruction, storeNames[opcode & 0xF], storeOperands[opcode & 0xF], (opcode & 0xF) ? d: readWord(address+2), d);
+                        instruction.supported = (SUPPORTED_STORES >> (opcode & 0xF)) & 0x1;
+                    }
+                    else
+                    {
+                        describe(instruction, loadNames[opcode & 0xF], loadOperands[opcode & 0xF], d, readWord(address+2));
+                        instruction.supported = (SUPPORTED_LOADS >> (opcode & 0xF)) & 0x1;
+                    }
+                    if(!instruction.mnemonic)
+                    {
+                        describe(instruction, ".word", "0x%04X", opcode, 0);
+                    }
+                    instruction.length = (opcode & 0xF) ? 2: 4;
+                    break;
+                case 0x4:
+                case 0x5:
+                    if((opcode == 0x9409) || (opcode == 0x9419))
+                    {
+                        describe(instruction, (opcode == 0x9409) ? "ijmp": "eijmp", "", 0, 0);
+                        instruction.flow = FLOW_INDIRECT_JUMP;
+#ifndef ATMEGA2560
+                        instruction.supported = (opcode == 0x9409);
+#endif
+                    }
+                    else if((opcode == 0x9509) || (opcode == 0x9519))
+                    {
+                        describe(instruction, (opcode == 0x9509) ? "icall": "eicall", "", 0, 0);
+                        instruction.flow = FLOW_INDIRECT_CALL;
+#ifndef ATMEGA2560
+                        instruction.supported = (opcode == 0x9509);
+#endif
+                    }
+                    else if((opcode & 0xFF0F) == 0x9408)
+                    {
+                        describe(instruction, (opcode & 0x80) ? flagClearNames[(opcode >> 4) & 0x7]: flagSetNames[(opcode >> 4) & 0x7], "", 0, 0);
+                    }
+                    else if((opcode == 0x9508) || (opcode == 0x9518))
+                    {
+                        describe(instruction, (opcode == 0x9508) ? "ret": "reti", "", 0, 0);
+                        instruction.flow = FLOW_RETURN;
+                    }
+                    else if(opcode == 0x9598)
+                    {
+                        describe(instruction, "break", "", 0, 0);
+                        instruction.flow = FLOW_STOP;
+                    }
+                    else if((opcode == 0x9588) || (opcode == 0x95A8))
+                    {
+                        describe(instruction, (opcode == 0x9588) ? "sleep": "wdr", "", 0, 0);
+                    }
+                    else if((opcode & 0xC) == 0xC)
+                    {
+                        instruction.length = 4;
+                        instruction.target = programStart + 2*((((opcode >> 4) & 0x1F) << 17) | ((opcode & 0x1) << 16) | readWord(address+2));
+                        instruction.flow = (opcode & 0x2) ? FLOW_CALL: FLOW_JUMP;
+                        describe(instruction, singleOpcodeNames[opcode & 0xF], "0x%X", instruction.target - programStart, 0);
+                    }
+                    else if(singleOpcodeNames[opcode & 0xF])
+                    {
+                        describe(instruction, singleOpcodeNames[opcode & 0xF], "r%d", d, 0);
+                    }
+                    else
+                    {
+                        instruction.supported = false;
+                    }
+                    break;
+                case 0x6:
+                case 0x7:
+                    describe(instruction, (opcode & 0x0100) ? "sbiw": "adiw", "r%d, 0x%02X", 24 + ((opcode >> 3) & 0x6), ((opcode >> 2) & 0x30) | (opcode & 0xF));
+                    break;
+                case 0x8:
+                case 0x9:
+                case 0xA:
+                case 0xB:
+                {
+                    const char* names[4] = {"cbi", "sbic", "sbi", "sbis"};
+                    describe(instruction, names[(opcode >> 8) & 0x3], "0x%02X, %d", (opcode >> 3) & 0x1F, opcode & 0x7);
+                    instruction.flow = (opcode & 0x0100) ? FLOW_SKIP: FLOW_NEXT;
+                    break;
+                }
+                default:
+                    describe(instruction, "mul", "r%d, r%d", d, r);
+                    break;
+            }
+            break;
+        case 0xB:
+            if(opcode & 0x0800)
+            {
+                describe(instruction, "out", "0x%02X, r%d", ((opcode >> 5) & 0x30) | (opcode & 0xF), d);
+            }
+            else
+            {
+                describe(instruction, "in", "r%d, 0x%02X", d, ((opcode >> 5) & 0x30) | (opcode & 0xF));
+            }
+            break;
+        case 0xC:
+        case 0xD:
+            offset = (opcode & 0x800) ? (opcode & 0xFFF) - 0x1000: (opcode & 0xFFF);
+            instruction.target = address + 2 + 2*offset;
+            instruction.flow = (opcode & 0x1000) ? FLOW_CALL: ((opcode == 0xCFFF) ? FLOW_STOP: FLOW_JUMP);
+            describe(instruction, (opcode & 0x1000) ? "rcall": "rjmp", "0x%X", instruction.target - programStart, 0);
+            break;
+        case 0xF:
+            if(!(opcode & 0x0800))
+            {
+                offset = (opcode & 0x200) ? ((opcode >> 3) & 0x7F) - 0x80: ((opcode >> 3) & 0x7F);
+                instruction.target = address + 2 + 2*offset;
+                instruction.flow = FLOW_BRANCH;
+                instruction.supported = (SUPPORTED_BRANCH_BITS >> (opcode & 0x7)) & 0x1;
+                describe(instruction, (opcode & 0x0400) ? branchClearNames[opcode & 0x7]: branchSetNames[opcode & 0x7], "0x%X", instruction.target - programStart, 0);
+            }
+            else
+            {
+                const char* names[4] = {"bld", "bst", "sbrc", "sbrs"};
+                describe(instruction, names[(opcode >> 9) & 0x3], "r%d, %d", d, opcode & 0x7);
+                instruction.flow = (opcode & 0x0400) ? FLOW_SKIP: FLOW_NEXT;
+                instruction.supported = ((opcode & 0x0600) == 0x0200) || !(opcode & 0x8);
+            }
+            break;
+    }
+}
+
+int32_t analysisStack[FLASH_SIZE/2];
+int32_t analysisDepth = 0;
+
+void queueCode(int32_t address, uint8_t flags)
+{
+    if((address < programStart) || (address >= programEnd) || (address & 1))
+    {
+        return;
+    }
+    predecodedWord& word = predecoded[address >> 1];
+    if(!(word.code & WORD_INSTRUCTION))
+    {
+        analysisStack[analysisDepth++] = address;
+    }
+    word.code |= WORD_INSTRUCTION | flags;
+}
+
+// Word address of the table in "subi r30, lo8(-(table)); sbci r31,
+// hi8(-(table))" shortly before address, -1 if there is none. entries is
+// set from a "cpi rN, count; ... brsh" bounds check ahead of it, if any.
+int32_t findTableBase(int32_t address, int32_t& entries)
+{
+    entries = JUMP_TABLE_LIMIT;
+    for(int32_t sbci = address - 2; (sbci > address - 2*TABLE_SEARCH_WORDS) && (sbci - 2 >= programStart); sbci -= 2)
+    {
+        if(!IS_SBCI(sbci) || ((memory[sbci+1] & 0xF0) != 0xF0) || !IS_SUBI(sbci-2) || ((memory[sbci-1] & 0xF0) != 0xE0)) //r31, r30
+        {
+            continue;
+        }
+        int32_t base = (0x10000 - ((immediateOperand(sbci) << 8) | immediateOperand(sbci-2))) & 0xFFFF;
+        bool bounded = false;
+        for(int32_t check = sbci - 4; (check > sbci - 2*TABLE_SEARCH_WORDS) && (check >= programStart); check -= 2)
+        {
+            if((readWord(check) & 0xF807) == 0xF000) //brlo, brsh
+            {
+                bounded = true;
+            }
+            else if(bounded && IS_CPI(check))
+            {
+                entries = immediateOperand(check);
+                break;
+            }
+        }
+        return base;
+    }
+    return -1;
+}
+
+// Matches "lsl r30; rol r31" followed by an lpm or elpm through Z+, the
+// start of avr-gcc's __tablejump2__ helper.
+bool isTableJumpHelper(int32_t address)
+{
+    if((readWord(address) != 0x0FEE) || (readWord(address+2) != 0x1FFF))
+    {
+        return false;
+    }
+    for(int32_t next = address + 4; next < address + 12; next += 2)
+    {
+        if((readWord(next) == 0x9005) || (readWord(next) == 0x9007))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Follows the word address table read by a jump to __tablejump2__ at
+// address. The table entries are data, their targets code.
+void queueAddressTable(int32_t address)
+{
+    int32_t entries = 0;
+    int32_t base = findTableBase(address, entries);
+    if(base < 0)
+    {
+        return;
+    }
+    for(int32_t entry = programStart + 2*base; entries-- && (entry < programEnd); entry += 2)
+    {
+        //Entries are little endian word addresses, the opposite of opcode order
+        int32_t target = programStart + 2*((memory[entry] << 8) | memory[entry+1]);
+        if((target >= programEnd) || (predecoded[entry >> 1].code & WORD_INSTRUCTION))
+        {
+            break;
+        }
+        predecoded[entry >> 1].code |= WORD_JUMP_TABLE;
+        queueCode(target, WORD_BLOCK_START);
+    }
+}
+
+// Follows a table of rjmp or jmp instructions indexed by an ijmp at
+// address. Returns false when no table was found.
+bool queueJumpTable(int32_t address)
+{
+    int32_t entries = 0;
+    int32_t base = findTableBase(address, entries);
+    if(base < 0)
+    {
+        return false;
+    }
+    decodedInstruction instruction;
+    for(int32_t entry = programStart + 2*base; entries-- && (entry < programEnd); entry += instruction.length)
+    {
+        decodeInstruction(entry, instruction);
+        if((instruction.flow != FLOW_JUMP) || ((predecoded[entry >> 1].code & WORD_INSTRUCTION) && !(predecoded[entry >> 1].code & WORD_JUMP_TABLE)))
+        {
+            break;
+        }
+        queueCode(entry, WORD_BLOCK_START | WORD_JUMP_TABLE);
+    }
+    return true;
+}
+
+void analyzeProgram()
+{
+    for(int32_t word = ENTRY_ADDRESS/2; word < MEMORY_SIZE/2; word++)
+    {
+        predecoded[word].code = 0;
+    }
+    decodedInstruction instruction;
+    queueCode(programStart, WORD_BLOCK_START | WORD_VECTOR);
+    //Vector slots are code only as far as the image starts with a table of jumps
+    decodeInstruction(programStart, instruction);
+    for(uint32_t vector = 1; (instruction.flow == FLOW_JUMP) && (vector < INTERRUPT_VECTOR_COUNT); vector++)
+    {
+        decodeInstruction(programStart + vector*INTERRUPT_VECTOR_SIZE, instruction);
+        if((instruction.flow == FLOW_JUMP) || (instruction.flow == FLOW_RETURN))
+        {
+            queueCode(programStart + vector*INTERRUPT_VECTOR_SIZE, WORD_BLOCK_START | WORD_VECTOR);
+            instruction.flow = FLOW_JUMP;
+        }
+    }
+    while(analysisDepth)
+    {
+        int32_t address = analysisStack[--analysisDepth];
+        decodeInstruction(address, instruction);
+        if(!instruction.supported)
+        {
+            predecoded[address >> 1].code |= WORD_UNSUPPORTED;
+            continue;
+        }
+        if(instruction.length == 4)
+        {
+            predecoded[(address >> 1) + 1].code |= WORD_OPERAND;
+        }
+        int32_t next = address + instruction.length;
+        switch(instruction.flow)
+        {
+            case FLOW_NEXT:
+                queueCode(next, 0);
+                break;
+            case FLOW_BRANCH:
+                queueCode(instruction.target, WORD_BLOCK_START);
+                queueCode(next, WORD_BLOCK_START);
+                break;
+            case FLOW_SKIP:
+                queueCode(next, WORD_BLOCK_START);
+                if(next < programEnd)
+                {
+                    queueCode(next + (longOpcode(next) ? 4: 2), WORD_BLOCK_START);
+                }
+                break;
+            case FLOW_JUMP:
+                queueCode(instruction.target, WORD_BLOCK_START);
+                if(isTableJumpHelper(instruction.target))
+                {
+                    queueAddressTable(address);
+                }
+                break;
+            case FLOW_CALL:
+                queueCode(instruction.target, WORD_BLOCK_START | WORD_CALL_TARGET);
+                queueCode(next, WORD_BLOCK_START);
+                break;
+            case FLOW_INDIRECT_JUMP:
+                if(!queueJumpTable(address))
+                {
+                    predecoded[address >> 1].code |= WORD_INDIRECT;
+                }
+                break;
+            case FLOW_INDIRECT_CALL:
+                predecoded[address >> 1].code |= WORD_INDIRECT;
+                queueCode(next, WORD_BLOCK_START);
+                break;
+        }
+    }
+    programAnalyzed = true;
+}
+
+// Formats the instruction at address, objdump style, and returns its length.
+int32_t disassemble(int32_t address, char* text, size_t size)
+{
+    decodedInstruction instruction;
+    decodeInstruction(address, instruction);
+    char operands[32];
+    snprintf(operands, sizeof(operands), instruction.operands, instruction.a, instruction.b);
+    snprintf(text, size, operands[0] ? "%-7s %s": "%s", instruction.mnemonic, operands);
+    return instruction.length;
+}
+
+#ifndef LIBRARY
+// Warns about reachable opcodes that would stop the run, before it starts
+void reportUnsupported()
+{
+    char buffer[64];
+    for(int32_t address = programStart; address < programEnd; address += 2)
+    {
+        if(predecoded[address >> 1].code & WORD_UNSUPPORTED)
+        {
+            sprintf(buffer, "Unsupported opcode 0x%04X at 0x%X", readWord(address), address - programStart);
+            platformPrint(buffer);
+        }
+    }
+}
+
+// "-list image.hex" prints the analyzed image instead of running it. Words
+// the analysis did not reach are shown as data.
+void printListing()
+{
+    char buffer[256];
+    char text[64];
+    int32_t instructions = 0, blocks = 0, calls = 0, tables = 0, unsupported = 0, indirect = 0;
+    for(int32_t address = programStart; address < programEnd;)
+    {
+        uint8_t code = predecoded[address >> 1].code;
+        if(code & WORD_INSTRUCTION)
+        {
+            if(code & WORD_BLOCK_START)
+            {
+                sprintf(buffer, "\n%05X <%s%s%s%s>:", address - programStart, (code & WORD_VECTOR) ? "vector": "block",
+                        (code & WORD_CALL_TARGET) ? ", call target": "", (code & WORD_JUMP_TABLE) ? ", jump table": "", (code & WORD_UNSUPPORTED) ? ", unsupported": "");
+                platformPrint(buffer);
+            }
+            int32_t length = disassemble(address, text, sizeof(text));
+            int32_t written = sprintf(buffer, "%5X:\t%02X %02X ", address - programStart, memory[address+1], memory[address]);
+            written += sprintf(buffer + written, (length == 4) ? "%02X %02X\t": "     \t", memory[address+3], memory[address+2]);
+            sprintf(buffer + written, "%s%s%s", text, (code & WORD_UNSUPPORTED) ? "\t; unsupported": "", (code & WORD_INDIRECT) ? "\t; unresolved": "");
+            platformPrint(buffer);
+            instructions++;
+            blocks += (code & WORD_BLOCK_START) != 0;
+            calls += (code & WORD_CALL_TARGET) != 0;
+            tables += (code & WORD_JUMP_TABLE) != 0;
+            unsupported += (code & WORD_UNSUPPORTED) != 0;
+            indirect += (code & WORD_INDIRECT) != 0;
+            address += length;
+        }
+        else if(code & WORD_JUMP_TABLE)
+        {
+            sprintf(buffer, "%5X:\t%02X %02X      \t.word   0x%X\t; jump table", address - programStart, memory[address+1], memory[address],
+                    2*((memory[address] << 8) | memory[address+1]));
+            platformPrint(buffer);
+            tables++;
+            address += 2;
+        }
+        else
+        {
+            int32_t written = sprintf(buffer, "%5X:\t", address - programStart);
+            for(int32_t word = 0; (word < 8) && (address < programEnd) && !(predecoded[address >> 1].code & (WORD_INSTRUCTION | WORD_JUMP_TABLE)); word++, address += 2)
+            {
+                written += sprintf(buffer + written, "%02X %02X ", memory[address+1], memory[address]);
+            }
+            platformPrint(buffer);
+        }
+    }
+    sprintf(buffer, "\n%d instructions, %d blocks, %d call targets, %d jump table entries, %d unresolved, %d unsupported",
+            instructions, blocks, calls, tables, indirect, unsupported);
+    platformPrint(buffer);
+}
+#endif
+
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+//Tiered Execution
+// Single producer, single consumer rings between the core and the compiler
+// thread. Requests carry an empty block, completions the same block back.
+#define TIER_QUEUE_SIZE 256 // power of two
+#define COMPILED_MIN_LENGTH 2
+struct tierQueue
+{
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    compiledBlock* blocks[TIER_QUEUE_SIZE];
+};
+tierQueue tierRequests;
+tierQueue tierCompleted;
+std::atomic<bool> tierClosing(false);
+std::thread* tierCompiler = NULL;
+
+bool tierPush(tierQueue& queue, compiledBlock* block)
+{
+    uint32_t tail = queue.tail.load(std::memory_order_relaxed);
+    if(tail - queue.head.load(std::memory_order_acquire) == TIER_QUEUE_SIZE)
+    {
+        return false;
+    }
+    queue.blocks[tail & (TIER_QUEUE_SIZE - 1)] = block;
+    queue.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+compiledBlock* tierPop(tierQueue& queue)
+{
+    uint32_t head = queue.head.load(std::memory_order_relaxed);
+    if(head == queue.tail.load(std::memory_order_acquire))
+    {
+        return NULL;
+    }
+    compiledBlock* block = queue.blocks[head & (TIER_QUEUE_SIZE - 1)];
+    queue.head.store(head + 1, std::memory_order_release);
+    return block;
+}
+
+// Translates one instruction with the operands fetch() would use. Only
+// register to register work, relative branches and rjmp are compiled, so
+// a block never touches I/O, the stack or the interrupt state.
+bool compileInstruction(uint16_t instruction, int32_t address, compiledOp& op)
+{
+    uint8_t high = instruction >> 8;
+    uint8_t low = instruction & 0xFF;
+    op.d = ((high & 0x1) << 4) | (low >> 4);
+    op.r = ((high & 0x2) << 3) | (low & 0xF);
+    op.k = ((high & 0xF) << 4) | (low & 0xF);
+    op.code = COMPILED_NOP;
+    op.target = 0;
+    switch(high & 0xFC)
+    {
+        case 0x04: op.code = COMPILED_CPC; return true;
+        case 0x08: op.code = COMPILED_SBC; return true;
+        case 0x0C: op.code = COMPILED_ADD; return true;
+        case 0x14: op.code = COMPILED_CP; return true;
+        case 0x18: op.code = COMPILED_SUB; return true;
+        case 0x1C: op.code = COMPILED_ADC; return true;
+        case 0x20: op.code = COMPILED_AND; return true;
+        case 0x24: op.code = COMPILED_EOR; return true;
+        case 0x28: op.code = COMPILED_OR; return true;
+        case 0x2C: op.code = COMPILED_MOV; return true;
+        case 0x9C: op.code = COMPILED_MUL; return true;
+    }
+    switch(high >> 4)
+    {
+        case 0x3: op.code = COMPILED_CP | COMPILED_IMMEDIATE; break; //cpi
+        case 0x4: op.code = COMPILED_SBC | COMPILED_IMMEDIATE; break; //sbci
+        case 0x5: op.code = COMPILED_SUB | COMPILED_IMMEDIATE; break; //subi
+        case 0x6: op.code = COMPILED_OR | COMPILED_IMMEDIATE; break; //ori
+        case 0x7: op.code = COMPILED_AND | COMPILED_IMMEDIATE; break; //andi
+        case 0xE: op.code = COMPILED_MOV | COMPILED_IMMEDIATE; break; //ldi
+        case 0xC: //rjmp
+            if(instruction == 0xCFFF)
+            {
+                return false;
+            }
+            op.code = COMPILED_RJMP;
+            op.target = (instruction & 0x800) ? address + 2 - (0x1000 - 2*(instruction & 0x7FF)): address + 2 + 2*(instruction & 0x7FF);
+            return true;
+        case 0xF:
+            if((high >= 0xF8) || !((SUPPORTED_BRANCH_BITS >> (low & 0x7)) & 0x1))
+            {
+                return false;
+            }
+            op.code = COMPILED_BRANCH;
+            op.k = 1 << (low & 0x7);
+            op.r = (high < 0xF4); // taken when the flag is set
+            op.target = (((instruction >> 3) & 0x7F) >= 0x40) ? address + 2 - 2*(0x80 - ((instruction >> 3) & 0x7F)): address + 2 + 2*((instruction >> 3) & 0x7F);
+            return true;
+        default:
+            break;
+    }
+    if(op.code & COMPILED_IMMEDIATE)
+    {
+        op.d = 16 + (low >> 4);
+        return true;
+    }
+    if(instruction == 0x0000)
+    {
+        op.code = COMPILED_NOP;
+        return true;
+    }
+    if(high == 0x01)
+    {
+        op.code = COMPILED_MOVW;
+        op.d = (low >> 4)*2;
+        op.r = (low & 0xF)*2;
+        return true;
+    }
+    if((high == 0x96) || (high == 0x97))
+    {
+        op.code = (high == 0x96) ? COMPILED_ADIW: COMPILED_SBIW;
+        op.d = 24 + ((low & 0x30) >> 3);
+        op.k = ((low & 0xC0) >> 0x2) | (low & 0xF);
+        return true;
+    }
+    if((high == 0x94) || (high == 0x95))
+    {
+        static const uint8_t singleOps[16] = {COMPILED_COM, COMPILED_NEG, COMPILED_SWAP, COMPILED_INC, 0xFF, COMPILED_ASR, COMPILED_LSR, COMPILED_ROR,
+                                       0xFF, 0xFF, COMPILED_DEC, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+        op.code = singleOps[low & 0xF];
+        return op.code != 0xFF;
+    }
+    return false;
+}
+
+// Runs on the compiler thread. Conditional branches become side exits, the
+// block ends after an rjmp or before the first instruction it cannot
+// compile.
+void compileBlock(compiledBlock& block)
+{
+    int32_t address = block.start;
+    block.host = NULL;
+    for(block.length = 0; (block.length < COMPILED_BLOCK_LIMIT) && (address + 1 < MEMORY_SIZE); address += 2)
+    {
+        uint16_t instruction = (memory[address] << 8) | memory[address+1];
+        compiledOp& op = block.ops[block.length];
+        if(!compileInstruction(instruction, address, op))
+        {
+            break;
+        }
+        block.source[block.length++] = instruction;
+        if(op.code == COMPILED_RJMP)
+        {
+            break;
+        }
+    }
+    //FUSED_SBIW_BRNE already runs a whole delay loop in one dispatch
+    if((block.length >= 2) && (block.ops[0].code == COMPILED_SBIW) && (block.ops[1].target == block.start))
+    {
+        block.length = 0;
+    }
+}
+
+// Takes every request waiting at once, so that one host compiler run
+// covers the whole batch.
+void tierCompilerLoop()
+{
+    compiledBlock* batch[TIER_QUEUE_SIZE];
+    while(!tierClosing)
+    {
+        int32_t count = 0;
+        while((count < TIER_QUEUE_SIZE) && (batch[count] = tierPop(tierRequests)))
+        {
+            compileBlock(*batch[count++]);
+        }
+        if(!count)
+        {
+            std::this_thread::sleep_for(microseconds(100));
+            continue;
+        }
+        compileHost(batch, count);
+        for(int32_t i = 0; i < count; i++)
+        {
+            while(!tierPush(tierCompleted, batch[i]))
+            {
+                if(tierClosing)
+                {
+                    for(; i < count; i++)
+                    {
+                        free(batch[i]);
+                    }
+                    return;
+                }
+                std::this_thread::sleep_for(microseconds(100));
+            }
+        }
+    }
+}
+
+// Number of leading instructions of block that still match flash and
+// cover no breakpoint.
+int32_t validCompiled(const compiledBlock& block)
+{
+    int32_t length = 0;
+    for(int32_t address = block.start; length < block.length; length++, address += 2)
+    {
+        if((block.source[length] != ((memory[address] << 8) | memory[address+1])) || predecoded[address >> 1].breakpoint)
+        {
+            break;
+        }
+    }
+    return length;
+}
+
+void demoteBlock(int32_t start)
+{
+    free(compiledBlocks[start >> 1]);
+    compiledBlocks[start >> 1] = NULL;
+    wordTier[start >> 1] = TIER_PREDECODED;
+    blockHeat[start >> 1] = 0;
+    droppedBlocks++;
+}
+
+// Called by predecodeProgram() before it rebuilds [start, end). Compiled
+// blocks overlapping the range are dropped when the flash under them
+// changed or a breakpoint landed on them. Returns the start of the range
+// to rebuild, which includes the first word of any dropped block.
+int32_t dropCompiled(int32_t start, int32_t end)
+{
+    int32_t first = start;
+    for(int32_t address = (start - 2*COMPILED_BLOCK_LIMIT > programStart) ? start - 2*COMPILED_BLOCK_LIMIT: programStart; address < end; address += 2)
+    {
+        const compiledBlock* block = compiledBlocks[address >> 1];
+        if(block && (address + 2*block->length > start) && (validCompiled(*block) < block->length))
+        {
+            demoteBlock(address);
+            first = (address < first) ? address: first;
+        }
+    }
+    return first;
+}
+
+void installCompiled(compiledBlock* block)
+{
+    int32_t start = block->start;
+    int32_t index = start >> 1;
+    int32_t length = validCompiled(*block);
+    if(block->length < COMPILED_MIN_LENGTH)
+    {
+        wordTier[index] = TIER_UNCOMPILABLE;
+        tierPromotions[TIER_UNCOMPILABLE]++;
+        free(block);
+    }
+    else if(length < COMPILED_MIN_LENGTH)
+    {
+        //Flash or breakpoints changed while it was queued, start over
+        wordTier[index] = TIER_PREDECODED;
+        blockHeat[index] = 0;
+        free(block);
+    }
+    else
+    {
+        if(length < block->length)
+        {
+            //The host code covers the whole block, run what is left as ops
+            block->length = length;
+            block->host = NULL;
+        }
+        compiledBlocks[index] = block;
+        wordTier[index] = TIER_COMPILED;
+        tierPromotions[TIER_COMPILED]++;
+    }
+    predecodeProgram(start, start + 2);
+}
+
+// Every entry of a block below the compiled tier lands here before the
+// word runs through fetch().
+void profileBlock()
+{
+    compiledBlock* finished = NULL;
+    while((finished = tierPop(tierCompleted)))
+    {
+        installCompiled(finished);
+    }
+    int32_t index = PC >> 1;
+    if(wordTier[index] > TIER_QUEUED)
+    {
+        return;
+    }
+    blockHeat[index]++;
+    if((wordTier[index] == TIER_INTERPRETED) && (blockHeat[index] >= tierWarm))
+    {
+        int32_t end = PC + 2;
+        while((end < programEnd) && !(predecoded[end >> 1].code & WORD_BLOCK_START))
+        {
+            end += 2;
+        }
+        memset(&wordTier[index], TIER_PREDECODED, (end - PC) >> 1);
+        tierPromotions[TIER_PREDECODED]++;
+        predecodeProgram(PC, end);
+    }
+    if((wordTier[index] == TIER_PREDECODED) && (blockHeat[index] >= tierHot))
+    {
+        compiledBlock* block = (compiledBlock*)malloc(sizeof(compiledBlock));
+        block->start = PC;
+        block->length = 0;
+        if(tierPush(tierRequests, block))
+        {
+            wordTier[index] = TIER_QUEUED;
+            tierPromotions[TIER_QUEUED]++;
+        }
+        else
+        {
+            free(block); //retried on the next entry
+        }
+    }
+}
+
+const compiledMachine hostMachine = {memory, &SREG, &addFlags[0][0][0], &subFlags[0][0][0], logicFlags, &shiftFlags[0][0]};
+
+// Runs the compiled block at PC with the architectural effects of stepping
+// it through fetch(). Returns the instructions retired, or 0 when the block
+// does not fit the budget or an interrupt is due after one instruction.
+int32_t runCompiled(int32_t budget)
+{
+    const compiledBlock& block = *compiledBlocks[PC >> 1];
+    if((block.length > budget) || interruptInhibit)
+    {
+        return 0;
+    }
+    if(block.host)
+    {
+        int32_t pc = 0;
+        int32_t executed = block.host(&hostMachine, &pc);
+        PC = programStart + pc;
+        totalFetches += executed;
+        cycleCount += executed;
+        compiledDispatches++;
+        compiledInstructions += executed;
+        hostDispatches++;
+        return executed;
+    }
+    int32_t executed = 0;
+    bool exited = false;
+    PC = block.start + 2*block.length;
+    while(!exited && (executed < block.length))
+    {
+        const compiledOp* op = &block.ops[executed++];
+        uint8_t& rd = memory[op->d];
+        uint8_t rr = (op->code & COMPILED_IMMEDIATE) ? op->k: memory[op->r];
+        uint8_t carry = SREG & SREG_C;
+        uint16_t value = 0;
+        switch(op->code & ~COMPILED_IMMEDIATE)
+        {
+            case COMPILED_MOV:
+                rd = rr;
+                break;
+            case COMPILED_MOVW:
+                writePair(op->d, readPair(op->r));
+                break;
+            case COMPILED_ADD:
+                setFlags(addFlags[0][rd][rr], ARITHMETIC_FLAGS);
+                rd += rr;
+                break;
+            case COMPILED_ADC:
+                setFlags(addFlags[carry][rd][rr], ARITHMETIC_FLAGS);
+                rd += rr + carry;
+                break;
+            case COMPILED_SUB:
+                setFlags(subFlags[0][rd][rr], ARITHMETIC_FLAGS);
+                rd -= rr;
+                break;
+            case COMPILED_SBC:
+                setFlags(subFlags[carry][rd][rr] & (SREG | ~SREG_Z), ARITHMETIC_FLAGS);
+                rd -= rr + carry;
+                break;
+            case COMPILED_CP:
+                setFlags(subFlags[0][rd][rr], ARITHMETIC_FLAGS);
+                break;
+            case COMPILED_CPC:
+                setFlags(subFlags[carry][rd][rr] & (SREG | ~SREG_Z), ARITHMETIC_FLAGS);
+                break;
+            case COMPILED_AND:
+                rd &= rr;
+                setFlags(logicFlags[rd], LOGIC_FLAGS);
+                break;
+            case COMPILED_OR:
+                rd |= rr;
+                setFlags(logicFlags[rd], LOGIC_FLAGS);
+                break;
+            case COMPILED_EOR:
+                rd ^= rr;
+                setFlags(logicFlags[rd], LOGIC_FLAGS);
+                break;
+            case COMPILED_MUL:
+                value = rd*rr;
+                setFlags((value == 0x0000 ? SREG_Z: 0) | ((value & 0x8000) ? SREG_C: 0), SREG_Z|SREG_C);
+                memory[1] = value >> 8;
+                memory[0] = value & 0xFF;
+                break;
+            case COMPILED_COM:
+                rd = ~rd;
+                setFlags(logicFlags[rd] | SREG_C, LOGIC_FLAGS|SREG_C);
+                break;
+            case COMPILED_NEG:
+                setFlags(subFlags[0][0][rd], ARITHMETIC_FLAGS);
+                rd = -rd;
+                break;
+            case COMPILED_SWAP:
+                rd = (rd << 4) | (rd >> 4);
+                break;
+            case COMPILED_INC:
+                setFlags(addFlags[0][rd][1], LOGIC_FLAGS);
+                rd++;
+                break;
+            case COMPILED_DEC:
+                setFlags(subFlags[0][rd][1], LOGIC_FLAGS);
+                rd--;
+                break;
+            case COMPILED_ASR:
+                setFlags(shiftFlags[rd & 0x1][(rd >> 1) | (rd & 0x80)], LOGIC_FLAGS|SREG_C);
+                rd = (rd >> 1) | (rd & 0x80);
+                break;
+            case COMPILED_LSR:
+                setFlags(shiftFlags[rd & 0x1][rd >> 1], LOGIC_FLAGS|SREG_C);
+                rd >>= 1;
+                break;
+            case COMPILED_ROR:
+                setFlags(shiftFlags[rd & 0x1][(rd >> 1) | (carry << 7)], LOGIC_FLAGS|SREG_C);
+                rd = (rd >> 1) | (carry << 7);
+                break;
+            case COMPILED_ADIW:
+                value = readPair(op->d) + op->k;
+                //V = !Rdh7 & R15, C = !R15 & Rdh7
+                setFlags(((~memory[op->d+1] & (value >> 8) & 0x80) ? SREG_V: 0) | ((~(value >> 8) & memory[op->d+1] & 0x80) ? SREG_C: 0), SREG_V|SREG_C);
+                setFlags((value == 0x0000 ? SREG_Z: 0) | ((value & 0x8000) ? SREG_N: 0) |
+                         ((((value & 0x8000) != 0) != ((SREG & SREG_V) != 0)) ? SREG_S: 0), SREG_Z|SREG_N|SREG_S);
+                writePair(op->d, value);
+                break;
+            case COMPILED_SBIW:
+                value = readPair(op->d) - op->k;
+                //V = Rdh7 & !R15, C = R15 & !Rdh7
+                setFlags(((memory[op->d+1] & ~(value >> 8) & 0x80) ? SREG_V: 0) | (((value >> 8) & ~memory[op->d+1] & 0x80) ? SREG_C: 0), SREG_V|SREG_C);
+                setFlags((value == 0x0000 ? SREG_Z: 0) | ((value & 0x8000) ? SREG_N: 0) |
+                         ((((value & 0x8000) != 0) != ((SREG & SREG_V) != 0)) ? SREG_S: 0), SREG_Z|SREG_N|SREG_S);
+                writePair(op->d, value);
+                break;
+            case COMPILED_BRANCH:
+                if(((SREG & op->k) != 0) != op->r)
+                {
+                    coverEdge(block.start + 2*executed);
+                    break;
+                }
+                //Taken, fall through to leave the block
+            case COMPILED_RJMP:
+                PC = op->target;
+                coverEdge(PC);
+                exited = true;
+                break;
+        }
+    }
+    totalFetches += executed;
+    cycleCount += executed;
+    compiledDispatches++;
+    compiledInstructions += executed;
+    return executed;
+}
+
+void startTiering(uint32_t warm, uint32_t hot)
+{
+    tierWarm = warm;
+    tierHot = hot;
+    for(int32_t address = programStart; address < MEMORY_SIZE - 1; address += 2)
+    {
+        wordTier[address >> 1] = (warm && (predecoded[address >> 1].code & WORD_INSTRUCTION)) ? TIER_INTERPRETED: TIER_PREDECODED;
+    }
+    tiering = true;
+    tierCompiler = new std::thread(tierCompilerLoop);
+    predecodeProgram(programStart, programEnd);
+}
+
+void stopTiering()
+{
+    if(!tiering)
+    {
+        return;
+    }
+    tierClosing = true;
+    tierCompiler->join();
+    delete tierCompiler;
+    compiledBlock* block = NULL;
+    while((block = tierPop(tierRequests)) || (block = tierPop(tierCompleted)))
+    {
+        free(block);
+    }
+    tierStatistics statistics;
+    readTierStatistics(statistics);
+    char buffer[256];
+    sprintf(buffer, "Tiers: %d interpreted, %d predecoded, %d queued, %d compiled (%d in host code), %d uncompilable blocks", statistics.blocks[TIER_INTERPRETED],
+            statistics.blocks[TIER_PREDECODED], statistics.blocks[TIER_QUEUED], statistics.blocks[TIER_COMPILED], statistics.hostBlocks,
+            statistics.blocks[TIER_UNCOMPILABLE]);
+    platformPrint(buffer);
+    sprintf(buffer, "Promotions: %llu predecoded, %llu queued, %llu compiled, %llu uncompilable, %llu dropped",
+            (unsigned long long)statistics.promotions[TIER_PREDECODED], (unsigned long long)statistics.promotions[TIER_QUEUED],
+            (unsigned long long)statistics.promotions[TIER_COMPILED], (unsigned long long)statistics.promotions[TIER_UNCOMPILABLE], (unsigned long long)statistics.dropped);
+    platformPrint(buffer);
+    sprintf(buffer, "Compiled: %llu dispatches (%llu in host code), %llu instructions", (unsigned long long)statistics.dispatches,
+            (unsigned long long)statistics.hostDispatches, (unsigned long long)statistics.instructions);
+    platformPrint(buffer);
+}
+
+// Fills statistics with the tier of every block and the counts since
+// startTiering(), for callers that report them while the core runs.
+void readTierStatistics(tierStatistics& statistics)
+{
+    memset(&statistics, 0, sizeof(statistics));
+    for(int32_t address = programStart; address < programEnd; address += 2)
+    {
+        if(predecoded[address >> 1].code & WORD_BLOCK_START)
+        {
+            statistics.blocks[wordTier[address >> 1]]++;
+            statistics.hostBlocks += (wordTier[address >> 1] == TIER_COMPILED) && compiledBlocks[address >> 1]->host;
+        }
+    }
+    memcpy(statistics.promotions, tierPromotions, sizeof(tierPromotions));
+    statistics.dropped = droppedBlocks;
+    statistics.dispatches = compiledDispatches;
+    statistics.instructions = compiledInstructions;
+    statistics.hostDispatches = hostDispatches;
+}
+
+//Static Recompilation
+// "-aot name file.cpp" writes the analyzed blocks of the loaded image as
+// C++ for the library's avrcoreAttachRecompiled(). Blocks are split at
+// RECOMPILED_BLOCK_LIMIT instructions so that they fit between timer
+// events, and end before instructions that stop the core.
+#define RECOMPILED_BLOCK_LIMIT 64
+
+// Shared by the generated images and the native tier, over a machine m
+// laid out like avrcoreMachine
+const char* compiledMacros =
+    "#define SET_FLAGS(flags, mask) sreg = (sreg & ~(mask)) | ((flags) & (mask))\n"
+    "#define ADD_FLAGS(carry, a, b) m->addFlags[((carry) << 16) | ((a) << 8) | (b)]\n"
+    "#define SUB_FLAGS(carry, a, b) m->subFlags[((carry) << 16) | ((a) << 8) | (b)]\n"
+    "#define LOGIC_FLAGS(value) m->logicFlags[value]\n"
+    "#define SHIFT_FLAGS(carry, value) m->shiftFlags[((carry) << 8) | (value)]\n";
+
+const char* recompiledPrelude =
+    "// Runs one instruction through the interpreter, the block goes on if it lands on next\n"
+    "#define STEP(address, next) *pc = address; if(!m->step(pc) || (*pc != next))\n";
+
+// Writes the statements for one inlined instruction, fetch() semantics
+void emitCompiled(FILE* file, const compiledOp& op, int32_t executed)
+{
+    char right[16];
+    if(op.code & COMPILED_IMMEDIATE)
+    {
+        snprintf(right, sizeof(right), "0x%02X", op.k);
+    }
+    else
+    {
+        snprintf(right, sizeof(right), "r[%d]", op.r);
+    }
+    int32_t d = op.d;
+    switch(op.code & ~COMPILED_IMMEDIATE)
+    {
+        case COMPILED_NOP:
+            fprintf(file, "    ;\n");
+            break;
+        case COMPILED_MOV:
+            fprintf(file, "    r[%d] = %s;\n", d, right);
+            break;
+        case COMPILED_MOVW:
+            fprintf(file, "    r[%d] = r[%d]; r[%d] = r[%d];\n", d, op.r, d+1, op.r+1);
+            break;
+        case COMPILED_ADD:
+            fprintf(file, "    SET_FLAGS(ADD_FLAGS(0, r[%d], %s), 0x%02X); r[%d] += %s;\n", d, right, ARITHMETIC_FLAGS, d, right);
+            break;
+        case COMPILED_ADC:
+            fprintf(file, "    { uint8_t carry = sreg & 0x%02X; SET_FLAGS(ADD_FLAGS(carry, r[%d], %s), 0x%02X); r[%d] += %s + carry; }\n",
+                    SREG_C, d, right, ARITHMETIC_FLAGS, d, right);
+            break;
+        case COMPILED_SUB:
+            fprintf(file, "    SET_FLAGS(SUB_FLAGS(0, r[%d], %s), 0x%02X); r[%d] -= %s;\n", d, right, ARITHMETIC_FLAGS, d, right);
+            break;
+        case COMPILED_SBC:
+            fprintf(file, "    { uint8_t carry = sreg & 0x%02X; SET_FLAGS(SUB_FLAGS(carry, r[%d], %s) & (sreg | ~0x%02X), 0x%02X); r[%d] -= %s + carry; }\n",
+                    SREG_C, d, right, SREG_Z, ARITHMETIC_FLAGS, d, right);
+            break;
+        case COMPILED_CP:
+            fprintf(file, "    SET_FLAGS(SUB_FLAGS(0, r[%d], %s), 0x%02X);\n", d, right, ARITHMETIC_FLAGS);
+            break;
+        case COMPILED_CPC:
+            fprintf(file, "    SET_FLAGS(SUB_FLAGS(sreg & 0x%02X, r[%d], %s) & (sreg | ~0x%02X), 0x%02X);\n", SREG_C, d, right, SREG_Z, ARITHMETIC_FLAGS);
+            break;
+        case COMPILED_AND:
+        case COMPILED_OR:
+        case COMPILED_EOR:
+            fprintf(file, "    r[%d] %s= %s; SET_FLAGS(LOGIC_FLAGS(r[%d]), 0x%02X);\n", d,
+                    ((op.code & ~COMPILED_IMMEDIATE) == COMPILED_AND) ? "&": ((op.code & ~COMPILED_IMMEDIATE) == COMPILED_OR) ? "|": "^", right, d, LOGIC_FLAGS);
+            break;
+        case COMPILED_MUL:
+            fprintf(file, "    { uint16_t value = r[%d]*r[%d]; SET_FLAGS((value == 0 ? 0x%02X: 0) | ((value & 0x8000) ? 0x%02X: 0), 0x%02X); r[1] = value >> 8; r[0] = value; }\n",
+                    d, op.r, SREG_Z, SREG_C, SREG_Z|SREG_C);
+            break;
+        case COMPILED_COM:
+            fprintf(file, "    r[%d] = ~r[%d]; SET_FLAGS(LOGIC_FLAGS(r[%d]) | 0x%02X, 0x%02X);\n", d, d, d, SREG_C, LOGIC_FLAGS|SREG_C);
+            break;
+        case COMPILED_NEG:
+            fprintf(file, "    SET_FLAGS(SUB_FLAGS(0, 0, r[%d]), 0x%02X); r[%d] = -r[%d];\n", d, ARITHMETIC_FLAGS, d, d);
+            break;
+        case COMPILED_SWAP:
+            fprintf(file, "    r[%d] = (r[%d] << 4) | (r[%d] >> 4);\n", d, d, d);
+            break;
+        case COMPILED_INC:
+            fprintf(file, "    SET_FLAGS(ADD_FLAGS(0, r[%d], 1), 0x%02X); r[%d]++;\n", d, LOGIC_FLAGS, d);
+            break;
+        case COMPILED_DEC:
+            fprintf(file, "    SET_FLAGS(SUB_FLAGS(0, r[%d], 1), 0x%02X); r[%d]--;\n", d, LOGIC_FLAGS, d);
+            break;
+        case COMPILED_ASR:
+            fprintf(file, "    SET_FLAGS(SHIFT_FLAGS(r[%d] & 0x01, (r[%d] >> 1) | (r[%d] & 0x80)), 0x%02X); r[%d] = (r[%d] >> 1) | (r[%d] & 0x80);\n",
+                    d, d, d, LOGIC_FLAGS|SREG_C, d, d, d);
+            break;
+        case COMPILED_LSR:
+            fprintf(file, "    SET_FLAGS(SHIFT_FLAGS(r[%d] & 0x01, r[%d] >> 1), 0x%02X); r[%d] >>= 1;\n", d, d, LOGIC_FLAGS|SREG_C, d);
+            break;
+        case COMPILED_ROR:
+            fprintf(file, "    { uint8_t carry = sreg & 0x%02X; SET_FLAGS(SHIFT_FLAGS(r[%d] & 0x01, (r[%d] >> 1) | (carry << 7)), 0x%02X); r[%d] = (r[%d] >> 1) | (carry << 7); }\n",
+                    SREG_C, d, d, LOGIC_FLAGS|SREG_C, d, d);
+            break;
+        case COMPILED_ADIW:
+        case COMPILED_SBIW:
+            //V and C from bit 7 of the high byte before and after, as in fetch()
+            fprintf(file, "    { uint16_t value = (r[%d] | (r[%d] << 8)) %c %d;\n", d, d+1, (op.code == COMPILED_ADIW) ? '+': '-', op.k);
+            if(op.code == COMPILED_ADIW)
+            {
+                fprintf(file, "      SET_FLAGS(((~r[%d] & (value >> 8) & 0x80) ? 0x%02X: 0) | ((~(value >> 8) & r[%d] & 0x80) ? 0x%02X: 0), 0x%02X);\n",
+                        d+1, SREG_V, d+1, SREG_C, SREG_V|SREG_C);
+            }
+            else
+            {
+                fprintf(file, "      SET_FLAGS(((r[%d] & ~(value >> 8) & 0x80) ? 0x%02X: 0) | (((value >> 8) & ~r[%d] & 0x80) ? 0x%02X: 0), 0x%02X);\n",
+                        d+1, SREG_V, d+1, SREG_C, SREG_V|SREG_C);
+            }
+            fprintf(file, "      SET_FLAGS((value == 0 ? 0x%02X: 0) | ((value & 0x8000) ? 0x%02X: 0) | ((((value & 0x8000) != 0) != ((sreg & 0x%02X) != 0)) ? 0x%02X: 0), 0x%02X);\n",
+                    SREG_Z, SREG_N, SREG_V, SREG_S, SREG_Z|SREG_N|SREG_S);
+            fprintf(file, "      r[%d] = value; r[%d] = value >> 8; }\n", d, d+1);
+            break;
+        case COMPILED_BRANCH:
+            fprintf(file, "    if(%s(sreg & 0x%02X)) { *pc = 0x%X; return %d; }\n", op.r ? "": "!", op.k, op.target - programStart, executed);
+            break;
+        case COMPILED_RJMP:
+            fprintf(file, "    *pc = 0x%X; return %d;\n", op.target - programStart, executed);
+            break;
+    }
+}
+
+// Writes the function for the block at start and returns the address it
+// stops at. Stores the instructions it covers, 0 when there is nothing to
+// recompile there.
+int32_t emitRecompiledBlock(FILE* file, int32_t start, int32_t& instructions)
+{
+    decodedInstruction instruction;
+    compiledOp op;
+    char text[64];
+    int32_t address = start;
+    bool ended = false;
+    instructions = 0;
+    while(!ended && (instructions < RECOMPILED_BLOCK_LIMIT) && (address < programEnd) && (predecoded[address >> 1].code & WORD_INSTRUCTION) &&
+          ((address == start) || !(predecoded[address >> 1].code & WORD_BLOCK_START)))
+    {
+        decodeInstruction(address, instruction);
+        if(!instruction.supported || (instruction.flow == FLOW_STOP))
+        {
+            break;
+        }
+        if(!instructions)
+        {
+            fprintf(file, "\nstatic int32_t block_%05X(const avrcoreMachine* m, int32_t* pc)\n{\n    uint8_t* const r = m->data;\n    uint8_t& sreg = *m->sreg;\n    (void)r; (void)sreg;\n",
+                    start - programStart);
+        }
+        instructions++;
+        int32_t next = address + instruction.length;
+        disassemble(address, text, sizeof(text));
+        fprintf(file, "    //%X: %s\n", address - programStart, text);
+        if(compileInstruction(readWord(address), address, op))
+        {
+            emitCompiled(file, op, instructions);
+            ended = (op.code == COMPILED_RJMP);
+        }
+        else if(instruction.flow == FLOW_JUMP)
+        {
+            fprintf(file, "    *pc = 0x%X; return %d;\n", instruction.target - programStart, instructions);
+            ended = true;
+        }
+        else if((instruction.flow == FLOW_RETURN) || (instruction.flow == FLOW_INDIRECT_JUMP))
+        {
+            //The interpreter leaves the target in *pc
+            fprintf(file, "    *pc = 0x%X; m->step(pc); return %d;\n", address - programStart, instructions);
+            ended = true;
+        }
+        else
+        {
+            fprintf(file, "    STEP(0x%X, 0x%X) return %d;\n", address - programStart, next - programStart, instructions);
+        }
+        address = next;
+    }
+    if(instructions)
+    {
+        if(!ended)
+        {
+            fprintf(file, "    *pc = 0x%X;\n    return %d;\n", address - programStart, instructions);
+        }
+
+        fprintf(file, "}\n");
+    }
+    return address;
+}
+
+bool writeRecompiled(const char* name, const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if(!file)
+    {
+        return false;
+    }
+    fprintf(file, "// Generated by avrcore -aot from %s for the %s, see avrcoreAttachRecompiled().\n", (cachedArgc > 1) ? cachedArgv[1]: "the default program", MCU_NAME);
+    fputs("#include \"avrcore.h\"\n\n", file);
+    fputs(compiledMacros, file);
+    fputs(recompiledPrelude, file);
+    //Flash byte addresses and instruction counts of the blocks written
+    int32_t* starts = (int32_t*)malloc(sizeof(int32_t)*(MEMORY_SIZE/2));
+    int32_t* lengths = (int32_t*)malloc(sizeof(int32_t)*(MEMORY_SIZE/2));
+    int32_t* ends = (int32_t*)malloc(sizeof(int32_t)*(MEMORY_SIZE/2));
+    int32_t count = 0;
+    for(int32_t address = programStart; address < programEnd; address += 2)
+    {
+        int32_t start = address;
+        while((predecoded[address >> 1].code & WORD_BLOCK_START) && (predecoded[address >> 1].code & WORD_INSTRUCTION))
+        {
+            int32_t instructions = 0;
+            int32_t end = emitRecompiledBlock(file, start, instructions);
+            if(!instructions)
+            {
+                break;
+            }
+            starts[count] = start;
+            lengths[count] = instructions;
+            ends[count++] = end;
+            //Split by the limit, the rest continues as a block of its own
+            if((instructions < RECOMPILED_BLOCK_LIMIT) || (end >= programEnd) || (predecoded[end >> 1].code & WORD_BLOCK_START) ||
+               !(predecoded[end >> 1].code & WORD_INSTRUCTION))
+            {
+                break;
+            }
+            start = end;
+        }
+    }
+    for(int32_t i = 0; i < count; i++)
+    {
+        fprintf(file, "\nstatic const uint16_t source_%05X[] =\n{", starts[i] - programStart);
+        for(int32_t address = starts[i]; address < ends[i]; address += 2)
+        {
+            fprintf(file, "%s0x%04X,", ((address - starts[i]) % 16) ? " ": "\n    ", readWord(address));
+        }
+        fprintf(file, "\n};\n");
+    }
+    fprintf(file, "\nstatic const avrcoreRecompiledBlock blocks[] =\n{\n");
+    for(int32_t i = 0; i < count; i++)
+    {
+        fprintf(file, "    {0x%X, %d, %d, source_%05X, block_%05X},\n", starts[i] - programStart, lengths[i], (ends[i] - starts[i]) >> 1,
+                starts[i] - programStart, starts[i] - programStart);
+    }
+    if(!count)
+    {
+        fprintf(file, "    {0, 0, 0, 0, 0},\n");
+    }
+    fprintf(file, "};\n\nextern \"C\" const avrcoreRecompiledImage %s = {AVRCORE_ABI_VERSION, \"%s\", %d, blocks};\n", name, MCU_NAME, count);
+    free(starts);
+    free(lengths);
+    free(ends);
+    fclose(file);
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "Recompiled %d blocks to %s", count, path);
+    platformPrint(buffer);
+    return true;
+}
+
+//Host Code Tier
+// The compiler thread writes each batch of compiled blocks through
+// emitCompiled(), builds it with the host C++ compiler ($CXX, c++ when
+// unset) into a shared object and loads that with dlopen(). Blocks keep
+// their ops, which runCompiled() interprets when there is no compiler or
+// the build fails. The first failure turns the host compiler off for the
+// rest of the run, the libraries loaded stay until exit.
+#ifdef FUZZ
+bool hostCompiler = false; // the edge map needs the side exits the ops record
+#else
+bool hostCompiler = true;
+#endif
+
+const char* hostPrelude =
+    "#include <stdint.h>\n\n"
+    "struct compiledMachine\n{\n"
+    "    uint8_t* data;\n"
+    "    uint8_t* sreg;\n"
+    "    const uint8_t* addFlags;\n"
+    "    const uint8_t* subFlags;\n"
+    "    const uint8_t* logicFlags;\n"
+    "    const uint8_t* shiftFlags;\n"
+    "};\n";
+
+void emitHostBlock(FILE* file, const compiledBlock& block, int32_t index)
+{
+    fprintf(file, "\nextern \"C\" int32_t block_%d(const compiledMachine* m, int32_t* pc)\n{\n    uint8_t* const r = m->data;\n    uint8_t& sreg = *m->sreg;\n"
+            "    (void)r; (void)sreg;\n", index);
+    for(int32_t i = 0; i < block.length; i++)
+    {
+        emitCompiled(file, block.ops[i], i + 1);
+    }
+    if(block.ops[block.length - 1].code != COMPILED_RJMP)
+    {
+        fprintf(file, "    *pc = 0x%X;\n    return %d;\n", block.start + 2*block.length - programStart, block.length);
+    }
+    fprintf(file, "}\n");
+}
+
+// Sets the host function of every block in the batch that the host
+// compiler built, on the compiler thread
+void compileHost(compiledBlock** blocks, int32_t count)
+{
+    if(!hostCompiler)
+    {
+        return;
+    }
+    char directory[] = "/tmp/avrcoreXXXXXX";
+    if(!mkdtemp(directory))
+    {
+        hostCompiler = false;
+        return;
+    }
+    char source[64];
+    char library[64];
+    snprintf(source, sizeof(source), "%s/tier.cpp", directory);
+    snprintf(library, sizeof(library), "%s/tier.so", directory);
+    void* handle = NULL;
+    FILE* file = fopen(source, "w");
+    if(file)
+    {
+        fputs(hostPrelude, file);
+        fputs(compiledMacros, file);
+        for(int32_t i = 0; i < count; i++)
+        {
+            if(blocks[i]->length >= COMPILED_MIN_LENGTH)
+            {
+                emitHostBlock(file, *blocks[i], i);
+            }
+        }
+        fclose(file);
+        const char* compiler = getenv("CXX");
+        char command[256];
+        snprintf(command, sizeof(command), "%s -O2 -shared -fPIC -o %s %s 2>/dev/null", (compiler && *compiler) ? compiler: "c++", library, source);
+        handle = (system(command) == 0) ? dlopen(library, RTLD_NOW|RTLD_LOCAL): NULL;
+    }
+    for(int32_t i = 0; handle && (i < count); i++)
+    {
+        if(blocks[i]->length >= COMPILED_MIN_LENGTH)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "block_%d", i);
+            blocks[i]->host = (compiledFunction)dlsym(handle, name);
+        }
+    }
+    hostCompiler = (handle != NULL);
+    unlink(source);
+    unlink(library);
+    rmdir(directory);
+}
+#endif
+
+#ifdef COVERAGE
+//Coverage Export
+// The coverage build runs "image.hex bitmap" and ORs the words executed by
+// the run into the bitmap file, creating it on first use, so any number of
+// runs accumulate into one file. "-lcov bitmap image.elf out.info" maps a
+// bitmap through the DWARF line table of the matching ELF into an lcov
+// tracefile; a line counts as hit once any instruction generated for it
+// ran. Images without line information are reported per function symbol,
+// one pseudo line per function, under the ELF's own name.
+#define COVERAGE_MAGIC 0x56435641 // "AVCV"
+struct coverageHeader
+{
+    uint32_t magic;
+    uint32_t words;
+};
+
+// Loads a bitmap into executedWords, or returns false when it is missing
+// or was written for a different flash size.
+bool loadCoverage(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if(!file)
+    {
+        return false;
+    }
+    coverageHeader header;
+    bool loaded = (fread(&header, sizeof(header), 1, file) == 1) && (header.magic == COVERAGE_MAGIC) &&
+                  (header.words == COVERAGE_WORDS) && (fread(executedWords, sizeof(executedWords), 1, file) == 1);
+    fclose(file);
+    return loaded;
+}
+
+bool mergeCoverage(const char* path)
+{
+    char buffer[1024];
+    static uint64_t runWords[COVERAGE_WORDS/64];
+    memcpy(runWords, executedWords, sizeof(executedWords));
+    FILE* file = fopen(path, "rb");
+    if(file)
+    {
+        fclose(file);
+        if(!loadCoverage(path))
+        {
+            sprintf(buffer, "%s is not a coverage bitmap for this MCU", path);
+            platformPrint(buffer);
+            return false;
+        }
+        for(uint32_t i = 0; i < COVERAGE_WORDS/64; i++)
+        {
+            executedWords[i] |= runWords[i];
+        }
+    }
+    coverageHeader header = {COVERAGE_MAGIC, COVERAGE_WORDS};
+    file = fopen(path, "wb");
+    bool written = file && (fwrite(&header, sizeof(header), 1, file) == 1) && (fwrite(executedWords, sizeof(executedWords), 1, file) == 1);
+    if(!file || fclose(file) || !written)
+    {
+        sprintf(buffer, "Cannot write %s", path);
+        platformPrint(buffer);
+        return false;
+    }
+    return true;
+}
+
+// Whether any instruction starting in the flash byte range [start, end) ran
+bool rangeExecuted(uint32_t start, uint32_t end)
+{
+    for(uint32_t word = start >> 1; (word < ((end + 1) >> 1)) && (word < COVERAGE_WORDS); word++)
+    {
+        if(executedWords[word >> 6] & (1ULL << (word & 63)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//DWARF
+#define DW_LNS_copy 1
+#define DW_LNS_advance_pc 2
+#define DW_LNS_advance_line 3
+#define DW_LNS_set_file 4
+#define DW_LNS_const_add_pc 8
+#define DW_LNS_fixed_advance_pc 9
+#define DW_LNE_end_sequence 1
+#define DW_LNE_set_address 2
+#define DW_LNE_define_file 3
+#define DW_LNCT_path 1
+#define DW_LNCT_directory_index 2
+#define DW_FORM_block 0x09
+#define DW_FORM_data1 0x0b
+#define DW_FORM_data2 0x05
+#define DW_FORM_data4 0x06
+#define DW_FORM_data8 0x07
+#define DW_FORM_data16 0x1e
+#define DW_FORM_string 0x08
+#define DW_FORM_strp 0x0e
+#define DW_FORM_udata 0x0f
+#define DW_FORM_line_strp 0x1f
+
+struct dwarfSection
+{
+    const uint8_t* start;
+    const uint8_t* end;
+};
+
+// Readers stop at end and return 0 past it, so truncated input cannot run
+// off the section.
+uint64_t readLittle(const uint8_t*& cursor, const uint8_t* end, int32_t size)
+{
+    uint64_t value = 0;
+    for(int32_t i = 0; i < size; i++)
+    {
+        value |= (cursor < end) ? ((uint64_t)*cursor++ << (8*i)): 0;
+    }
+    return value;
+}
+
+uint64_t readUleb(const uint8_t*& cursor, const uint8_t* end)
+{
+    uint64_t value = 0;
+    int32_t shift = 0;
+    while(cursor < end)
+    {
+        uint8_t byte = *cursor++;
+        value |= (shift < 64) ? ((uint64_t)(byte & 0x7F) << shift): 0;
+        shift += 7;
+        if(!(byte & 0x80))
+        {
+            break;
+        }
+    }
+    return value;
+}
+
+int64_t readSleb(const uint8_t*& cursor, const uint8_t* end)
+{
+    int64_t value = 0;
+    int32_t shift = 0;
+    uint8_t byte = 0;
+    while(cursor < end)
+    {
+        byte = *cursor++;
+        value |= (shift < 64) ? ((int64_t)(byte & 0x7F) << shift): 0;
+        shift += 7;
+        if(!(byte & 0x80))
+        {
+            break;
+        }
+    }
+    if((shift < 64) && (byte & 0x40))
+    {
+        value |= -((int64_t)1 << shift);
+    }
+    return value;
+}
+
+std::string readString(const uint8_t*& cursor, const uint8_t* end)
+{
+    const uint8_t* start = cursor;
+    while((cursor < end) && *cursor)
+    {
+        cursor++;
+    }
+    std::string value((const char*)start, cursor - start);
+    cursor += (cursor < end);
+    return value;
+}
+
+std::string sectionString(const dwarfSection& section, uint64_t offset)
+{
+    const uint8_t* cursor = section.start + offset;
+    return (cursor < section.end) ? readString(cursor, section.end): std::string();
+}
+
+// Reads one DWARF 5 directory or file entry, keeping the path and the
+// directory index. Returns false on forms a line table cannot use.
+bool readEntry(const uint8_t*& cursor, const uint8_t* end, const std::vector<uint64_t>& format,
+               const dwarfSection& lineStrings, const dwarfSection& strings, std::string& path, uint64_t& directory)
+{
+    for(size_t i = 0; i < format.size(); i += 2)
+    {
+        uint64_t value = 0;
+        std::string text;
+        switch(format[i+1])
+        {
+            case DW_FORM_string:
+                text = readString(cursor, end);
+                break;
+            case DW_FORM_line_strp:
+                text = sectionString(lineStrings, readLittle(cursor, end, 4));
+                break;
+            case DW_FORM_strp:
+                text = sectionString(strings, readLittle(cursor, end, 4));
+                break;
+            case DW_FORM_udata:
+                value = readUleb(cursor, end);
+                break;
+            case DW_FORM_data1:
+                value = readLittle(cursor, end, 1);
+                break;
+            case DW_FORM_data2:
+                value = readLittle(cursor, end, 2);
+                break;
+            case DW_FORM_data4:
+                value = readLittle(cursor, end, 4);
+                break;
+            case DW_FORM_data8:
+                value = readLittle(cursor, end, 8);
+                break;
+            case DW_FORM_data16:
+                cursor += ((end - cursor) < 16) ? (end - cursor): 16;
+                break;
+            case DW_FORM_block:
+                value = readUleb(cursor, end);
+                cursor += ((uint64_t)(end - cursor) < value) ? (end - cursor): value;
+                break;
+            default:
+                return false;
+        }
+        if(format[i] == DW_LNCT_path)
+        {
+            path = text;
+        }
+        else if(format[i] == DW_LNCT_directory_index)
+        {
+            directory = value;
+        }
+    }
+    return true;
+}
+
+std::string joinPath(const std::string& directory, const std::string& name)
+{
+    return (directory.empty() || (name[0] == '/')) ? name: directory + "/" + name;
+}
+
+struct lineLocation
+{
+    std::string file;
+    uint32_t line;
+};
+
+// Runs every line number program in .debug_line (DWARF 2 to 5, 32-bit
+// format). Each row covers the bytes up to the next row of its sequence;
+// lines gets the hit state of every line that owns at least one byte and
+// entries the first location recorded for each address.
+void readLineTable(const dwarfSection& table, const dwarfSection& lineStrings, const dwarfSection& strings,
+                   std::map<std::string, std::map<uint32_t, bool> >& lines, std::map<uint32_t, lineLocation>& entries)
+{
+    const uint8_t* unit = table.start;
+    while(table.end - unit > 4)
+    {
+        const uint8_t* cursor = unit;
+        uint64_t unitLength = readLittle(cursor, table.end, 4);
+        if(unitLength >= 0xFFFFFFF0) //64-bit DWARF
+        {
+            return;
+        }
+        const uint8_t* end = ((uint64_t)(table.end - cursor) < unitLength) ? table.end: cursor + unitLength;
+        unit = end;
+        int32_t version = readLittle(cursor, end, 2);
+        if((version < 2) || (version > 5))
+        {
+            continue;
+        }
+        if(version >= 5)
+        {
+            cursor += 2; //address and segment selector sizes
+        }
+        uint64_t headerLength = readLittle(cursor, end, 4);
+        const uint8_t* program = ((uint64_t)(end - cursor) < headerLength) ? end: cursor + headerLength;
+        uint8_t minimumLength = readLittle(cursor, end, 1);
+        if(version >= 4)
+        {
+            cursor++; //maximum operations per instruction
+        }
+        cursor++; //default is_stmt
+        int8_t lineBase = readLittle(cursor, end, 1);
+        uint8_t lineRange = readLittle(cursor, end, 1);
+        uint8_t opcodeBase = readLittle(cursor, end, 1);
+        if(!lineRange || !opcodeBase)
+        {
+            continue;
+        }
+        std::vector<uint8_t> operandCounts(opcodeBase, 0);
+        for(int32_t opcode = 1; opcode < opcodeBase; opcode++)
+        {
+            operandCounts[opcode] = readLittle(cursor, end, 1);
+        }
+
+        std::vector<std::string> directories;
+        std::vector<std::string> files;
+        if(version < 5)
+        {
+            directories.push_back(std::string());
+            while((cursor < end) && *cursor)
+            {
+                directories.push_back(readString(cursor, end));
+            }
+            cursor++;
+            files.push_back(std::string());
+            while((cursor < end) && *cursor)
+            {
+                std::string name = readString(cursor, end);
+                uint64_t directory = readUleb(cursor, end);
+                readUleb(cursor, end);
+                readUleb(cursor, end);
+                files.push_back(joinPath((directory < directories.size()) ? directories[directory]: std::string(), name));
+            }
+        }
+        else
+        {
+            bool readable = true;
+            for(int32_t list = 0; (list < 2) && readable; list++)
+            {
+                std::vector<uint64_t> format(2*readLittle(cursor, end, 1));
+                for(size_t i = 0; i < format.size(); i++)
+                {
+                    format[i] = readUleb(cursor, end);
+                }
+                uint64_t count = readUleb(cursor, end);
+                for(uint64_t i = 0; (i < count) && readable && (cursor < end); i++)
+                {
+                    std::string path;
+                    uint64_t directory = 0;
+                    readable = readEntry(cursor, end, format, lineStrings, strings, path, directory);
+                    if(list == 0)
+                    {
+                        directories.push_back(path);
+                    }
+                    else
+                    {
+                        files.push_back(joinPath((directory < directories.size()) ? directories[directory]: std::string(), path));
+                    }
+                }
+            }
+            if(!readable)
+            {
+                continue;
+            }
+        }
+
+        uint64_t address = 0;
+        uint64_t file = 1;
+        int64_t line = 1;
+        bool previous = false;
+        uint64_t previousAddress = 0;
+        uint64_t previousFile = 0;
+        int64_t previousLine = 0;
+        cursor = program;
+        while(cursor < end)
+        {
+            uint8_t opcode = *cursor++;
+            bool emit = false;
+            bool endSequence = false;
+            if(opcode >= opcodeBase)
+            {
+                address += ((opcode - opcodeBase) / lineRange)*minimumLength;
+                line += lineBase + ((opcode - opcodeBase) % lineRange);
+                emit = true;
+            }
+            else if(opcode == 0)
+            {
+                uint64_t length = readUleb(cursor, end);
+                const uint8_t* next = ((uint64_t)(end - cursor) < length) ? end: cursor + length;
+                uint8_t extended = length ? readLittle(cursor, end, 1): 0;
+                if(extended == DW_LNE_end_sequence)
+                {
+                    emit = true;
+                    endSequence = true;
+                }
+                else if(extended == DW_LNE_set_address)
+                {
+                    address = readLittle(cursor, end, (length - 1 > 8) ? 8: length - 1);
+                }
+                else if(extended == DW_LNE_define_file)
+                {
+                    std::string name = readString(cursor, end);
+                    uint64_t directory = readUleb(cursor, end);
+                    files.push_back(joinPath((directory < directories.size()) ? directories[directory]: std::string(), name));
+                }
+                cursor = next;
+            }
+            else if(opcode == DW_LNS_copy)
+            {
+                emit = true;
+            }
+            else if(opcode == DW_LNS_advance_pc)
+            {
+                address += readUleb(cursor, end)*minimumLength;
+            }
+            else if(opcode == DW_LNS_advance_line)
+            {
+                line += readSleb(cursor, end);
+            }
+            else if(opcode == DW_LNS_set_file)
+            {
+                file = readUleb(cursor, end);
+            }
+            else if(opcode == DW_LNS_const_add_pc)
+            {
+                address += ((255 - opcodeBase) / lineRange)*minimumLength;
+            }
+            else if(opcode == DW_LNS_fixed_advance_pc)
+            {
+                address += readLittle(cursor, end, 2);
+            }
+            else
+            {
+                for(int32_t i = 0; i < operandCounts[opcode]; i++)
+                {
+                    readUleb(cursor, end);
+                }
+            }
+            if(!emit)
+            {
+                continue;
+            }
+            if(previous && (address > previousAddress) && (previousFile < files.size()) && (previousLine > 0))
+            {
+                bool& hit = lines[files[previousFile]][previousLine];
+                hit = hit || rangeExecuted(previousAddress, address);
+            }
+            if(!endSequence && (file < files.size()) && (line > 0) && !entries.count(address))
+            {
+                lineLocation location = {files[file], (uint32_t)line};
+                entries[address] = location;
+            }
+            previous = !endSequence;
+            previousAddress = address;
+            previousFile = file;
+            previousLine = line;
+            if(endSequence)
+            {
+                address = 0;
+                file = 1;
+                line = 1;
+            }
+        }
+    }
+}
+
+//ELF
+struct elfFunction
+{
+    std::string name;
+    uint32_t address;
+};
+
+// Reads the ELF sections the export needs. AVR ELF files are little-endian
+// ELF32, so the headers are copied out as they are on little-endian hosts.
+bool readElf(const std::vector<uint8_t>& image, dwarfSection& lineTable, dwarfSection& lineStrings,
+             dwarfSection& strings, std::vector<elfFunction>& functions)
+{
+    Elf32_Ehdr header;
+    if((image.size() < sizeof(header)) || memcmp(image.data(), ELFMAG, SELFMAG))
+    {
+        return false;
+    }
+    memcpy(&header, image.data(), sizeof(header));
+    if((header.e_ident[EI_CLASS] != ELFCLASS32) || (header.e_ident[EI_DATA] != ELFDATA2LSB) || (header.e_machine != EM_AVR) ||
+       (header.e_shentsize != sizeof(Elf32_Shdr)) || (header.e_shoff + (uint64_t)header.e_shnum*sizeof(Elf32_Shdr) > image.size()) ||
+       (header.e_shstrndx >= header.e_shnum))
+    {
+        return false;
+    }
+    std::vector<Elf32_Shdr> sections(header.e_shnum);
+    memcpy(sections.data(), &image[header.e_shoff], header.e_shnum*sizeof(Elf32_Shdr));
+    for(size_t i = 0; i < sections.size(); i++)
+    {
+        if((uint64_t)sections[i].sh_offset + sections[i].sh_size > image.size())
+        {
+            sections[i].sh_size = (sections[i].sh_type == SHT_NOBITS) ? sections[i].sh_size: 0;
+        }
+    }
+    const Elf32_Shdr& names = sections[header.e_shstrndx];
+    dwarfSection sectionNames = {&image[0] + names.sh_offset, &image[0] + names.sh_offset + names.sh_size};
+    const Elf32_Shdr* symbols = NULL;
+    for(size_t i = 0; i < sections.size(); i++)
+    {
+        std::string name = sectionString(sectionNames, sections[i].sh_name);
+        dwarfSection section = {&image[0] + sections[i].sh_offset, &image[0] + sections[i].sh_offset + sections[i].sh_size};
+        if(name == ".debug_line")
+        {
+            lineTable = section;
+        }
+        else if(name == ".debug_line_str")
+        {
+            lineStrings = section;
+        }
+        else if(name == ".debug_str")
+        {
+            strings = section;
+        }
+        else if((sections[i].sh_type == SHT_SYMTAB) && (sections[i].sh_link < sections.size()))
+        {
+            symbols = &sections[i];
+        }
+    }
+    if(symbols)
+    {
+        const Elf32_Shdr& symbolTable = sections[symbols->sh_link];
+        dwarfSection symbolNames = {&image[0] + symbolTable.sh_offset, &image[0] + symbolTable.sh_offset + symbolTable.sh_size};
+        for(uint32_t offset = 0; offset + sizeof(Elf32_Sym) <= symbols->sh_size; offset += sizeof(Elf32_Sym))
+        {
+            Elf32_Sym symbol;
+            memcpy(&symbol, &image[symbols->sh_offset + offset], sizeof(symbol));
+            //Flash is at 0 in AVR ELF files, the data space at 0x800000
+            if((ELF32_ST_TYPE(symbol.st_info) == STT_FUNC) && (symbol.st_shndx != SHN_UNDEF) && (symbol.st_value < 0x800000))
+            {
+                elfFunction function = {sectionString(symbolNames, symbol.st_name), symbol.st_value};
+                functions.push_back(function);
+            }
+        }
+    }
+    return true;
+}
+
+bool exportLcov(const char* bitmapPath, const char* elfPath, const char* infoPath)
+{
+    char buffer[1024];
+    if(!loadCoverage(bitmapPath))
+    {
+        sprintf(buffer, "%s is not a coverage bitmap for this MCU", bitmapPath);
+        platformPrint(buffer);
+        return false;
+    }
+    std::vector<uint8_t> image;
+    FILE* file = fopen(elfPath, "rb");
+    if(file)
+    {
+        fseek(file, 0, SEEK_END);
+        image.resize(ftell(file));
+        rewind(file);
+        image.resize(fread(image.data(), 1, image.size(), file));
+        fclose(file);
+    }
+    dwarfSection lineTable = {NULL, NULL};
+    dwarfSection lineStrings = {NULL, NULL};
+    dwarfSection strings = {NULL, NULL};
+    std::vector<elfFunction> functions;
+    if(!readElf(image, lineTable, lineStrings, strings, functions))
+    {
+        sprintf(buffer, "%s is not an AVR ELF file", elfPath);
+        platformPrint(buffer);
+        return false;
+    }
+
+    std::map<std::string, std::map<uint32_t, bool> > lines;
+    std::map<uint32_t, lineLocation> entries;
+    readLineTable(lineTable, lineStrings, strings, lines, entries);
+    //file -> function name -> (line, hit)
+    std::map<std::string, std::map<std::string, std::pair<uint32_t, bool> > > records;
+    bool symbolsOnly = lines.empty();
+    if(symbolsOnly)
+    {
+        std::sort(functions.begin(), functions.end(), [](const elfFunction& first, const elfFunction& second) { return first.address < second.address; });
+    }
+    for(size_t i = 0; i < functions.size(); i++)
+    {
+        bool hit = rangeExecuted(functions[i].address, functions[i].address + 1);
+        if(symbolsOnly)
+        {
+            lines[elfPath][i + 1] = hit;
+            records[elfPath][functions[i].name] = std::make_pair((uint32_t)(i + 1), hit);
+        }
+        else if(entries.count(functions[i].address))
+        {
+            const lineLocation& location = entries[functions[i].address];
+            records[location.file][functions[i].name] = std::make_pair(location.line, hit);
+        }
+    }
+
+    FILE* info = fopen(infoPath, "w");
+    if(!info)
+    {
+        return false;
+    }
+    int32_t linesFound = 0;
+    int32_t linesHit = 0;
+    for(std::map<std::string, std::map<uint32_t, bool> >::iterator source = lines.begin(); source != lines.end(); ++source)
+    {
+        fprintf(info, "TN:\nSF:%s\n", source->first.c_str());
+        std::map<std::string, std::pair<uint32_t, bool> >& sourceFunctions = records[source->first];
+        int32_t functionsHit = 0;
+        for(std::map<std::string, std::pair<uint32_t, bool> >::iterator function = sourceFunctions.begin(); function != sourceFunctions.end(); ++function)
+        {
+            fprintf(info, "FN:%u,%s\n", function->second.first, function->first.c_str());
+        }
+        for(std::map<std::string, std::pair<uint32_t, bool> >::iterator function = sourceFunctions.begin(); function != sourceFunctions.end(); ++function)
+        {
+            fprintf(info, "FNDA:%i,%s\n", function->second.second ? 1: 0, function->first.c_str());
+            functionsHit += function->second.second;
+        }
+        fprintf(info, "FNF:%i\nFNH:%i\n", (int32_t)sourceFunctions.size(), functionsHit);
+        int32_t hit = 0;
+        for(std::map<uint32_t, bool>::iterator line = source->second.begin(); line != source->second.end(); ++line)
+        {
+            fprintf(info, "DA:%u,%i\n", line->first, line->second ? 1: 0);
+            hit += line->second;
+        }
+        fprintf(info, "LF:%i\nLH:%i\nend_of_record\n", (int32_t)source->second.size(), hit);
+        linesFound += source->second.size();
+        linesHit += hit;
+    }
+    if(fclose(info))
+    {
+        return false;
+    }
+    sprintf(buffer, "%i of %i lines in %i files", linesHit, linesFound, (int32_t)lines.size());
+    platformPrint(buffer);
+    return true;
+}
+#endif
+
+#ifdef FUZZ
+//Fuzzing
+// Persistent-mode harness. The image boots once, up to its first read of
+// an input register, and every input restarts from a snapshot of that
+// state. Input bytes are handed out in order to reads of the USART data
+// register, the ADC result and the port input registers, and the USART
+// status shows RXC while bytes remain, and sbis/sbic polling loops see it
+// too. Illegal opcodes, stack overflows and watchdog resets count as crashes.
+#define FUZZ_INPUT_LIMIT (1 << 20)
+#define FUZZ_BOOT_LIMIT 100000000
+#define FUZZ_INSTRUCTION_BUDGET 10000000
+// Instructions still run once the firmware asks for more input than it got
+#define FUZZ_TAIL_INSTRUCTIONS 4096
+#define FUZZ_PERSISTENT_RUNS 10000
+// Wild stores reach at most 64 bytes past a 16-bit pointer, the SPM
+// signature read patches flash at Z
+#define FUZZ_WRITABLE_END (ENTRY_ADDRESS + 0x10040)
+#define FORKSERVER_FD 198
+#define UDR_OFFSET 6
+#define RXC_BIT 1<<7
+#define WDTCSR_ADDRESS 0x60
+#define WDE_BIT 1<<3
+#define WDP3_BIT 1<<5
+// Shortest watchdog timeout, 2K cycles of the 128 kHz oscillator at 16 MHz
+#define WATCHDOG_CYCLES 256000
+
+#define FUZZ_CRASH_NONE 0
+#define FUZZ_CRASH_ILLEGAL_OPCODE 1
+#define FUZZ_CRASH_STACK_OVERFLOW 2
+#define FUZZ_CRASH_WATCHDOG 3
+const char* fuzzCrashNames[] =
+{
+    "none",
+    "illegal opcode",
+    "stack overflow",
+    "watchdog",
+};
+// afl-fuzz only runs binaries carrying this marker in persistent mode
+const char* volatile persistentSignature = "##SIG_AFL_PERSISTENT##";
+
+const int32_t fuzzInputAddresses[] =
+{
+    UCSRA_ADDRESS + UDR_OFFSET,
+    ADCL_ADDRESS,
+    ADCH_ADDRESS,
+    PORTB_ADDRESS - 2,
+    PORTC_ADDRESS - 2,
+    PORTD_ADDRESS - 2,
+#ifdef ATMEGA32U4
+    ATMEGA32U4_PORTE_ADDRESS - 2,
+    ATMEGA32U4_PORTF_ADDRESS - 2,
+#endif
+};
+bool inputRegister[RAMSTART];
+uint8_t fuzzInput[FUZZ_INPUT_LIMIT];
+int32_t fuzzInputSize = 0;
+int32_t fuzzInputCursor = 0;
+bool fuzzInputDrained = false;
+
+struct fuzzSnapshot
+{
+    uint8_t data[ENTRY_ADDRESS];
+    uint8_t flash[FUZZ_WRITABLE_END - ENTRY_ADDRESS];
+    programCounter PC;
+    uint8_t SREG;
+    uint16_t stackPointer;
+    uint64_t cycleCount;
+    uint64_t pendingInterrupts;
+    bool interruptInhibit;
+    int32_t trackedFetches;
+    uint64_t watchdogResetCycle;
+};
+fuzzSnapshot bootSnapshot;
+
+uint8_t readFuzzInput(void* context, int32_t address, uint8_t value)
+{
+    if(address == UCSRA_ADDRESS)
+    {
+        fuzzInputDrained |= (fuzzInputCursor == fuzzInputSize);
+        return (fuzzInputCursor < fuzzInputSize) ? (value | RXC_BIT): (value & ~(RXC_BIT));
+    }
+    if(!inputRegister[address])
+    {
+        return value;
+    }
+    if(fuzzInputCursor < fuzzInputSize)
+    {
+        return fuzzInput[fuzzInputCursor++];
+    }
+    fuzzInputDrained = true;
+    return value;
+}
+
+void saveBootSnapshot()
+{
+    memcpy(bootSnapshot.data, memory, ENTRY_ADDRESS);
+    memcpy(bootSnapshot.flash, &memory[ENTRY_ADDRESS], sizeof(bootSnapshot.flash));
+    bootSnapshot.PC = PC;
+    bootSnapshot.SREG = SREG;
+    bootSnapshot.stackPointer = stackPointer;
+    bootSnapshot.cycleCount = cycleCount;
+    bootSnapshot.pendingInterrupts = pendingInterrupts;
+    bootSnapshot.interruptInhibit = interruptInhibit;
+    bootSnapshot.trackedFetches = trackedFetches;
+    bootSnapshot.watchdogResetCycle = watchdogResetCycle;
+}
+
+void restoreBootSnapshot()
+{
+    memcpy(memory, bootSnapshot.data, ENTRY_ADDRESS);
+    if(flashWritten)
+    {
+        memcpy(&memory[ENTRY_ADDRESS], bootSnapshot.flash, sizeof(bootSnapshot.flash));
+        predecodeProgram(programStart, programEnd);
+        flashWritten = false;
+    }
+    PC = bootSnapshot.PC;
+    SREG = bootSnapshot.SREG;
+    stackPointer = bootSnapshot.stackPointer;
+    cycleCount = bootSnapshot.cycleCount;
+    pendingInterrupts = bootSnapshot.pendingInterrupts;
+    interruptInhibit = bootSnapshot.interruptInhibit;
+    trackedFetches = bootSnapshot.trackedFetches;
+    watchdogResetCycle = bootSnapshot.watchdogResetCycle;
+    stopReason = STOP_BUDGET;
+    updateInterruptMask();
+}
+
+uint64_t watchdogTimeout()
+{
+    uint8_t control = memory[WDTCSR_ADDRESS];
+    return (uint64_t)WATCHDOG_CYCLES << (((control & WDP3_BIT) >> 2) | (control & 0x7));
+}
+
+// Runs up to the first read of an input register, which completes with the
+// idle value. Returns false when the image stops before asking for input.
+bool fuzzBoot()
+{
+    for(uint32_t i = 0; i < sizeof(fuzzInputAddresses)/sizeof(fuzzInputAddresses[0]); i++)
+    {
+        setWatchpoint(fuzzInputAddresses[i], WATCH_READ);
+    }
+    setWatchpoint(UCSRA_ADDRESS, WATCH_READ);
+    int32_t reason = STOP_BUDGET;
+    for(uint64_t booted = 0; booted < FUZZ_BOOT_LIMIT; booted += INSTRUCTION_LIMIT)
+    {
+        reason = runUntil(INSTRUCTION_LIMIT, 0);
+        if((reason == STOP_SLEEP) && wakeFromSleep())
+        {
+            continue;
+        }
+        if(reason != STOP_BUDGET)
+        {
+            break;
+        }
+    }
+    clearWatchpoints();
+    watchpointAddress = -1;
+    watchdogResetCycle = cycleCount;
+    return (reason == STOP_BUDGET) || (reason == STOP_WATCHPOINT);
+}
+
+// Runs the current input from the boot snapshot and returns a FUZZ_CRASH_*
+// code.
+int32_t fuzzOne()
+{
+    restoreBootSnapshot();
+    fuzzInputCursor = 0;
+    fuzzInputDrained = false;
+    previousLocation = 0;
+    uint64_t remaining = FUZZ_INSTRUCTION_BUDGET;
+    while(remaining)
+    {
+        int32_t reason = runUntil(INSTRUCTION_LIMIT, 0);
+        remaining = (remaining > INSTRUCTION_LIMIT) ? remaining - INSTRUCTION_LIMIT: 0;
+        if(reason == STOP_ILLEGAL_OPCODE)
+        {
+            return FUZZ_CRASH_ILLEGAL_OPCODE;
+        }
+        if(reason == STOP_STACK_OVERFLOW)
+        {
+            return FUZZ_CRASH_STACK_OVERFLOW;
+        }
+        if((memory[WDTCSR_ADDRESS] & WDE_BIT) && ((cycleCount - watchdogResetCycle) >= watchdogTimeout()))
+        {
+            return FUZZ_CRASH_WATCHDOG;
+        }
+        if(reason == STOP_SLEEP)
+        {
+            if(!wakeFromSleep())
+            {
+                //Nothing but the watchdog could end this sleep
+                return (memory[WDTCSR_ADDRESS] & WDE_BIT) ? FUZZ_CRASH_WATCHDOG: FUZZ_CRASH_NONE;
+            }
+        }
+        else if(reason != STOP_BUDGET)
+        {
+            break;
+        }
+        if(fuzzInputDrained && (remaining > FUZZ_TAIL_INSTRUCTIONS))
+        {
+            remaining = FUZZ_TAIL_INSTRUCTIONS;
+        }
+    }
+    return FUZZ_CRASH_NONE;
+}
+
+// Reads a whole input from path, or from stdin when path is NULL.
+bool loadFuzzInput(const char* path)
+{
+    int32_t input = path ? open(path, O_RDONLY): 0;
+    if(input < 0)
+    {
+        return false;
+    }
+    fuzzInputSize = 0;
+    ssize_t length;
+    while((fuzzInputSize < FUZZ_INPUT_LIMIT) && ((length = read(input, &fuzzInput[fuzzInputSize], FUZZ_INPUT_LIMIT - fuzzInputSize)) > 0))
+    {
+        fuzzInputSize += length;
+    }
+    if(path)
+    {
+        close(input);
+    }
+    return true;
+}
+
+// Child side of a persistent afl-fuzz session: stops itself after every
+// input so that the fork server can resume it for the next one. Crashes
+// abort, which afl-fuzz records before forking a fresh child.
+void fuzzPersistent(const char* path)
+{
+    for(int32_t run = 0; run < FUZZ_PERSISTENT_RUNS; run++)
+    {
+        if(run)
+        {
+            raise(SIGSTOP);
+            previousLocation = 0;
+        }
+        if(!loadFuzzInput(path))
+        {
+            _exit(1);
+        }
+        if(fuzzOne() != FUZZ_CRASH_NONE)
+        {
+            abort();
+        }
+    }
+}
+
+// AFL fork server protocol. Returns false right away when not started by
+// afl-fuzz; otherwise serves runs until afl-fuzz goes away.
+bool fuzzForkServer(const char* path)
+{
+    int32_t status = 0;
+    if(write(FORKSERVER_FD + 1, &status, 4) != 4)
+    {
+        return false;
+    }
+    pid_t child = -1;
+    bool stopped = false;
+    while(true)
+    {
+        int32_t killed;
+        if(read(FORKSERVER_FD, &killed, 4) != 4)
+        {
+            return true;
+        }
+        if(stopped && killed)
+        {
+            waitpid(child, &status, 0);
+            stopped = false;
+        }
+        if(stopped)
+        {
+            kill(child, SIGCONT);
+        }
+        else
+        {
+            child = fork();
+            if(child < 0)
+            {
+                return true;
+            }
+            if(child == 0)
+            {
+                close(FORKSERVER_FD);
+                close(FORKSERVER_FD + 1);
+                fuzzPersistent(path);
+                _exit(0);
+            }
+        }
+        if(write(FORKSERVER_FD + 1, &child, 4) != 4)
+        {
+            return true;
+        }
+        if(waitpid(child, &status, WUNTRACED) < 0)
+        {
+            return true;
+        }
+        stopped = WIFSTOPPED(status);
+        if(write(FORKSERVER_FD + 1, &status, 4) != 4)
+        {
+            return true;
+        }
+    }
+}
+
+// Under afl-fuzz the input file is the first argument (@@) or stdin. Run
+// directly, every argument is an input and the run ends with throughput
+// and coverage figures; the exit code is 1 if any input crashed.
+int32_t fuzzMain(int32_t inputCount, char** inputs)
+{
+    char buffer[1024];
+    portCallback = ignorePort;
+    spiCallback = ignoreSpi;
+    ioReadCallback = readFuzzInput;
+    for(uint32_t i = 0; i < sizeof(fuzzInputAddresses)/sizeof(fuzzInputAddresses[0]); i++)
+    {
+        inputRegister[fuzzInputAddresses[i]] = true;
+    }
+    if(!fuzzBoot())
+    {
+        sprintf(buffer, "Stopped on %s at address 0x%X during boot", stopReasonNames[stopReason], PC);
+        platformPrint(buffer);
+        return 1;
+    }
+    saveBootSnapshot();
+    memset(localEdges, 0, sizeof(localEdges));
+
+    const char* sharedMemory = getenv("__AFL_SHM_ID");
+    if(sharedMemory)
+    {
+        void* map = shmat(atoi(sharedMemory), NULL, 0);
+        if(map != (void*)-1)
+        {
+            edgeMap = (uint8_t*)map;
+        }
+    }
+    if(fuzzForkServer((inputCount > 0) ? inputs[0]: NULL))
+    {
+        return 0;
+    }
+
+    microseconds start = duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch());
+    int32_t crashes = 0;
+    int32_t runs = (inputCount > 0) ? inputCount: 1;
+    for(int32_t run = 0; run < runs; run++)
+    {
+        const char* path = (inputCount > 0) ? inputs[run]: NULL;
+        if(!loadFuzzInput(path))
+        {
+            sprintf(buffer, "Cannot read %s", path);
+            platformPrint(buffer);
+            return 1;
+        }
+        int32_t crash = fuzzOne();
+        if(crash != FUZZ_CRASH_NONE)
+        {
+            sprintf(buffer, "Crash (%s) at address 0x%X on %s", fuzzCrashNames[crash], PC, path ? path: "stdin");
+            platformPrint(buffer);
+            crashes++;
+        }
+    }
+    microseconds end = duration_cast<microseconds>(high_resolution_clock::now().time_since_epoch());
+
+    int32_t edges = 0;
+    for(int32_t i = 0; i < EDGE_MAP_SIZE; i++)
+    {
+        edges += (edgeMap[i] != 0);
+    }
+    long long elapsed = (long long)(end.count()-start.count());
+    sprintf(buffer, "%i execs in %lld us, %lld execs/s, %i edges, %i crashes", runs, elapsed, elapsed ? (runs*1000000LL)/elapsed: 0, edges, crashes);
+    platformPrint(buffer);
+    return crashes ? 1: 0;
+}
+#endif
+
+//Reverse Execution
+// A history keeps checkpoints while the core runs: the CPU state and, as an
+// undo log, the previous contents of every data space page that changed
+// since the checkpoint before. The newest data space is kept as a shadow,
+// so going back applies undo pages newest first, loads the CPU state of the
+// nearest earlier checkpoint and re-executes forward from there. Port, SPI
+// and I/O write callbacks are silenced while re-executing, since they saw
+// those writes already. Flash is not checkpointed.
+struct coreState
+{
+    programCounter PC;
+    uint8_t SREG;
+    uint16_t stackPointer;
+    uint64_t cycleCount;
+    uint64_t pendingInterrupts;
+    bool interruptInhibit;
+    int32_t trackedFetches;
+    int32_t programEnd;
+};
+
+void saveCoreState(coreState& state)
+{
+    state.PC = PC;
+    state.SREG = SREG;
+    state.stackPointer = stackPointer;
+    state.cycleCount = cycleCount;
+    state.pendingInterrupts = pendingInterrupts;
+    state.interruptInhibit = interruptInhibit;
+    state.trackedFetches = trackedFetches;
+    state.programEnd = programEnd;
+}
+
+void loadCoreState(const coreState& state)
+{
+    PC = state.PC;
+    SREG = state.SREG;
+    stackPointer = state.stackPointer;
+    cycleCount = state.cycleCount;
+    pendingInterrupts = state.pendingInterrupts;
+    interruptInhibit = state.interruptInhibit;
+    trackedFetches = state.trackedFetches;
+    programEnd = state.programEnd;
+    updateInterruptMask();
+}
+
+#define HISTORY_PAGE_SIZE 256
+#define HISTORY_PAGE_COUNT (ENTRY_ADDRESS/HISTORY_PAGE_SIZE)
+#define HISTORY_INTERVAL_MIN 65536ULL
+#define HISTORY_INTERVAL_MAX (1ULL << 32)
+// Share of run time, in percent, that taking checkpoints may cost. The
+// interval between them doubles above it and halves below a quarter of it.
+#define HISTORY_OVERHEAD 2
+
+struct checkpoint
+{
+    coreState state;
+    uint64_t instructions;
+    int32_t pageCount;
+    uint8_t pageIndex[HISTORY_PAGE_COUNT];
+    uint8_t* pages; // pageCount pages as they were at the checkpoint before
+};
+
+struct executionHistory
+{
+    checkpoint* ring;
+    int32_t capacity;
+    int32_t oldest;
+    int32_t count;
+    uint8_t shadow[ENTRY_ADDRESS]; // data space at the newest checkpoint
+    uint64_t interval; // cycles
+    uint64_t nextCycle;
+    bool stale; // changed outside a run since the newest checkpoint
+    uint64_t checkpointTime; // nanoseconds, decaying
+    uint64_t runTime;
+};
+
+executionHistory* history = NULL;
+
+executionHistory* createHistory(int32_t capacity)
+{
+    executionHistory* created = (executionHistory*)calloc(1, sizeof(executionHistory));
+    if(!created)
+    {
+        return NULL;
+    }
+    created->ring = (checkpoint*)calloc(capacity, sizeof(checkpoint));
+    if(!created->ring)
+    {
+        free(created);
+        return NULL;
+    }
+    created->capacity = capacity;
+    created->interval = HISTORY_INTERVAL_MIN;
+    created->stale = true;
+    return created;
+}
+
+checkpoint& historyEntry(executionHistory* from, int32_t index)
+{
+    return from->ring[(from->oldest + index) % from->capacity];
+}
+
+// Drops every checkpoint after index
+void truncateHistory(executionHistory* from, int32_t index)
+{
+    while(from->count > index + 1)
+    {
+        checkpoint& entry = historyEntry(from, --from->count);
+        free(entry.pages);
+        entry.pages = NULL;
+    }
+}
+
+void clearHistory(executionHistory* from)
+{
+    if(from)
+    {
+        truncateHistory(from, -1);
+        from->oldest = 0;
+        from->stale = true;
+    }
+}
+
+void destroyHistory(executionHistory* from)
+{
+    if(from)
+    {
+        clearHistory(from);
+        free(from->ring);
+        free(from);
+    }
+}
+
+void takeCheckpoint()
+{
+    steady_clock::time_point start = steady_clock::now();
+    if(history->count == history->capacity)
+    {
+        checkpoint& evicted = historyEntry(history, 0);
+        free(evicted.pages);
+        evicted.pages = NULL;
+        history->oldest = (history->oldest + 1) % history->capacity;
+        history->count--;
+    }
+    checkpoint& entry = historyEntry(history, history->count);
+    saveCoreState(entry.state);
+    entry.instructions = instructionCount;
+    entry.pageCount = 0;
+    entry.pages = NULL;
+    if(!history->count)
+    {
+        memcpy(history->shadow, memory, ENTRY_ADDRESS);
+    }
+    for(int32_t page = 0; page < HISTORY_PAGE_COUNT; page++)
+    {
+        if(memcmp(&memory[page*HISTORY_PAGE_SIZE], &history->shadow[page*HISTORY_PAGE_SIZE], HISTORY_PAGE_SIZE))
+        {
+            entry.pageIndex[entry.pageCount++] = page;
+        }
+    }
+    if(entry.pageCount && !(entry.pages = (uint8_t*)malloc(entry.pageCount*HISTORY_PAGE_SIZE)))
+    {
+        //Out of memory, keep the older history consistent and skip this one
+        history->nextCycle = cycleCount + history->interval;
+        return;
+    }
+    for(int32_t i = 0; i < entry.pageCount; i++)
+    {
+        int32_t offset = entry.pageIndex[i]*HISTORY_PAGE_SIZE;
+        memcpy(&entry.pages[i*HISTORY_PAGE_SIZE], &history->shadow[offset], HISTORY_PAGE_SIZE);
+        memcpy(&history->shadow[offset], &memory[offset], HISTORY_PAGE_SIZE);
+    }
+    history->count++;
+    history->stale = false;
+
+    history->checkpointTime += duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    if(history->checkpointTime*100 > history->runTime*HISTORY_OVERHEAD)
+    {
+        history->interval = (history->interval < HISTORY_INTERVAL_MAX) ? history->interval*2: history->interval;
+    }
+    else if(history->checkpointTime*100*4 < history->runTime*HISTORY_OVERHEAD)
+    {
+        history->interval = (history->interval > HISTORY_INTERVAL_MIN) ? history->interval/2: history->interval;
+    }
+    history->checkpointTime /= 2;
+    history->runTime /= 2;
+    history->nextCycle = cycleCount + history->interval;
+}
+
+// Rebuilds the data space and CPU state of a checkpoint, keeping the ones
+// after it
+void restoreCheckpoint(int32_t index)
+{
+    memcpy(memory, history->shadow, ENTRY_ADDRESS);
+    for(int32_t newer = history->count - 1; newer > index; newer--)
+    {
+        checkpoint& entry = historyEntry(history, newer);
+        for(int32_t i = 0; i < entry.pageCount; i++)
+        {
+            memcpy(&memory[entry.pageIndex[i]*HISTORY_PAGE_SIZE], &entry.pages[i*HISTORY_PAGE_SIZE], HISTORY_PAGE_SIZE);
+        }
+    }
+    checkpoint& entry = historyEntry(history, index);
+    loadCoreState(entry.state);
+    instructionCount = entry.instructions;
+}
+
+// Newest checkpoint at or before the instruction, -1 if there is none
+int32_t findCheckpoint(uint64_t instruction)
+{
+    for(int32_t index = history->count - 1; index >= 0; index--)
+    {
+        if(historyEntry(history, index).instructions <= instruction)
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// What re-execution looks for, besides the data space addresses
+#define HISTORY_FIND_NOTHING -2
+#define HISTORY_FIND_STOPS -1 // breakpoints and watchpoint hits
+
+// Runs up to the instruction with the write callbacks silenced. Unless it
+// finds nothing, every instruction is its own run and lastHit receives the
+// newest one that was a breakpoint, a watchpoint hit or, for an address,
+// a write to it.
+bool reexecute(uint64_t instruction, int32_t find, int64_t& lastHit)
+{
+    portWriteHandler port = portCallback;
+    spiWriteHandler spi = spiCallback;
+    ioWriteHandler ioWrite = ioWriteCallback;
+    watchHandler watch = watchCallback;
+    portCallback = ignorePort;
+    spiCallback = ignoreSpi;
+    ioWriteCallback = NULL;
+    watchCallback = ignoreWatch;
+    bool reached = true;
+    while(instructionCount < instruction)
+    {
+        uint64_t before = instructionCount;
+        uint8_t value = (find >= 0) ? memory[find]: 0;
+        bool breakpoint = (find == HISTORY_FIND_STOPS) && predecoded[PC >> 1].breakpoint;
+        int32_t reason = runUntil((find == HISTORY_FIND_NOTHING) ? instruction - instructionCount: 1, 0);
+        if(breakpoint || ((find != HISTORY_FIND_NOTHING) && (reason == STOP_WATCHPOINT)) || ((find >= 0) && (memory[find] != value)))
+        {
+            lastHit = before;
+        }
+        if(((reason == STOP_BREAK) || (reason == STOP_ILLEGAL_OPCODE)) && (instructionCount == before))
+        {
+            reached = false;
+            break;
+        }
+    }
+    portCallback = port;
+    spiCallback = spi;
+    ioWriteCallback = ioWrite;
+    watchCallback = watch;
+    return reached;
+}
+
+// Leaves the core just before the given instruction and drops the now
+// diverging checkpoints after it
+bool seekInstruction(uint64_t instruction)
+{
+    int32_t index = findCheckpoint(instruction);
+    if(index < 0)
+    {
+        return false;
+    }
+    restoreCheckpoint(index);
+    truncateHistory(history, index);
+    memcpy(history->shadow, memory, ENTRY_ADDRESS);
+    history->nextCycle = cycleCount + history->interval;
+    history->stale = false;
+    int64_t unused;
+    return reexecute(instruction, HISTORY_FIND_NOTHING, unused);
+}
+
+// Checkpoints as it goes. A budget of 0 is unlimited, as for runUntil.
+int32_t runWithHistory(uint64_t instructions, uint64_t cycles)
+{
+    uint64_t instructionLimit = instructions ? instructionCount + instructions: UINT64_MAX;
+    uint64_t cycleLimit = cycles ? cycleCount + cycles: UINT64_MAX;
+    int32_t reason = STOP_BUDGET;
+    bool first = true;
+    while((instructionCount < instructionLimit) && (cycleCount < cycleLimit))
+    {
+        if(history->stale || (cycleCount >= history->nextCycle))
+        {
+            takeCheckpoint();
+        }
+        //runUntil steps over a breakpoint it starts on, which only the first slice may do
+        if(!first && predecoded[PC >> 1].breakpoint)
+        {
+            return STOP_BREAKPOINT;
+        }
+        first = false;
+        uint64_t limit = (history->nextCycle < cycleLimit) ? history->nextCycle: cycleLimit;
+        steady_clock::time_point start = steady_clock::now();
+        reason = runUntil((instructionLimit == UINT64_MAX) ? 0: instructionLimit - instructionCount, limit - cycleCount);
+        history->runTime += duration_cast<nanoseconds>(steady_clock::now() - start).count();
+        if(reason != STOP_BUDGET)
+        {
+            break;
+        }
+    }
+    return reason;
+}
+
+// Moves back to just before the newest instruction that wrote the data
+// space address, or for HISTORY_FIND_STOPS that hit a breakpoint or a
+// watchpoint. Returns false without moving when the history holds none.
+// Stores trip a watchpoint; pushes and register writes bypass it and are
+// caught by the value changing. Each interval is single-stepped from its
+// checkpoint, newest first.
+bool runBack(int32_t find)
+{
+    uint64_t now = instructionCount;
+    watchpointSet saved = watchpoints;
+    int32_t savedAddress = watchpointAddress;
+    if(find >= 0)
+    {
+        clearWatchpoints();
+        setWatchpoint(find, WATCH_WRITE);
+    }
+    int64_t lastHit = -1;
+    for(int32_t index = findCheckpoint(now); (index >= 0) && (lastHit < 0); index--)
+    {
+        restoreCheckpoint(index);
+        reexecute((index == history->count - 1) ? now: historyEntry(history, index + 1).instructions, find, lastHit);
+    }
+    watchpoints = saved;
+    updateWatchedPages();
+    watchpointAddress = savedAddress;
+    seekInstruction((lastHit >= 0) ? lastHit: now);
+    return lastHit >= 0;
+}
+
+// Runs resume from a fresh checkpoint after the core was changed between
+// runs
+void historyChanged()
+{
+    if(history)
+    {
+        history->stale = true;
+    }
+}
+
+#if !defined(EMSCRIPTEN) && !defined(LIBRARY)
+//GDB Stub
+// "-gdb port" serves the GDB remote serial protocol on a local TCP port,
+// "-gdb path" on a Unix socket. Registers follow avr-gdb: r0 to r31, SREG,
+// SP as two bytes and PC as four, little-endian. Flash is at address 0
+// and the data space at 0x800000. Continuing runs in slices that poll for
+// an interrupt from the debugger in between, keeping a history so that
+// reverse step and continue work. Breakpoints and watchpoints are the
+// core's own, so running at full speed between them costs nothing extra.
+#define GDB_PACKET_SIZE 4096
+#define GDB_DATA_OFFSET 0x800000
+#define GDB_SLICE_CYCLES (CLOCK_HZ/100)
+#define GDB_HISTORY_CHECKPOINTS 1024
+#define GDB_REGISTER_BYTES 39
+
+int32_t gdbConnection = -1;
+bool gdbAcks = true;
+
+int32_t gdbGetChar()
+{
+    uint8_t c = 0;
+    return (recv(gdbConnection, &c, 1, 0) == 1) ? c: -1;
+}
+
+void gdbWrite(const char* data, size_t size)
+{
+    send(gdbConnection, data, size, MSG_NOSIGNAL);
+}
+
+int32_t hexDigit(char c)
+{
+    if((c >= '0') && (c <= '9')) return c - '0';
+    if((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+    if((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+    return -1;
+}
+
+// Reads a hex number and leaves text on the first character after it
+uint32_t parseHex(const char*& text)
+{
+    uint32_t value = 0;
+    for(; hexDigit(*text) >= 0; text++)
+    {
+        value = (value << 4) | hexDigit(*text);
+    }
+    return value;
+}
+
+// Receives the next packet without its framing, false once the debugger
+// is gone. Interrupts sent while the core is stopped are dropped.
+bool gdbReceive(char* packet)
+{
+    while(true)
+    {
+        int32_t c;
+        while(((c = gdbGetChar()) >= 0) && (c != '$'))
+            ;
+        size_t length = 0;
+        uint8_t checksum = 0;
+        while(((c = gdbGetChar()) >= 0) && (c != '#'))
+        {
+            checksum += c;
+            if(length < GDB_PACKET_SIZE - 1)
+            {
+                packet[length++] = c;
+            }
+        }
+        int32_t high = gdbGetChar();
+        int32_t low = gdbGetChar();
+        if((c < 0) || (high < 0) || (low < 0))
+        {
+            return false;
+        }
+        packet[length] = '\0';
+        if(!gdbAcks)
+        {
+            return true;
+        }
+        bool valid = (hexDigit(high) << 4 | hexDigit(low)) == checksum;
+        gdbWrite(valid ? "+": "-", 1);
+        if(valid)
+        {
+            return true;
+        }
+    }
+}
+
+void gdbSend(const char* payload)
+{
+    static char framed[GDB_PACKET_SIZE + 4];
+    uint8_t checksum = 0;
+    size_t length = strlen(payload);
+    for(size_t i = 0; i < length; i++)
+    {
+        checksum += payload[i];
+    }
+    sprintf(framed, "$%s#%02x", payload, checksum);
+    do
+    {
+        gdbWrite(framed, length + 4);
+    }
+    while(gdbAcks && (gdbGetChar() == '-'));
+}
+
+// A Ctrl-C from the debugger while the core runs
+bool gdbInterrupted()
+{
+    uint8_t c = 0;
+    return (recv(gdbConnection, &c, 1, MSG_DONTWAIT) == 1) && (c == 0x03);
+}
+
+// Debugger view of the data space, with SREG and SP where the program
+// would find them
+bool gdbReadByte(uint32_t address, uint8_t& value)
+{
+    if(address < GDB_DATA_OFFSET)
+    {
+        if((address >= FLASH_SIZE) || (ENTRY_ADDRESS + address >= MEMORY_SIZE))
+        {
+            return false;
+        }
+        value = memory[(ENTRY_ADDRESS + address) ^ 1];
+        return true;
+    }
+    address -= GDB_DATA_OFFSET;
+    if(address >= ENTRY_ADDRESS)
+    {
+        return false;
+    }
+    switch(address)
+    {
+        case SREG_ADDRESS:
+            value = SREG;
+            break;
+        case SPL_ADDRESS:
+            value = stackPointer & 0xFF;
+            break;
+        case SPH_ADDRESS:
+            value = stackPointer >> 8;
+            break;
+        default:
+            value = memory[address];
+            break;
+    }
+    return true;
+}
+
+bool gdbWriteByte(uint32_t address, uint8_t value)
+{
+    if(address < GDB_DATA_OFFSET)
+    {
+        if((address >= FLASH_SIZE) || (ENTRY_ADDRESS + address >= MEMORY_SIZE))
+        {
+            return false;
+        }
+        memory[(ENTRY_ADDRESS + address) ^ 1] = value;
+        predecodeProgram(ENTRY_ADDRESS + address - 2*FUSED_RUN_LIMIT, ENTRY_ADDRESS + address + 2);
+        return true;
+    }
+    address -= GDB_DATA_OFFSET;
+    if(address >= ENTRY_ADDRESS)
+    {
+        return false;
+    }
+    memory[address] = value;
+    switch(address)
+    {
+        case SREG_ADDRESS:
+            SREG = value;
+            break;
+        case SPL_ADDRESS:
+            stackPointer = (stackPointer & 0xFF00) | value;
+            break;
+        case SPH_ADDRESS:
+            stackPointer = (stackPointer & 0x00FF) | (value << 8);
+            break;
+    }
+    if(address < INTERRUPT_REGISTER_LIMIT)
+    {
+        updateInterruptMask();
+    }
+    historyChanged();
+    return true;
+}
+
+// Register file as avr-gdb numbers it, 32 is SREG, 33 SP and 34 PC
+uint32_t gdbReadRegister(int32_t reg)
+{
+    switch(reg)
+    {
+        case 32: return SREG;
+        case 33: return stackPointer;
+        case 34: return PC - programStart;
+        default: return memory[reg];
+    }
+}
+
+void gdbWriteRegister(int32_t reg, uint32_t value)
+{
+    switch(reg)
+    {
+        case 32:
+            SREG = value;
+            updateInterruptMask();
+            break;
+        case 33:
+            stackPointer = value;
+            break;
+        case 34:
+            PC = (programStart + value) & ~1;
+            break;
+        default:
+            memory[reg] = value;
+            break;
+    }
+    historyChanged();
+}
+
+int32_t gdbRegisterSize(int32_t reg)
+{
+    return (reg == 34) ? 4: ((reg == 33) ? 2: 1);
+}
+
+void gdbStopReply(int32_t reason, char* reply)
+{
+    switch(reason)
+    {
+        case STOP_WATCHPOINT:
+        {
+            int32_t mode = watchpointMode & (WATCH_READ | WATCH_WRITE);
+            const char* kind = (mode == (WATCH_READ | WATCH_WRITE)) ? "awatch": ((mode == WATCH_READ) ? "rwatch": "watch");
+            sprintf(reply, "T05%s:%x;", kind, GDB_DATA_OFFSET + watchpointAddress);
+            break;
+        }
+        case STOP_ILLEGAL_OPCODE:
+            strcpy(reply, "S04");
+            break;
+        case STOP_STACK_OVERFLOW:
+            strcpy(reply, "S0b");
+            break;
+        case STOP_BREAK:
+        case STOP_SLEEP:
+            sprintf(reply, "W%02x", memory[24]);
+            break;
+        default:
+            strcpy(reply, "S05");
+            break;
+    }
+}
+
+// Runs until something stops the core or the debugger interrupts. Sleep
+// skips ahead to the next timer event, as fetchN does, and only ends the
+// run when nothing could wake the core.
+int32_t gdbRun(uint64_t instructions)
+{
+    bool first = true;
+    while(true)
+    {
+        //Slices after the first must stop on a breakpoint they start on
+        if(!first && predecoded[PC >> 1].breakpoint)
+        {
+            return STOP_BREAKPOINT;
+        }
+        first = false;
+        int32_t reason = runWithHistory(instructions, instructions ? 0: GDB_SLICE_CYCLES);
+        if(reason == STOP_SLEEP)
+        {
+            if(!wakeFromSleep())
+            {
+                return reason;
+            }
+            historyChanged();
+            reason = STOP_BUDGET;
+        }
+        if(instructions || (reason != STOP_BUDGET))
+        {
+            return reason;
+        }
+        if(gdbInterrupted())
+        {
+            return STOP_BUDGET;
+        }
+    }
+}
+
+// Moves back one instruction, or to the last breakpoint or watchpoint hit,
+// and answers "replaylog:begin" when the history runs out first
+void gdbRunBack(bool step, char* reply)
+{
+    bool moved = false;
+    if(history->count && (historyEntry(history, 0).instructions < instructionCount))
+    {
+        moved = step ? seekInstruction(instructionCount - 1): runBack(HISTORY_FIND_STOPS);
+        if(!moved && !step)
+        {
+            seekInstruction(historyEntry(history, 0).instructions);
+        }
+    }
+    strcpy(reply, moved ? "S05": "T05replaylog:begin;");
+}
+
+bool gdbWatch(uint32_t address, uint32_t length, int32_t mode, bool insert)
+{
+    if((address < GDB_DATA_OFFSET) || (length > ENTRY_ADDRESS))
+    {
+        return false;
+    }
+    int32_t start = address - GDB_DATA_OFFSET;
+    watchpoint* entry = findWatchRange(start, start + length);
+    int32_t current = entry ? entry->mode: 0;
+    return setWatchRange(start, start + length, insert ? (current | mode): (current & ~mode), 0);
+}
+
+bool openGdb(const char* endpoint)
+{
+    bool local = strspn(endpoint, "0123456789") != strlen(endpoint);
+    int32_t server = socket(local ? AF_UNIX: AF_INET, SOCK_STREAM, 0);
+    if(server < 0)
+    {
+        return false;
+    }
+    int32_t bound = -1;
+    if(local)
+    {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, endpoint, sizeof(address.sun_path) - 1);
+        //Only a socket left behind by an earlier session is replaced
+        struct stat existing;
+        if(!lstat(endpoint, &existing))
+        {
+            if(!S_ISSOCK(existing.st_mode))
+            {
+                close(server);
+                return false;
+            }
+            unlink(endpoint);
+        }
+        bound = bind(server, (sockaddr*)&address, sizeof(address));
+    }
+    else
+    {
+        int32_t reuse = 1;
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(atoi(endpoint));
+        bound = bind(server, (sockaddr*)&address, sizeof(address));
+    }
+    if((bound < 0) || (listen(server, 1) < 0))
+    {
+        close(server);
+        return false;
+    }
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "Waiting for gdb on %s%s", local ? "": "127.0.0.1:", endpoint);
+    platformPrint(buffer);
+    gdbConnection = accept(server, NULL, NULL);
+    close(server);
+    if(local)
+    {
+        unlink(endpoint);
+    }
+    if(gdbConnection < 0)
+    {
+        return false;
+    }
+    int32_t noDelay = 1;
+    setsockopt(gdbConnection, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    history = createHistory(GDB_HISTORY_CHECKPOINTS);
+    return history != NULL;
+}
+
+// Serves the debugger until it kills the program or goes away. A detach
+// lets the program run on as it would without one.
+void execGdb()
+{
+    static char packet[GDB_PACKET_SIZE];
+    static char reply[GDB_PACKET_SIZE];
+    bool detached = false;
+    bool killed = false;
+    while(!detached && !killed && gdbReceive(packet))
+    {
+        const char* arguments = packet + 1;
+        reply[0] = '\0';
+        switch(packet[0])
+        {
+            case '?':
+                strcpy(reply, "S05");
+                break;
+            case 'g':
+                for(int32_t reg = 0, offset = 0; reg < 35; reg++)
                 {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory(((memory[29] << 8) | memory[28]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
-                    // No SREG Updates
-                    PC+=2;
-                    break;
+                    uint32_t value = gdbReadRegister(reg);
+                    for(int32_t i = 0; i < gdbRegisterSize(reg); i++, offset += 2, value >>= 8)
+                    {
+                        sprintf(&reply[offset], "%02x", value & 0xFF);
+                    }
                 }
-                if((memory[PC+1] & 0xF) < 0x8) //ld (ldd) z
+                break;
+            case 'G':
+                if(strlen(arguments) < 2*GDB_REGISTER_BYTES)
                 {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory(((memory[31] << 8) | memory[30]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
-                    // No SREG Updates
-                    PC+=2;
+                    strcpy(reply, "E01");
                     break;
                 }
-                handleUnimplemented();
-            case 0x8A:
-            case 0x8B:
-            case 0x8E:
-            case 0x8F:
-                if((memory[PC+1] & 0xF) >= 0x8) //st (std) y
+                for(int32_t reg = 0; reg < 35; reg++)
                 {
-                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    writeMemory(((memory[29] << 8) | memory[28]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
-                    // No SREG Updates
-                    PC+=2;
-                    break;
+                    uint32_t value = 0;
+                    for(int32_t i = 0; i < gdbRegisterSize(reg); i++, arguments += 2)
+                    {
+                        value |= (hexDigit(arguments[0]) << 4 | hexDigit(arguments[1])) << (8*i);
+                    }
+                    gdbWriteRegister(reg, value);
                 }
-                if((memory[PC+1] & 0xF) < 0x8) //st (std) z
+                strcpy(reply, "OK");
+                break;
+            case 'p':
+            {
+                int32_t reg = parseHex(arguments);
+                if(reg > 34)
                 {
-                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    writeMemory(((memory[31] << 8) | memory[30]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
-                    // No SREG Updates
-                    PC+=2;
+                    strcpy(reply, "E01");
                     break;
                 }
-                handleUnimplemented();
-            case 0x90:
-            case 0x91:
-                if((memory[PC+1] & 0xF) == 0x0) //lds
+                uint32_t value = gdbReadRegister(reg);
+                for(int32_t i = 0; i < gdbRegisterSize(reg); i++, value >>= 8)
                 {
-                   memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)] = readMemory(((memory[PC+2] << 8) | memory[PC+3]));
-                   // No SREG Updates
-                   PC+=4;
-                   break;
+                    sprintf(&reply[2*i], "%02x", value & 0xFF);
                 }
-                if((memory[PC+1] & 0xF) == 0x1) //ld z+
+                break;
+            }
+            case 'P':
+            {
+                int32_t reg = parseHex(arguments);
+                if((reg > 34) || (*arguments++ != '='))
                 {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory((memory[31] << 8) | memory[30]);
-                    // No SREG Updates
-                    if(memory[30] < 0xFF)
-                    {
-                        memory[30] = memory[30]+1;
-                    }
-                    else
-                    {
-                        memory[31] = memory[31]+1;
-                        memory[30] = 0x00;
-                    }
-                    PC+=2;
+                    strcpy(reply, "E01");
                     break;
                 }
-                if((memory[PC+1] & 0xF) == 0x2) //ld -z
+                uint32_t value = 0;
+                for(int32_t i = 0; (i < gdbRegisterSize(reg)) && (hexDigit(arguments[0]) >= 0); i++, arguments += 2)
                 {
-                    if(memory[30] == 0x00)
-                    {
-                        memory[30] = 0xFF;
-                        memory[31] = memory[31]-1;
-                    }
-                    else
-                    {
-                        memory[30] = memory[30]-1;
-                    }
-                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
-                    memory[result] = readMemory((memory[31] << 8) | memory[30]);
-                    // No SREG Updates
-                    PC+=2;
-                    break;
+                    value |= (hexDigit(arguments[0]) << 4 | hexDigit(arguments[1])) << (8*i);
                 }
-                if((memory[PC+1] & 0xF) == 0x4) //lpm (rd, z)
+                gdbWriteRegister(reg, value);
+                strcpy(reply, "OK");
+                break;
+            }
+            case 'm':
+            {
+                uint32_t address = parseHex(arguments);
+                arguments++;
+                uint32_t length = parseHex(arguments);
+                length = (length < GDB_PACKET_SIZE/2) ? length: GDB_PACKET_SIZE/2 - 1;
+                uint8_t value = 0;
+                for(uint32_t i = 0; (i < length) && gdbReadByte(address + i, value); i++)
                 {
-                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
-                    memory[result] = readMemory(2*(((memory[31] << 8) | memory[30]) >> 1) + programStart + ((((memory[31] << 8) | memory[30]) & 0x1) == 0 ? 1: 0));
-                    // No SREG Updates
-                    PC+=2;
-                    break;
+                    sprintf(&reply[2*i], "%02x", value);
                 }
-                if((memory[PC+1] & 0xF) == 0x5) //lpm (rd, z+)
+                if(length && !reply[0])
                 {
-                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
-                    memory[result] = readMemory(2*(((memory[31] << 8) | memory[30]) >> 1) + programStart + ((((memory[31] << 8) | memory[30]) & 0x1) == 0 ? 1: 0));
-                    // No SREG Updates
-                    if(memory[30] < 0xFF)
-                    {
-                        memory[30] = memory[30]+1;
-                    }
-                    else
-                    {
-                        memory[31] = memory[31]+1;
-                        memory[30] = 0x00;
-                    }
-                    PC+=2;
-                    break;
+                    strcpy(reply, "E01");
                 }
-                if((memory[PC+1] & 0xF) == 0x7) //elpm
+                break;
+            }
+            case 'M':
+            {
+                uint32_t address = parseHex(arguments);
+                arguments++;
+                uint32_t length = parseHex(arguments);
+                arguments++;
+                strcpy(reply, "OK");
+                for(uint32_t i = 0; i < length; i++, arguments += 2)
                 {
-                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
-                    memory[result] = readMemory(2*(((memory[31] << 8) | memory[30]) >> 1) + programStart + ((((memory[31] << 8) | memory[30]) & 0x1) == 0 ? 1: 0) + (memory[ATMEGA2560_RAMPZ] << 16));
-                    // No SREG Updates
-                    if(memory[30] < 0xFF)
-                    {
-                        memory[30] = memory[30]+1;
-                    }
-                    else
+                    if((hexDigit(arguments[0]) < 0) || (hexDigit(arguments[1]) < 0) || !gdbWriteByte(address + i, hexDigit(arguments[0]) << 4 | hexDigit(arguments[1])))
                     {
-                        memory[31] = memory[31]+1;
-                        memory[30] = 0x00;
+                        strcpy(reply, "E01");
+                        break;
                     }
-                    PC+=2;
-                    break;
                 }
-                if((memory[PC+1] & 0xF) == 0x9) //ld y+
+                break;
+            }
+            case 'c':
+            case 's':
+            {
+                if(*arguments)
                 {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory((memory[29] << 8) | memory[28]);
-                    // No SREG Updates
-                    if(memory[28] < 0xFF)
-                    {
-                        memory[28] = memory[28]+1;
-                    }
-                    else
-                    {
-                        memory[29] = memory[29]+1;
-                        memory[29] = 0x00;
-                    }
-                    PC+=2;
-                    break;
+                    gdbWriteRegister(34, parseHex(arguments));
                 }
-                if((memory[PC+1] & 0xF) == 0xA) //ld -y
+                int32_t reason = gdbRun(packet[0] == 's');
+                if((reason == STOP_BUDGET) && (packet[0] == 'c'))
                 {
-                    if(memory[28] == 0x00)
-                    {
-                        memory[28] = 0xFF;
-                        memory[29] = memory[29]-1;
-                    }
-                    else
-                    {
-                        memory[28] = memory[28]-1;
-                    }
-                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
-                    memory[result] = readMemory((memory[29] << 8) | memory[28]);
-                    // No SREG Updates
-                    PC+=2;
-                    break;
+                    strcpy(reply, "S02");
                 }
-                if((memory[PC+1] & 0xF) == 0xC) //ld x
+                else
                 {
-                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
-                    memory[result] = readMemory((memory[27] << 8) | memory[26]);
-                    // No SREG Updates
-                    PC+=2;
-                    break;
+                    gdbStopReply(reason, reply);
                 }
-                if((memory[PC+1] & 0xF) == 0xD) //ld x+
+                break;
+            }
+            case 'b':
+                if((arguments[0] == 's') || (arguments[0] == 'c'))
                 {
-                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
-                    memory[result] = readMemory((memory[27] << 8) | memory[26]);
-                    // No SREG Updates
-                    if(memory[26] < 0xFF)
-                    {
-                        memory[26] = memory[26]+1;
-                    }
-                    else
-                    {
-                        memory[27] = memory[27]+1;
-                        memory[26] = 0x00;
-                    }
-                    PC+=2;
-                    break;
+                    gdbRunBack(arguments[0] == 's', reply);
                 }
-                if((memory[PC+1] & 0xF) == 0xF) //pop
+                break;
+            case 'Z':
+            case 'z':
+            {
+                int32_t type = parseHex(arguments);
+                arguments++;
+                uint32_t address = parseHex(arguments);
+                arguments++;
+                uint32_t length = parseHex(arguments);
+                bool insert = packet[0] == 'Z';
+                bool done = false;
+                if((type <= 1) && (address < FLASH_SIZE))
                 {
-                    result = ((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4);
-                    incrementStackPointer();
-                    memory[result] = memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]];
-                    // No SREG Updates
-                    PC+=2;
-                    break;
+                    setBreakpoint(address, insert);
+                    done = true;
                 }
-                handleUnimplemented();
-            case 0x92:
-            case 0x93:
-               if((memory[PC+1] & 0xF) == 0x0) //sts
-               {
-                  writeMemory(((memory[PC+2] << 8) | memory[PC+3]), memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)]);
-                  // No SREG Updates
-                  PC+=4;
-                  break;
-               }
-               if((memory[PC+1] & 0xF) == 0x1) //st (std) z+
-               {
-                   result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                   writeMemory((memory[31] << 8) | memory[30], result);
-                   // No SREG Updates
-                   if(memory[30] < 0xFF)
-                   {
-                       memory[30] = memory[30]+1;
-                   }
-                   else
-                   {
-                       memory[31] = memory[31]+1;
-                       memory[30] = 0x00;
-                   }
-                   PC+=2;
-                   break;
-               }
-               if((memory[PC+1] & 0xF) == 0x2) //st (std) -z
-               {
-                   result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                   if(memory[30] == 0x00)
-                   {
-                       memory[30] = 0xFF;
-                       memory[31] = memory[31]-1;
-                   }
-                   else
-                   {
-                       memory[30] = memory[30]-1;
-                   }
-                   writeMemory(((memory[31] << 8) | memory[30]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
-                   // No SREG Updates
-                   PC+=2;
-                   break;
-               }
-               if((memory[PC+1] & 0xF) == 0x9) //st (std) y+
-               {
-                   result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                   writeMemory(((memory[29] << 8) | memory[28]), result);
-                   // No SREG Updates
-                   if(memory[28] < 0xFF)
-                   {
-                       memory[28] = memory[28]+1;
-                   }
-                   else
-                   {
-                       memory[29] = memory[29]+1;
-                       memory[28] = 0x00;
-                   }
-                   PC+=2;
-                   break;
-               }
-               if((memory[PC+1] & 0xF) == 0xA) //st (std) -y
-               {
-                   if(memory[28] == 0x00)
-                   {
-                       memory[29] = memory[29]-1;
-                       memory[28] = 0xFF;
-                   }
-                   else
-                   {
-                       memory[28] = memory[28]-1;
-                   }
-                   result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                   writeMemory(((memory[29] << 8) | memory[28]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
-                   // No SREG Updates
-                   PC+=2;
-                   break;
-               }
-               if((memory[PC+1] & 0xF) == 0xF) //push
-               {
-                   memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                   decrementStackPointer();
-                   // No SREG Updates
-                   PC+=2;
-                   break;
-               }
-               if((memory[PC+1] & 0xF) == 0xC) //st x
-               {
-                   result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                   writeMemory((memory[27] << 8) | memory[26], result);
-                   // No SREG Updates
-                   PC+=2;
-                   break;
-               }
-               if((memory[PC+1] & 0xF) == 0xD) //st x+
-               {
-                   result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                   writeMemory((memory[27] << 8) | memory[26], result);
-                   // No SREG Updates
-                   if(memory[26] < 0xFF)
-                   {
-                       memory[26] = memory[26]+1;
-                   }
-                   else
-                   {
-                       memory[27] = memory[27]+1;
-                       memory[26] = 0x00;
-                   }
-                   PC+=2;
-                   break;
-               }
-               if((memory[PC+1] & 0xF) == 0xE) //st -x
-               {
-                   result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                   if(memory[26] == 0x00)
-                   {
-                       memory[26] = 0xFF;
-                       memory[27] = memory[27]-1;
-                   }
-                   else
-                   {
-                       memory[26] = memory[26]-1;
-                   }
-                   writeMemory((memory[27] << 8) | memory[26], result);
-                   // No SREG Updates
-                   PC+=2;
-                   break;
-               }
-               handleUnimplemented();
-            case 0x94:
-            case 0x95:
-                if((memory[PC] == 0x94) && (memory[PC+1] == 0x08)) //sec
-                {
-                    newStatus.C = SET;
-                    PC+=2;
-                    break;
+                else if((type >= 2) && (type <= 4))
+                {
+                    int32_t modes[3] = {WATCH_WRITE, WATCH_READ, WATCH_READ | WATCH_WRITE};
+                    done = gdbWatch(address, length, modes[type - 2], insert);
                 }
-                if((memory[PC] == 0x94) && (memory[PC+1] == 0x09)) //ijmp
+                strcpy(reply, done ? "OK": "E01");
+                break;
+            }
+            case 'q':
+                if(!strncmp(packet, "qSupported", 10))
                 {
-                    result = (2*((memory[31] << 8) | memory[30])) + programStart;
-                    // No SREG Updates
-                    PC = result;
-                    break;
+                    sprintf(reply, "PacketSize=%x;QStartNoAckMode+;ReverseStep+;ReverseContinue+", GDB_PACKET_SIZE);
                 }
-                if((memory[PC] == 0x94) && (memory[PC+1] == 0x68)) //set
+                else if(!strcmp(packet, "qAttached"))
                 {
-                    newStatus.T = SET;
-                    PC+=2;
-                    break;
+                    strcpy(reply, "1");
                 }
-                if((memory[PC] == 0x94) && (memory[PC+1] == 0x78)) //sei
+                else if(!strcmp(packet, "qC"))
                 {
-                    newStatus.I = SET;
-                    PC+=2;
-                    break;
+                    strcpy(reply, "QC1");
                 }
-                if((memory[PC] == 0x94) && (memory[PC+1] == 0xE8)) //clt
+                else if(!strcmp(packet, "qfThreadInfo"))
                 {
-                    newStatus.T = CLR;
-                    PC+=2;
-                    break;
+                    strcpy(reply, "m1");
                 }
-                if((memory[PC] == 0x94) && (memory[PC+1] == 0xF8)) //cli
+                else if(!strcmp(packet, "qsThreadInfo"))
                 {
-                    newStatus.I = CLR;
-                    PC+=2;
-                    break;
+                    strcpy(reply, "l");
                 }
-                if((memory[PC+1] == 0x88) || (memory[PC+1] == 0xA8)) //sleep || wdr
+                break;
+            case 'Q':
+                if(!strcmp(packet, "QStartNoAckMode"))
                 {
-                    // No SREG Updates
-                    PC+=2;
-                    break;
+                    gdbSend("OK");
+                    gdbAcks = false;
+                    continue;
                 }
-                if((memory[PC] == 0x95) && (memory[PC+1] == 0x8)) //ret
+                break;
+            case 'H':
+            case 'T':
+                strcpy(reply, "OK");
+                break;
+            case 'v':
+                if(!strcmp(packet, "vKill;1"))
                 {
-                    incrementStackPointer();
-                    result = (memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS];
-                    // No SREG Updates
-                    incrementStackPointer();
+                    gdbSend("OK");
+                    killed = true;
+                    continue;
+                }
+                break;
+            case 'k':
+                killed = true;
+                continue;
+            case 'D':
+                strcpy(reply, "OK");
+                detached = true;
+                break;
+        }
+        gdbSend(reply);
+    }
+    close(gdbConnection);
+    destroyHistory(history);
+    history = NULL;
+    if(detached)
+    {
+        runProgram();
+        reportStop();
+    }
+}
+
+//Co-simulation
+// "-cosim n" checks the fast engine, with whatever superinstructions and
+// tiers are enabled, against plain fetch() every n instructions. Each
+// interval runs on the reference interpreter first with its writes
+// silenced, then again from the same state on the fast engine, whose
+// output is the one shown. The reason either stopped, the instruction and
+// cycle counts, PC, SREG, SP, pending interrupts and the whole data space
+// must then match. A mismatch is bisected down to the first instruction
+// after which the engines differ, which is printed with the reference
+// trace leading up to it, and the run exits with status 1. Fused sequences
+// never straddle the end of an interval, so intervals much longer than
+// FUSED_RUN_LIMIT keep the fast paths busy.
+#define COSIM_TRACE_CONTEXT 16
+#define COSIM_DIFFERENCE_LIMIT 32
+
+struct cosimState
+{
+    coreState state;
+    uint64_t instructions;
+    int32_t reason;
+    uint8_t data[ENTRY_ADDRESS];
+};
+
+cosimState cosimStart;
+cosimState cosimReference;
+cosimState cosimFast;
+
+void saveCosim(cosimState& to, int32_t reason)
+{
+    saveCoreState(to.state);
+    to.instructions = instructionCount;
+    to.reason = reason;
+    memcpy(to.data, memory, ENTRY_ADDRESS);
+}
+
+void loadCosim(const cosimState& from)
+{
+    //The interrupt mask is rebuilt from the data space
+    memcpy(memory, from.data, ENTRY_ADDRESS);
+    loadCoreState(from.state);
+    instructionCount = from.instructions;
+}
+
+// Runs up to n instructions on one engine and wakes the core from sleep
+// like fetchN()
+int32_t runEngine(bool reference, bool silent, uint64_t n)
+{
+    portWriteHandler port = portCallback;
+    spiWriteHandler spi = spiCallback;
+    ioWriteHandler ioWrite = ioWriteCallback;
+    watchHandler watch = watchCallback;
+    bool traced = tracing;
+    if(silent)
+    {
+        portCallback = ignorePort;
+        spiCallback = ignoreSpi;
+        ioWriteCallback = NULL;
+        watchCallback = ignoreWatch;
+        tracing = false;
+    }
+    semihostMuted = silent;
+    referenceEngine = reference;
+    int32_t reason = n ? runUntil(n, 0): STOP_BUDGET;
+    if((reason == STOP_SLEEP) && wakeFromSleep())
+    {
+        reason = STOP_BUDGET;
+    }
+    referenceEngine = false;
+    semihostMuted = false;
+    portCallback = port;
+    spiCallback = spi;
+    ioWriteCallback = ioWrite;
+    watchCallback = watch;
+    tracing = traced;
+    return reason;
+}
+
+bool cosimField(const char* name, uint64_t reference, uint64_t fast, bool print)
+{
+    if(print && (reference != fast))
+    {
+        char buffer[256];
+        sprintf(buffer, "  %s 0x%llX reference, 0x%llX fast", name, (unsigned long long)reference, (unsigned long long)fast);
+        platformPrint(buffer);
+    }
+    return reference != fast;
+}
+
+// Returns how many differences there are between the two engines
+int32_t cosimDifferences(bool print)
+{
+    const coreState& reference = cosimReference.state;
+    const coreState& fast = cosimFast.state;
+    int32_t count = cosimField("stop reason", cosimReference.reason, cosimFast.reason, print);
+    count += cosimField("instructions", cosimReference.instructions, cosimFast.instructions, print);
+    count += cosimField("cycles", reference.cycleCount, fast.cycleCount, print);
+    count += cosimField("PC", reference.PC, fast.PC, print);
+    count += cosimField("SREG", reference.SREG, fast.SREG, print);
+    count += cosimField("SP", reference.stackPointer, fast.stackPointer, print);
+    count += cosimField("pending interrupts", reference.pendingInterrupts, fast.pendingInterrupts, print);
+    count += cosimField("interrupt inhibit", reference.interruptInhibit, fast.interruptInhibit, print);
+    char name[32];
+    for(int32_t address = 0; address < ENTRY_ADDRESS; address++)
+    {
+        if(cosimReference.data[address] == cosimFast.data[address])
+        {
+            continue;
+        }
+        if(address < 32)
+        {
+            sprintf(name, "r%d", address);
+        }
+        else
+        {
+            sprintf(name, "[0x%04X]", address);
+        }
+        cosimField(name, cosimReference.data[address], cosimFast.data[address], print && (count < COSIM_DIFFERENCE_LIMIT));
+        count++;
+    }
+    if(print && (count > COSIM_DIFFERENCE_LIMIT))
+    {
+        char buffer[256];
+        sprintf(buffer, "  %d more differences", count - COSIM_DIFFERENCE_LIMIT);
+        platformPrint(buffer);
+    }
+    return count;
+}
+
+// Runs n instructions from cosimStart on both engines, leaving the core in
+// the state of the fast one. Returns true when they match.
+bool cosimInterval(uint64_t n, bool silent)
+{
+    loadCosim(cosimStart);
+    saveCosim(cosimReference, runEngine(true, true, n));
+    loadCosim(cosimStart);
+    saveCosim(cosimFast, runEngine(false, silent, n));
+    return !cosimDifferences(false);
+}
+
+// Bisects a diverging interval down to the first instruction after which
+// the engines differ, then prints the reference trace up to there
+void reportDivergence(uint64_t interval)
+{
+    uint64_t same = 0;
+    uint64_t differ = interval;
+    while(differ - same > 1)
+    {
+        uint64_t middle = same + (differ - same)/2;
+        if(cosimInterval(middle, true))
+        {
+            same = middle;
+        }
+        else
+        {
+            differ = middle;
+        }
+    }
+    char buffer[256];
+    sprintf(buffer, "Cosim: engines diverge after instruction %llu", (unsigned long long)(cosimStart.instructions + differ));
+    platformPrint(buffer);
+    loadCosim(cosimStart);
+    runEngine(true, true, (differ > COSIM_TRACE_CONTEXT) ? differ - COSIM_TRACE_CONTEXT: 0);
+    char text[64];
+    while(instructionCount < cosimStart.instructions + differ)
+    {
+        uint64_t instruction = instructionCount;
+        programCounter address = PC;
+        if(interruptReady && !interruptInhibit)
+        {
+            //The step enters the interrupt and runs the first instruction of its vector
+            address = programStart + __builtin_ctzll(pendingInterrupts & enabledInterrupts)*INTERRUPT_VECTOR_SIZE;
+            platformPrint("  interrupt");
+        }
+        int32_t reason = runEngine(true, true, 1);
+        disassemble(address, text, sizeof(text));
+        sprintf(buffer, "  %llu 0x%X: %s", (unsigned long long)(instruction + 1), address - programStart, text);
+        platformPrint(buffer);
+        if(reason != STOP_BUDGET)
+        {
+            break;
+        }
+    }
+    cosimInterval(differ, true);
+    cosimDifferences(true);
+}
+
+// Returns false when the engines diverged
+bool execCosim(uint64_t interval)
+{
+    uint64_t intervals = 0;
+    do
+    {
+        saveCosim(cosimStart, STOP_BUDGET);
+        if(!cosimInterval(interval, false))
+        {
+            reportDivergence(interval);
+            return false;
+        }
+        intervals++;
+    }
+    while(cosimFast.reason == STOP_BUDGET);
+    reportStop();
+    char buffer[256];
+    sprintf(buffer, "Cosim: %llu intervals, %llu instructions matched", (unsigned long long)intervals, (unsigned long long)instructionCount);
+    platformPrint(buffer);
+    return true;
+}
+#endif
+
+#ifdef LIBRARY
+//Library API
+// The emulator's state is global, so a process runs one core at a time:
+// avrcoreCreate() fails while another core exists. A handle only owns what
+// the core allocated along the way.
+struct avrcore
+{
+    eventQueue* events;
+    executionHistory* history;
+    const avrcoreRecompiledBlock** recompiled;
+};
+
+#define SNAPSHOT_MAGIC 0x53525641 // "AVRS"
+struct snapshotHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entryAddress;
+    uint32_t memorySize;
+    uint32_t stateSize;
+};
+
+avrcore* activeCore = NULL;
+
+// Every call names its core; with one per process this only catches a
+// handle used after avrcoreDestroy()
+void selectCore(avrcore* core)
+{
+    assert(core == activeCore);
+}
+
+void resetCore()
+{
+    memset(memory, 0, ENTRY_ADDRESS);
+    cycleCount = 0;
+    instructionCount = 0;
+    clearHistory(history);
+    trackedFetches = 0;
+    stopReason = STOP_BUDGET;
+    watchpointAddress = -1;
+    engineInit();
+}
+
+int32_t avrcoreAbiVersion()
+{
+    return AVRCORE_ABI_VERSION;
+}
+
+const char* avrcoreMcu()
+{
+    return MCU_NAME;
+}
+
+void clearImage()
+{
+    memset(&memory[ENTRY_ADDRESS], 0, FLASH_SIZE);
+    for(int32_t word = ENTRY_ADDRESS/2; word < MEMORY_SIZE/2; word++)
+    {
+        predecoded[word].pattern = FUSED_NONE;
+        predecoded[word].length = 0;
+        predecoded[word].code = 0;
+    }
+    programEnd = ENTRY_ADDRESS;
+    programAnalyzed = false;
+}
+
+avrcore* avrcoreCreate()
+{
+    if(activeCore)
+    {
+        return NULL;
+    }
+    avrcore* core = (avrcore*)calloc(1, sizeof(avrcore));
+    if(!core)
+    {
+        return NULL;
+    }
+    activeCore = core;
+    //Nothing of a destroyed core may carry over
+    watchpoints = watchpointSet();
+    updateWatchedPages();
+    stackLimit = RAMSTART - 1;
+    recompiledBlocks = NULL;
+    nativeEnabled = true;
+    portCallback = NULL;
+    spiCallback = NULL;
+    ioWriteCallback = NULL;
+    ioReadCallback = NULL;
+    watchCallback = NULL;
+    peripheralContext = NULL;
+    eventSink = NULL;
+    history = NULL;
+    clearImage();
+    resetCore();
+    return core;
+}
+
+void avrcoreDestroy(avrcore* core)
+{
+    selectCore(core);
+    activeCore = NULL;
+    delete core->events;
+    destroyHistory(core->history);
+    free(core->recompiled);
+    free(core);
+}
+
+void avrcoreReset(avrcore* core)
+{
+    selectCore(core);
+    resetCore();
+}
+
+int32_t avrcoreLoadHex(avrcore* core, const char* hex, size_t size)
+{
+    selectCore(core);
+    clearImage();
+    bool loaded = loadHex((const uint8_t*)hex, size);
+    resetCore();
+    return loaded ? 0: -1;
+}
+
+int32_t avrcoreLoadBinary(avrcore* core, const uint8_t* image, size_t size)
+{
+    selectCore(core);
+    if(size > FLASH_SIZE)
+    {
+        return -1;
+    }
+    clearImage();
+    //Flash words are stored high byte first
+    for(size_t i = 0; i < size; i++)
+    {
+        memory[(ENTRY_ADDRESS + i) ^ 1] = image[i];
+    }
+    programEnd = ENTRY_ADDRESS + ((size + 1) & ~1);
+    resetCore();
+    return 0;
+}
+
+void claimEvents(avrcore* core)
+{
+    while(core->events && core->events->producing.exchange(true, std::memory_order_acquire))
+    {
+        std::this_thread::yield();
+    }
+}
+
+void releaseEvents(avrcore* core)
+{
+    if(core->events)
+    {
+        flushCoalesced(*core->events);
+        core->events->producing.store(false, std::memory_order_release);
+    }
+}
+
+int32_t avrcoreRun(avrcore* core, uint64_t instructions, uint64_t cycles)
+{
+    selectCore(core);
+    claimEvents(core);
+    int32_t reason = history ? runWithHistory(instructions, cycles): runUntil(instructions, cycles);
+    releaseEvents(core);
+    return reason;
+}
+
+uint64_t avrcoreCycles(avrcore* core)
+{
+    selectCore(core);
+    return cycleCount;
+}
+
+int32_t avrcoreWatchpointAddress(avrcore* core)
+{
+    selectCore(core);
+    return watchpointAddress;
+}
+
+int32_t avrcoreReadMemory(avrcore* core, int32_t address, uint8_t* buffer, size_t size)
+{
+    selectCore(core);
+    if((address < 0) || (address + size > ENTRY_ADDRESS))
+    {
+        return -1;
+    }
+    memcpy(buffer, &memory[address], size);
+    if((address <= SREG_ADDRESS) && (SREG_ADDRESS < address + size))
+    {
+        buffer[SREG_ADDRESS - address] = SREG;
+    }
+    if((address <= SPL_ADDRESS) && (SPL_ADDRESS < address + size))
+    {
+        buffer[SPL_ADDRESS - address] = stackPointer & 0xFF;
+    }
+    if((address <= SPH_ADDRESS) && (SPH_ADDRESS < address + size))
+    {
+        buffer[SPH_ADDRESS - address] = stackPointer >> 8;
+    }
+    return 0;
+}
+
+int32_t avrcoreWriteMemory(avrcore* core, int32_t address, const uint8_t* buffer, size_t size)
+{
+    selectCore(core);
+    if((address < 0) || (address + size > ENTRY_ADDRESS))
+    {
+        return -1;
+    }
+    historyChanged();
+    memcpy(&memory[address], buffer, size);
+    if((address <= SREG_ADDRESS) && (SREG_ADDRESS < address + size))
+    {
+        SREG = buffer[SREG_ADDRESS - address];
+    }
+    if((address <= SPL_ADDRESS) && (SPL_ADDRESS < address + size))
+    {
+        stackPointer = (stackPointer & 0xFF00) | buffer[SPL_ADDRESS - address];
+    }
+    if((address <= SPH_ADDRESS) && (SPH_ADDRESS < address + size))
+    {
+        stackPointer = (stackPointer & 0x00FF) | (buffer[SPH_ADDRESS - address] << 8);
+    }
+    if(address < INTERRUPT_REGISTER_LIMIT)
+    {
+        updateInterruptMask();
+    }
+    return 0;
+}
+
+int32_t avrcoreReadFlash(avrcore* core, int32_t address, uint8_t* buffer, size_t size)
+{
+    selectCore(core);
+    if((address < 0) || (address + size > FLASH_SIZE))
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < size; i++)
+    {
+        buffer[i] = memory[(ENTRY_ADDRESS + address + i) ^ 1];
+    }
+    return 0;
+}
+
+uint32_t avrcoreReadRegister(avrcore* core, int32_t reg)
+{
+    selectCore(core);
+    switch(reg)
+    {
+        case AVRCORE_REGISTER_SREG:
+            return SREG;
+        case AVRCORE_REGISTER_SP:
+            return stackPointer;
+        case AVRCORE_REGISTER_PC:
+            return PC - programStart;
+    }
+    return (reg >= 0 && reg < 32) ? memory[reg]: 0;
+}
+
+void avrcoreWriteRegister(avrcore* core, int32_t reg, uint32_t value)
+{
+    selectCore(core);
+    historyChanged();
+    switch(reg)
+    {
+        case AVRCORE_REGISTER_SREG:
+            SREG = value;
+            updateInterruptState();
+            return;
+        case AVRCORE_REGISTER_SP:
+            stackPointer = value;
+            return;
+        case AVRCORE_REGISTER_PC:
+            PC = programStart + (value & ~1);
+            return;
+    }
+    if(reg >= 0 && reg < 32)
+    {
+        memory[reg] = value;
+    }
+}
+
+void avrcoreRaiseInterrupt(avrcore* core, int32_t vector)
+{
+    selectCore(core);
+    if((vector > 0) && (vector < INTERRUPT_VECTOR_COUNT))
+    {
+        historyChanged();
+        raiseInterrupt(vector);
+    }
+}
+
+void avrcoreSetBreakpoint(avrcore* core, int32_t address, int32_t enabled)
+{
+    selectCore(core);
+    setBreakpoint(address, enabled != 0);
+}
+
+void avrcoreSetWatchpoint(avrcore* core, int32_t address, int32_t mode)
+{
+    selectCore(core);
+    setWatchpoint(address, mode);
+}
+
+int32_t avrcoreSetWatchRange(avrcore* core, int32_t start, int32_t end, int32_t mode, uint8_t value)
+{
+    selectCore(core);
+    return setWatchRange(start, end, mode, value) ? 0: -1;
+}
+
+void avrcoreSetStackLimit(avrcore* core, int32_t address)
+{
+    selectCore(core);
+    setStackLimit(address);
+}
+
+void avrcoreEnableNative(avrcore* core, int32_t enabled)
+{
+    selectCore(core);
+    nativeEnabled = (enabled != 0);
+    predecodeProgram(programStart, programEnd);
+}
+
+void avrcoreSetPortCallback(avrcore* core, avrcorePortCallback callback, void* context)
+{
+    selectCore(core);
+    portCallback = callback;
+    peripheralContext = context;
+}
+
+void avrcoreSetSpiCallback(avrcore* core, avrcoreSpiCallback callback, void* context)
+{
+    selectCore(core);
+    spiCallback = callback;
+    peripheralContext = context;
+}
+
+void avrcoreSetIoCallbacks(avrcore* core, avrcoreIoReadCallback read, avrcoreIoWriteCallback write, void* context)
+{
+    selectCore(core);
+    ioReadCallback = read;
+    ioWriteCallback = write;
+    peripheralContext = context;
+}
+
+void avrcoreSetWatchCallback(avrcore* core, avrcoreWatchCallback callback, void* context)
+{
+    selectCore(core);
+    watchCallback = callback;
+    peripheralContext = context;
+}
+
+int32_t avrcoreEnableEventQueue(avrcore* core, int32_t policy)
+{
+    if((policy < BACKPRESSURE_DROP) || (policy > BACKPRESSURE_COALESCE))
+    {
+        return -1;
+    }
+    selectCore(core);
+    if(!core->events)
+    {
+        core->events = eventSink = new eventQueue();
+    }
+    core->events->policy = policy;
+    portCallback = queuePort;
+    spiCallback = queueSpi;
+    return 0;
+}
+
+// Only touches the consumer's side of the queue, so it does not select the core
+size_t avrcorePollEvents(avrcore* core, avrcoreEvent* events, size_t count)
+{
+    size_t polled = 0;
+    peripheralEvent event;
+    for(int32_t pass = 0; core->events && (pass < 2); pass++)
+    {
+        while((polled < count) && consumeEvent(*core->events, event))
+        {
+            events[polled].cycle = event.cycle;
+            events[polled].kind = event.kind;
+            events[polled].port = event.port;
+            events[polled++].value = event.value;
+        }
+        //Between runs, publish what the core coalesced and poll once more
+        if((polled == count) || core->events->producing.exchange(true, std::memory_order_acquire))
+        {
+            break;
+        }
+        releaseEvents(core);
+    }
+    return polled;
+}
+
+uint64_t avrcoreLostEvents(avrcore* core)
+{
+    return core->events ? core->events->dropped.load(): 0;
+}
+
+int32_t avrcoreEnableHistory(avrcore* core, int32_t checkpoints)
+{
+    selectCore(core);
+    destroyHistory(history);
+    history = core->history = NULL;
+    if(checkpoints <= 0)
+    {
+        return 0;
+    }
+    history = core->history = createHistory(checkpoints);
+    return history ? 0: -1;
+}
+
+uint64_t avrcoreInstructions(avrcore* core)
+{
+    selectCore(core);
+    return instructionCount;
+}
+
+int32_t avrcoreStepBack(avrcore* core, uint64_t instructions)
+{
+    selectCore(core);
+    if(!history || (instructions > instructionCount))
+    {
+        return -1;
+    }
+    if(!instructions)
+    {
+        return 0;
+    }
+    return seekInstruction(instructionCount - instructions) ? 0: -1;
+}
+
+int32_t avrcoreRunBackToWrite(avrcore* core, int32_t address)
+{
+    selectCore(core);
+    if(!history || (address < 0) || (address >= ENTRY_ADDRESS))
+    {
+        return -1;
+    }
+    return runBack(address) ? 0: -1;
+}
+
+size_t avrcoreSnapshotSize()
+{
+    return sizeof(snapshotHeader) + sizeof(coreState) + MEMORY_SIZE;
+}
+
+int32_t avrcoreSaveSnapshot(avrcore* core, void* buffer, size_t size)
+{
+    selectCore(core);
+    if(size < avrcoreSnapshotSize())
+    {
+        return -1;
+    }
+    snapshotHeader header = {SNAPSHOT_MAGIC, AVRCORE_ABI_VERSION, ENTRY_ADDRESS, MEMORY_SIZE, sizeof(coreState)};
+    coreState state;
+    saveCoreState(state);
+    uint8_t* cursor = (uint8_t*)buffer;
+    memcpy(cursor, &header, sizeof(header));
+    memcpy(cursor += sizeof(header), &state, sizeof(state));
+    memcpy(cursor += sizeof(state), memory, MEMORY_SIZE);
+    return 0;
+}
+
+int32_t avrcoreRestoreSnapshot(avrcore* core, const void* buffer, size_t size)
+{
+    selectCore(core);
+    snapshotHeader header;
+    if(size < avrcoreSnapshotSize())
+    {
+        return -1;
+    }
+    const uint8_t* cursor = (const uint8_t*)buffer;
+    memcpy(&header, cursor, sizeof(header));
+    if((header.magic != SNAPSHOT_MAGIC) || (header.version != AVRCORE_ABI_VERSION) ||
+       (header.entryAddress != ENTRY_ADDRESS) || (header.memorySize != MEMORY_SIZE) || (header.stateSize != sizeof(coreState)))
+    {
+        return -1;
+    }
+    coreState state;
+    memcpy(&state, cursor += sizeof(header), sizeof(state));
+    int32_t previousEnd = programEnd;
+    memcpy(memory, cursor += sizeof(state), MEMORY_SIZE);
+    loadCoreState(state);
+    clearHistory(history);
+    predecodeProgram(programStart, previousEnd > programEnd ? previousEnd: programEnd);
+    analyzeProgram();
+    return 0;
+}
+
+uint32_t avrcoreCodeFlags(avrcore* core, int32_t address)
+{
+    selectCore(core);
+    address = programStart + (address & ~1);
+    if((address < programStart) || (address >= MEMORY_SIZE))
+    {
+        return 0;
+    }
+    return predecoded[address >> 1].code;
+}
+
+int32_t avrcoreDisassemble(avrcore* core, int32_t address, char* text, size_t size)
+{
+    selectCore(core);
+    address = programStart + (address & ~1);
+    if((address < programStart) || (address >= MEMORY_SIZE) || !size)
+    {
+        return -1;
+    }
+    return disassemble(address, text, size);
+}
+
+//Recompiled Images
+int32_t recompiledSteps = 0;
+
+bool recompiledValid(const avrcoreRecompiledBlock& block)
+{
+    int32_t address = programStart + block.address;
+    if((block.address < 0) || (block.instructions <= 0) || (block.instructions > 0xFF) || (address + 2*block.words > MEMORY_SIZE))
+    {
+        return false;
+    }
+    for(int32_t word = 0; word < block.words; word++, address += 2)
+    {
+        if((block.source[word] != ((memory[address] << 8) | memory[address+1])) || predecoded[address >> 1].breakpoint)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// avrcoreMachine.step, the interpreter fallback of recompiled blocks
+int32_t stepRecompiled(int32_t* pc)
+{
+    PC = programStart + *pc;
+    bool running = fetch();
+    recompiledSteps++;
+    *pc = PC - programStart;
+    return running && !interruptReady && (stopReason == STOP_BUDGET) && (stackPointer >= stackLimit);
+}
+
+avrcoreMachine recompiledMachine = {memory, &SREG, &addFlags[0][0][0], &subFlags[0][0][0], logicFlags, &shiftFlags[0][0], stepRecompiled};
+
+// Instructions that went through step() were counted by fetch() already
+int32_t runRecompiled(int32_t budget)
+{
+    const avrcoreRecompiledBlock& block = *recompiledBlocks[PC >> 1];
+    if((block.instructions > budget) || interruptInhibit)
+    {
+        return 0;
+    }
+    int32_t pc = PC - programStart;
+    recompiledSteps = 0;
+    int32_t executed = block.run(&recompiledMachine, &pc);
+    PC = programStart + pc;
+#ifndef EMSCRIPTEN
+    totalFetches += executed - recompiledSteps;
+#endif
+    cycleCount += executed - recompiledSteps;
+    return executed;
+}
+
+int32_t avrcoreAttachRecompiled(avrcore* core, const avrcoreRecompiledImage* image)
+{
+    selectCore(core);
+    if(image && ((image->abiVersion != AVRCORE_ABI_VERSION) || strcmp(image->mcu, MCU_NAME)))
+    {
+        return -1;
+    }
+    free(core->recompiled);
+    core->recompiled = recompiledBlocks = NULL;
+    int32_t matched = 0;
+    if(image)
+    {
+        if(!(core->recompiled = (const avrcoreRecompiledBlock**)calloc(MEMORY_SIZE/2, sizeof(avrcoreRecompiledBlock*))))
+        {
+            return -1;
+        }
+        recompiledBlocks = core->recompiled;
+        for(int32_t i = 0; i < image->count; i++)
+        {
+            const avrcoreRecompiledBlock& block = image->blocks[i];
+            if((block.address >= 0) && (programStart + block.address < MEMORY_SIZE))
+            {
+                //Blocks that do not match stay attached for images loaded later
+                recompiledBlocks[(programStart + block.address) >> 1] = &block;
+                matched += recompiledValid(block);
+            }
+        }
+    }
+    predecodeProgram(programStart, programEnd);
+    return matched;
+}
+
+//Lanes
+// A lane set runs LANE_COUNT copies of one core in lockstep. Registers,
+// SREG and SRAM are stored one byte per lane, so an instruction that every
+// lane of the group executes is decoded once and run with GCC vector
+// extensions (SSE2, or AVX2 when built with SIMD_FLAGS=-mavx2). Lanes whose
+// PC diverges leave the group and the lowest PC is scheduled next, which
+// lets them rejoin once they reach the same instruction. Everything that
+// can touch the I/O space runs per lane through fetch() on that lane's low
+// data space, so peripherals and callbacks behave as in the scalar core.
+#define LANE_COUNT AVRCORE_LANE_COUNT
+#define ALL_LANES 0xFFFFFFFF
+#define IS_LANE_SRAM(address) (((address) >= RAMSTART) && ((address) < ENTRY_ADDRESS))
+typedef uint8_t laneByte __attribute__((vector_size(LANE_COUNT)));
+typedef uint16_t laneWord __attribute__((vector_size(LANE_COUNT*2)));
+typedef uint32_t laneMask; // one bit per lane
+
+struct avrcoreLanes
+{
+    avrcore* core;
+    laneByte data[ENTRY_ADDRESS]; // registers and SRAM; the rows of the I/O space are unused
+    uint8_t io[LANE_COUNT][RAMSTART]; // the rest of the low data space, as fetch() sees it
+    laneByte SREG;
+    laneWord stackPointer;
+    programCounter PC[LANE_COUNT];
+    uint64_t cycleCount[LANE_COUNT];
+    uint64_t remaining[LANE_COUNT];
+    int32_t trackedFetches[LANE_COUNT];
+    uint64_t pendingInterrupts[LANE_COUNT];
+    uint64_t enabledInterrupts[LANE_COUNT];
+    bool interruptInhibit[LANE_COUNT];
+    int32_t stopReason[LANE_COUNT];
+    laneMask running;
+    laneMask ready; // interruptReady of every lane
+    laneMask overflowCheck; // check the stack limit after the lane's next instruction
+    // Running lanes that share groupPC. PC[] is stale for members until
+    // they leave, and groupSteps instructions have not been added to their
+    // counters yet.
+    laneMask group;
+    laneByte groupActive;
+    laneWord groupActiveWord;
+    programCounter groupPC;
+    programCounter waitingPC; // lowest PC of the running lanes outside the group
+    uint32_t groupSteps;
+    uint32_t countdown; // steps before any lane can reach a timer event or its budget
+};
+
+int32_t currentLane = -1;
+const laneByte laneZero = {};
+const laneWord laneZeroWord = {};
+
+inline laneByte laneFill(uint8_t value)
+{
+    return laneZero + value;
+}
+
+inline laneWord laneFillWord(uint16_t value)
+{
+    return laneZeroWord + value;
+}
+
+inline laneMask laneBits(laneByte lanes)
+{
+#if defined(__AVX2__) && (LANE_COUNT == 32)
+    return _mm256_movemask_epi8((__m256i)lanes);
+#elif defined(__SSE2__) && (LANE_COUNT == 32)
+    __m128i halves[2];
+    memcpy(halves, &lanes, sizeof(halves));
+    return _mm_movemask_epi8(halves[0]) | (_mm_movemask_epi8(halves[1]) << 16);
+#else
+    laneMask bits = 0;
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        bits |= (lanes[lane] >> 7) << lane;
+    }
+    return bits;
+#endif
+}
+
+inline laneMask laneWordBits(laneWord lanes)
+{
+    return laneBits(__builtin_convertvector(lanes, laneByte));
+}
+
+inline void laneWrite(laneByte& target, laneByte value, laneByte active)
+{
+    target ^= (target ^ value) & active;
+}
+
+inline void laneSetFlags(avrcoreLanes& lanes, laneByte flags, uint8_t mask)
+{
+    laneWrite(lanes.SREG, flags, lanes.groupActive & mask);
+}
+
+// Flags from the tables fetch() uses, looked up for every lane; the
+// caller keeps those of the group. carry is 0 or 1 in each lane.
+inline laneByte laneAddFlags(laneByte carry, laneByte first, laneByte second)
+{
+    laneByte flags;
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        flags[lane] = addFlags[carry[lane]][first[lane]][second[lane]];
+    }
+    return flags;
+}
+
+inline laneByte laneSubFlags(laneByte carry, laneByte first, laneByte second)
+{
+    laneByte flags;
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        flags[lane] = subFlags[carry[lane]][first[lane]][second[lane]];
+    }
+    return flags;
+}
+
+inline laneByte laneLogicFlags(laneByte result)
+{
+    laneByte flags;
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        flags[lane] = logicFlags[result[lane]];
+    }
+    return flags;
+}
+
+// carry is the shifted out bit
+inline laneByte laneShiftFlags(laneByte carry, laneByte result)
+{
+    laneByte flags;
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        flags[lane] = shiftFlags[carry[lane]][result[lane]];
+    }
+    return flags;
+}
+
+// Raw data space access of one lane, as fetch() does with memory[].
+inline uint8_t laneLoad(const avrcoreLanes& lanes, int32_t lane, int32_t address)
+{
+    if((address < 32) || IS_LANE_SRAM(address))
+    {
+        return lanes.data[address][lane];
+    }
+    return (address < RAMSTART) ? lanes.io[lane][address]: memory[address];
+}
+
+inline void laneStore(avrcoreLanes& lanes, int32_t lane, int32_t address, uint8_t value)
+{
+    if((address < 32) || IS_LANE_SRAM(address))
+    {
+        lanes.data[address][lane] = value;
+    }
+    else if(address < RAMSTART)
+    {
+        lanes.io[lane][address] = value;
+    }
+    else
+    {
+        memory[address] = value;
+    }
+}
+
+inline uint16_t laneReadPair(const avrcoreLanes& lanes, int32_t lane, int32_t reg)
+{
+    return lanes.data[reg][lane] | (lanes.data[reg+1][lane] << 8);
+}
+
+// True when every lane of the group holds the same byte at address.
+inline bool laneUniform(const avrcoreLanes& lanes, int32_t address, uint8_t& value)
+{
+    value = lanes.data[address][__builtin_ctz(lanes.group)];
+    return (laneBits((laneByte)(lanes.data[address] == laneFill(value))) & lanes.group) == lanes.group;
+}
+
+inline bool laneUniformPair(const avrcoreLanes& lanes, int32_t reg, uint16_t& value)
+{
+    uint8_t low;
+    uint8_t high;
+    bool uniform = laneUniform(lanes, reg, low) && laneUniform(lanes, reg + 1, high);
+    value = low | (high << 8);
+    return uniform;
+}
+
+// True when the group shares a stack pointer with room for a return address
+// in SRAM on either side.
+inline bool laneUniformStack(const avrcoreLanes& lanes, uint16_t& stackPointer)
+{
+    stackPointer = lanes.stackPointer[__builtin_ctz(lanes.group)];
+    return ((laneWordBits((laneWord)(lanes.stackPointer == laneFillWord(stackPointer))) & lanes.group) == lanes.group) &&
+           IS_LANE_SRAM(stackPointer - RETURN_ADDRESS_SIZE) && IS_LANE_SRAM(stackPointer + RETURN_ADDRESS_SIZE);
+}
+
+inline void laneUpdateInterruptState(avrcoreLanes& lanes, int32_t lane)
+{
+    bool ready = (lanes.SREG[lane] & SREG_I) && ((lanes.pendingInterrupts[lane] & lanes.enabledInterrupts[lane]) != 0);
+    lanes.ready = ready ? (lanes.ready | (1u << lane)): (lanes.ready & ~(1u << lane));
+}
+
+void laneUpdateInterruptMask(avrcoreLanes& lanes, int32_t lane)
+{
+    lanes.enabledInterrupts[lane] = 0;
+    for(uint32_t vector = 1; vector < INTERRUPT_VECTOR_COUNT; vector++)
+    {
+        if(interruptVectors[vector].enableAddress && (laneLoad(lanes, lane, interruptVectors[vector].enableAddress) & interruptVectors[vector].enableMask))
+        {
+            lanes.enabledInterrupts[lane] |= (1ULL << vector);
+        }
+    }
+    laneUpdateInterruptState(lanes, lane);
+}
+
+void laneStop(avrcoreLanes& lanes, int32_t lane, int32_t reason)
+{
+    lanes.stopReason[lane] = reason;
+    lanes.running &= ~(1u << lane);
+    lanes.group &= ~(1u << lane);
+    lanes.groupActive[lane] = 0;
+    lanes.groupActiveWord[lane] = 0;
+}
+
+// Adds retired instructions to a lane, raising the timer interrupt and
+// ending the budget on the same instruction runUntil would.
+void laneAdvance(avrcoreLanes& lanes, int32_t lane, uint32_t executed)
+{
+    lanes.cycleCount[lane] += executed;
+    lanes.remaining[lane] -= executed;
+    lanes.trackedFetches[lane] += executed;
+    if(lanes.trackedFetches[lane] == INSTRUCTION_LIMIT)
+    {
+        lanes.trackedFetches[lane] = 0;
+        lanes.pendingInterrupts[lane] |= (1ULL << TIMER0_OVF_VECTOR);
+        laneUpdateInterruptState(lanes, lane);
+    }
+    if(!lanes.remaining[lane])
+    {
+        laneStop(lanes, lane, STOP_BUDGET);
+    }
+}
+
+void laneCheckStack(avrcoreLanes& lanes, int32_t lane)
+{
+    lanes.overflowCheck &= ~(1u << lane);
+    if(lanes.stackPointer[lane] < stackLimit)
+    {
+        laneStop(lanes, lane, STOP_STACK_OVERFLOW);
+    }
+}
+
+// Takes a lane out of the group at PC, after it retired executed (0 or 1)
+// instructions of the current step.
+void laneLeave(avrcoreLanes& lanes, int32_t lane, uint32_t executed, programCounter PC)
+{
+    laneMask bit = 1u << lane;
+    lanes.group &= ~bit;
+    lanes.groupActive[lane] = 0;
+    lanes.groupActiveWord[lane] = 0;
+    lanes.PC[lane] = PC;
+    laneAdvance(lanes, lane, lanes.groupSteps + executed);
+    if(executed && (lanes.overflowCheck & bit))
+    {
+        laneCheckStack(lanes, lane);
+    }
+    if((lanes.running & bit) && (PC < lanes.waitingPC))
+    {
+        lanes.waitingPC = PC;
+    }
+}
+
+// Flags the group lanes whose stack pointer went below the limit.
+inline void laneCheckStackLimit(avrcoreLanes& lanes)
+{
+    lanes.overflowCheck |= laneWordBits((laneWord)(lanes.stackPointer < laneFillWord(stackLimit))) & lanes.group;
+}
+
+void lanePushReturnAddress(avrcoreLanes& lanes, int32_t lane, programCounter address)
+{
+    address = (address - programStart) >> 1;
+    uint16_t stackPointer = lanes.stackPointer[lane];
+    laneStore(lanes, lane, stackPointer--, address & 0xFF);
+    laneStore(lanes, lane, stackPointer--, (address & 0xFF00) >> 8);
+#ifdef ATMEGA2560
+    laneStore(lanes, lane, stackPointer--, (address & 0x3F0000) >> 16);
+#endif
+    lanes.stackPointer[lane] = stackPointer;
+}
+
+programCounter lanePopReturnAddress(avrcoreLanes& lanes, int32_t lane)
+{
+    uint16_t stackPointer = lanes.stackPointer[lane];
 #ifndef ATMEGA2560
-                    PC = ((memory[result] << 8) | (memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]]));
+    programCounter address = (laneLoad(lanes, lane, stackPointer+1) << 8) | laneLoad(lanes, lane, stackPointer+2);
 #else
-                    result = ((memory[result] << 16) | (memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]]) << 8);
-                    incrementStackPointer();
-                    PC = result | (memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]]);
+    programCounter address = ((laneLoad(lanes, lane, stackPointer+1) & 0x3F) << 16) | (laneLoad(lanes, lane, stackPointer+2) << 8) | laneLoad(lanes, lane, stackPointer+3);
 #endif
-                    break;
-                }
-                if((memory[PC] == 0x95) && (memory[PC+1] == 0x9)) //icall
-                {
-                    result = (((memory[31] << 8) | memory[30])*2)+programStart;
-                    PC += 2;
-                    memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = (PC & 0xFF);
-                    decrementStackPointer();
-                    memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = (PC & 0xFF00) >> 8;
-                    decrementStackPointer();
+    lanes.stackPointer[lane] = stackPointer + RETURN_ADDRESS_SIZE;
+    return programStart + (address << 1);
+}
+
+void lanePushGroup(avrcoreLanes& lanes, programCounter address)
+{
+    uint16_t stackPointer;
+    if(laneUniformStack(lanes, stackPointer))
+    {
+        address = (address - programStart) >> 1;
+        laneWrite(lanes.data[stackPointer], laneFill(address & 0xFF), lanes.groupActive);
+        laneWrite(lanes.data[stackPointer-1], laneFill((address & 0xFF00) >> 8), lanes.groupActive);
+#ifdef ATMEGA2560
+        laneWrite(lanes.data[stackPointer-2], laneFill((address & 0x3F0000) >> 16), lanes.groupActive);
+#endif
+        lanes.stackPointer -= lanes.groupActiveWord & RETURN_ADDRESS_SIZE;
+    }
+    else
+    {
+        for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+        {
+            lanePushReturnAddress(lanes, __builtin_ctz(bits), address);
+        }
+    }
+    laneCheckStackLimit(lanes);
+}
+
+// Moves the group to per-lane targets; lanes that disagree with the first
+// one leave.
+void laneJump(avrcoreLanes& lanes, const programCounter* targets)
+{
+    lanes.groupPC = targets[__builtin_ctz(lanes.group)];
+    for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+    {
+        int32_t lane = __builtin_ctz(bits);
+        if(targets[lane] != lanes.groupPC)
+        {
+            laneLeave(lanes, lane, 1, targets[lane]);
+        }
+    }
+}
+
+// Branches the lanes in taken to target and keeps the rest on fallthrough.
+void laneBranch(avrcoreLanes& lanes, laneByte taken, programCounter target, programCounter fallthrough)
+{
+    laneMask bits = laneBits(taken) & lanes.group;
+    if(bits == lanes.group)
+    {
+        lanes.groupPC = target;
+        return;
+    }
+    for(; bits; bits &= bits - 1)
+    {
+        laneLeave(lanes, __builtin_ctz(bits), 1, target);
+    }
+    lanes.groupPC = fallthrough;
+}
+
+// Runs the instruction at PC through fetch() for the given group lanes,
+// with the emulator globals standing in for one lane at a time. Lanes that
+// do not end up on next leave the group; with adopt, next is taken from
+// the first lane that completes. Returns next.
+programCounter laneFetch(avrcoreLanes& lanes, laneMask bits, programCounter pc, programCounter next, bool adopt)
+{
+    for(; bits; bits &= bits - 1)
+    {
+        int32_t lane = __builtin_ctz(bits);
+        memcpy(memory, lanes.io[lane], RAMSTART);
+        for(int32_t reg = 0; reg < 32; reg++)
+        {
+            memory[reg] = lanes.data[reg][lane];
+        }
+        PC = pc;
+        SREG = lanes.SREG[lane];
+        stackPointer = lanes.stackPointer[lane];
+        pendingInterrupts = lanes.pendingInterrupts[lane];
+        enabledInterrupts = lanes.enabledInterrupts[lane];
+        interruptInhibit = lanes.interruptInhibit[lane];
+        updateInterruptState();
+        cycleCount = 0;
+        stopReason = STOP_BUDGET;
+        currentLane = lane;
+        bool executed = fetch();
+        currentLane = -1;
+        memcpy(lanes.io[lane], memory, RAMSTART);
+        for(int32_t reg = 0; reg < 32; reg++)
+        {
+            lanes.data[reg][lane] = memory[reg];
+        }
+        lanes.SREG[lane] = SREG;
+        lanes.stackPointer[lane] = stackPointer;
+        lanes.pendingInterrupts[lane] = pendingInterrupts;
+        lanes.enabledInterrupts[lane] = enabledInterrupts;
+        lanes.interruptInhibit[lane] = interruptInhibit;
+        laneUpdateInterruptState(lanes, lane);
+        //Illegal opcodes use a cycle without retiring
+        lanes.cycleCount[lane] += cycleCount - executed;
+        if(stackPointer < stackLimit)
+        {
+            lanes.overflowCheck |= (1u << lane);
+        }
+        if(!executed || (stopReason != STOP_BUDGET))
+        {
+            int32_t reason = stopReason;
+            laneLeave(lanes, lane, executed, PC);
+            laneStop(lanes, lane, reason);
+        }
+        else if(adopt)
+        {
+            next = PC;
+            adopt = false;
+        }
+        else if(PC != next)
+        {
+            laneLeave(lanes, lane, 1, PC);
+        }
+    }
+    return next;
+}
+
+inline void laneFetchGroup(avrcoreLanes& lanes)
+{
+    lanes.groupPC = laneFetch(lanes, lanes.group, lanes.groupPC, 0, true);
+}
+
+inline void laneIncrementPair(avrcoreLanes& lanes, int32_t reg, laneByte active)
+{
+    laneByte low = lanes.data[reg] + 1;
+    laneWrite(lanes.data[reg+1], lanes.data[reg+1] + 1, active & (laneByte)(low == laneZero));
+    laneWrite(lanes.data[reg], low, active);
+}
+
+inline void laneDecrementPair(avrcoreLanes& lanes, int32_t reg, laneByte active)
+{
+    laneWrite(lanes.data[reg+1], lanes.data[reg+1] - 1, active & (laneByte)(lanes.data[reg] == laneZero));
+    laneWrite(lanes.data[reg], lanes.data[reg] - 1, active);
+}
+
+#define POINTER_PLAIN 0
+#define POINTER_POST_INCREMENT 1
+#define POINTER_PRE_DECREMENT 2
+// ld, ldd and st, std through X, Y or Z. The order of the pointer update
+// and the register access follows the matching fetch() case, so pointer
+// registers used as operands end up as in the scalar core. Lanes that
+// address anything but SRAM go through fetch().
+void laneIndirect(avrcoreLanes& lanes, int32_t pointer, int32_t displacement, int32_t mode, int32_t reg, bool store, bool registerFirst)
+{
+    programCounter pc = lanes.groupPC;
+    int32_t adjust = (mode == POINTER_PRE_DECREMENT) ? -1: 0;
+    laneMask native = lanes.group;
+    uint16_t address;
+    bool uniform = laneUniformPair(lanes, pointer, address);
+    if(uniform)
+    {
+        address += adjust;
+        if(!IS_LANE_SRAM(address + displacement))
+        {
+            laneFetchGroup(lanes);
+            return;
+        }
+    }
+    else
+    {
+        for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+        {
+            int32_t lane = __builtin_ctz(bits);
+            if(!IS_LANE_SRAM((uint16_t)(laneReadPair(lanes, lane, pointer) + adjust) + displacement))
+            {
+                native &= ~(1u << lane);
+            }
+        }
+    }
+    laneByte active = lanes.groupActive;
+    if(native != lanes.group)
+    {
+        for(laneMask bits = lanes.group & ~native; bits; bits &= bits - 1)
+        {
+            active[__builtin_ctz(bits)] = 0;
+        }
+        laneFetch(lanes, lanes.group & ~native, pc, pc + 2, false);
+    }
+    laneByte value = lanes.data[reg];
+    if(mode == POINTER_PRE_DECREMENT)
+    {
+        laneDecrementPair(lanes, pointer, active);
+        if(!registerFirst)
+        {
+            value = lanes.data[reg];
+        }
+    }
+    if(uniform)
+    {
+        if(store)
+        {
+            laneWrite(lanes.data[address + displacement], value, active);
+        }
+        else
+        {
+            laneWrite(lanes.data[reg], lanes.data[address + displacement], active);
+        }
+    }
+    else
+    {
+        for(; native; native &= native - 1)
+        {
+            int32_t lane = __builtin_ctz(native);
+            int32_t target = laneReadPair(lanes, lane, pointer) + displacement;
+            if(store)
+            {
+                lanes.data[target][lane] = value[lane];
+            }
+            else
+            {
+                lanes.data[reg][lane] = lanes.data[target][lane];
+            }
+        }
+    }
+    if(mode == POINTER_POST_INCREMENT)
+    {
+        laneIncrementPair(lanes, pointer, active);
+    }
+    lanes.groupPC = pc + 2;
+}
+
+void laneDirect(avrcoreLanes& lanes, int32_t address, int32_t reg, bool store)
+{
+    if(!IS_LANE_SRAM(address))
+    {
+        laneFetchGroup(lanes);
+        return;
+    }
+    if(store)
+    {
+        laneWrite(lanes.data[address], lanes.data[reg], lanes.groupActive);
+    }
+    else
+    {
+        laneWrite(lanes.data[reg], lanes.data[address], lanes.groupActive);
+    }
+    lanes.groupPC += 4;
+}
+
+// lpm reads the shared flash
+void laneProgramLoad(avrcoreLanes& lanes, int32_t reg, bool increment)
+{
+    uint16_t address;
+    if(laneUniformPair(lanes, Z_REGISTER, address))
+    {
+        laneWrite(lanes.data[reg], laneFill(memory[programStart + (address ^ 1)]), lanes.groupActive);
+    }
+    else
+    {
+        for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+        {
+            int32_t lane = __builtin_ctz(bits);
+            lanes.data[reg][lane] = memory[programStart + (laneReadPair(lanes, lane, Z_REGISTER) ^ 1)];
+        }
+    }
+    if(increment)
+    {
+        laneIncrementPair(lanes, Z_REGISTER, lanes.groupActive);
+    }
+    lanes.groupPC += 2;
+}
+
+void lanePush(avrcoreLanes& lanes, int32_t reg)
+{
+    uint16_t stackPointer;
+    if(laneUniformStack(lanes, stackPointer))
+    {
+        laneWrite(lanes.data[stackPointer], lanes.data[reg], lanes.groupActive);
+        lanes.stackPointer -= lanes.groupActiveWord & 1;
+    }
+    else
+    {
+        for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+        {
+            int32_t lane = __builtin_ctz(bits);
+            laneStore(lanes, lane, lanes.stackPointer[lane]--, lanes.data[reg][lane]);
+        }
+    }
+    laneCheckStackLimit(lanes);
+    lanes.groupPC += 2;
+}
+
+void lanePop(avrcoreLanes& lanes, int32_t reg)
+{
+    uint16_t stackPointer;
+    if(laneUniformStack(lanes, stackPointer))
+    {
+        laneWrite(lanes.data[reg], lanes.data[stackPointer+1], lanes.groupActive);
+        lanes.stackPointer += lanes.groupActiveWord & 1;
+    }
+    else
+    {
+        for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+        {
+            int32_t lane = __builtin_ctz(bits);
+            lanes.data[reg][lane] = laneLoad(lanes, lane, ++lanes.stackPointer[lane]);
+        }
+    }
+    lanes.groupPC += 2;
+}
+
+void laneReturn(avrcoreLanes& lanes)
+{
+    uint16_t stackPointer;
+    uint8_t bytes[RETURN_ADDRESS_SIZE];
+    if(laneUniformStack(lanes, stackPointer) && laneUniform(lanes, stackPointer+1, bytes[0]) &&
+       laneUniform(lanes, stackPointer+2, bytes[1])
 #ifdef ATMEGA2560
-                    memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = 0x00;
-                    decrementStackPointer();
+       && laneUniform(lanes, stackPointer+3, bytes[2])
 #endif
-                    // No SREG Updates
-                    PC = result;
-                    break;
-                }
-                if((memory[PC] == 0x95) && (memory[PC+1] == 0x18)) //reti
-                {
-                    incrementStackPointer();
-                    result = (memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS];
-                    incrementStackPointer();
-                    newStatus.I = SET;
+       )
+    {
 #ifndef ATMEGA2560
-                    PC = (memory[result] | ((memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]]) << 8));
+        programCounter address = (bytes[0] << 8) | bytes[1];
 #else
-                    incrementStackPointer();
-                    PC |= ((memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]]) << 16);
-#endif
-                    break;
-                }
-                switch(memory[PC+1] & 0x0F)
-                {
-                    case 0x0: //com
-                        result = ~memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
-                        newStatus.V = CLR;
-                        newStatus.C = SET;
-                        newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                        newStatus.Z = result == 0x00 ? SET: CLR;
-                        newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                        PC+=2;
-                        break;
-                    case 0x1: //neg
-                        if(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] != 0x80)
-                        {
-                            result = (~memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] + 1) & 0xFF;
-                            memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
-                        }
-                        newStatus.H = generateHStatus(memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)], result);
-                        newStatus.V = result == 0x80 ? SET: CLR;
-                        newStatus.C = result == 0x00 ? CLR: SET;
-                        newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                        newStatus.Z = result == 0x00 ? SET: CLR;
-                        newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                        PC+=2;
-                        break;
-                    case 0x2: //swap
-                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] << 4;
-                        result |= (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] >> 4);
-                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
-                        PC+=2;
-                        break;
-                    case 0x3: //inc
-                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                        newStatus.V = result == 0x7F ? SET: CLR;
-                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = ++result;
-                        newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                        newStatus.Z = (result & 0xFF) == 0x00 ? SET: CLR;
-                        newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                        PC+=2;
-                        break;
-                    case 0x5: //asr
-                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                        newStatus.C = (result & 0x1) > 0 ? SET: CLR;
-                        result = ((result >> 1) | (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] & 0x80));
-                        newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                        newStatus.V = ((newStatus.N ^ newStatus.C) > 0) ? SET: CLR;
-                        newStatus.Z = result == 0x00 ? SET: CLR;
-                        newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
-                        PC+=2;
-                        break;
-                    case 0x6: //lsr
-                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                        newStatus.C = (result & 0x1) > 0 ? SET: CLR;
-                        result = (result >> 1);
-                        newStatus.N = CLR;
-                        newStatus.V = ((newStatus.N ^ newStatus.C) > 0) ? SET: CLR;
-                        newStatus.Z = result == 0x00 ? SET: CLR;
-                        newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
-                        PC+=2;
-                        break;
-                    case 0x7: //ror
-                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                        newStatus.C = (result & 0x1) > 0 ? SET: CLR;
-                        result = ((result >> 1) | (SREG.C << 7));
-                        newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                        newStatus.V = ((newStatus.N ^ newStatus.C) > 0) ? SET: CLR;
-                        newStatus.Z = result == 0x00 ? SET: CLR;
-                        newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = result;
-                        PC+=2;
-                        break;
-                    case 0xA: //dec
-                        result = memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)];
-                        newStatus.V = result == 0x80 ? SET: CLR;
-                        memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] = --result;
-                        newStatus.N = ((result & 0x80) > 0) ? SET: CLR;
-                        newStatus.Z = result == 0x00 ? SET: CLR;
-                        newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                        PC+=2;
-                        break;
-                    case 0xC:
-                    case 0xD: //jmp
-                        // No SREG Updates
-                        result  = (memory[PC] & 0x1) << 21;
-                        result += (memory[PC+1] >> 4) << 17;
-                        result += (memory[PC+1] & 0x1) << 16;
-                        result += (memory[PC+2] << 8 | memory[PC+3]);
-                        PC = programStart + (result*2);
-                        break;
-                    case 0xE:
-                    case 0xF: //call
-                        result = programStart + (((memory[PC] & 0x1) << 21) | ((memory[PC+1] & 0xF0) << 17) | ((memory[PC+1] & 0x1) << 16)
-                         | (memory[PC+2] << 8) | memory[PC+3])*2;
-                        PC += 4;
-                        memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = (PC & 0xFF);
-                        decrementStackPointer();
-                        memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = (PC & 0xFF00) >> 8;
-                        decrementStackPointer();
-#ifdef ATMEGA2560
-                        memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = (PC & 0xFF0000) >> 16;
-                        decrementStackPointer();
+        programCounter address = ((bytes[0] & 0x3F) << 16) | (bytes[1] << 8) | bytes[2];
 #endif
-                        // No SREG Updates
-                        PC = result;
-                        break;
-                    default:
-                        handleUnimplemented();
-                        break;
-                }
-                break;
-            case 0x96: //adiw
-            case 0x97: //sbiw
-                result = ((memory[PC+1] & 0x30) >> 4);
-                switch(result)
-                {
-                    case 0:
-                        result = 24;
-                        break;
-                    case 1:
-                        result = 26;
-                        break;
-                    case 2:
-                        result = 28;
-                        break;
-                    case 3:
-                        result = 30;
-                        break;
-                    default:
-                        handleUnimplemented();
-                }
-                result = (memory[result+1] << 8) | memory[result];
-                newStatus.V = generateVStatus(result, (((memory[PC+1] & 0xC0) >> 0x2) | (memory[PC+1] & 0xF)));
-                newStatus.C = abs((((memory[PC+1] & 0xC0) >> 0x2) | (memory[PC+1] & 0xF))) > abs(result) ? SET: CLR;
-                if(memory[PC] == 0x96)
-                {
-                    result = result + (((memory[PC+1] & 0xC0) >> 0x2) | (memory[PC+1] & 0xF));
-                }
-                if(memory[PC] == 0x97)
-                {
-                    result = result - (((memory[PC+1] & 0xC0) >> 0x2) | (memory[PC+1] & 0xF));
-                }
-                newStatus.N = ((result & 0x8000) > 0) ? SET: CLR;
-                newStatus.Z = result == 0x0000 ? SET: CLR;
-                newStatus.S = ((newStatus.N ^ newStatus.V) > 0) ? SET: CLR;
-                switch((memory[PC+1] & 0x30) >> 4)
-                {
-                    case 0:
-                        memory[24] = result & 0xFF;
-                        memory[25] = (result & 0xFF00) >> 8;
-                        break;
-                    case 1:
-                        memory[26] = result & 0xFF;
-                        memory[27] = (result & 0xFF00) >> 8;
-                        break;
-                    case 2:
-                        memory[28] = result & 0xFF;
-                        memory[29] = (result & 0xFF00) >> 8;
-                        break;
-                    case 3:
-                        memory[30] = result & 0xFF;
-                        memory[31] = (result & 0xFF00) >> 8;
-                        break;
-                    default:
-                        handleUnimplemented();
-                }
-                PC+=2;
-                break;
-            case 0x98: //cbi
-                result = (1 << (memory[PC+1] & 0x7));
-                memory[(memory[PC+1] >> 0x3) + IO_REG_START] &= ~result;
-                // No SREG Updates
-                PC+=2;
-                break;
-            case 0x9A: //sbi
-                result = (1 << (memory[PC+1] & 0x7));
-                memory[(memory[PC+1] >> 0x3) + IO_REG_START] |= result;
-                // No SREG Updates
-                PC+=2;
-                break;
-            case 0x9B: //sbis
-                result = memory[(memory[PC+1] >> 0x3) + IO_REG_START];
-                if((result & (1 << (memory[PC+1] & 0x7))) > 0)
-                {
-                    PC+=2;
-                    if(longOpcode(PC))
-                    {
-                        PC+=2;
-                    }
-                }
-                // No SREG Updates
-                PC+=2;
-                break;
-            case 0x9C:
-            case 0x9D:
-            case 0x9E:
-            case 0x9F: //mul
-               result = (memory[((memory[PC] & 0x1) << 4) | (memory[PC+1] >> 4)] * memory[(((memory[PC] & 0x2) >> 1) << 4) | (memory[PC+1] & 0xF)]);
-               newStatus.Z = result == 0x0000 ? SET: CLR;
-               newStatus.C = ((result & 0x8000) > 0) ? SET: CLR;
-               memory[1] = result >> 8;
-               memory[0] = result & 0xFF;
-               PC+=2;
-               break;
-            case 0xA0:
-            case 0xA1:
-            case 0xA4:
-            case 0xA5:
-            case 0xA8:
-            case 0xA9:
-            case 0xAC:
-            case 0xAD:
-                if((memory[PC+1] & 0xF) < 0x8) //ld (ldd) z
-                {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory(((memory[31] << 8) | memory[30]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
-                    // No SREG Updates
-                    PC+=2;
+        lanes.stackPointer += lanes.groupActiveWord & RETURN_ADDRESS_SIZE;
+        lanes.groupPC = programStart + (address << 1);
+        return;
+    }
+    programCounter targets[LANE_COUNT];
+    for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+    {
+        int32_t lane = __builtin_ctz(bits);
+        targets[lane] = lanePopReturnAddress(lanes, lane);
+    }
+    laneJump(lanes, targets);
+}
+
+// Jumps through Z, pushing the return address first for icall.
+void laneIndirectJump(avrcoreLanes& lanes, bool call)
+{
+    if(call)
+    {
+        lanePushGroup(lanes, lanes.groupPC + 2);
+    }
+    uint16_t address;
+    if(laneUniformPair(lanes, Z_REGISTER, address))
+    {
+        lanes.groupPC = (address*2) + programStart;
+        return;
+    }
+    programCounter targets[LANE_COUNT];
+    for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+    {
+        int32_t lane = __builtin_ctz(bits);
+        targets[lane] = (laneReadPair(lanes, lane, Z_REGISTER)*2) + programStart;
+    }
+    laneJump(lanes, targets);
+}
+
+// Mirrors serviceInterrupts for a lane that is out of the group.
+void laneServiceInterrupt(avrcoreLanes& lanes, int32_t lane)
+{
+    int32_t vector = __builtin_ctzll(lanes.pendingInterrupts[lane] & lanes.enabledInterrupts[lane]);
+    lanes.pendingInterrupts[lane] &= ~(1ULL << vector);
+    lanePushReturnAddress(lanes, lane, lanes.PC[lane]);
+    lanes.SREG[lane] &= ~SREG_I;
+    lanes.PC[lane] = programStart + vector*INTERRUPT_VECTOR_SIZE;
+    lanes.cycleCount[lane] += INTERRUPT_ENTRY_CYCLES;
+    laneUpdateInterruptState(lanes, lane);
+    //runUntil checks the stack after the first instruction of the handler
+    lanes.overflowCheck |= (1u << lane);
+    if(lanes.PC[lane] < lanes.waitingPC)
+    {
+        lanes.waitingPC = lanes.PC[lane];
+    }
+}
+
+// Runs the instruction at groupPC for every lane in the group.
+void laneStep(avrcoreLanes& lanes)
+{
+    programCounter pc = lanes.groupPC;
+    if((pc >= MEMORY_SIZE) || ((memory[pc] == 0x95) && (memory[pc+1] == 0x98))) //break
+    {
+        laneFetchGroup(lanes);
+        return;
+    }
+    const uint8_t opcode0 = memory[pc];
+    const uint8_t opcode1 = memory[pc+1];
+    const int32_t d = ((opcode0 & 0x1) << 4) | (opcode1 >> 4);
+    const int32_t r = ((opcode0 & 0x2) << 3) | (opcode1 & 0xF);
+    const int32_t dImmediate = 16 + (opcode1 >> 4);
+    const laneByte immediate = laneFill(((opcode0 & 0xF) << 4) | (opcode1 & 0xF));
+    const laneByte active = lanes.groupActive;
+    const laneByte carry = lanes.SREG & SREG_C;
+    const uint8_t bit = 1 << (opcode1 & 0x7);
+    laneByte result;
+    laneByte flags;
+    programCounter targets[LANE_COUNT];
+
+    switch(opcode0)
+    {
+        case 0x0:
+            if(opcode1 == 0x00) //nop
+            {
+                lanes.groupPC += 2;
+                break;
+            }
+            laneFetchGroup(lanes);
+            break;
+        case 0x1: //movw
+            result = lanes.data[(opcode1 & 0xF)*2];
+            flags = lanes.data[(opcode1 & 0xF)*2 + 1];
+            laneWrite(lanes.data[(opcode1 >> 4)*2], result, active);
+            laneWrite(lanes.data[(opcode1 >> 4)*2 + 1], flags, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x4:
+        case 0x5:
+        case 0x6:
+        case 0x7: //cpc
+            laneSetFlags(lanes, laneSubFlags(carry, lanes.data[d], lanes.data[r]) & (lanes.SREG | (uint8_t)~SREG_Z), ARITHMETIC_FLAGS);
+            lanes.groupPC += 2;
+            break;
+        case 0x8:
+        case 0x9:
+        case 0xA:
+        case 0xB: //sbc
+            result = lanes.data[d] - lanes.data[r] - carry;
+            laneSetFlags(lanes, laneSubFlags(carry, lanes.data[d], lanes.data[r]) & (lanes.SREG | (uint8_t)~SREG_Z), ARITHMETIC_FLAGS);
+            laneWrite(lanes.data[d], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0xC:
+        case 0xD:
+        case 0xE:
+        case 0xF: //add
+            result = lanes.data[d] + lanes.data[r];
+            laneSetFlags(lanes, laneAddFlags(laneZero, lanes.data[d], lanes.data[r]), ARITHMETIC_FLAGS);
+            laneWrite(lanes.data[d], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x10:
+        case 0x11:
+        case 0x12:
+        case 0x13: //cpse
+            laneBranch(lanes, (laneByte)(lanes.data[d] == lanes.data[r]), pc + (longOpcode(pc + 2) ? 6: 4), pc + 2);
+            break;
+        case 0x14:
+        case 0x15:
+        case 0x16:
+        case 0x17: //cp
+            laneSetFlags(lanes, laneSubFlags(laneZero, lanes.data[d], lanes.data[r]), ARITHMETIC_FLAGS);
+            lanes.groupPC += 2;
+            break;
+        case 0x18:
+        case 0x19:
+        case 0x1A:
+        case 0x1B: //sub
+            result = lanes.data[d] - lanes.data[r];
+            laneSetFlags(lanes, laneSubFlags(laneZero, lanes.data[d], lanes.data[r]), ARITHMETIC_FLAGS);
+            laneWrite(lanes.data[d], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x1C:
+        case 0x1D:
+        case 0x1E:
+        case 0x1F: //adc
+            result = lanes.data[d] + lanes.data[r] + carry;
+            laneSetFlags(lanes, laneAddFlags(carry, lanes.data[d], lanes.data[r]), ARITHMETIC_FLAGS);
+            laneWrite(lanes.data[d], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x20:
+        case 0x21:
+        case 0x22:
+        case 0x23: //and
+            result = lanes.data[d] & lanes.data[r];
+            laneSetFlags(lanes, laneLogicFlags(result), LOGIC_FLAGS);
+            laneWrite(lanes.data[d], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x24:
+        case 0x25:
+        case 0x26:
+        case 0x27: //eor
+            result = lanes.data[d] ^ lanes.data[r];
+            laneSetFlags(lanes, laneLogicFlags(result), LOGIC_FLAGS);
+            laneWrite(lanes.data[d], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x28:
+        case 0x29:
+        case 0x2A:
+        case 0x2B: //or
+            result = lanes.data[d] | lanes.data[r];
+            laneSetFlags(lanes, laneLogicFlags(result), LOGIC_FLAGS);
+            laneWrite(lanes.data[d], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x2C:
+        case 0x2D:
+        case 0x2E:
+        case 0x2F: //mov
+            laneWrite(lanes.data[d], lanes.data[r], active);
+            lanes.groupPC += 2;
+            break;
+        case 0x30:
+        case 0x31:
+        case 0x32:
+        case 0x33:
+        case 0x34:
+        case 0x35:
+        case 0x36:
+        case 0x37:
+        case 0x38:
+        case 0x39:
+        case 0x3A:
+        case 0x3B:
+        case 0x3C:
+        case 0x3D:
+        case 0x3E:
+        case 0x3F: //cpi
+            laneSetFlags(lanes, laneSubFlags(laneZero, lanes.data[dImmediate], immediate), ARITHMETIC_FLAGS);
+            lanes.groupPC += 2;
+            break;
+        case 0x40:
+        case 0x41:
+        case 0x42:
+        case 0x43:
+        case 0x44:
+        case 0x45:
+        case 0x46:
+        case 0x47:
+        case 0x48:
+        case 0x49:
+        case 0x4A:
+        case 0x4B:
+        case 0x4C:
+        case 0x4D:
+        case 0x4E:
+        case 0x4F: //sbci
+            result = lanes.data[dImmediate] - immediate - carry;
+            laneSetFlags(lanes, laneSubFlags(carry, lanes.data[dImmediate], immediate) & (lanes.SREG | (uint8_t)~SREG_Z), ARITHMETIC_FLAGS);
+            laneWrite(lanes.data[dImmediate], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x50:
+        case 0x51:
+        case 0x52:
+        case 0x53:
+        case 0x54:
+        case 0x55:
+        case 0x56:
+        case 0x57:
+        case 0x58:
+        case 0x59:
+        case 0x5A:
+        case 0x5B:
+        case 0x5C:
+        case 0x5D:
+        case 0x5E:
+        case 0x5F: //subi
+            result = lanes.data[dImmediate] - immediate;
+            laneSetFlags(lanes, laneSubFlags(laneZero, lanes.data[dImmediate], immediate), ARITHMETIC_FLAGS);
+            laneWrite(lanes.data[dImmediate], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x60:
+        case 0x61:
+        case 0x62:
+        case 0x63:
+        case 0x64:
+        case 0x65:
+        case 0x66:
+        case 0x67:
+        case 0x68:
+        case 0x69:
+        case 0x6A:
+        case 0x6B:
+        case 0x6C:
+        case 0x6D:
+        case 0x6E:
+        case 0x6F: //ori
+            result = lanes.data[dImmediate] | immediate;
+            laneSetFlags(lanes, laneLogicFlags(result), LOGIC_FLAGS);
+            laneWrite(lanes.data[dImmediate], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x70:
+        case 0x71:
+        case 0x72:
+        case 0x73:
+        case 0x74:
+        case 0x75:
+        case 0x76:
+        case 0x77:
+        case 0x78:
+        case 0x79:
+        case 0x7A:
+        case 0x7B:
+        case 0x7C:
+        case 0x7D:
+        case 0x7E:
+        case 0x7F: //andi
+            result = lanes.data[dImmediate] & immediate;
+            laneSetFlags(lanes, laneLogicFlags(result), LOGIC_FLAGS);
+            laneWrite(lanes.data[dImmediate], result, active);
+            lanes.groupPC += 2;
+            break;
+        case 0x80:
+        case 0x81:
+        case 0x82:
+        case 0x83:
+        case 0x84:
+        case 0x85:
+        case 0x86:
+        case 0x87:
+        case 0x88:
+        case 0x89:
+        case 0x8A:
+        case 0x8B:
+        case 0x8C:
+        case 0x8D:
+        case 0x8E:
+        case 0x8F:
+        case 0xA0:
+        case 0xA1:
+        case 0xA2:
+        case 0xA3:
+        case 0xA4:
+        case 0xA5:
+        case 0xA6:
+        case 0xA7:
+        case 0xA8:
+        case 0xA9:
+        case 0xAA:
+        case 0xAB:
+        case 0xAC:
+        case 0xAD:
+        case 0xAE:
+        case 0xAF: //ld (ldd), st (std) y and z
+            laneIndirect(lanes, (opcode1 & 0x8) ? Y_REGISTER: Z_REGISTER, (opcode0 & 0x20) | ((opcode0 & 0xC) << 1) | (opcode1 & 0x7),
+                         POINTER_PLAIN, d, (opcode0 & 0x2) != 0, true);
+            break;
+        case 0x90:
+        case 0x91:
+            switch(opcode1 & 0xF)
+            {
+                case 0x0: //lds
+                    laneDirect(lanes, (memory[pc+2] << 8) | memory[pc+3], d, false);
                     break;
-                }
-                if((memory[PC+1] & 0xF) >= 0x8) //ld (ldd) y
-                {
-                    result = ((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4);
-                    memory[result] = readMemory(((memory[29] << 8) | memory[28]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)));
-                    // No SREG Updates
-                    PC+=2;
+                case 0x1: //ld z+
+                    laneIndirect(lanes, Z_REGISTER, 0, POINTER_POST_INCREMENT, d, false, true);
                     break;
-                }
-                handleUnimplemented();
-            case 0xA2:
-            case 0xA3:
-            case 0xA6:
-            case 0xA7:
-            case 0xAA:
-            case 0xAB:
-            case 0xAE:
-            case 0xAF:
-                if((memory[PC+1] & 0xF) < 0x8) //st (std) z
-                {
-                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    writeMemory(((memory[31] << 8) | memory[30]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1)), result);
-                    // No SREG Updates
-                    PC+=2;
+                case 0x2: //ld -z
+                    laneIndirect(lanes, Z_REGISTER, 0, POINTER_PRE_DECREMENT, d, false, true);
                     break;
-                }
-                if((memory[PC+1] & 0xF) >= 0x8) //st (std) y
-                {
-                    result = memory[((memory[PC] & 0x1) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    writeMemory(((memory[29] << 8) | memory[28]) + (((memory[PC] & 0xC) << 1) | (memory[PC+1] & 0x7) | (((memory[PC] >> 1) & 0x10) << 1 )), result);
-                    // No SREG Updates
-                    PC+=2;
+                case 0x4: //lpm (rd, z)
+                    laneProgramLoad(lanes, d, false);
                     break;
-                }
-                handleUnimplemented();
-            case 0xB0:
-            case 0xB1:
-            case 0xB2:
-            case 0xB3:
-            case 0xB4:
-            case 0xB5:
-            case 0xB6:
-            case 0xB7: //in
-                memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)] = readMemory(((((memory[PC] & 0x07) >> 1) << 4) | (memory[PC+1] & 0x0F)) + IO_REG_START);
-                // No SREG Updates
-                PC+=2;
+                case 0x5: //lpm (rd, z+)
+                    laneProgramLoad(lanes, d, true);
+                    break;
+                case 0x9: //ld y+
+                    laneIndirect(lanes, Y_REGISTER, 0, POINTER_POST_INCREMENT, d, false, true);
+                    break;
+                case 0xA: //ld -y
+                    laneIndirect(lanes, Y_REGISTER, 0, POINTER_PRE_DECREMENT, d, false, true);
+                    break;
+                case 0xC: //ld x
+                    laneIndirect(lanes, X_REGISTER, 0, POINTER_PLAIN, d, false, true);
+                    break;
+                case 0xD: //ld x+
+                    laneIndirect(lanes, X_REGISTER, 0, POINTER_POST_INCREMENT, d, false, true);
+                    break;
+                case 0xF: //pop
+                    lanePop(lanes, d);
+                    break;
+                default:
+                    laneFetchGroup(lanes);
+                    break;
+            }
+            break;
+        case 0x92:
+        case 0x93:
+            switch(opcode1 & 0xF)
+            {
+                case 0x0: //sts
+                    laneDirect(lanes, (memory[pc+2] << 8) | memory[pc+3], d, true);
+                    break;
+                case 0x1: //st (std) z+
+                    laneIndirect(lanes, Z_REGISTER, 0, POINTER_POST_INCREMENT, d, true, true);
+                    break;
+                case 0x2: //st (std) -z
+                    laneIndirect(lanes, Z_REGISTER, 0, POINTER_PRE_DECREMENT, d, true, true);
+                    break;
+                case 0x9: //st (std) y+
+                    laneIndirect(lanes, Y_REGISTER, 0, POINTER_POST_INCREMENT, d, true, true);
+                    break;
+                case 0xA: //st (std) -y
+                    laneIndirect(lanes, Y_REGISTER, 0, POINTER_PRE_DECREMENT, d, true, false);
+                    break;
+                case 0xC: //st x
+                    laneIndirect(lanes, X_REGISTER, 0, POINTER_PLAIN, d, true, true);
+                    break;
+                case 0xD: //st x+
+                    laneIndirect(lanes, X_REGISTER, 0, POINTER_POST_INCREMENT, d, true, true);
+                    break;
+                case 0xE: //st -x
+                    laneIndirect(lanes, X_REGISTER, 0, POINTER_PRE_DECREMENT, d, true, true);
+                    break;
+                case 0xF: //push
+                    lanePush(lanes, d);
+                    break;
+                default:
+                    laneFetchGroup(lanes);
+                    break;
+            }
+            break;
+        case 0x94:
+        case 0x95:
+            if((opcode0 == 0x94) && (opcode1 == 0x09)) //ijmp
+            {
+                laneIndirectJump(lanes, false);
                 break;
-            case 0xB8:
-            case 0xB9:
-            case 0xBA:
-            case 0xBB:
-            case 0xBC:
-            case 0xBD:
-            case 0xBE:
-            case 0xBF: //out
-                writeMemory(((((memory[PC] & 0x07) >> 1) << 4) | (memory[PC+1] & 0x0F)) + IO_REG_START, memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)]);
-                // No SREG Updates
-                PC+=2;
+            }
+            if((opcode0 == 0x94) && ((opcode1 & 0xF) == 0x8) && (((opcode1 >> 4) & 0x7) != 0x7)) //bset, bclr except sei, cli
+            {
+                laneSetFlags(lanes, (opcode1 & 0x80) ? laneZero: laneFill(0xFF), 1 << ((opcode1 >> 4) & 0x7));
+                lanes.groupPC += 2;
                 break;
-            case 0xC0:
-            case 0xC1:
-            case 0xC2:
-            case 0xC3:
-            case 0xC4:
-            case 0xC5:
-            case 0xC6:
-            case 0xC7:
-            case 0xC8:
-            case 0xC9:
-            case 0xCA:
-            case 0xCB:
-            case 0xCC:
-            case 0xCD:
-            case 0xCE:
-            case 0xCF: //rjmp
-                if((memory[PC] == 0xCF) && (memory[PC+1] == 0xFF))
-                {
-                    //Program Exit
-                    return false;
-                }
-                result = ((memory[PC] & 0xF) << 8) | memory[PC+1];
-                PC+=2;
-                PC = (0x800 == (result & 0x800)) ? PC - (0x1000 - (2*(result^0x800))) : PC + (2*result);
-                // No SREG Updates
+            }
+            if((opcode0 == 0x95) && (opcode1 == 0xA8)) //wdr
+            {
+                lanes.groupPC += 2;
                 break;
-            case 0xD0:
-            case 0xD1:
-            case 0xD2:
-            case 0xD3:
-            case 0xD4:
-            case 0xD5:
-            case 0xD6:
-            case 0xD7:
-            case 0xD8:
-            case 0xD9:
-            case 0xDA:
-            case 0xDB:
-            case 0xDC:
-            case 0xDD:
-            case 0xDE:
-            case 0xDF: //rcall
-                result = ((memory[PC] & 0xF) << 8) | memory[PC+1];
-                PC+=2;
-                memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = (PC & 0xFF);
-                decrementStackPointer();
-                memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = (PC & 0xFF00) >> 8;
-                decrementStackPointer();
+            }
+            if((opcode0 == 0x95) && (opcode1 == 0x8)) //ret
+            {
+                laneReturn(lanes);
+                break;
+            }
+            if((opcode0 == 0x95) && (opcode1 == 0x9)) //icall
+            {
+                laneIndirectJump(lanes, true);
+                break;
+            }
 #ifdef ATMEGA2560
-                memory[(memory[SPH_ADDRESS] << 8) | memory[SPL_ADDRESS]] = (PC & 0xFF0000) >> 16;
-                decrementStackPointer();
-#endif
-                // No SREG Updates
-                if(0x800 == (result & 0x800))
+            if((opcode0 == 0x95) && (opcode1 == 0x19)) //eicall
+            {
+                for(laneMask bits = lanes.group; bits; bits &= bits - 1)
                 {
-                    PC -= (0x1000 - 2*(result^0x800));
+                    int32_t lane = __builtin_ctz(bits);
+                    lanePushReturnAddress(lanes, lane, pc + 2);
+                    targets[lane] = (2*(laneReadPair(lanes, lane, Z_REGISTER) | ((lanes.io[lane][ATMEGA2560_EIND] & 0x3F) << 16))) + programStart;
                 }
-                else
+                laneCheckStackLimit(lanes);
+                laneJump(lanes, targets);
+                break;
+            }
+#endif
+            if((opcode0 == 0x95) && (opcode1 == 0x18)) //reti
+            {
+                for(laneMask bits = lanes.group; bits; bits &= bits - 1)
                 {
-                    PC += (2*result);
+                    int32_t lane = __builtin_ctz(bits);
+                    lanes.SREG[lane] |= SREG_I;
+                    laneUpdateInterruptState(lanes, lane);
+                    lanes.interruptInhibit[lane] = (lanes.ready >> lane) & 0x1;
+                    targets[lane] = lanePopReturnAddress(lanes, lane);
                 }
+                laneJump(lanes, targets);
                 break;
-            case 0xE0:
-            case 0xE1:
-            case 0xE2:
-            case 0xE3:
-            case 0xE4:
-            case 0xE5:
-            case 0xE6:
-            case 0xE7:
-            case 0xE8:
-            case 0xE9:
-            case 0xEA:
-            case 0xEB:
-            case 0xEC:
-            case 0xED:
-            case 0xEE:
-            case 0xEF: //ldi
-                memory[16 + ((memory[PC+1] & 0xF0) >> 4)] = ((memory[PC] & 0xF) << 4) | (memory[PC+1] & 0xF);
-                // No SREG Updates
-                PC+=2;
+            }
+            if(((opcode0 == 0x94) && ((opcode1 == 0x19) || ((opcode1 & 0xF) == 0x8))) ||
+               ((opcode0 == 0x95) && ((opcode1 == 0x88) || (opcode1 == 0x19)))) //eijmp, sei, cli, sleep
+            {
+                laneFetchGroup(lanes);
                 break;
-            case 0xF0:
-            case 0xF1:
-            case 0xF2:
-            case 0xF3:
-                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x0)) //brcs
-                {
-                    if(SREG.C == SET)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x1)) //breq
-                {
-                    if(SREG.Z == SET)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x2)) //brmi
-                {
-                    if(SREG.N == SET)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
-                    break;
-                }
-                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x4)) //brlt
-                {
-                    if(SREG.S == SET)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
+            }
+            switch(opcode1 & 0x0F)
+            {
+                case 0x0: //com
+                    result = ~lanes.data[d];
+                    laneSetFlags(lanes, laneLogicFlags(result) | SREG_C, LOGIC_FLAGS|SREG_C);
+                    laneWrite(lanes.data[d], result, active);
+                    lanes.groupPC += 2;
                     break;
-                }
-                if((((memory[PC] & 0x0C) >> 2) == 0x0) && ((memory[PC+1] & 0x7) == 0x6)) //brts
-                {
-                    if(SREG.T == SET)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
+                case 0x1: //neg
+                    result = laneZero - lanes.data[d];
+                    laneSetFlags(lanes, laneSubFlags(laneZero, laneZero, lanes.data[d]), ARITHMETIC_FLAGS);
+                    laneWrite(lanes.data[d], result, active);
+                    lanes.groupPC += 2;
                     break;
-                }
-                handleUnimplemented();
-            case 0xF4:
-            case 0xF5:
-            case 0xF6:
-            case 0xF7:
-                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x2)) //brpl
-                {
-                    if(SREG.N == CLR)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
+                case 0x2: //swap
+                    laneWrite(lanes.data[d], (lanes.data[d] << 4) | (lanes.data[d] >> 4), active);
+                    lanes.groupPC += 2;
                     break;
-                }
-                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x0)) //brcc
-                {
-                    if(SREG.C == CLR)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
+                case 0x3: //inc
+                    result = lanes.data[d] + 1;
+                    laneSetFlags(lanes, laneAddFlags(laneZero, lanes.data[d], laneFill(1)), LOGIC_FLAGS);
+                    laneWrite(lanes.data[d], result, active);
+                    lanes.groupPC += 2;
                     break;
-                }
-                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x1)) //brne
-                {
-                    if(SREG.Z == CLR)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
+                case 0x5: //asr
+                    result = (lanes.data[d] >> 1) | (lanes.data[d] & 0x80);
+                    laneSetFlags(lanes, laneShiftFlags(lanes.data[d] & 0x1, result), LOGIC_FLAGS|SREG_C);
+                    laneWrite(lanes.data[d], result, active);
+                    lanes.groupPC += 2;
                     break;
-                }
-                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x4)) //brge
-                {
-                    if(SREG.S == CLR)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
+                case 0x6: //lsr
+                    result = lanes.data[d] >> 1;
+                    laneSetFlags(lanes, laneShiftFlags(lanes.data[d] & 0x1, result), LOGIC_FLAGS|SREG_C);
+                    laneWrite(lanes.data[d], result, active);
+                    lanes.groupPC += 2;
                     break;
-                }
-                if((((memory[PC] & 0x0C) >> 2) == 0x1) && ((memory[PC+1] & 0x7) == 0x6)) //brtc
-                {
-                    if(SREG.T == CLR)
-                    {
-                        result = ((memory[PC] & 0x3) << 5) | (memory[PC+1] >> 3);
-                        PC = (0x40 < result) ? (PC - (2*(0x80 - result))) : (PC + (2*result));
-                    }
-                    // No SREG Updates
-                    PC+=2;
+                case 0x7: //ror
+                    result = (lanes.data[d] >> 1) | (carry << 7);
+                    laneSetFlags(lanes, laneShiftFlags(lanes.data[d] & 0x1, result), LOGIC_FLAGS|SREG_C);
+                    laneWrite(lanes.data[d], result, active);
+                    lanes.groupPC += 2;
                     break;
-                }
-                handleUnimplemented();
-            case 0xF8:
-            case 0xF9: //bld
-                if((memory[PC+1] & 0xF) < 0x8)
-                {
-                    if(SREG.T == SET)
-                    {
-                        memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)] |= (1 << (memory[PC+1] & 0x7));
-                    }
-                    else
-                    {
-                        memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)] &= ~(1 << (memory[PC+1] & 0x7));
-                    }
-                    PC+=2;
+                case 0xA: //dec
+                    result = lanes.data[d] - 1;
+                    laneSetFlags(lanes, laneSubFlags(laneZero, lanes.data[d], laneFill(1)), LOGIC_FLAGS);
+                    laneWrite(lanes.data[d], result, active);
+                    lanes.groupPC += 2;
+                    break;
+                case 0xC:
+                case 0xD: //jmp
+                    target  = (opcode0 & 0x1) << 21;
+                    target |= (opcode1 >> 4) << 17;
+                    target |= (opcode1 & 0x1) << 16;
+                    target |= (memory[pc+2] << 8 | memory[pc+3]);
+                    lanes.groupPC = programStart + (target*2);
+                    break;
+                case 0xE:
+                case 0xF: //call
+                    target = programStart + (((opcode0 & 0x1) << 21) | ((opcode1 & 0xF0) << 13) | ((opcode1 & 0x1) << 16)
+                     | (memory[pc+2] << 8) | memory[pc+3])*2;
+                    lanePushGroup(lanes, pc + 4);
+                    lanes.groupPC = target;
+                    break;
+                default:
+                    laneFetchGroup(lanes);
                     break;
+            }
+            break;
+        case 0x96: //adiw
+        case 0x97: //sbiw
+        {
+            const int32_t pair = 24 + ((opcode1 & 0x30) >> 3);
+            const laneWord high = __builtin_convertvector(lanes.data[pair+1], laneWord) << 8;
+            const laneWord value = __builtin_convertvector(lanes.data[pair], laneWord) | high;
+            const laneWord constant = laneFillWord(((opcode1 & 0xC0) >> 0x2) | (opcode1 & 0xF));
+            laneWord sum;
+            laneWord overflow;
+            laneWord borrow;
+            if(opcode0 == 0x96)
+            {
+                sum = value + constant;
+                //V = !Rdh7 & R15, C = !R15 & Rdh7
+                overflow = ~high & sum;
+                borrow = ~sum & high;
+            }
+            else
+            {
+                sum = value - constant;
+                //V = Rdh7 & !R15, C = R15 & !Rdh7
+                overflow = high & ~sum;
+                borrow = sum & ~high;
+            }
+            const laneWord wordFlags = (borrow >> 15) | ((laneWord)(sum == laneZeroWord) & SREG_Z) | ((sum >> 15) << 2) |
+                                       ((overflow >> 15) << 3) | (((sum ^ overflow) >> 15) << 4);
+            laneSetFlags(lanes, __builtin_convertvector(wordFlags, laneByte), SREG_S|SREG_V|SREG_N|SREG_Z|SREG_C);
+            laneWrite(lanes.data[pair], __builtin_convertvector(sum, laneByte), active);
+            laneWrite(lanes.data[pair+1], __builtin_convertvector(sum >> 8, laneByte), active);
+            lanes.groupPC += 2;
+            break;
+        }
+        case 0x9C:
+        case 0x9D:
+        case 0x9E:
+        case 0x9F: //mul
+        {
+            const laneWord product = __builtin_convertvector(lanes.data[d], laneWord) * __builtin_convertvector(lanes.data[r], laneWord);
+            const laneWord wordFlags = ((laneWord)(product == laneZeroWord) & SREG_Z) | (product >> 15);
+            laneSetFlags(lanes, __builtin_convertvector(wordFlags, laneByte), SREG_Z|SREG_C);
+            laneWrite(lanes.data[1], __builtin_convertvector(product >> 8, laneByte), active);
+            laneWrite(lanes.data[0], __builtin_convertvector(product, laneByte), active);
+            lanes.groupPC += 2;
+            break;
+        }
+        case 0xC0:
+        case 0xC1:
+        case 0xC2:
+        case 0xC3:
+        case 0xC4:
+        case 0xC5:
+        case 0xC6:
+        case 0xC7:
+        case 0xC8:
+        case 0xC9:
+        case 0xCA:
+        case 0xCB:
+        case 0xCC:
+        case 0xCD:
+        case 0xCE:
+        case 0xCF: //rjmp
+            if((opcode0 == 0xCF) && (opcode1 == 0xFF))
+            {
+                //Program Exit
+                for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+                {
+                    int32_t lane = __builtin_ctz(bits);
+                    laneLeave(lanes, lane, 0, pc);
+                    laneStop(lanes, lane, STOP_BREAK);
                 }
-                handleUnimplemented();
-            case 0xFA:
-            case 0xFB: //bst
-                result = memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                newStatus.T = (result & (1 << (memory[PC+1] & 0x7))) > 0 ? SET: CLR;
-                PC+=2;
                 break;
-            case 0xFC:
-            case 0xFD: //sbrc
-                if((memory[PC+1] & 0xF) < 0x8)
+            }
+            lanes.groupPC = pc + 2 + 2*((int16_t)(((opcode0 & 0xF) << 12) | (opcode1 << 4)) >> 4);
+            break;
+        case 0xD0:
+        case 0xD1:
+        case 0xD2:
+        case 0xD3:
+        case 0xD4:
+        case 0xD5:
+        case 0xD6:
+        case 0xD7:
+        case 0xD8:
+        case 0xD9:
+        case 0xDA:
+        case 0xDB:
+        case 0xDC:
+        case 0xDD:
+        case 0xDE:
+        case 0xDF: //rcall
+            lanePushGroup(lanes, pc + 2);
+            lanes.groupPC = pc + 2 + 2*((int16_t)(((opcode0 & 0xF) << 12) | (opcode1 << 4)) >> 4);
+            break;
+        case 0xE0:
+        case 0xE1:
+        case 0xE2:
+        case 0xE3:
+        case 0xE4:
+        case 0xE5:
+        case 0xE6:
+        case 0xE7:
+        case 0xE8:
+        case 0xE9:
+        case 0xEA:
+        case 0xEB:
+        case 0xEC:
+        case 0xED:
+        case 0xEE:
+        case 0xEF: //ldi
+            laneWrite(lanes.data[dImmediate], immediate, active);
+            lanes.groupPC += 2;
+            break;
+        case 0xF0:
+        case 0xF1:
+        case 0xF2:
+        case 0xF3:
+        case 0xF4:
+        case 0xF5:
+        case 0xF6:
+        case 0xF7: //brbs, brbc for the flags fetch() supports
+            if(((opcode1 & 0x7) == 0x3) || ((opcode1 & 0x7) == 0x5) || ((opcode1 & 0x7) == 0x7))
+            {
+                laneFetchGroup(lanes);
+                break;
+            }
+            result = (laneByte)((lanes.SREG & bit) != laneZero);
+            laneBranch(lanes, (opcode0 & 0x4) ? ~result: result,
+                       pc + 2 + 2*((int8_t)(((opcode0 & 0x3) << 6) | ((opcode1 >> 3) << 1)) >> 1), pc + 2);
+            break;
+        case 0xF8:
+        case 0xF9: //bld
+            if((opcode1 & 0xF) < 0x8)
+            {
+                result = (laneByte)((lanes.SREG & SREG_T) != laneZero);
+                laneWrite(lanes.data[d], (lanes.data[d] & (uint8_t)~bit) | (result & bit), active);
+                lanes.groupPC += 2;
+                break;
+            }
+            laneFetchGroup(lanes);
+            break;
+        case 0xFA:
+        case 0xFB: //bst
+            laneSetFlags(lanes, (laneByte)((lanes.data[d] & bit) != laneZero) & SREG_T, SREG_T);
+            lanes.groupPC += 2;
+            break;
+        case 0xFC:
+        case 0xFD: //sbrc
+        case 0xFE:
+        case 0xFF: //sbrs
+            if((opcode1 & 0xF) < 0x8)
+            {
+                result = (laneByte)((lanes.data[d] & bit) != laneZero);
+                laneBranch(lanes, (opcode0 & 0x2) ? result: ~result, pc + (longOpcode(pc + 2) ? 6: 4), pc + 2);
+                break;
+            }
+            laneFetchGroup(lanes);
+            break;
+        default: //muls, mulsu, in, out, cbi, sbi, sbic, sbis and unimplemented opcodes
+            laneFetchGroup(lanes);
+            break;
+    }
+}
+
+// Adds the instructions the group ran since the last settle to its lanes.
+void laneSettle(avrcoreLanes& lanes)
+{
+    uint32_t steps = lanes.groupSteps;
+    lanes.groupSteps = 0;
+    for(laneMask bits = lanes.group; bits; bits &= bits - 1)
+    {
+        int32_t lane = __builtin_ctz(bits);
+        lanes.PC[lane] = lanes.groupPC;
+        laneAdvance(lanes, lane, steps);
+    }
+}
+
+void laneSync(avrcoreLanes& lanes)
+{
+    laneSettle(lanes);
+    uint64_t countdown = INSTRUCTION_LIMIT;
+    for(laneMask bits = lanes.running; bits; bits &= bits - 1)
+    {
+        int32_t lane = __builtin_ctz(bits);
+        countdown = (INSTRUCTION_LIMIT - lanes.trackedFetches[lane] < countdown) ? (INSTRUCTION_LIMIT - lanes.trackedFetches[lane]): countdown;
+        countdown = (lanes.remaining[lane] < countdown) ? lanes.remaining[lane]: countdown;
+    }
+    lanes.countdown = countdown;
+}
+
+// Schedules the running lanes with the lowest PC.
+void laneRegroup(avrcoreLanes& lanes)
+{
+    laneSettle(lanes);
+    programCounter lowest = ~(programCounter)0;
+    for(laneMask bits = lanes.running; bits; bits &= bits - 1)
+    {
+        int32_t lane = __builtin_ctz(bits);
+        lowest = (lanes.PC[lane] < lowest) ? lanes.PC[lane]: lowest;
+    }
+    lanes.group = 0;
+    lanes.waitingPC = ~(programCounter)0;
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        bool member = ((lanes.running >> lane) & 0x1) && (lanes.PC[lane] == lowest);
+        lanes.group |= member ? (1u << lane): 0;
+        lanes.groupActive[lane] = member ? 0xFF: 0;
+        lanes.groupActiveWord[lane] = member ? 0xFFFF: 0;
+        if(((lanes.running >> lane) & 0x1) && !member && (lanes.PC[lane] < lanes.waitingPC))
+        {
+            lanes.waitingPC = lanes.PC[lane];
+        }
+    }
+    lanes.groupPC = lowest;
+}
+
+void laneRun(avrcoreLanes& lanes)
+{
+    while(lanes.running)
+    {
+        if(!lanes.countdown)
+        {
+            laneSync(lanes);
+            continue;
+        }
+        if(!lanes.group || (lanes.groupPC >= lanes.waitingPC))
+        {
+            laneRegroup(lanes);
+        }
+        if(lanes.ready & lanes.group)
+        {
+            for(laneMask bits = lanes.ready & lanes.group; bits; bits &= bits - 1)
+            {
+                int32_t lane = __builtin_ctz(bits);
+                if(lanes.interruptInhibit[lane])
                 {
-                    result = memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    if((result & (1 << (memory[PC+1] & 0xF))) == 0)
-                    {
-                        PC+=2;
-                        if(longOpcode(PC))
-                        {
-                            PC+=2;
-                        }
-                    }
-                    PC+=2;
-                    break;
+                    lanes.interruptInhibit[lane] = false;
+                    continue;
                 }
-                handleUnimplemented();
-            case 0xFE:
-            case 0xFF: //sbrs
-                if((memory[PC+1] & 0xF) < 0x8)
+                laneLeave(lanes, lane, 0, lanes.groupPC);
+                laneServiceInterrupt(lanes, lane);
+            }
+            if(!lanes.group)
+            {
+                continue;
+            }
+        }
+        laneStep(lanes);
+        lanes.groupSteps++;
+        lanes.countdown--;
+        if(lanes.overflowCheck & lanes.group)
+        {
+            for(laneMask bits = lanes.overflowCheck & lanes.group; bits; bits &= bits - 1)
+            {
+                int32_t lane = __builtin_ctz(bits);
+                if(lanes.stackPointer[lane] < stackLimit)
                 {
-                    result = memory[((memory[PC] & 0x01) << 4) | ((memory[PC+1] & 0xF0) >> 4)];
-                    if((result & (1 << (memory[PC+1] & 0xF))) > 0)
-                    {
-                        PC+=2;
-                        if(longOpcode(PC))
-                        {
-                            PC+=2;
-                        }
-                    }
-                    PC+=2;
-                    break;
+                    laneLeave(lanes, lane, 0, lanes.groupPC);
                 }
-                handleUnimplemented();
+                laneCheckStack(lanes, lane);
+            }
+        }
+    }
+}
+
+int32_t avrcoreLaneCount()
+{
+    return LANE_COUNT;
+}
+
+avrcoreLanes* avrcoreLanesCreate(avrcore* core)
+{
+    void* storage = NULL;
+    if(posix_memalign(&storage, 64, sizeof(avrcoreLanes)))
+    {
+        return NULL;
+    }
+    avrcoreLanes* lanes = (avrcoreLanes*)storage;
+    memset(lanes, 0, sizeof(avrcoreLanes));
+    selectCore(core);
+    lanes->core = core;
+    for(int32_t address = 0; address < ENTRY_ADDRESS; address++)
+    {
+        lanes->data[address] = laneFill(memory[address]);
+    }
+    lanes->SREG = laneFill(SREG);
+    lanes->stackPointer = laneFillWord(stackPointer);
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        memcpy(lanes->io[lane], memory, RAMSTART);
+        lanes->PC[lane] = PC;
+        lanes->cycleCount[lane] = cycleCount;
+        lanes->trackedFetches[lane] = trackedFetches;
+        lanes->pendingInterrupts[lane] = pendingInterrupts;
+        lanes->enabledInterrupts[lane] = enabledInterrupts;
+        lanes->interruptInhibit[lane] = interruptInhibit;
+        lanes->stopReason[lane] = STOP_BUDGET;
+    }
+    lanes->ready = interruptReady ? ALL_LANES: 0;
+    return lanes;
+}
+
+void avrcoreLanesDestroy(avrcoreLanes* lanes)
+{
+    free(lanes);
+}
+
+void avrcoreLanesRun(avrcoreLanes* lanes, uint64_t instructions, int32_t* reasons)
+{
+    selectCore(lanes->core);
+    claimEvents(lanes->core);
+    //The globals stand in for one lane at a time; keep the core's own state
+    coreState state;
+    saveCoreState(state);
+    uint8_t low[RAMSTART];
+    memcpy(low, memory, RAMSTART);
+    uint8_t watchedLanes[sizeof(watchedPages)];
+    memcpy(watchedLanes, watchedPages, sizeof(watchedPages));
+    memset(watchedPages, 0, sizeof(watchedPages));
+
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        lanes->remaining[lane] = instructions ? instructions: UINT64_MAX;
+        lanes->stopReason[lane] = STOP_BUDGET;
+    }
+    lanes->running = ALL_LANES;
+    lanes->group = 0;
+    lanes->groupSteps = 0;
+    lanes->overflowCheck = 0;
+    lanes->countdown = 0;
+    laneRun(*lanes);
+    if(reasons)
+    {
+        memcpy(reasons, lanes->stopReason, sizeof(lanes->stopReason));
+    }
+
+    memcpy(watchedPages, watchedLanes, sizeof(watchedPages));
+    memcpy(memory, low, RAMSTART);
+    loadCoreState(state);
+    stopReason = STOP_BUDGET;
+    releaseEvents(lanes->core);
+}
+
+uint64_t avrcoreLanesCycles(avrcoreLanes* lanes, int32_t lane)
+{
+    return ((lane >= 0) && (lane < LANE_COUNT)) ? lanes->cycleCount[lane]: 0;
+}
+
+int32_t avrcoreLanesReadMemory(avrcoreLanes* lanes, int32_t lane, int32_t address, uint8_t* buffer, size_t size)
+{
+    if((lane < 0) || (lane >= LANE_COUNT) || (address < 0) || (address + size > ENTRY_ADDRESS))
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < size; i++)
+    {
+        switch(address + i)
+        {
+            case SREG_ADDRESS:
+                buffer[i] = lanes->SREG[lane];
+                break;
+            case SPL_ADDRESS:
+                buffer[i] = lanes->stackPointer[lane] & 0xFF;
+                break;
+            case SPH_ADDRESS:
+                buffer[i] = lanes->stackPointer[lane] >> 8;
+                break;
             default:
-                handleUnimplemented();
+                buffer[i] = laneLoad(*lanes, lane, address + i);
                 break;
         }
-        pushStatus(newStatus);
-        resetFetchState();
-#ifdef EMSCRIPTEN
-        std::this_thread::yield();
-#else
-        while(system_clock::now() < syncPoint)
-            ;
-#endif
-        return true;
+    }
+    return 0;
+}
+
+int32_t avrcoreLanesWriteMemory(avrcoreLanes* lanes, int32_t lane, int32_t address, const uint8_t* buffer, size_t size)
+{
+    if((lane < 0) || (lane >= LANE_COUNT) || (address < 0) || (address + size > ENTRY_ADDRESS))
+    {
+        return -1;
+    }
+    for(size_t i = 0; i < size; i++)
+    {
+        laneStore(*lanes, lane, address + i, buffer[i]);
+        switch(address + i)
+        {
+            case SREG_ADDRESS:
+                lanes->SREG[lane] = buffer[i];
+                break;
+            case SPL_ADDRESS:
+                lanes->stackPointer[lane] = (lanes->stackPointer[lane] & 0xFF00) | buffer[i];
+                break;
+            case SPH_ADDRESS:
+                lanes->stackPointer[lane] = (lanes->stackPointer[lane] & 0x00FF) | (buffer[i] << 8);
+                break;
+        }
+    }
+    if(address < INTERRUPT_REGISTER_LIMIT)
+    {
+        laneUpdateInterruptMask(*lanes, lane);
+    }
+    return 0;
+}
+
+uint32_t avrcoreLanesReadRegister(avrcoreLanes* lanes, int32_t lane, int32_t reg)
+{
+    if((lane < 0) || (lane >= LANE_COUNT))
+    {
+        return 0;
+    }
+    switch(reg)
+    {
+        case AVRCORE_REGISTER_SREG:
+            return lanes->SREG[lane];
+        case AVRCORE_REGISTER_SP:
+            return lanes->stackPointer[lane];
+        case AVRCORE_REGISTER_PC:
+            return lanes->PC[lane] - programStart;
+    }
+    return (reg >= 0 && reg < 32) ? lanes->data[reg][lane]: 0;
+}
+
+void avrcoreLanesWriteRegister(avrcoreLanes* lanes, int32_t lane, int32_t reg, uint32_t value)
+{
+    if((lane < 0) || (lane >= LANE_COUNT))
+    {
+        return;
+    }
+    switch(reg)
+    {
+        case AVRCORE_REGISTER_SREG:
+            lanes->SREG[lane] = value;
+            laneUpdateInterruptState(*lanes, lane);
+            return;
+        case AVRCORE_REGISTER_SP:
+            lanes->stackPointer[lane] = value;
+            return;
+        case AVRCORE_REGISTER_PC:
+            lanes->PC[lane] = programStart + (value & ~1);
+            return;
+    }
+    if(reg >= 0 && reg < 32)
+    {
+        lanes->data[reg][lane] = value;
+    }
+}
+
+void avrcoreLanesRaiseInterrupt(avrcoreLanes* lanes, int32_t lane, int32_t vector)
+{
+    if((lane >= 0) && (lane < LANE_COUNT) && (vector > 0) && (vector < INTERRUPT_VECTOR_COUNT))
+    {
+        lanes->pendingInterrupts[lane] |= (1ULL << vector);
+        laneUpdateInterruptState(*lanes, lane);
+    }
+}
+
+int32_t avrcoreLaneIndex()
+{
+    return currentLane;
+}
+
+// Runs a branchy arithmetic loop on every lane with inputs of its own, then
+// again on the scalar core one lane at a time, and compares registers,
+// cycles and SRAM. Each flag setting instruction is followed by in r21, SREG
+// and st X+, r21 (0xB75F, 0x935D), so SRAM holds a trail of its flags.
+#define LANE_TRAIL_SIZE 256
+bool verifyLanes()
+{
+    const uint16_t mix[] =
+    {
+        0xE0A0, //ldi r26, 0
+        0xE0B0 | (RAMSTART >> 8), //ldi r27, RAMSTART >> 8
+        0xE046, //ldi r20, 6
+        0x2F80, //mov r24, r16
+        0x0F81, 0xB75F, 0x935D, //add r24, r17
+        0x2F92, //mov r25, r18
+        0x1F90, 0xB75F, 0x935D, //adc r25, r16
+        0xF430, //brcc +6
+        0x1B82, 0xB75F, 0x935D, //sub r24, r18
+        0x0B91, 0xB75F, 0x935D, //sbc r25, r17
+        0x1780, //cp r24, r16
+        0x0791, 0xB75F, 0x935D, //cpc r25, r17
+        0xF03C, //brlt +7
+        0x2781, 0xB75F, 0x935D, //eor r24, r17
+        0x779C, 0xB75F, 0x935D, //andi r25, 0x7C
+        0xC006, //rjmp +6
+        0x2B82, 0xB75F, 0x935D, //or r24, r18
+        0x6891, 0xB75F, 0x935D, //ori r25, 0x81
+        0x9580, 0xB75F, 0x935D, //com r24
+        0x9591, 0xB75F, 0x935D, //neg r25
+        0xF01A, //brmi +3
+        0x9583, 0xB75F, 0x935D, //inc r24
+        0x959A, 0xB75F, 0x935D, //dec r25
+        0xF419, //brne +3
+        0x9585, 0xB75F, 0x935D, //asr r24
+        0x9596, 0xB75F, 0x935D, //lsr r25
+        0x9587, 0xB75F, 0x935D, //ror r24
+        0xF018, //brcs +3
+        0x5183, 0xB75F, 0x935D, //subi r24, 0x13
+        0x4092, 0xB75F, 0x935D, //sbci r25, 0x02
+        0x3480, 0xB75F, 0x935D, //cpi r24, 0x40
+        0xF418, //brsh +3
+        0x2390, 0xB75F, 0x935D, //and r25, r16
+        0x2F09, //mov r16, r25
+        0x2F18, //mov r17, r24
+        0x954A, //dec r20
+        0xF009, //breq +1
+        0xCFB5, //rjmp -75
+        0x9598, //break
+    };
+    avrcore* core = avrcoreCreate();
+    loadCheck(0, mix, sizeof(mix)/sizeof(mix[0]));
+    avrcoreReset(core);
+    avrcoreLanes* lanes = avrcoreLanesCreate(core);
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        avrcoreLanesWriteRegister(lanes, lane, 16, lane*29 + 3);
+        avrcoreLanesWriteRegister(lanes, lane, 17, (lane*101) ^ 0xA5);
+        avrcoreLanesWriteRegister(lanes, lane, 18, 0x80 - lane*7);
+    }
+    int32_t reasons[LANE_COUNT];
+    avrcoreLanesRun(lanes, CHECK_INSTRUCTION_LIMIT, reasons);
+
+    bool passed = true;
+    for(int32_t lane = 0; lane < LANE_COUNT; lane++)
+    {
+        avrcoreReset(core);
+        avrcoreWriteRegister(core, 16, lane*29 + 3);
+        avrcoreWriteRegister(core, 17, (lane*101) ^ 0xA5);
+        avrcoreWriteRegister(core, 18, 0x80 - lane*7);
+        int32_t reason = avrcoreRun(core, CHECK_INSTRUCTION_LIMIT, 0);
+        bool matched = (reasons[lane] == reason) && (avrcoreLanesCycles(lanes, lane) == avrcoreCycles(core));
+        for(int32_t reg = 0; reg <= AVRCORE_REGISTER_PC; reg++)
+        {
+            matched &= avrcoreLanesReadRegister(lanes, lane, reg) == avrcoreReadRegister(core, reg);
+        }
+        uint8_t laneTrail[LANE_TRAIL_SIZE];
+        uint8_t trail[LANE_TRAIL_SIZE];
+        avrcoreLanesReadMemory(lanes, lane, RAMSTART, laneTrail, sizeof(laneTrail));
+        avrcoreReadMemory(core, RAMSTART, trail, sizeof(trail));
+        matched &= !memcmp(laneTrail, trail, sizeof(trail));
+        if(!matched)
+        {
+            printf("lanes: lane %d stopped %d with r25:r24 0x%X and SREG 0x%X, fetch() %d with 0x%X and 0x%X\n", lane, reasons[lane],
+                   avrcoreLanesReadRegister(lanes, lane, 24) | (avrcoreLanesReadRegister(lanes, lane, 25) << 8),
+                   avrcoreLanesReadRegister(lanes, lane, AVRCORE_REGISTER_SREG), reason,
+                   avrcoreReadRegister(core, 24) | (avrcoreReadRegister(core, 25) << 8), avrcoreReadRegister(core, AVRCORE_REGISTER_SREG));
+            passed = false;
+        }
+    }
+    avrcoreLanesDestroy(lanes);
+    avrcoreDestroy(core);
+    return passed;
+}
+
+#ifdef ENGINE_CHECK
+// The library has no main() of its own, so the enginecheck_lib build runs
+// the checks through this one.
+int32_t main()
+{
+    return verifyEngines() ? 0: 1;
 }
+#endif
+#endif